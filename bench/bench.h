@@ -0,0 +1,40 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * @brief Monotonic clock in nanoseconds
+ */
+static inline uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Get a percentile of the samples. Sorts the samples in place.
+ *
+ * @param samples The samples
+ * @param count Number of samples
+ * @param percentile Percentile in [0, 100]
+ * @return uint64_t The sample at the percentile
+ */
+static inline uint64_t bench_percentile(uint64_t* samples, size_t count, double percentile) {
+    if (count == 0) {
+        return 0;
+    }
+    qsort(samples, count, sizeof(uint64_t), bench_compare_u64);
+    size_t rank = (size_t) (percentile / 100.0 * (count - 1) + 0.5);
+    return samples[rank];
+}
+
+#endif // BENCH_H
@@ -0,0 +1,118 @@
+/**
+ * Compares scanning every course with the hashed course code index at
+ * 10, 10k and 1M courses, and reports the memory held by the courses db.
+ * Build and run with `make bench_courses_lookup`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "../src/database.h"
+
+#define LOOKUP_BUDGET 20000000ULL  // Course comparisons the scan may spend per size
+
+// The fixed size course struct every row used to be malloc'd as
+typedef struct __legacy_course_t {
+    char course_code[32];
+    int credits;
+    char professor[64];
+    char days[32];
+    char course_name[128];
+    struct __legacy_course_t* next;
+} legacy_course_t;
+
+static const char* bench_days[] = { "Mon;Wed", "Tue;Thu", "Mon;Wed;Fri", "Fri", "Tue" };
+
+// Catalog shaped like the department exports: a few hundred professors, a handful of day patterns
+static courses_db_t* bench_db_create(size_t count) {
+    courses_db_t* db = database_courses_create();
+    if (db == NULL) {
+        return NULL;
+    }
+    char course_code[32], professor[64], course_name[128];
+    for (size_t i = 0; i < count; i++) {
+        snprintf(course_code, sizeof(course_code), "CS%zu", 100 + i);
+        snprintf(professor, sizeof(professor), "Professor %zu", i % 400);
+        snprintf(course_name, sizeof(course_name), "Topics in Computer Science %zu", i);
+        if (database_courses_add(db, STRING_SLICE(course_code), 4, STRING_SLICE(professor), STRING_SLICE(bench_days[i % 5]), STRING_SLICE(course_name)) != ERR_OK) {
+            return NULL;
+        }
+    }
+    database_courses_shrink(db);
+    if (database_courses_index_build(db) != ERR_OK) {
+        return NULL;
+    }
+    return db;
+}
+
+// Lower cased codes, so that both paths pay for the case-insensitive compare
+static char (*bench_keys_create(size_t count, size_t keys_count))[32] {
+    char (*keys)[32] = malloc(keys_count * sizeof(*keys));
+    if (keys == NULL) {
+        return NULL;
+    }
+    srand(450);
+    for (size_t i = 0; i < keys_count; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "cs%zu", 100 + (size_t) rand() % count);
+    }
+    return keys;
+}
+
+static double bench_scan(const courses_db_t* db, char (*keys)[32], size_t lookups) {
+    size_t found = 0;
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < lookups; i++) {
+        found += database_courses_scan(db, STRING_SLICE(keys[i])) != NULL;
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    if (found != lookups) {
+        fprintf(stderr, "scan missed %zu courses\n", lookups - found);
+    }
+    return (double) elapsed / lookups;
+}
+
+static double bench_index(const courses_db_t* db, char (*keys)[32], size_t lookups) {
+    size_t found = 0;
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < lookups; i++) {
+        found += database_courses_lookup(db, STRING_SLICE(keys[i])) != NULL;
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    if (found != lookups) {
+        fprintf(stderr, "index lookup missed %zu courses\n", lookups - found);
+    }
+    return (double) elapsed / lookups;
+}
+
+int main(void) {
+    const size_t sizes[] = { 10, 10000, 1000000 };
+    const size_t index_lookups = 1000000;
+
+    printf("%10s %14s %14s %10s %14s %14s\n", "courses", "scan ns/op", "index ns/op", "speedup", "db bytes", "course_t bytes");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t count = sizes[s];
+        courses_db_t* db = bench_db_create(count);
+        char (*keys)[32] = bench_keys_create(count, index_lookups);
+        if (db == NULL || keys == NULL) {
+            fprintf(stderr, "Failed to allocate %zu courses\n", count);
+            return 1;
+        }
+
+        // A scan costs count / 2 compares on average
+        size_t scan_lookups = LOOKUP_BUDGET / count;
+        if (scan_lookups < 10) scan_lookups = 10;
+        if (scan_lookups > index_lookups) scan_lookups = index_lookups;
+
+        double scan_ns = bench_scan(db, keys, scan_lookups);
+        double index_ns = bench_index(db, keys, index_lookups);
+        // What one malloc'd course_t per row used to hold, before the allocator's own overhead
+        size_t course_t_bytes = count * sizeof(legacy_course_t);
+        printf("%10zu %14.1f %14.1f %9.1fx %14zu %14zu\n", count, scan_ns, index_ns, scan_ns / index_ns,
+            database_courses_footprint(db), course_t_bytes);
+
+        free(keys);
+        database_courses_free(db);
+    }
+    return 0;
+}
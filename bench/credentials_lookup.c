@@ -0,0 +1,123 @@
+/**
+ * Loads one million synthetic credentials through the serverC loader and
+ * reports validation throughput and latency percentiles. Build and run with
+ * `make bench_credentials_lookup`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "../src/database.h"
+#include "../src/fileio.h"
+
+#define BENCH_USERS         1000000
+#define BENCH_LOOKUPS       1000000
+#define BENCH_LIST_LOOKUPS  100         // The list walk is only sampled, it is O(users)
+
+static void bench_credential(credentials_t* credential, size_t user, size_t password) {
+    memset(credential, 0, sizeof(credentials_t));
+    credential->username_len = snprintf((char*) credential->username, sizeof(credential->username), "user%07zu", user);
+    credential->password_len = snprintf((char*) credential->password, sizeof(credential->password), "pass%07zu", password);
+}
+
+static int bench_credentials_file_create(char* path) {
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return -1;
+    }
+    FILE* fp = fdopen(fd, "w");
+    if (fp == NULL) {
+        close(fd);
+        return -1;
+    }
+    for (size_t i = 0; i < BENCH_USERS; i++) {
+        fprintf(fp, "user%07zu,pass%07zu\n", i, i);
+    }
+    fclose(fp);
+    return 0;
+}
+
+// 90% valid logins, 5% wrong passwords and 5% unknown users
+static credentials_t* bench_requests_create(size_t count) {
+    credentials_t* requests = malloc(count * sizeof(credentials_t));
+    if (requests == NULL) {
+        return NULL;
+    }
+    srand(450);
+    for (size_t i = 0; i < count; i++) {
+        size_t user = (size_t) rand() % BENCH_USERS;
+        int dice = rand() % 100;
+        if (dice < 90) {
+            bench_credential(&requests[i], user, user);
+        } else if (dice < 95) {
+            bench_credential(&requests[i], user, user + 1);
+        } else {
+            bench_credential(&requests[i], BENCH_USERS + user, user);
+        }
+    }
+    return requests;
+}
+
+int main(void) {
+    char path[] = "/tmp/bench_credentials_XXXXXX";
+    if (bench_credentials_file_create(path) != 0) {
+        perror("Failed to create the credentials file");
+        return 1;
+    }
+
+    uint64_t start = bench_now_ns();
+    credentials_db_t* db = fileio_credential_server_db_create(path);
+    uint64_t load_ns = bench_now_ns() - start;
+    unlink(path);
+    if (db == NULL || db->index == NULL) {
+        fprintf(stderr, "Failed to load the credentials\n");
+        return 1;
+    }
+
+    credentials_t* requests = bench_requests_create(BENCH_LOOKUPS);
+    uint64_t* samples = malloc(BENCH_LOOKUPS * sizeof(uint64_t));
+    if (requests == NULL || samples == NULL) {
+        fprintf(stderr, "Failed to allocate the requests\n");
+        return 1;
+    }
+
+    // Throughput, without the clock reads in the loop
+    size_t accepted = 0;
+    start = bench_now_ns();
+    for (size_t i = 0; i < BENCH_LOOKUPS; i++) {
+        accepted += database_credentials_validate(db, &requests[i]) == ERR_OK;
+    }
+    uint64_t total_ns = bench_now_ns() - start;
+
+    // Latency of every single validation
+    for (size_t i = 0; i < BENCH_LOOKUPS; i++) {
+        uint64_t t0 = bench_now_ns();
+        database_credentials_validate(db, &requests[i]);
+        samples[i] = bench_now_ns() - t0;
+    }
+
+    // Sample the list walk the index replaced
+    uint32_t* index = db->index;
+    db->index = NULL;
+    start = bench_now_ns();
+    for (size_t i = 0; i < BENCH_LIST_LOOKUPS; i++) {
+        database_credentials_validate(db, &requests[i]);
+    }
+    uint64_t list_ns = (bench_now_ns() - start) / BENCH_LIST_LOOKUPS;
+    db->index = index;
+
+    printf("users            %zu\n", db->count);
+    printf("load             %.1f ms\n", load_ns / 1e6);
+    printf("accepted         %zu / %d\n", accepted, BENCH_LOOKUPS);
+    printf("lookups/s        %.0f\n", BENCH_LOOKUPS / (total_ns / 1e9));
+    printf("p50              %lu ns\n", (unsigned long) bench_percentile(samples, BENCH_LOOKUPS, 50));
+    printf("p99              %lu ns\n", (unsigned long) bench_percentile(samples, BENCH_LOOKUPS, 99));
+    printf("list walk        %lu ns/op\n", (unsigned long) list_ns);
+
+    free(samples);
+    free(requests);
+    fileio_credential_server_db_free(db);
+    return 0;
+}
@@ -0,0 +1,216 @@
+#include "harness.h"
+
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Allocations made by the code under test. The benchmarks are linked with
+// -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc, so that every call from the
+// project's objects goes through the wrappers below. Calls libc makes
+// internally are not seen.
+static uint64_t allocs = 0;
+static uint64_t alloc_bytes = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    allocs++;
+    alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    allocs++;
+    alloc_bytes += count * size;
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    allocs++;
+    alloc_bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+typedef enum {
+    CYCLES_UNKNOWN,
+    CYCLES_PERF,                        // Core cycles of this thread
+    CYCLES_TSC,                         // Time stamp counter ticks, which run at a fixed rate
+    CYCLES_NONE,
+} cycles_source_t;
+
+static const char* CYCLES_SOURCE_NAMES[] = { "", "perf", "tsc", "none" };
+
+static cycles_source_t cycles_source = CYCLES_UNKNOWN;
+static int perf_fd = -1;
+
+static void cycles_open(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_hv = 1;
+    perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perf_fd >= 0) {
+        cycles_source = CYCLES_PERF;
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+        return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    cycles_source = CYCLES_TSC;
+#else
+    cycles_source = CYCLES_NONE;
+#endif
+}
+
+static uint64_t cycles_now(void) {
+    uint64_t count = 0;
+    if (cycles_source == CYCLES_PERF) {
+        if (read(perf_fd, &count, sizeof(count)) != sizeof(count)) {
+            count = 0;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+    } else if (cycles_source == CYCLES_TSC) {
+        count = __rdtsc();
+#endif
+    }
+    return count;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// Sorts the values in place
+static double median(double* values, size_t count) {
+    qsort(values, count, sizeof(double), compare_doubles);
+    return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+static void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--runs <n>] [--run-ms <ms>] [--warmup-ms <ms>] [--json] [filter]\n", program);
+    exit(1);
+}
+
+void bench_options_parse(bench_options_t* options, int argc, char** argv) {
+    *options = (bench_options_t) { .runs = BENCH_RUNS, .run_ns = BENCH_RUN_MS * 1000000ULL, .warmup_ns = BENCH_WARMUP_MS * 1000000ULL };
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            options->json = true;
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            options->runs = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--run-ms") == 0 && i + 1 < argc) {
+            options->run_ns = strtoull(argv[++i], NULL, 10) * 1000000ULL;
+        } else if (strcmp(argv[i], "--warmup-ms") == 0 && i + 1 < argc) {
+            options->warmup_ns = strtoull(argv[++i], NULL, 10) * 1000000ULL;
+        } else if (argv[i][0] != '-' && options->filter == NULL) {
+            options->filter = argv[i];
+        } else {
+            print_usage(argv[0]);
+        }
+    }
+    if (options->runs == 0 || options->run_ns == 0) {
+        print_usage(argv[0]);
+    }
+}
+
+void bench_begin(const bench_options_t* options) {
+    if (cycles_source == CYCLES_UNKNOWN) {
+        cycles_open();
+    }
+    if (!options->json) {
+        printf("%-40s %12s %9s %12s %10s %10s %14s\n", "BENCHMARK", "NS/OP", "MAD", "CYCLES/OP", "ALLOCS/OP", "B/OP", "RUNS x OPS");
+    }
+}
+
+static void print_result(const bench_options_t* options, const bench_result_t* result) {
+    if (options->json) {
+        printf("{\"name\": \"%s\", \"runs\": %zu, \"iterations\": %llu, \"ns_per_op\": %.3f, \"ns_mad\": %.3f, \"ns_min\": %.3f, "
+            "\"cycles_per_op\": %.1f, \"cycles_source\": \"%s\", \"allocs_per_op\": %.3f, \"alloc_bytes_per_op\": %.1f}\n",
+            result->name, result->runs, (unsigned long long) result->iterations, result->ns_median, result->ns_mad, result->ns_min,
+            result->cycles, CYCLES_SOURCE_NAMES[cycles_source], result->allocs, result->alloc_bytes);
+    } else {
+        char cycles[16], runs[32];
+        if (result->cycles < 0) {
+            snprintf(cycles, sizeof(cycles), "-");
+        } else {
+            snprintf(cycles, sizeof(cycles), "%.1f%s", result->cycles, cycles_source == CYCLES_TSC ? "t" : "");
+        }
+        snprintf(runs, sizeof(runs), "%zu x %llu", result->runs, (unsigned long long) result->iterations);
+        printf("%-40s %12.1f %8.1f%% %12s %10.2f %10.1f %14s\n", result->name, result->ns_median,
+            result->ns_median > 0 ? 100.0 * result->ns_mad / result->ns_median : 0.0, cycles, result->allocs, result->alloc_bytes, runs);
+    }
+    fflush(stdout);
+}
+
+bool bench_run(const bench_options_t* options, const char* name, bench_fn_t fn, void* ctx, bench_result_t* result) {
+    if (options->filter != NULL && strstr(name, options->filter) == NULL) {
+        return false;
+    }
+    if (cycles_source == CYCLES_UNKNOWN) {
+        cycles_open();
+    }
+
+    // Grow the batch until it takes a tenth of a run, then size it to a whole run. This also warms up.
+    uint64_t warmup_start = bench_now_ns();
+    uint64_t iterations = 1, elapsed = 0;
+    while (true) {
+        uint64_t start = bench_now_ns();
+        fn(ctx, iterations);
+        elapsed = bench_now_ns() - start;
+        if (elapsed >= options->run_ns / 10 || iterations >= (1ULL << 40)) {
+            break;
+        }
+        iterations *= 2;
+    }
+    iterations = elapsed > 0 ? iterations * options->run_ns / elapsed : iterations;
+    iterations = iterations > 0 ? iterations : 1;
+    while (bench_now_ns() - warmup_start < options->warmup_ns) {
+        fn(ctx, iterations);
+    }
+
+    double* ns = malloc(options->runs * sizeof(double));
+    double* cycles = malloc(options->runs * sizeof(double));
+    if (ns == NULL || cycles == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    uint64_t allocs_before = allocs, alloc_bytes_before = alloc_bytes;
+    for (size_t run = 0; run < options->runs; run++) {
+        uint64_t cycles_start = cycles_now();
+        uint64_t start = bench_now_ns();
+        fn(ctx, iterations);
+        uint64_t end = bench_now_ns();
+        uint64_t cycles_end = cycles_now();
+        ns[run] = (double) (end - start) / iterations;
+        cycles[run] = (double) (cycles_end - cycles_start) / iterations;
+    }
+    uint64_t operations = options->runs * iterations;
+
+    *result = (bench_result_t) { .name = name, .runs = options->runs, .iterations = iterations };
+    result->allocs = (double) (allocs - allocs_before) / operations;
+    result->alloc_bytes = (double) (alloc_bytes - alloc_bytes_before) / operations;
+    result->cycles = cycles_source == CYCLES_PERF || cycles_source == CYCLES_TSC ? median(cycles, options->runs) : -1;
+    result->ns_median = median(ns, options->runs);
+    result->ns_min = ns[0];
+    for (size_t run = 0; run < options->runs; run++) {
+        ns[run] = ns[run] > result->ns_median ? ns[run] - result->ns_median : result->ns_median - ns[run];
+    }
+    result->ns_mad = median(ns, options->runs);
+    free(cycles);
+    free(ns);
+
+    print_result(options, result);
+    return true;
+}
@@ -0,0 +1,66 @@
+#ifndef BENCH_HARNESS_H
+#define BENCH_HARNESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bench.h"
+
+#define BENCH_RUNS                  15
+#define BENCH_RUN_MS                20
+#define BENCH_WARMUP_MS             100
+
+// Runs a benchmark's operation `iterations` times
+typedef void (*bench_fn_t)(void* ctx, size_t iterations);
+
+typedef struct __bench_options_t {
+    size_t runs;                        // Timed runs per benchmark
+    uint64_t run_ns;                    // Length each run is sized to
+    uint64_t warmup_ns;                 // Spent running the operation before the timed runs
+    const char* filter;                 // Only benchmarks whose name contains it. NULL runs every one.
+    bool json;                          // One JSON object per line instead of a table
+} bench_options_t;
+
+typedef struct __bench_result_t {
+    const char* name;
+    size_t runs;
+    uint64_t iterations;                // Per run
+    double ns_median;                   // Per operation, over the runs
+    double ns_mad;                      // Median absolute deviation of the runs from ns_median
+    double ns_min;
+    double cycles;                      // Per operation, median over the runs. Negative without a cycle counter.
+    double allocs;                      // malloc, calloc and realloc calls per operation
+    double alloc_bytes;                 // Bytes asked of them per operation
+} bench_result_t;
+
+/**
+ * @brief Keep the compiler from optimizing away a computation whose result is otherwise unused
+ */
+static inline void bench_escape(const void* p) {
+    __asm__ volatile("" : : "g"(p) : "memory");
+}
+
+/**
+ * @brief Read the options every benchmark program takes:
+ * `[--runs <n>] [--run-ms <ms>] [--warmup-ms <ms>] [--json] [filter]`. Exits on a bad option.
+ */
+void bench_options_parse(bench_options_t* options, int argc, char** argv);
+
+/**
+ * @brief Print the header of the table, or nothing for JSON
+ */
+void bench_begin(const bench_options_t* options);
+
+/**
+ * @brief Warm up, size and time a benchmark, and print its result
+ *
+ * The operation is run for the warmup, then as many times per run as fill options->run_ns, then options->runs times
+ * for the statistics. Allocations are counted through the wrapped allocator and cycles through perf_event_open,
+ * or the time stamp counter where perf events are not allowed.
+ *
+ * @return bool false if the filter skipped the benchmark
+ */
+bool bench_run(const bench_options_t* options, const char* name, bench_fn_t fn, void* ctx, bench_result_t* result);
+
+#endif // BENCH_HARNESS_H
@@ -0,0 +1,105 @@
+/**
+ * Compares the throughput of the old synchronous printf logger with the
+ * ring buffer logger drained by the log thread, with 1 and 4 threads
+ * logging a typical serverM line to a temporary file. stdout is line
+ * buffered for the printf logger, as it is on a terminal.
+ * Build and run with `make bench_logger`.
+ */
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "../src/log.h"
+
+LOG_TAG(bench);
+
+#define LINES_PER_THREAD 200000
+
+typedef void (*bench_log_fn)(int i);
+
+// What log_text() used to do: four stdio calls per line
+static void legacy_log_text(const LogLevel_t logLevel, const char* tag, const char* format, ...) {
+    printf("%s%s %s : %s", "\033[1;32m", "I", tag, "\033[0;32m");
+    va_list argptr;
+    va_start(argptr, format);
+    vprintf(format, argptr);
+    va_end(argptr);
+    printf("\033[0m\n");
+}
+
+static void bench_legacy_line(int i) {
+    legacy_log_text(LOG_LVL_INFO, TAG, "The main server received a request from james to lookup CS%d's Credits using TCP over port %d.", 100 + i % 400, 37576);
+}
+
+static void bench_line(int i) {
+    LOG_INFO("The main server received a request from james to lookup CS%d's Credits using TCP over port %d.", 100 + i % 400, 37576);
+}
+
+static void* bench_thread(void* params) {
+    bench_log_fn fn = (bench_log_fn) params;
+    for (int i = 0; i < LINES_PER_THREAD; i++) {
+        fn(i);
+    }
+    return NULL;
+}
+
+// Returns the ns per line the logging threads spent
+static double bench_run(bench_log_fn fn, int threads_count) {
+    pthread_t threads[4];
+    uint64_t start = bench_now_ns();
+    for (int t = 0; t < threads_count; t++) {
+        pthread_create(&threads[t], NULL, bench_thread, fn);
+    }
+    for (int t = 0; t < threads_count; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    return (double) (bench_now_ns() - start) / ((uint64_t) threads_count * LINES_PER_THREAD);
+}
+
+int main(void) {
+    const int threads[] = { 1, 4 };
+    double legacy_ns[2], async_ns[2], delivered_ns[2];
+    uint64_t dropped[2];
+
+    // Keep the real stdout for the report
+    char path[] = "/tmp/bench_logger_XXXXXX";
+    int fd = mkstemp(path);
+    FILE* report = fdopen(dup(STDOUT_FILENO), "w");
+    if (fd < 0 || report == NULL || freopen(path, "w", stdout) == NULL) {
+        fprintf(stderr, "Failed to redirect stdout\n");
+        return 1;
+    }
+    close(fd);
+    setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
+
+    for (int i = 0; i < 2; i++) {
+        legacy_ns[i] = bench_run(bench_legacy_line, threads[i]);
+        fflush(stdout);
+    }
+    if (log_start(path) != ERR_OK) {
+        fprintf(stderr, "Failed to start the log thread\n");
+        return 1;
+    }
+    for (int i = 0; i < 2; i++) {
+        uint64_t dropped_before = log_dropped();
+        uint64_t start = bench_now_ns();
+        async_ns[i] = bench_run(bench_line, threads[i]);
+        log_flush();
+        dropped[i] = log_dropped() - dropped_before;
+        // Time until the lines that were not dropped are written
+        delivered_ns[i] = (double) (bench_now_ns() - start) / ((uint64_t) threads[i] * LINES_PER_THREAD - dropped[i]);
+    }
+    unlink(path);
+
+    // ns/op is the time a logging thread spends per line. Written lines/s counts the lines that reached the file.
+    fprintf(report, "%8s %14s %14s %18s %18s %10s\n", "threads", "printf ns/op", "async ns/op", "printf written/s", "async written/s", "dropped");
+    for (int i = 0; i < 2; i++) {
+        fprintf(report, "%8d %14.1f %14.1f %18.0f %18.0f %10llu\n", threads[i], legacy_ns[i], async_ns[i],
+            1e9 / legacy_ns[i], 1e9 / delivered_ns[i], (unsigned long long) dropped[i]);
+    }
+    fclose(report);
+    return 0;
+}
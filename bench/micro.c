@@ -0,0 +1,352 @@
+/**
+ * Microbenchmarks of the per-request building blocks: encoding and decoding
+ * the protocol messages, looking up courses and credentials, and loading
+ * the csv databases. Every benchmark is warmed up and timed over repeated
+ * runs, and reports the median time per operation with its median absolute
+ * deviation, cycles and allocations per operation.
+ * Build and run with `make bench`. `make bench BENCH_ARGS="--json protocol/"`
+ * passes options through: `[--runs <n>] [--run-ms <ms>] [--warmup-ms <ms>] [--json] [filter]`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "harness.h"
+#include "../src/database.h"
+#include "../src/fileio.h"
+#include "../src/message_buffer.h"
+#include "../src/protocol.h"
+
+#define BENCH_COURSES               10000
+#define BENCH_USERS                 100000
+#define BENCH_MULTI_COURSES         10
+#define BENCH_KEYS                  1024        // Keys cycled through by the lookups. A power of 2.
+
+static const char* bench_days[] = { "Mon;Wed", "Tue;Thu", "Mon;Wed;Fri", "Fri", "Tue" };
+
+static const courses_lookup_category_t bench_categories[] = {
+    COURSES_LOOKUP_CATEGORY_CREDITS, COURSES_LOOKUP_CATEGORY_PROFESSOR, COURSES_LOOKUP_CATEGORY_DAYS, COURSES_LOOKUP_CATEGORY_COURSE_NAME,
+};
+
+// Inputs shared by the benchmarks, built once
+typedef struct __bench_ctx_t {
+    courses_db_t* courses;
+    credentials_db_t* credentials;
+    char courses_path[64];
+    char credentials_path[64];
+    char course_codes[BENCH_KEYS][16];
+    char missing_codes[BENCH_KEYS][16];
+    credentials_t logins[BENCH_KEYS];
+    struct __message_t auth_request;
+    struct __message_t single_request;
+    struct __message_t single_response;
+    struct __message_t detail_responses[BENCH_MULTI_COURSES];
+    string_slice_t records[BENCH_MULTI_COURSES];
+    char multi_codes[BENCH_MULTI_COURSES * 8];
+    size_t multi_codes_len;
+    message_buffer_t multi_request;
+    message_buffer_t multi_response;
+} bench_ctx_t;
+
+/* ---------------------------------------- Protocol ------------------------------------------ */
+
+static void bench_auth_request_encode(void* arg, size_t iterations) {
+    bench_ctx_t* ctx = arg;
+    struct __message_t message;
+    for (size_t i = 0; i < iterations; i++) {
+        protocol_authentication_request_encode(&ctx->logins[i & (BENCH_KEYS - 1)], &message);
+        bench_escape(&message);
+    }
+}
+
+static void bench_auth_request_decode(void* arg, size_t iterations) {
+    bench_ctx_t* ctx = arg;
+    credentials_t credentials;
+    for (size_t i = 0; i < iterations; i++) {
+        protocol_authentication_request_decode(&ctx->auth_request, &credentials);
+        bench_escape(&credentials);
+    }
+}
+
+static void bench_single_request_encode(void* arg, size_t iterations) {
+    bench_ctx_t* ctx = arg;
+    struct __message_t message;
+    for (size_t i = 0; i < iterations; i++) {
+        const char* code = ctx->course_codes[i & (BENCH_KEYS - 1)];
+        protocol_courses_lookup_single_request_encode(code, strlen(code), bench_categories[i & 3], &message);
+        bench_escape(&message);
+    }
+}
+
+static void bench_single_request_view(void* arg, size_t iterations) {
+    bench_ctx_t* ctx = arg;
+    string_slice_t course_code;
+    courses_lookup_category_t category;
+    for (size_t i = 0; i < iterations; i++) {
+        protocol_courses_lookup_single_request_view(&ctx->single_request, &course_code, &category);
+        bench_escape(&course_code);
+    }
+}
+
+static void bench_single_response_encode(void* arg, size_t iterations) {
+    struct __message_t message;
+    static const char information[] = "Sathyanaraya Raghavachary";
+    for (size_t i = 0; i < iterations; i++) {
+        protocol_courses_lookup_single_response_encode("CS100", 5, COURSES_LOOKUP_CATEGORY_PROFESSOR, (const uint8_t*) information,
+            sizeof(information) - 1, &message);
+        bench_escape(&message);
+    }
+}
+
+static void bench_single_response_view(void* arg, size_t iterations) {
+    bench_ctx_t* ctx = arg;
+    string_slice_t course_code, information;
+    courses_lookup_category_t category;
+    for (size_t i = 0; i < iterations; i++) {
+        protocol_courses_lookup_single_response_view(&ctx->single_response, &course_code, &category, &information);
+        bench_escape(&information);
+    }
+}
+
+static void bench_detail_response_encode(void* arg, size_t iterations) {
+    bench_ctx_t* ctx = arg;
+    struct __message_t message;
+    course_view_t course;
+    for (size_t i = 0; i < iterations; i++) {
+        database_courses_view(ctx->courses, &ctx->courses->courses[i % ctx->courses->count], &course);
+        protocol_courses_lookup_detail_response_encode(&course, &message);
+        bench_escape(&message);
+    }
+}
+
+static void bench_multi_request_encode(void* arg, size_t iterations) {
+    bench_ctx_t* ctx = arg;
+    for (size_t i = 0; i < iterations; i++) {
+        message_buffer_t message = {0};
+        protocol_courses_lookup_multiple_request_encode(BENCH_MULTI_COURSES, (const uint8_t*) ctx->multi_codes, ctx->multi_codes_len, &message);
+        bench_escape(message.data);
+        message_buffer_release(&message);
+    }
+}
+
+static void bench_count_course_code(const uint8_t idx, const char* course_code, const uint8_t course_code_len, void* user_data) {
+    *(size_t*) user_data += course_code_len;
+}
+
+static void bench_multi_request_decode(void* arg, size_t iterations) {
+    bench_ctx_t* ctx = arg;
+    size_t total = 0;
+    uint8_t count;
+    for (size_t i = 0; i < iterations; i++) {
+        protocol_courses_lookup_multiple_request_decode(&ctx->multi_request, &count, bench_count_course_code, &total);
+    }
+    bench_escape(&total);
+}
+
+static void bench_multi_response_encode(void* arg, size_t iterations) {
+    bench_ctx_t* ctx = arg;
+    for (size_t i = 0; i < iterations; i++) {
+        message_buffer_t message = {0};
+        protocol_courses_lookup_multiple_response_encode(ctx->records, BENCH_MULTI_COURSES, &message);
+        bench_escape(message.data);
+        message_buffer_release(&message);
+    }
+}
+
+static void bench_multi_response_iterate(void* arg, size_t iterations) {
+    bench_ctx_t* ctx = arg;
+    courses_iterator_t iterator;
+    course_details_view_t course;
+    for (size_t i = 0; i < iterations; i++) {
+        protocol_courses_lookup_multiple_response_iterate(&ctx->multi_response, &iterator);
+        while (protocol_courses_iterator_next(&iterator, &course)) {
+            bench_escape(&course);
+        }
+    }
+}
+
+/* ---------------------------------------- Database ------------------------------------------ */
+
+static void bench_courses_lookup_hit(void* arg, size_t iterations) {
+    bench_ctx_t* ctx = arg;
+    for (size_t i = 0; i < iterations; i++) {
+        const course_record_t* record = database_courses_lookup(ctx->courses, STRING_SLICE(ctx->course_codes[i & (BENCH_KEYS - 1)]));
+        bench_escape(record);
+    }
+}
+
+static void bench_courses_lookup_miss(void* arg, size_t iterations) {
+    bench_ctx_t* ctx = arg;
+    for (size_t i = 0; i < iterations; i++) {
+        const course_record_t* record = database_courses_lookup(ctx->courses, STRING_SLICE(ctx->missing_codes[i & (BENCH_KEYS - 1)]));
+        bench_escape(record);
+    }
+}
+
+static void bench_courses_lookup_info(void* arg, size_t iterations) {
+    bench_ctx_t* ctx = arg;
+    uint8_t information[256];
+    size_t information_len;
+    course_view_t course;
+    for (size_t i = 0; i < iterations; i++) {
+        const course_record_t* record = database_courses_lookup(ctx->courses, STRING_SLICE(ctx->course_codes[i & (BENCH_KEYS - 1)]));
+        database_courses_view(ctx->courses, record, &course);
+        database_courses_lookup_info(&course, bench_categories[i & 3], information, sizeof(information), &information_len);
+        bench_escape(information);
+    }
+}
+
+static void bench_credentials_encrypt(void* arg, size_t iterations) {
+    bench_ctx_t* ctx = arg;
+    credentials_t encrypted;
+    for (size_t i = 0; i < iterations; i++) {
+        database_credentials_encrypt(&ctx->logins[i & (BENCH_KEYS - 1)], &encrypted);
+        bench_escape(&encrypted);
+    }
+}
+
+static void bench_credentials_validate(void* arg, size_t iterations) {
+    bench_ctx_t* ctx = arg;
+    size_t accepted = 0;
+    for (size_t i = 0; i < iterations; i++) {
+        accepted += database_credentials_validate(ctx->credentials, &ctx->logins[i & (BENCH_KEYS - 1)]) == ERR_OK;
+    }
+    bench_escape(&accepted);
+}
+
+/* ----------------------------------------- File IO ------------------------------------------ */
+
+static void bench_department_db_create(void* arg, size_t iterations) {
+    bench_ctx_t* ctx = arg;
+    for (size_t i = 0; i < iterations; i++) {
+        fileio_department_server_db_free(fileio_department_server_db_create(ctx->courses_path));
+    }
+}
+
+static void bench_credential_db_create(void* arg, size_t iterations) {
+    bench_ctx_t* ctx = arg;
+    for (size_t i = 0; i < iterations; i++) {
+        fileio_credential_server_db_free(fileio_credential_server_db_create(ctx->credentials_path));
+    }
+}
+
+/* ------------------------------------------ Setup ------------------------------------------- */
+
+// Department export and credentials file shaped like bench_startup's
+static int bench_files_create(bench_ctx_t* ctx) {
+    strcpy(ctx->courses_path, "/tmp/bench_courses_XXXXXX");
+    strcpy(ctx->credentials_path, "/tmp/bench_credentials_XXXXXX");
+    int courses_fd = mkstemp(ctx->courses_path);
+    int credentials_fd = mkstemp(ctx->credentials_path);
+    FILE* courses = courses_fd < 0 ? NULL : fdopen(courses_fd, "w");
+    FILE* credentials = credentials_fd < 0 ? NULL : fdopen(credentials_fd, "w");
+    if (courses == NULL || credentials == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < BENCH_COURSES; i++) {
+        fprintf(courses, "EE%zu,%zu,Professor %zu,%s,Topics in Electrical Engineering %zu\r\n", 100 + i, 1 + i % 4, i % 400, bench_days[i % 5], i / 4);
+    }
+    for (size_t i = 0; i < BENCH_USERS; i++) {
+        fprintf(credentials, "user%07zu,pass%07zu\n", i, i);
+    }
+    fclose(courses);
+    fclose(credentials);
+    return 0;
+}
+
+static int bench_ctx_init(bench_ctx_t* ctx) {
+    if (bench_files_create(ctx) != 0) {
+        perror("Failed to create the csv files");
+        return -1;
+    }
+    ctx->courses = fileio_department_server_db_create(ctx->courses_path);
+    ctx->credentials = fileio_credential_server_db_create(ctx->credentials_path);
+    if (ctx->courses == NULL || ctx->credentials == NULL) {
+        fprintf(stderr, "Failed to load the csv files\n");
+        return -1;
+    }
+
+    // Lookup keys spread over the catalog, typed in lower case half the time
+    srand(450);
+    for (size_t i = 0; i < BENCH_KEYS; i++) {
+        size_t course = (size_t) rand() % BENCH_COURSES;
+        snprintf(ctx->course_codes[i], sizeof(ctx->course_codes[i]), i % 2 ? "EE%zu" : "ee%zu", 100 + course);
+        snprintf(ctx->missing_codes[i], sizeof(ctx->missing_codes[i]), "CS%zu", 100 + course);
+        size_t user = (size_t) rand() % BENCH_USERS;
+        credentials_t* login = &ctx->logins[i];
+        login->username_len = snprintf((char*) login->username, sizeof(login->username), "user%07zu", user);
+        login->password_len = snprintf((char*) login->password, sizeof(login->password), "pass%07zu", user);
+    }
+
+    // Received messages for the decoders
+    protocol_authentication_request_encode(&ctx->logins[0], &ctx->auth_request);
+    protocol_courses_lookup_single_request_encode("EE450", 5, COURSES_LOOKUP_CATEGORY_PROFESSOR, &ctx->single_request);
+    protocol_courses_lookup_single_response_encode("EE450", 5, COURSES_LOOKUP_CATEGORY_PROFESSOR, (const uint8_t*) "Ali Zahid", 9, &ctx->single_response);
+    for (size_t i = 0; i < BENCH_MULTI_COURSES; i++) {
+        course_view_t course;
+        course_details_view_t details;
+        database_courses_view(ctx->courses, &ctx->courses->courses[i * 7], &course);
+        ctx->multi_codes_len += snprintf(ctx->multi_codes + ctx->multi_codes_len, sizeof(ctx->multi_codes) - ctx->multi_codes_len, "%s ", course.course_code);
+        protocol_courses_lookup_detail_response_encode(&course, &ctx->detail_responses[i]);
+        protocol_courses_lookup_detail_response_view(&ctx->detail_responses[i], &ctx->records[i], &details);
+    }
+    if (protocol_courses_lookup_multiple_request_encode(BENCH_MULTI_COURSES, (const uint8_t*) ctx->multi_codes, ctx->multi_codes_len, &ctx->multi_request) != ERR_OK
+            || protocol_courses_lookup_multiple_response_encode(ctx->records, BENCH_MULTI_COURSES, &ctx->multi_response) != ERR_OK) {
+        fprintf(stderr, "Failed to encode the multi lookup messages\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void bench_ctx_free(bench_ctx_t* ctx) {
+    message_buffer_release(&ctx->multi_request);
+    message_buffer_release(&ctx->multi_response);
+    fileio_department_server_db_free(ctx->courses);
+    fileio_credential_server_db_free(ctx->credentials);
+    unlink(ctx->courses_path);
+    unlink(ctx->credentials_path);
+}
+
+typedef struct __bench_case_t {
+    const char* name;
+    bench_fn_t fn;
+} bench_case_t;
+
+static const bench_case_t bench_cases[] = {
+    { "protocol/auth_request_encode", bench_auth_request_encode },
+    { "protocol/auth_request_decode", bench_auth_request_decode },
+    { "protocol/single_request_encode", bench_single_request_encode },
+    { "protocol/single_request_view", bench_single_request_view },
+    { "protocol/single_response_encode", bench_single_response_encode },
+    { "protocol/single_response_view", bench_single_response_view },
+    { "protocol/detail_response_encode", bench_detail_response_encode },
+    { "protocol/multi_request_encode_10", bench_multi_request_encode },
+    { "protocol/multi_request_decode_10", bench_multi_request_decode },
+    { "protocol/multi_response_encode_10", bench_multi_response_encode },
+    { "protocol/multi_response_iterate_10", bench_multi_response_iterate },
+    { "database/courses_lookup_hit_10k", bench_courses_lookup_hit },
+    { "database/courses_lookup_miss_10k", bench_courses_lookup_miss },
+    { "database/courses_lookup_info_10k", bench_courses_lookup_info },
+    { "database/credentials_encrypt", bench_credentials_encrypt },
+    { "database/credentials_validate_100k", bench_credentials_validate },
+    { "fileio/department_db_create_10k", bench_department_db_create },
+    { "fileio/credential_db_create_100k", bench_credential_db_create },
+};
+
+int main(int argc, char** argv) {
+    bench_options_t options;
+    bench_options_parse(&options, argc, argv);
+
+    static bench_ctx_t ctx;
+    if (bench_ctx_init(&ctx) != 0) {
+        return 1;
+    }
+    bench_begin(&options);
+    bench_result_t result;
+    for (size_t i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++) {
+        bench_run(&options, bench_cases[i].name, bench_cases[i].fn, &ctx, &result);
+    }
+    bench_ctx_free(&ctx);
+    return 0;
+}
@@ -0,0 +1,85 @@
+/**
+ * Measures how long serverCS/serverEE and serverC take to load their csv
+ * databases, in milliseconds per MB. Build and run with `make bench_startup`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "../src/database.h"
+#include "../src/fileio.h"
+
+#define BENCH_COURSES       2000000
+#define BENCH_USERS         2000000
+#define BENCH_RUNS          5
+
+static const char* bench_days[] = { "Mon;Wed", "Tue;Thu", "Mon;Wed;Fri", "Fri", "Tue" };
+
+static size_t bench_file_create(char* path, int courses) {
+    int fd = mkstemp(path);
+    FILE* fp = fd < 0 ? NULL : fdopen(fd, "w");
+    if (fp == NULL) {
+        return 0;
+    }
+    if (courses) {
+        for (size_t i = 0; i < BENCH_COURSES; i++) {
+            fprintf(fp, "EE%zu,%zu,Professor %zu,%s,Topics in Electrical Engineering %zu\r\n", 100 + i, 1 + i % 4, i % 400, bench_days[i % 5], i / 4);
+        }
+    } else {
+        for (size_t i = 0; i < BENCH_USERS; i++) {
+            fprintf(fp, "user%07zu,pass%07zu\n", i, i);
+        }
+    }
+    long size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+static void bench_report(const char* name, size_t file_bytes, uint64_t* samples, size_t records) {
+    double mb = file_bytes / (1024.0 * 1024.0);
+    double median_ms = bench_percentile(samples, BENCH_RUNS, 50) / 1e6;
+    printf("%-10s %8.1f MB %10zu records %9.1f ms %9.2f ms/MB\n", name, mb, records, median_ms, median_ms / mb);
+}
+
+int main(void) {
+    char courses_path[] = "/tmp/bench_courses_XXXXXX";
+    char credentials_path[] = "/tmp/bench_credentials_XXXXXX";
+    size_t courses_bytes = bench_file_create(courses_path, 1);
+    size_t credentials_bytes = bench_file_create(credentials_path, 0);
+    if (courses_bytes == 0 || credentials_bytes == 0) {
+        perror("Failed to create the csv files");
+        return 1;
+    }
+
+    uint64_t samples[BENCH_RUNS];
+    size_t records = 0;
+
+    for (size_t run = 0; run < BENCH_RUNS; run++) {
+        uint64_t start = bench_now_ns();
+        courses_db_t* db = fileio_department_server_db_create(courses_path);
+        samples[run] = bench_now_ns() - start;
+        records = db ? db->count : 0;
+        fileio_department_server_db_free(db);
+    }
+    bench_report("courses", courses_bytes, samples, records);
+
+    for (size_t run = 0; run < BENCH_RUNS; run++) {
+        uint64_t start = bench_now_ns();
+        credentials_db_t* db = fileio_credential_server_db_create(credentials_path);
+        samples[run] = bench_now_ns() - start;
+        records = db ? db->count : 0;
+        fileio_credential_server_db_free(db);
+    }
+    bench_report("credentials", credentials_bytes, samples, records);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("peak rss   %8.1f MB\n", usage.ru_maxrss / 1024.0);
+
+    unlink(courses_path);
+    unlink(credentials_path);
+    return 0;
+}
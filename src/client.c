@@ -19,6 +19,7 @@
 #include "messages.h"
 #include "constants.h"
 #include "database.h"
+#include "trace.h"
 
 LOG_TAG(client);
 
@@ -36,6 +37,10 @@ typedef struct __client_context_t {
     sem_t semaphore;
     tcp_client_t *client;
     credentials_t creds;
+    trace_span_t span;                  // Of the request waiting for its response
+    request_type_t request_type;
+    _Atomic(request_id_t) request_id;   // Of the request waiting for its response. Other responses came too late.
+    double trace_sample_rate;           // Share of the requests that start a trace
 } client_context_t;
 
 static err_t collect_credentials(credentials_t* user) {
@@ -85,7 +90,7 @@ static err_t collect_credentials(credentials_t* user) {
     return ERR_OK;
 }
 
-static int collect_course_codes(uint8_t* course_code, uint8_t course_code_buffer_size) {
+static int collect_course_codes(uint8_t* course_code, size_t course_code_buffer_size) {
 #ifdef CLIENT_TEST
     strncpy((char*) course_code, TEST_COURSE_INPUT, course_code_buffer_size);
 #else
@@ -94,7 +99,7 @@ static int collect_course_codes(uint8_t* course_code, uint8_t course_code_buffer
     return utils_get_word_count((char*) course_code);
 }
 
-static int new_request_prompt(uint8_t* course_code_buffer, uint8_t course_code_buffer_size, uint8_t* category_buffer, uint8_t category_buffer_size) {
+static int new_request_prompt(uint8_t* course_code_buffer, size_t course_code_buffer_size, uint8_t* category_buffer, uint8_t category_buffer_size) {
     // Prompt user for course codes
     printf(CLIENT_MESSAGE_INPUT_COURSE_NAME);
     fflush(stdout);
@@ -156,10 +161,18 @@ static void authenticate_user(client_context_t* ctx) {
         return;
     }
 
+    trace_span_start_root(&ctx->span, ctx->trace_sample_rate);
+    ctx->request_type = REQUEST_TYPE_AUTH;
+    protocol_set_request_id(&sgmnt, ++ctx->request_id);
+    trace_span_inject(&ctx->span, &sgmnt);
+
     // Send authentication request
+    // Hold stdout until the request is logged, so that the network thread cannot print the response first
+    flockfile(stdout);
     if (tcp_client_send(ctx->client, &sgmnt) == ERR_OK) {
         LOG_INFO(CLIENT_MESSAGE_ON_AUTH_REQUEST, ctx->creds.username_len, ctx->creds.username);
     }
+    funlockfile(stdout);
 }
 
 static void on_setup_complete(client_context_t* ctx) {
@@ -168,31 +181,60 @@ static void on_setup_complete(client_context_t* ctx) {
     sem_post(&ctx->semaphore);
 }
 
-static void send_request(client_context_t* ctx, int courses_count, uint8_t* course_code_buffer, uint8_t course_code_buffer_size, uint8_t* category_buffer, uint8_t category_buffer_size) {
+static void send_request(client_context_t* ctx, int courses_count, uint8_t* course_code_buffer, size_t course_code_buffer_size, uint8_t* category_buffer, uint8_t category_buffer_size) {
     tcp_sgmnt_t sgmnt = {0};
+    err_t err = ERR_INVALID_PARAMETERS;
+    trace_span_start_root(&ctx->span, ctx->trace_sample_rate);
+    // Hold stdout until the request is logged, so that the network thread cannot print the response first
+    flockfile(stdout);
     if (courses_count == 1) {
         // Only one course code was entered. Send a lookup request for the course code and category.
         courses_lookup_category_t category = database_courses_lookup_category_from_string(utils_string_trim((char*) category_buffer));
         if (category == COURSES_LOOKUP_CATEGORY_INVALID) {
             LOG_ERR("Invalid category.");
+            funlockfile(stdout);
             sem_post(&ctx->semaphore);
             return;
         }
         // Encode the lookup request.
         protocol_courses_lookup_single_request_encode((const char*) course_code_buffer, strlen((const char*) course_code_buffer), category, &sgmnt);
+        ctx->request_type = REQUEST_TYPE_COURSES_SINGLE_LOOKUP;
+        protocol_set_request_id(&sgmnt, ++ctx->request_id);
+        trace_span_inject(&ctx->span, &sgmnt);
+        // Send the request.
+        err = tcp_client_send(ctx->client, &sgmnt);
+    } else if (courses_count > MULTI_LOOKUP_MAX_COURSES) {
+        LOG_ERR("At most %d courses can be looked up at once.", MULTI_LOOKUP_MAX_COURSES);
+        funlockfile(stdout);
+        sem_post(&ctx->semaphore);
+        return;
     } else if (courses_count > 1) {
         LOG_DBG("Requesting course details for multiple course codes. (%s)", course_code_buffer);
-        // Encode the lookup request for multiple courses.
-        protocol_courses_lookup_multiple_request_encode(courses_count, course_code_buffer, course_code_buffer_size, &sgmnt);
+        // Encode the lookup request for multiple courses. Long lists are sent as several frames.
+        message_buffer_t message = {0};
+        err = protocol_courses_lookup_multiple_request_encode(courses_count, course_code_buffer, course_code_buffer_size, &message);
+        ctx->request_type = REQUEST_TYPE_COURSES_MULTI_LOOKUP;
+        if (err == ERR_OK) {
+            protocol_set_message_request_id(&message, ++ctx->request_id);
+        }
+        size_t offset = 0;
+        if (err == ERR_OK && !protocol_fragment_encode(&message, &offset, &sgmnt)) {
+            // The whole message fits a single frame, which has room for the trace context
+            trace_span_inject(&ctx->span, &sgmnt);
+            err = tcp_client_send(ctx->client, &sgmnt);
+        } else if (err == ERR_OK) {
+            err = tcp_client_send_message(ctx->client, &message);
+        }
+        message_buffer_release(&message);
     }
-    // Send the request.
-    if (tcp_client_send(ctx->client, &sgmnt) == ERR_OK) {
+    if (err == ERR_OK) {
         if (courses_count == 1) {
             LOG_INFO("%.*s sent a request to the main server.", ctx->creds.username_len, ctx->creds.username);
         } else {
             LOG_INFO("%.*s sent a request with multiple CourseCode to the main server", ctx->creds.username_len, ctx->creds.username);
         }
     }
+    funlockfile(stdout);
 }
 
 static void on_course_lookup_info(client_context_t* ctx, tcp_sgmnt_t* sgmnt) {
@@ -216,15 +258,24 @@ static void on_course_lookup_info(client_context_t* ctx, tcp_sgmnt_t* sgmnt) {
     }
 }
 
-static void on_course_multi_lookup(client_context_t* ctx, tcp_sgmnt_t* sgmnt) {
+static void on_course_multi_lookup(client_context_t* ctx, const message_buffer_t* message) {
     LOG_DBG("Received course multi lookup info.");
-    course_t* courses = NULL;
-    // Decode the multiple courses lookup response. This is an allocating function.
-    protocol_courses_lookup_multiple_response_decode(sgmnt, &courses);
+    course_details_view_t courses[MULTI_LOOKUP_MAX_COURSES];
+    size_t count = 0;
+    courses_iterator_t iterator;
+    // Walk the multiple courses lookup response. The courses point into the message.
+    if (protocol_courses_lookup_multiple_response_iterate(message, &iterator) != ERR_OK) {
+        LOG_ERR("Failed to decode course multi lookup info.");
+        return;
+    }
+    while (count < MULTI_LOOKUP_MAX_COURSES && protocol_courses_iterator_next(&iterator, &courses[count])) {
+        count++;
+    }
+    if (iterator.remaining > 0) {
+        LOG_ERR("Failed to decode course multi lookup info.");
+    }
     // Print the courses information.
-    log_course_multi_lookup_result(courses);
-    // Free the courses.
-    protocol_courses_lookup_multiple_response_decode_dealloc(courses);
+    log_course_multi_lookup_result(courses, count);
 }
 
 static err_t create_timeout(struct timespec* ts, time_t sec, time_t nsec) {
@@ -247,6 +298,8 @@ static void on_course_lookup_error(client_context_t* ctx, tcp_sgmnt_t* sgmnt) {
     if (protocol_courses_error_decode(sgmnt, &error_code, buffer, &buffer_len) == ERR_OK) {
         if (error_code == ERR_COURSES_NOT_FOUND) {
             LOG_WARN("Didn't find the course: %.*s", buffer_len, (char*) buffer);
+        } else if (error_code == ERR_NETWORK_FAILURE) {
+            LOG_ERR("The department server did not answer about %.*s. Try again.", buffer_len, (char*) buffer);
         } else {
             LOG_ERR("Unknown error code: %d", error_code);
         }
@@ -284,7 +337,7 @@ static void* user_input_task(void* params) {
     LOG_INFO("-------- User \"%.*s\" Authenticated --------", ctx->creds.username_len, ctx->creds.username);
 
 
-    uint8_t course_code[COURSE_NAME_BUFFER_SIZE] = {0};
+    uint8_t course_code[COURSE_CODES_INPUT_BUFFER_SIZE] = {0};
     uint8_t category[COURSE_CATEGORY_BUFFER_SIZE] = {0};
 
     while(1) {
@@ -311,6 +364,11 @@ static void* user_input_task(void* params) {
 static void on_receive(tcp_client_t* client, tcp_sgmnt_t* sgmnt) {
     client_context_t* ctx = (client_context_t*) client->user_data;
     response_type_t response_type = protocol_get_request_type(sgmnt);
+    if (protocol_get_request_id(sgmnt) != ctx->request_id) {
+        // The answer to a request that already timed out. Waking the user input task would end the next request early.
+        LOG_DBG("Dropped a late response to request %u", protocol_get_request_id(sgmnt));
+        return;
+    }
     if (response_type != RESPONSE_TYPE_AUTH) {
         LOG_INFO(CLIENT_MESSAGE_ON_RESPONSE, client->port);
     }
@@ -324,8 +382,8 @@ static void on_receive(tcp_client_t* client, tcp_sgmnt_t* sgmnt) {
             on_course_lookup_info(ctx, sgmnt);
             break;
         case RESPONSE_TYPE_COURSES_MULTI_LOOKUP:
-            // On course multi lookup response
-            on_course_multi_lookup(ctx, sgmnt);
+            // On course multi lookup response that fits a single segment
+            on_course_multi_lookup(ctx, &MESSAGE_BUFFER_VIEW(sgmnt->data, sgmnt->data_len));
             break;
         case RESPONSE_TYPE_COURSES_ERROR:
             // On course lookup error
@@ -335,6 +393,26 @@ static void on_receive(tcp_client_t* client, tcp_sgmnt_t* sgmnt) {
             LOG_ERR("Unknown segment type. %d", response_type);
             break;
     }
+    trace_span_end(&ctx->span, TRACE_KIND_CLIENT, protocol_get_request_id(sgmnt), ctx->request_type, SERVER_M_TCP_PORT_NUMBER);
+    // Notify the user input task that the response has been received.
+    sem_post(&ctx->semaphore);
+}
+
+// A response that was sent as several frames
+static void on_receive_message(tcp_client_t* client, const message_buffer_t* message) {
+    client_context_t* ctx = (client_context_t*) client->user_data;
+    response_type_t response_type = protocol_get_message_type(message);
+    if (protocol_get_message_request_id(message) != ctx->request_id) {
+        LOG_DBG("Dropped a late response to request %u", protocol_get_message_request_id(message));
+        return;
+    }
+    LOG_INFO(CLIENT_MESSAGE_ON_RESPONSE, client->port);
+    if (response_type == RESPONSE_TYPE_COURSES_MULTI_LOOKUP) {
+        on_course_multi_lookup(ctx, message);
+    } else {
+        LOG_ERR("Unexpected %ld byte message of type %d", message->data_len, response_type);
+    }
+    trace_span_end(&ctx->span, TRACE_KIND_CLIENT, protocol_get_message_request_id(message), ctx->request_type, SERVER_M_TCP_PORT_NUMBER);
     // Notify the user input task that the response has been received.
     sem_post(&ctx->semaphore);
 }
@@ -355,6 +433,11 @@ static void* network_thread_task(void* params) {
 
     // Create a new TCP client
     ctx->client = tcp_client_connect(&dst, on_receive, on_tcp_disconnect);
+    if (ctx->client == NULL) {
+        on_tcp_disconnect(NULL);
+        return NULL;
+    }
+    ctx->client->on_receive_message = on_receive_message;
 
     // Set the user data to be passed to the callback functions
     on_setup_complete(ctx);
@@ -376,6 +459,14 @@ int main() {
     // Initialize the semaphore
     sem_init(&ctx.semaphore, 0, 0);
 
+    // Trace a share of the requests when asked to. `make tracemerge` joins the spans up with those of the servers.
+    const char* trace_path = getenv(TRACE_FILE_ENV);
+    const char* trace_sample = getenv(TRACE_SAMPLE_ENV);
+    if (trace_path != NULL && trace_open(trace_path, "client", TRACE_RECORDS) != ERR_OK) {
+        LOG_WARN("Failed to open the trace file %s", trace_path);
+    }
+    ctx.trace_sample_rate = trace_sample != NULL ? atof(trace_sample) : 0;
+
     // Start the user input thread
     pthread_create(&ctx.user_input_thread, NULL, &user_input_task, &ctx);
 
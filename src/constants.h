@@ -33,7 +33,84 @@
 #define TCP_QUERY_TIMEOUT_DELAY_S                   2
 #define TCP_QUERY_TIMEOUT_DELAY_NS                  0
 
-#define COURSE_NAME_BUFFER_SIZE                     128
+// Bytes queued for a slow TCP peer before its responses are dropped
+#define TCP_TX_BUFFER_MAX                           (1024 * 1024)
+
+// Bytes of a single frame (or datagram), header included
+#define MESSAGE_FRAME_SIZE                          1024
+
+// Largest message reassembled from continuation frames. Bounds what a peer can make us buffer.
+#define TCP_MESSAGE_MAX                             (256 * 1024)
+
+// Pooled message buffers. Sizes are powers of 2 from MIN to MAX, larger buffers are never cached.
+#define MESSAGE_BUFFER_POOL_MIN                     MESSAGE_FRAME_SIZE
+#define MESSAGE_BUFFER_POOL_MAX                     TCP_MESSAGE_MAX
+#define MESSAGE_BUFFER_POOL_DEPTH                   64
+
+// Bytes buffered per TCP connection while a frame is reassembled. Holds several pipelined frames.
+#define TCP_RX_BUFFER_SIZE                          (4 * 1024)
+
+// Requested kernel buffer size of the UDP sockets
+#define UDP_SOCKET_BUFFER_SIZE                      (4 * 1024 * 1024)
+
+// Datagrams received (and responses sent) per recvmmsg / sendmmsg call
+#define UDP_BATCH_SIZE                              32
+
+// Maximum time serverM's event loop blocks waiting for socket activity. Short enough to expire pending requests on time.
+#define SERVER_M_REACTOR_TICK_TIMEOUT_MS            250
+
+// Multi course lookups are fanned out at once. The response is sent when all replies are in or the deadline expires.
+#define MULTI_LOOKUP_MAX_COURSES                    UINT8_MAX
+#define MULTI_LOOKUP_TIMEOUT_MS                     1000
+
+// Worker threads running multi course lookups, and the lookups that may queue for them.
+// A worker is held for the whole fan-out, up to MULTI_LOOKUP_TIMEOUT_MS.
+#define SERVER_M_WORKER_THREADS                     32
+#define SERVER_M_TASK_QUEUE_SIZE                    1024
+
+// Requests serverM can have outstanding with the backend servers. Must be a power of 2.
+#define PENDING_REQUESTS_MAX                        4096
+
+// Requests a backend server has not replied to within this long are answered with an error, and their entry freed.
+// The event loop looks for them every PENDING_REQUEST_SWEEP_INTERVAL_MS. The error must reach the client before its
+// TCP_QUERY_TIMEOUT_DELAY_S, so the timeout stays at least a sweep interval below it.
+#define PENDING_REQUEST_TIMEOUT_MS                  1500
+#define PENDING_REQUEST_SWEEP_INTERVAL_MS           250
+
+// Identical single lookups received while one is with a department server wait for its reply, for up to this long
+#define SINGLE_FLIGHT_MAX_AGE_MS                    1000
+
+// serverM's cache of department server replies. The TTL and the size can be overridden on the command line.
+#define RESPONSE_CACHE_ENTRIES                      4096
+#define RESPONSE_CACHE_TTL_MS                       30000
+#define RESPONSE_CACHE_SHARDS                       16
+#define RESPONSE_CACHE_KEY_MAX                      32      // Longer course codes are not cached
+
+// Logging. Each thread queues its lines in a ring of LOG_RING_SIZE bytes (a power of 2) for the log thread.
+#define LOG_LINE_MAX                                1024
+#define LOG_RING_SIZE                               (64 * 1024)
+#define LOG_DRAIN_IOV_MAX                           64      // Buffers written per writev
+#define LOG_DRAIN_IDLE_US                           1000    // Pause of the log thread when there is nothing to write
+#define LOG_FILE_ENV                                "LOG_FILE" // Servers log to this file instead of stdout
+#define LOG_LEVEL_ENV                               "LOG_LEVEL" // Runtime levels, e.g. "warn,serverM=info"
+#define LOG_TAG_NAME_MAX                            32
+#define LOG_TAG_LEVELS_MAX                          32      // Tags with a level of their own
+
+// Binary event log of the servers, written to the file named by EVENT_LOG_ENV when it is set
+#define EVENT_LOG_ENV                               "EVENT_LOG"
+#define EVENT_LOG_RECORDS                           (256 * 1024) // 8 MB of 32 byte records
+
+// Spans of traced requests, written to the file named by TRACE_FILE_ENV when it is set.
+// The client starts a trace for the share of its requests set by TRACE_SAMPLE_ENV, none by default.
+#define TRACE_FILE_ENV                              "TRACE_FILE"
+#define TRACE_SAMPLE_ENV                            "TRACE_SAMPLE"
+#define TRACE_RECORDS                               (64 * 1024) // 3 MB of 48 byte records
+
+// Request latency histograms. Each server logs a summary at most this often, while it gets requests.
+#define METRICS_REPORT_INTERVAL_S                   60
+
+// A line of course codes typed into the client. Room for MULTI_LOOKUP_MAX_COURSES codes.
+#define COURSE_CODES_INPUT_BUFFER_SIZE              (MULTI_LOOKUP_MAX_COURSES * 16)
 #define COURSE_CATEGORY_BUFFER_SIZE                 24
 
 #define CREDENTIALS_MIN_USERNAME_LEN                 5
@@ -1,7 +1,10 @@
 #include "database.h"
 
+#include <ctype.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include "log.h"
 #include "protocol.h"
@@ -9,43 +12,376 @@
 
 LOG_TAG(database);
 
+#if defined(SERVER_C) || defined(SERVER_CS) || defined(SERVER_EE)
+// Grow an arena so that it holds at least `needed` elements. Doubles the capacity to keep appends amortized O(1).
+static err_t arena_reserve(void** arena, size_t* capacity, size_t needed, size_t element_size) {
+    if (needed <= *capacity) {
+        return ERR_OK;
+    }
+    size_t new_capacity = *capacity;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    void* grown = realloc(*arena, new_capacity * element_size);
+    if (grown == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    *arena = grown;
+    *capacity = new_capacity;
+    return ERR_OK;
+}
+#endif // SERVER_C || SERVER_CS || SERVER_EE
+
 #if defined(SERVER_CS) || defined(SERVER_EE)
-course_t* database_courses_lookup(const course_t* db, const char* course_code) {
-    const course_t* entry = db;
-    while (entry != NULL) {
-        if (strcasecmp(entry->course_code, course_code) == 0) {
-            return (course_t*)entry;
+#define COURSES_DB_INITIAL_RECORDS      64
+#define COURSES_DB_INITIAL_STRINGS      4096
+#define COURSES_DB_INITIAL_INTERNED     256
+
+// FNV-1a over the lower cased course code, so that lookups stay case-insensitive
+static uint64_t course_code_hash(string_slice_t course_code) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < course_code.len; i++) {
+        hash ^= (uint64_t) tolower((unsigned char) course_code.data[i]);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Case-insensitive compare of a stored course code with a slice. The slice may come from the network and hold NULs.
+static bool course_code_equals(const courses_db_t* db, const course_record_t* record, string_slice_t course_code) {
+    return record->course_code_len == course_code.len && strncasecmp(db->strings + record->course_code, course_code.data, course_code.len) == 0;
+}
+
+static uint64_t string_hash(const char* s, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) s[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Place a string known to be absent from the table
+static void interned_insert(interned_string_t* table, size_t capacity, string_ref_t ref, uint32_t hash) {
+    const size_t mask = capacity - 1;
+    size_t slot = hash & mask;
+    while (table[slot].ref != 0) {
+        slot = (slot + 1) & mask;
+    }
+    table[slot].ref = ref;
+    table[slot].hash = hash;
+}
+
+// Rehashing reuses the stored hashes, it never reads the pool
+static err_t interned_grow(courses_db_t* db) {
+    size_t capacity = db->interned_capacity * 2;
+    interned_string_t* table = calloc(capacity, sizeof(interned_string_t));
+    if (table == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    for (size_t i = 0; i < db->interned_capacity; i++) {
+        if (db->interned[i].ref != 0) {
+            interned_insert(table, capacity, db->interned[i].ref, db->interned[i].hash);
+        }
+    }
+    free(db->interned);
+    db->interned = table;
+    db->interned_capacity = capacity;
+    return ERR_OK;
+}
+
+// Recreate the interning table from the records after database_courses_shrink() released it
+static err_t interned_rebuild(courses_db_t* db) {
+    size_t capacity = COURSES_DB_INITIAL_INTERNED;
+    while (capacity < db->count * 3 * 2) {
+        capacity <<= 1;
+    }
+    interned_string_t* table = calloc(capacity, sizeof(interned_string_t));
+    if (table == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    const size_t mask = capacity - 1;
+    size_t count = 0;
+    for (size_t i = 0; i < db->count; i++) {
+        const course_record_t* record = &db->courses[i];
+        const string_ref_t refs[] = { record->professor, record->days, record->course_name };
+        for (size_t r = 0; r < sizeof(refs) / sizeof(refs[0]); r++) {
+            if (refs[r] == 0) {
+                continue;
+            }
+            uint32_t hash = string_hash(db->strings + refs[r], strlen(db->strings + refs[r]));
+            size_t slot = hash & mask;
+            while (table[slot].ref != 0 && table[slot].ref != refs[r]) {
+                slot = (slot + 1) & mask;
+            }
+            if (table[slot].ref == 0) {
+                table[slot].ref = refs[r];
+                table[slot].hash = hash;
+                count++;
+            }
+        }
+    }
+    db->interned = table;
+    db->interned_count = count;
+    db->interned_capacity = capacity;
+    return ERR_OK;
+}
+
+// Append a string to the pool without interning it
+static err_t string_append(courses_db_t* db, string_slice_t string, string_ref_t* ref) {
+    if (string.len == 0) {
+        *ref = 0;
+        return ERR_OK;
+    }
+    if (db->strings_len + string.len + 1 > UINT32_MAX) {
+        LOG_ERR("String pool is full");
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (arena_reserve((void**) &db->strings, &db->strings_capacity, db->strings_len + string.len + 1, 1) != ERR_OK) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    *ref = db->strings_len;
+    memcpy(db->strings + db->strings_len, string.data, string.len);
+    db->strings[db->strings_len + string.len] = '\0';
+    db->strings_len += string.len + 1;
+    return ERR_OK;
+}
+
+// Get the pool offset of a string, appending it to the pool the first time it is seen
+static err_t string_intern(courses_db_t* db, string_slice_t string, string_ref_t* ref) {
+    const char* s = string.data;
+    size_t len = string.len;
+    if (len == 0) {
+        *ref = 0;
+        return ERR_OK;
+    }
+    if (db->interned == NULL && interned_rebuild(db) != ERR_OK) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    const uint32_t hash = string_hash(s, len);
+    const size_t mask = db->interned_capacity - 1;
+    size_t slot = hash & mask;
+    while (db->interned[slot].ref != 0) {
+        // The pool is only read when the hashes match
+        if (db->interned[slot].hash == hash) {
+            const char* interned = db->strings + db->interned[slot].ref;
+            if (strncmp(interned, s, len) == 0 && interned[len] == '\0') {
+                *ref = db->interned[slot].ref;
+                return ERR_OK;
+            }
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    if (string_append(db, string, ref) != ERR_OK) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    db->interned[slot].ref = *ref;
+    db->interned[slot].hash = hash;
+    db->interned_count++;
+    // Keep the load factor at or below 0.5
+    if (db->interned_count * 2 > db->interned_capacity) {
+        return interned_grow(db);
+    }
+    return ERR_OK;
+}
+
+courses_db_t* database_courses_create(void) {
+    courses_db_t* db = calloc(1, sizeof(courses_db_t));
+    if (db == NULL) {
+        return NULL;
+    }
+    db->capacity = COURSES_DB_INITIAL_RECORDS;
+    db->courses = malloc(db->capacity * sizeof(course_record_t));
+    db->strings_capacity = COURSES_DB_INITIAL_STRINGS;
+    db->strings = malloc(db->strings_capacity);
+    db->interned_capacity = COURSES_DB_INITIAL_INTERNED;
+    db->interned = calloc(db->interned_capacity, sizeof(interned_string_t));
+    if (db->courses == NULL || db->strings == NULL || db->interned == NULL) {
+        database_courses_free(db);
+        return NULL;
+    }
+    // Offset 0 is the empty string
+    db->strings[0] = '\0';
+    db->strings_len = 1;
+    return db;
+}
+
+void database_courses_free(courses_db_t* db) {
+    if (db == NULL) {
+        return;
+    }
+    free(db->courses);
+    free(db->strings);
+    free(db->interned);
+    free(db->index);
+    free(db);
+}
+
+err_t database_courses_add(courses_db_t* db, string_slice_t course_code, int credits, string_slice_t professor, string_slice_t days, string_slice_t course_name) {
+    if (db == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    if (arena_reserve((void**) &db->courses, &db->capacity, db->count + 1, sizeof(course_record_t)) != ERR_OK) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    course_record_t* record = &db->courses[db->count];
+    record->credits = credits;
+    // Up to the first NUL, as stored
+    record->course_code_len = strnlen(course_code.data, course_code.len);
+    // Course codes are unique per course, interning them would only grow the table
+    if (string_append(db, course_code, &record->course_code) != ERR_OK ||
+        string_intern(db, professor, &record->professor) != ERR_OK ||
+        string_intern(db, days, &record->days) != ERR_OK ||
+        string_intern(db, course_name, &record->course_name) != ERR_OK) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    db->count++;
+    return ERR_OK;
+}
+
+void database_courses_shrink(courses_db_t* db) {
+    if (db == NULL) {
+        return;
+    }
+    free(db->interned);
+    db->interned = NULL;
+    db->interned_count = 0;
+    db->interned_capacity = 0;
+
+    // A failed shrink leaves the arena as it was
+    if (db->count > 0) {
+        course_record_t* courses = realloc(db->courses, db->count * sizeof(course_record_t));
+        if (courses != NULL) {
+            db->courses = courses;
+            db->capacity = db->count;
+        }
+    }
+    char* strings = realloc(db->strings, db->strings_len);
+    if (strings != NULL) {
+        db->strings = strings;
+        db->strings_capacity = db->strings_len;
+    }
+}
+
+err_t database_courses_index_build(courses_db_t* db) {
+    if (db == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
+
+    // Keep the load factor at or below 0.5 so that probe sequences stay short
+    size_t capacity = 16;
+    while (capacity < db->count * 2) {
+        capacity <<= 1;
+    }
+
+    uint32_t* index = calloc(capacity, sizeof(*index));
+    if (index == NULL) {
+        LOG_ERR("Failed to allocate the course index for %zu courses", db->count);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    const size_t mask = capacity - 1;
+    for (size_t i = 0; i < db->count; i++) {
+        string_slice_t course_code = { .data = db->strings + db->courses[i].course_code, .len = db->courses[i].course_code_len };
+        size_t slot = course_code_hash(course_code) & mask;
+        while (index[slot] != 0 && !course_code_equals(db, &db->courses[index[slot] - 1], course_code)) {
+            slot = (slot + 1) & mask;
+        }
+        // On duplicate codes the first one in the file wins, same as the scan
+        if (index[slot] == 0) {
+            index[slot] = i + 1;
+        }
+    }
+
+    free(db->index);
+    db->index = index;
+    db->index_capacity = capacity;
+    return ERR_OK;
+}
+
+const course_record_t* database_courses_lookup(const courses_db_t* db, string_slice_t course_code) {
+    if (db == NULL || course_code.data == NULL) {
+        return NULL;
+    }
+    if (db->index == NULL) {
+        return database_courses_scan(db, course_code);
+    }
+
+    const size_t mask = db->index_capacity - 1;
+    size_t slot = course_code_hash(course_code) & mask;
+    while (db->index[slot] != 0) {
+        const course_record_t* record = &db->courses[db->index[slot] - 1];
+        if (course_code_equals(db, record, course_code)) {
+            return record;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+const course_record_t* database_courses_scan(const courses_db_t* db, string_slice_t course_code) {
+    if (db == NULL || course_code.data == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < db->count; i++) {
+        if (course_code_equals(db, &db->courses[i], course_code)) {
+            return &db->courses[i];
         }
-        entry = entry->next;
     }
     return NULL;
 }
 
-err_t database_courses_lookup_info(const course_t* course, courses_lookup_category_t category, uint8_t* info_buf, size_t info_buf_size, size_t* info_len) {
-    if (course == NULL || info_buf == NULL || info_len == NULL || category >= COURSES_LOOKUP_CATEGORY_INVALID) {
+void database_courses_view(const courses_db_t* db, const course_record_t* record, course_view_t* view) {
+    view->course_code = db->strings + record->course_code;
+    view->credits = record->credits;
+    view->professor = db->strings + record->professor;
+    view->days = db->strings + record->days;
+    view->course_name = db->strings + record->course_name;
+}
+
+size_t database_courses_footprint(const courses_db_t* db) {
+    if (db == NULL) {
+        return 0;
+    }
+    return sizeof(courses_db_t) +
+        db->capacity * sizeof(course_record_t) +
+        db->strings_capacity +
+        db->interned_capacity * sizeof(interned_string_t) +
+        db->index_capacity * sizeof(uint32_t);
+}
+
+// Copy a field into the info buffer, truncating it to fit
+static size_t info_copy(const char* field, uint8_t* info_buf, size_t info_buf_size) {
+    size_t len = min(strlen(field), info_buf_size - 1);
+    memcpy(info_buf, field, len);
+    info_buf[len] = '\0';
+    return len;
+}
+
+err_t database_courses_lookup_info(const course_view_t* course, courses_lookup_category_t category, uint8_t* info_buf, size_t info_buf_size, size_t* info_len) {
+    if (course == NULL || info_buf == NULL || info_buf_size == 0 || info_len == NULL || category >= COURSES_LOOKUP_CATEGORY_INVALID) {
         return ERR_INVALID_PARAMETERS;
     }
 
     switch (category) {
         case COURSES_LOOKUP_CATEGORY_COURSE_CODE:
-            strncpy((char*)info_buf, course->course_code, info_buf_size);
-            *info_len = strlen(course->course_code);
+            *info_len = info_copy(course->course_code, info_buf, info_buf_size);
             break;
         case COURSES_LOOKUP_CATEGORY_CREDITS:
             snprintf((char*)info_buf, info_buf_size, "%d", course->credits);
             *info_len = strlen((char*)info_buf);
             break;
         case COURSES_LOOKUP_CATEGORY_PROFESSOR:
-            strncpy((char*)info_buf, course->professor, info_buf_size);
-            *info_len = strlen(course->professor);
+            *info_len = info_copy(course->professor, info_buf, info_buf_size);
             break;
         case COURSES_LOOKUP_CATEGORY_DAYS:
-            strncpy((char*)info_buf, course->days, info_buf_size);
-            *info_len = strlen(course->days);
+            *info_len = info_copy(course->days, info_buf, info_buf_size);
             break;
         case COURSES_LOOKUP_CATEGORY_COURSE_NAME:
-            strncpy((char*)info_buf, course->course_name, info_buf_size);
-            *info_len = strlen(course->course_name);
+            *info_len = info_copy(course->course_name, info_buf, info_buf_size);
             break;
         default:
             return ERR_INVALID_PARAMETERS;
@@ -139,20 +475,143 @@ err_t database_credentials_encrypt(const credentials_t* in_credentials, credenti
 #endif // SERVER_M
 
 #if defined(SERVER_C)
-err_t database_credentials_validate(const credentials_t* credentials_db, const credentials_t* credential) {
-    if (credentials_db == NULL || credential == NULL) {
+#define CREDENTIALS_DB_INITIAL_RECORDS  64
+
+static uint64_t username_hash(const uint8_t* username, size_t username_len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < username_len; i++) {
+        hash ^= username[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static bool username_equals(const credential_record_t* record, const uint8_t* username, size_t username_len) {
+    return record->username_len == username_len && memcmp(record->username, username, username_len) == 0;
+}
+
+// Touches CREDENTIALS_MAX_PASSWORD_LEN bytes of both passwords whatever the mismatch. Missing bytes read as zero.
+static bool password_equals(const credential_record_t* record, const credentials_t* credential) {
+    volatile uint8_t diff = record->password_len ^ credential->password_len;
+    for (size_t i = 0; i < CREDENTIALS_MAX_PASSWORD_LEN; i++) {
+        uint8_t expected = i < record->password_len ? record->password[i] : 0;
+        uint8_t received = i < credential->password_len ? credential->password[i] : 0;
+        diff |= expected ^ received;
+    }
+    return diff == 0;
+}
+
+credentials_db_t* database_credentials_create(void) {
+    credentials_db_t* db = calloc(1, sizeof(credentials_db_t));
+    if (db == NULL) {
+        return NULL;
+    }
+    db->capacity = CREDENTIALS_DB_INITIAL_RECORDS;
+    db->credentials = malloc(db->capacity * sizeof(credential_record_t));
+    if (db->credentials == NULL) {
+        free(db);
+        return NULL;
+    }
+    return db;
+}
+
+void database_credentials_free(credentials_db_t* db) {
+    if (db == NULL) {
+        return;
+    }
+    if (db->mapping != NULL) {
+        munmap(db->mapping, db->mapping_len);
+    }
+    free(db->credentials);
+    free(db->index);
+    free(db);
+}
+
+err_t database_credentials_add(credentials_db_t* db, string_slice_t username, string_slice_t password) {
+    if (db == NULL || username.len > CREDENTIALS_MAX_USERNAME_LEN || password.len > CREDENTIALS_MAX_PASSWORD_LEN) {
         return ERR_INVALID_PARAMETERS;
     }
-    while (credentials_db != NULL) {
-        if (strcmp((const char*) credentials_db->username, (const char*) credential->username) == 0) {
-            if(strcmp((const char*) credentials_db->password, (const char*) credential->password) == 0) {
-                return ERR_OK;
-            } else {
-                return ERR_CREDENTIALS_PASSWORD_MISMATCH;
+    if (arena_reserve((void**) &db->credentials, &db->capacity, db->count + 1, sizeof(credential_record_t)) != ERR_OK) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    credential_record_t* record = &db->credentials[db->count++];
+    record->username = (const uint8_t*) username.data;
+    record->username_len = username.len;
+    record->password = (const uint8_t*) password.data;
+    record->password_len = password.len;
+    return ERR_OK;
+}
+
+err_t database_credentials_index_build(credentials_db_t* db) {
+    if (db == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
+
+    // Keep the load factor at or below 0.5 so that probe sequences stay short
+    size_t capacity = 16;
+    while (capacity < db->count * 2) {
+        capacity <<= 1;
+    }
+
+    uint32_t* index = calloc(capacity, sizeof(*index));
+    if (index == NULL) {
+        LOG_ERR("Failed to allocate the credentials index for %zu users", db->count);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // On duplicate usernames the last one in the file wins, as it always has
+    const size_t mask = capacity - 1;
+    for (size_t i = db->count; i-- > 0;) {
+        const credential_record_t* record = &db->credentials[i];
+        size_t slot = username_hash(record->username, record->username_len) & mask;
+        while (index[slot] != 0 && !username_equals(&db->credentials[index[slot] - 1], record->username, record->username_len)) {
+            slot = (slot + 1) & mask;
+        }
+        if (index[slot] == 0) {
+            index[slot] = i + 1;
+        }
+    }
+
+    free(db->index);
+    db->index = index;
+    db->index_capacity = capacity;
+    return ERR_OK;
+}
+
+static const credential_record_t* credentials_lookup(const credentials_db_t* db, const credentials_t* credential) {
+    if (db->index == NULL) {
+        for (size_t i = db->count; i-- > 0;) {
+            if (username_equals(&db->credentials[i], credential->username, credential->username_len)) {
+                return &db->credentials[i];
             }
         }
-        credentials_db = credentials_db->next;
+        return NULL;
+    }
+
+    const size_t mask = db->index_capacity - 1;
+    size_t slot = username_hash(credential->username, credential->username_len) & mask;
+    while (db->index[slot] != 0) {
+        const credential_record_t* record = &db->credentials[db->index[slot] - 1];
+        if (username_equals(record, credential->username, credential->username_len)) {
+            return record;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+err_t database_credentials_validate(const credentials_db_t* credentials_db, const credentials_t* credential) {
+    if (credentials_db == NULL || credential == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    if (credential->username_len > CREDENTIALS_MAX_USERNAME_LEN || credential->password_len > CREDENTIALS_MAX_PASSWORD_LEN) {
+        return ERR_INVALID_PARAMETERS;
+    }
+
+    const credential_record_t* record = credentials_lookup(credentials_db, credential);
+    if (record == NULL) {
+        return ERR_CREDENTIALS_USER_NOT_FOUND;
     }
-    return ERR_CREDENTIALS_USER_NOT_FOUND;
+    return password_equals(record, credential) ? ERR_OK : ERR_CREDENTIALS_PASSWORD_MISMATCH;
 }
 #endif // SERVER_C
@@ -7,17 +7,112 @@
 #include "error.h"
 #include "networking.h"
 #include "protocol.h"
+#include "utils.h"
 
 #if defined(SERVER_CS) || defined(SERVER_EE)
+// Offset of a NUL terminated string in the string pool of a courses db
+typedef uint32_t string_ref_t;
+
+// Packed course record. Strings live in the string pool of the db.
+typedef struct __course_record_t {
+    string_ref_t course_code;
+    string_ref_t professor;
+    string_ref_t days;
+    string_ref_t course_name;
+    int32_t credits;
+    uint32_t course_code_len;       // Compared before the bytes, so that lookups never read past the stored code
+} course_record_t;
+
+// Slot of the interning table. The hash is kept so that probing and growing rarely read the pool.
+typedef struct __interned_string_t {
+    string_ref_t ref;
+    uint32_t hash;
+} interned_string_t;
+
+// Courses of a department server, stored in two growable arenas: a packed array of records in file order and a pool
+// of interned strings, so that professors, day patterns and names shared by many sections are stored once.
+typedef struct __courses_db_t {
+    course_record_t* courses;
+    size_t count;
+    size_t capacity;
+    char* strings;                  // String pool. Offset 0 holds the empty string.
+    size_t strings_len;
+    size_t strings_capacity;
+    interned_string_t* interned;    // Open addressing table over the pool, ref 0 marks a free slot. NULL once shrunk.
+    size_t interned_count;
+    size_t interned_capacity;       // Power of 2
+    uint32_t* index;                // Open addressing table keyed on the case-insensitive course code. Holds record + 1.
+    size_t index_capacity;          // Power of 2, at least twice the number of courses
+} courses_db_t;
+
+/**
+ * @brief Create an empty courses db
+ * 
+ * @return courses_db_t* The db, NULL if it could not be allocated
+ */
+courses_db_t* database_courses_create(void);
+
+/**
+ * @brief Free a courses db and its arenas
+ */
+void database_courses_free(courses_db_t* db);
+
+/**
+ * @brief Append a course to the db. Professor, days and name are interned. The caller keeps ownership of its buffers.
+ * 
+ * @return err_t ERR_OK on success, ERR_OUT_OF_MEMORY if an arena could not grow
+ */
+err_t database_courses_add(courses_db_t* db, string_slice_t course_code, int credits, string_slice_t professor, string_slice_t days, string_slice_t course_name);
+
+/**
+ * @brief Trim the arenas to their contents and release the interning table once the db is loaded.
+ * 
+ * Courses can still be added afterwards, the interning table is then rebuilt from the records.
+ */
+void database_courses_shrink(courses_db_t* db);
+
+/**
+ * @brief Build the course code index of the db. Replaces any existing index.
+ * 
+ * @param db The courses db with its records populated
+ * 
+ * @return err_t ERR_OK on success, ERR_OUT_OF_MEMORY if the index could not be allocated
+ */
+err_t database_courses_index_build(courses_db_t* db);
+
+/**
+ * @brief Find a course in the db using course_code. Case-insensitive.
+ * 
+ * @param db The courses db.
+ * @param course_code Course code to search for. It may point straight into a received message.
+ * 
+ * @return Pointer to the course record if found, NULL otherwise.
+ */
+const course_record_t* database_courses_lookup(const courses_db_t* db, string_slice_t course_code);
+
 /**
- * @brief Find a course from a linked list of courses using course_code.
+ * @brief Find a course in the db using course_code by scanning every record.
  * 
- * @param db Linked list of courses.
+ * @param db The courses db.
  * @param course_code Course code to search for.
  * 
- * @return Pointer to the course if found, NULL otherwise.
+ * @return Pointer to the course record if found, NULL otherwise.
+ */
+const course_record_t* database_courses_scan(const courses_db_t* db, string_slice_t course_code);
+
+/**
+ * @brief Get a view of a course record. The view borrows the strings of the db.
+ * 
+ * @param db The courses db holding the record
+ * @param record The course record
+ * @param view [out] The view to fill
+ */
+void database_courses_view(const courses_db_t* db, const course_record_t* record, course_view_t* view);
+
+/**
+ * @brief Get the bytes held by the db, its arenas and its tables
  */
-course_t* database_courses_lookup(const course_t* db, const char* course_code);
+size_t database_courses_footprint(const courses_db_t* db);
 
 /**
  * @brief Lookup a course's information.
@@ -30,7 +125,7 @@ course_t* database_courses_lookup(const course_t* db, const char* course_code);
  * 
  * @return err_t The error code.
  */
-err_t database_courses_lookup_info(const course_t* course, courses_lookup_category_t category, uint8_t* info_buf, size_t info_buf_size, size_t* info_len);
+err_t database_courses_lookup_info(const course_view_t* course, courses_lookup_category_t category, uint8_t* info_buf, size_t info_buf_size, size_t* info_len);
 #endif // SERVER_CS || SERVER_EE
 
 #if defined(CLIENT)
@@ -68,14 +163,62 @@ err_t database_credentials_encrypt(const credentials_t* in_credentials, credenti
 #endif // SERVER_M
 
 #ifdef SERVER_C
+// A credential. The username and password are borrowed, usually from the mapped credentials file.
+typedef struct __credential_record_t {
+    const uint8_t* username;
+    const uint8_t* password;
+    uint8_t username_len;
+    uint8_t password_len;
+} credential_record_t;
+
+// Credentials of serverC. The index maps encrypted usernames to records.
+typedef struct __credentials_db_t {
+    credential_record_t* credentials;   // File order
+    size_t count;
+    size_t capacity;
+    void* mapping;                      // The file the records point into, NULL if the records borrow other memory
+    size_t mapping_len;
+    uint32_t* index;                    // Open addressing table keyed on the encrypted username. Holds record + 1.
+    size_t index_capacity;              // Power of 2, at least twice the number of credentials
+} credentials_db_t;
+
 /**
- * @brief Validate the credentials from the given credentials linked list
+ * @brief Create an empty credentials db
+ * 
+ * @return credentials_db_t* The db, NULL if it could not be allocated
+ */
+credentials_db_t* database_credentials_create(void);
+
+/**
+ * @brief Free a credentials db and unmap its file
+ */
+void database_credentials_free(credentials_db_t* db);
+
+/**
+ * @brief Append a credential to the db. The record points at the given bytes, which must outlive the db.
+ * 
+ * @return err_t ERR_OK on success, ERR_INVALID_PARAMETERS if a field is too long, ERR_OUT_OF_MEMORY if the records could not grow
+ */
+err_t database_credentials_add(credentials_db_t* db, string_slice_t username, string_slice_t password);
+
+/**
+ * @brief Build the username index of the db. Replaces any existing index.
+ * 
+ * @param db The credentials db with its records populated
+ * @return err_t ERR_OK on success, ERR_OUT_OF_MEMORY if the index could not be allocated
+ */
+err_t database_credentials_index_build(credentials_db_t* db);
+
+/**
+ * @brief Validate the credentials against the given credentials db
+ * 
+ * The password is compared in constant time, so the response time does not leak how much of it matched.
  * 
- * @param credentials_db The credentials linked list
+ * @param credentials_db The credentials db
  * @param credential The credentials to validate
  * @return err_t 
  */
-err_t database_credentials_validate(const credentials_t* credentials_db, const credentials_t* credential);
+err_t database_credentials_validate(const credentials_db_t* credentials_db, const credentials_t* credential);
 
 #endif // SERVER_C
 
@@ -1,76 +1,188 @@
+#include <stdio.h>
+
 #include "database.h"
 #include "department_server.h"
+#include "event_log.h"
+#include "metrics.h"
 #include "fileio.h"
 #include "log.h"
 #include "messages.h"
 #include "networking.h"
+#include "server_observability.h"
+#include "trace.h"
 #include "utils.h"
 
 LOG_TAG(department_server);
 
-static course_t* db = NULL;
+static courses_db_t* db = NULL;
 static const char* subject_code = NULL;
 
+// The detail response, then a response per lookup category, for every course
+#define COURSE_RESPONSES_COUNT          (1 + COURSES_LOOKUP_CATEGORY_INVALID - COURSES_LOOKUP_CATEGORY_COURSE_CODE)
+#define COURSE_RESPONSE_DETAIL          0
+#define COURSE_RESPONSE_CATEGORY(c)     (1 + (c) - COURSES_LOOKUP_CATEGORY_COURSE_CODE)
+
+// An encoded response in the responses blob
+typedef struct __course_response_t {
+    uint32_t offset;
+    uint16_t len;                       // 0 if the course could not be encoded
+} course_response_t;
+
+// Every response the catalog can produce, encoded once at startup. The catalog is read-only after load,
+// so a lookup only copies the bytes and patches the header.
+static uint8_t* responses_blob = NULL;
+static size_t responses_blob_len = 0;
+static size_t responses_blob_capacity = 0;
+static course_response_t* course_responses = NULL;
+
+static err_t responses_append(const udp_dgram_t* dgram, course_response_t* response) {
+    if (responses_blob_len + dgram->data_len > UINT32_MAX) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (responses_blob_len + dgram->data_len > responses_blob_capacity) {
+        size_t capacity = max(responses_blob_capacity * 2, responses_blob_len + MESSAGE_FRAME_SIZE);
+        uint8_t* blob = realloc(responses_blob, capacity);
+        if (blob == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+        responses_blob = blob;
+        responses_blob_capacity = capacity;
+    }
+    memcpy(responses_blob + responses_blob_len, dgram->data, dgram->data_len);
+    response->offset = responses_blob_len;
+    response->len = dgram->data_len;
+    responses_blob_len += dgram->data_len;
+    return ERR_OK;
+}
+
+// Encode the responses of every course in the db
+static err_t responses_build(const courses_db_t* db) {
+    course_responses = calloc(max(db->count, 1) * COURSE_RESPONSES_COUNT, sizeof(course_response_t));
+    if (course_responses == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    for (size_t i = 0; i < db->count; i++) {
+        course_response_t* responses = &course_responses[i * COURSE_RESPONSES_COUNT];
+        course_view_t course;
+        udp_dgram_t dgram;
+        err_t err = ERR_OK;
+        database_courses_view(db, &db->courses[i], &course);
+
+        // A course whose fields do not fit a datagram is left out. Lookups for it get ERR_REQ_INVALID, as before.
+        if (protocol_courses_lookup_detail_response_encode(&course, &dgram) == ERR_OK) {
+            err = responses_append(&dgram, &responses[COURSE_RESPONSE_DETAIL]);
+        }
+        for (courses_lookup_category_t category = COURSES_LOOKUP_CATEGORY_COURSE_CODE; category < COURSES_LOOKUP_CATEGORY_INVALID && err == ERR_OK; category++) {
+            uint8_t info[128] = {0};
+            size_t info_len = 0;
+            if (database_courses_lookup_info(&course, category, info, sizeof(info), &info_len) == ERR_OK
+                    && protocol_courses_lookup_single_response_encode(course.course_code, min(strlen(course.course_code), UINT8_MAX), category, info, info_len, &dgram) == ERR_OK) {
+                err = responses_append(&dgram, &responses[COURSE_RESPONSE_CATEGORY(category)]);
+            }
+        }
+        if (err != ERR_OK) {
+            return err;
+        }
+    }
+    // Drop the slack left by the geometric growth
+    uint8_t* blob = realloc(responses_blob, max(responses_blob_len, 1));
+    if (blob != NULL) {
+        responses_blob = blob;
+        responses_blob_capacity = max(responses_blob_len, 1);
+    }
+    return ERR_OK;
+}
+
+static void responses_free(void) {
+    free(responses_blob);
+    free(course_responses);
+    responses_blob = NULL;
+    course_responses = NULL;
+    responses_blob_len = responses_blob_capacity = 0;
+}
+
+// Copy a precomputed response into the datagram to send. Returns false if the course has none.
+static bool response_copy(const course_record_t* record, size_t kind, udp_dgram_t* resp_dgram) {
+    const course_response_t* response = &course_responses[(record - db->courses) * COURSE_RESPONSES_COUNT + kind];
+    if (response->len == 0) {
+        return false;
+    }
+    memcpy(resp_dgram->data, responses_blob + response->offset, response->len);
+    resp_dgram->data_len = response->len;
+    return true;
+}
+
 static void handle_course_info_lookup_request(udp_dgram_t* req_dgram, udp_dgram_t* resp_dgram) {
 
-    char course_code[10] = {0};
-    uint8_t size = sizeof(course_code);
+    string_slice_t course_code = {0};
     courses_lookup_category_t category = COURSES_LOOKUP_CATEGORY_INVALID;
 
-    // Get the course code and category from the request
-    if (protocol_courses_lookup_single_request_decode(req_dgram, course_code, &size, &category) != ERR_OK) {
+    // Get the course code and category from the request. The course code points into the request.
+    if (protocol_courses_lookup_single_request_view(req_dgram, &course_code, &category) != ERR_OK) {
         // Failed to parse the request
-        protocol_courses_error_encode(ERR_REQ_INVALID, (uint8_t*) course_code, strlen(course_code), resp_dgram);
+        protocol_courses_error_encode(ERR_REQ_INVALID, NULL, 0, resp_dgram);
     } else {
-        LOG_INFO(SERVER_SUB_MESSAGE_ON_LOOKUP_REQUEST_RECEIVED, subject_code, database_courses_category_string_from_enum(category), course_code);
-        uint8_t info[128] = {0};
-        size_t info_len = 0;
+        // Course codes are echoed back with a one byte length
+        course_code.len = min(course_code.len, UINT8_MAX);
+        LOG_INFO(SERVER_SUB_MESSAGE_ON_LOOKUP_REQUEST_RECEIVED, subject_code, database_courses_category_string_from_enum(category), (int) course_code.len, course_code.data);
         // Lookup the course in the database
-        course_t* course = database_courses_lookup(db, course_code);
-        if (!course) {
+        const course_record_t* record = database_courses_lookup(db, course_code);
+        string_slice_t echoed_code, info;
+        if (!record) {
             // Course not found
-            LOG_WARN(SERVER_SUB_MESSAGE_ON_COURSE_NOT_FOUND, course_code);
-            protocol_courses_error_encode(ERR_COURSES_NOT_FOUND, (uint8_t*) course_code, strlen(course_code), resp_dgram);
-        } else if (category >= COURSES_LOOKUP_CATEGORY_INVALID) {
+            LOG_WARN(SERVER_SUB_MESSAGE_ON_COURSE_NOT_FOUND, (int) course_code.len, course_code.data);
+            protocol_courses_error_encode(ERR_COURSES_NOT_FOUND, (uint8_t*) course_code.data, course_code.len, resp_dgram);
+        } else if (category < COURSES_LOOKUP_CATEGORY_COURSE_CODE || category >= COURSES_LOOKUP_CATEGORY_INVALID) {
             // Invalid category
-            LOG_WARN("Invalid category for lookup: %s", category);
-            protocol_courses_error_encode(ERR_REQ_INVALID, (uint8_t*) course_code, strlen(course_code), resp_dgram);
-        } else {
-            LOG_DBG("Course found: %s", course->course_code);
-            // Get the course info
-            if (database_courses_lookup_info(course, category, info, sizeof(info), &info_len) == ERR_OK) {
-                LOG_INFO(SERVER_SUB_MESSAGE_ON_COURSE_FOUND, database_courses_category_string_from_enum(category), course_code, info);
-                // Encode the response
-                protocol_courses_lookup_single_response_encode(course_code, size, category, info, info_len, resp_dgram);
-            }
+            LOG_WARN("Invalid category for lookup: %d", category);
+            protocol_courses_error_encode(ERR_REQ_INVALID, (uint8_t*) course_code.data, course_code.len, resp_dgram);
+        } else if (!response_copy(record, COURSE_RESPONSE_CATEGORY(category), resp_dgram)) {
+            // The information did not fit a datagram
+            protocol_courses_error_encode(ERR_REQ_INVALID, (uint8_t*) course_code.data, course_code.len, resp_dgram);
+        } else if (protocol_courses_lookup_single_response_view(resp_dgram, &echoed_code, NULL, &info) == ERR_OK) {
+            // Echo the course code as it was asked for. A case-insensitive match has the same length.
+            memcpy((char*) echoed_code.data, course_code.data, echoed_code.len);
+            LOG_INFO(SERVER_SUB_MESSAGE_ON_COURSE_FOUND, database_courses_category_string_from_enum(category), (int) course_code.len, course_code.data, (int) info.len, info.data);
         }
     }
 }
 
 static void handle_course_detail_lookup_request(udp_dgram_t* req_dgram, udp_dgram_t* resp_dgram) {
-    uint8_t course_code[10] = {0};
-    uint8_t size = sizeof(course_code);
-    // Decode the request
-    if (protocol_courses_lookup_detail_request_decode(req_dgram, course_code, &size) != ERR_OK) {
+    string_slice_t course_code = {0};
+    // Decode the request. The course code points into the request.
+    if (protocol_courses_lookup_detail_request_view(req_dgram, &course_code) != ERR_OK) {
         // If the request is invalid, send an error response
-        protocol_courses_error_encode(ERR_REQ_INVALID, course_code, strlen((char*) course_code), resp_dgram);
+        protocol_courses_error_encode(ERR_REQ_INVALID, NULL, 0, resp_dgram);
     } else {
-        LOG_INFO(SERVER_SUB_MESSAGE_ON_SUMMARY_REQUEST_RECEIVED, subject_code, course_code);
+        course_code.len = min(course_code.len, UINT8_MAX);
+        LOG_INFO(SERVER_SUB_MESSAGE_ON_SUMMARY_REQUEST_RECEIVED, subject_code, (int) course_code.len, course_code.data);
         // If the request is valid, lookup the course
-        course_t* course = database_courses_lookup(db, (const char*) course_code);
-        if (!course) {
-            LOG_WARN(SERVER_SUB_MESSAGE_ON_COURSE_NOT_FOUND, course_code);
+        const course_record_t* record = database_courses_lookup(db, course_code);
+        if (!record) {
+            LOG_WARN(SERVER_SUB_MESSAGE_ON_COURSE_NOT_FOUND, (int) course_code.len, course_code.data);
             // If the course is not found, send an error response
-            protocol_courses_error_encode(ERR_COURSES_NOT_FOUND, course_code, strlen((char*) course_code), resp_dgram);
-        } else {
-            // If the course is found, send a response with the course details
-            protocol_courses_lookup_detail_response_encode(course, resp_dgram);
+            protocol_courses_error_encode(ERR_COURSES_NOT_FOUND, (uint8_t*) course_code.data, course_code.len, resp_dgram);
+        } else if (!response_copy(record, COURSE_RESPONSE_DETAIL, resp_dgram)) {
+            // The course details did not fit a datagram
+            protocol_courses_error_encode(ERR_REQ_INVALID, (uint8_t*) course_code.data, course_code.len, resp_dgram);
         }
     }
 }
 
+static void handle_stats_request(udp_dgram_t* resp_dgram) {
+    stats_item_t items[STATS_ITEMS_MAX];
+    size_t count = metrics_stats_items(items, STATS_ITEMS_MAX - 1);
+    items[count++] = (stats_item_t) { STATS_RECORDS, 0, db->count };
+    protocol_stats_response_encode(items, count, resp_dgram);
+}
+
 static void udp_message_rx_handler(udp_ctx_t* udp, udp_endpoint_t* src, udp_dgram_t* req_dgram) {
-    udp_dgram_t resp_dgram = {0};
+    // Every path below writes the response, only its length needs a reset
+    udp_dgram_t resp_dgram;
+    resp_dgram.data_len = 0;
+    trace_span_t span;
+    trace_span_start_from_message(&span, req_dgram);
+    event_log_message(EVENT_TAG_DEPARTMENT_SERVER, EVENT_REQUEST_RECEIVED, req_dgram, ntohs(src->addr.sin_port));
     request_type_t req_type = protocol_get_request_type(req_dgram);
     if (req_type == REQUEST_TYPE_COURSES_SINGLE_LOOKUP) {
         // Handle course info lookup request
@@ -78,22 +190,49 @@ static void udp_message_rx_handler(udp_ctx_t* udp, udp_endpoint_t* src, udp_dgra
     } else if (req_type == REQUEST_TYPE_COURSES_DETAIL_LOOKUP) {
         // Handle course detail lookup request
         handle_course_detail_lookup_request(req_dgram, &resp_dgram);
+    } else if (req_type == REQUEST_TYPE_STATS) {
+        // Handle a stats query
+        handle_stats_request(&resp_dgram);
     } else {
         // Handle invalid request
         LOG_WARN(SERVER_SUB_MESSAGE_ON_REQUEST_INVALID, subject_code);
         protocol_courses_error_encode(ERR_REQ_INVALID, NULL, 0, &resp_dgram);
     }
 
+    // Echo the request id so that serverM can match the response to its request
+    protocol_set_request_id(&resp_dgram, protocol_get_request_id(req_dgram));
+
     // Send response
+    event_log_message(EVENT_TAG_DEPARTMENT_SERVER, EVENT_RESPONSE_SENT, &resp_dgram, ntohs(src->addr.sin_port));
     udp_send(udp, src, &resp_dgram);
-    LOG_INFO(SERVER_SUB_MESSAGE_ON_RESPONSE_SENT, subject_code);
+    metrics_record_response(req_type, &resp_dgram, span.start_ns);
+    trace_span_end(&span, TRACE_KIND_SERVER, protocol_get_request_id(req_dgram), req_type, ntohs(src->addr.sin_port));
+    if (req_type != REQUEST_TYPE_STATS) {
+        LOG_INFO(SERVER_SUB_MESSAGE_ON_RESPONSE_SENT, subject_code);
+    }
 }
 
 int department_server_main(const char* subjectCode, const uint16_t port, const char* db_file) {
     subject_code = subjectCode;
 
+    char process[16];
+    snprintf(process, sizeof(process), "server%s", subject_code);
+    server_observability_start(process);
+
     // Load the department server database
     db = fileio_department_server_db_create(db_file);
+    if (db == NULL) {
+        return -1;
+    }
+
+    // Encode every response up front. Lookups only copy them.
+    if (responses_build(db) != ERR_OK) {
+        LOG_ERR("Failed to encode the responses of %zu courses", db->count);
+        responses_free();
+        fileio_department_server_db_free(db);
+        return -1;
+    }
+    LOG_DBG("Encoded %zu responses in %zu bytes", db->count * COURSE_RESPONSES_COUNT, responses_blob_len);
 
     // Create the UDP context. Bind it to the relevant port.
     udp_ctx_t* udp = udp_start(port);
@@ -106,15 +245,24 @@ int department_server_main(const char* subjectCode, const uint16_t port, const c
     // Register the UDP message handler
     udp->on_rx = udp_message_rx_handler;
 
-    // Wait for incoming messages
+    // The data was (re)loaded. Have serverM drop the replies it cached from our previous run.
+    udp_endpoint_t serverM = {0};
+    udp_dgram_t dgram;
+    SERVER_ADDR_PORT(serverM.addr, SERVER_M_UDP_PORT_NUMBER);
+    protocol_cache_invalidate_encode(subject_code, strlen(subject_code), &dgram);
+    udp_send(udp, &serverM, &dgram);
+
+    // Wait for incoming messages. Latencies are summarized now and then, between batches.
     while(1) {
-        udp_receive(udp);
+        udp_receive_batch(udp);
+        server_observability_report();
     }
 
     // Stop the UDP context. Free up the memory.
     udp_stop(udp);
 
-    // Free up the database
+    // Free up the database and its responses
+    responses_free();
     fileio_department_server_db_free(db);
     return 0;
 }
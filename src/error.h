@@ -8,6 +8,7 @@ typedef uint8_t err_t;
 #define ERR_OK                              0x00
 #define ERR_INVALID_PARAMETERS              0x01
 #define ERR_OUT_OF_MEMORY                   0x02
+#define ERR_QUEUE_FULL                      0x03
 
 #define ERR_REQ_BASE                        0x10
 #define ERR_REQ_INVALID                     (ERR_REQ_BASE | ERR_INVALID_PARAMETERS)
@@ -18,8 +19,14 @@ typedef uint8_t err_t;
 #define ERR_CREDENTIALS_BASE                0x30
 #define ERR_CREDENTIALS_USER_NOT_FOUND      (ERR_CREDENTIALS_BASE | 0x02)
 #define ERR_CREDENTIALS_PASSWORD_MISMATCH   (ERR_CREDENTIALS_BASE | 0x03)
+#define ERR_CREDENTIALS_NOT_AUTHENTICATED   (ERR_CREDENTIALS_BASE | 0x04)
 
 #define ERR_COURSES_BASE                    0x40
 #define ERR_COURSES_NOT_FOUND               (ERR_COURSES_BASE | 0x02)
 
+#define ERR_NETWORK_BASE                    0x50
+#define ERR_NETWORK_WOULD_BLOCK             (ERR_NETWORK_BASE | 0x02)
+#define ERR_NETWORK_FAILURE                 (ERR_NETWORK_BASE | 0x03)
+#define ERR_NETWORK_DISCONNECTED            (ERR_NETWORK_BASE | 0x04)
+
 #endif // ERROR_H
@@ -0,0 +1,91 @@
+#include "event_log.h"
+
+#include <stddef.h>
+
+_Static_assert(sizeof(event_record_t) == 32, "event records are written to disk");
+
+const record_ring_format_t EVENT_LOG_FORMAT = {
+    .name = "event log",
+    .magic = EVENT_LOG_MAGIC,
+    .version = EVENT_LOG_VERSION,
+    .record_size = sizeof(event_record_t),
+    .committed_offset = offsetof(event_record_t, committed),
+};
+
+// The mapped file. Set up by event_log_open() before the threads that record events start.
+static record_ring_t ring = {0};
+
+err_t event_log_open(const char* path, const char* process, size_t capacity) {
+    return record_ring_open(&ring, &EVENT_LOG_FORMAT, path, process, capacity);
+}
+
+void event_log_close(void) {
+    record_ring_close(&ring);
+}
+
+void event_log_record(event_tag_t tag, event_id_t event, request_id_t request_id, uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3) {
+    if (ring.header == NULL) {
+        return;
+    }
+    uint64_t timestamp_ns = record_ring_now_ns();
+    event_record_t* record = record_ring_claim(&ring);
+    record->timestamp_ns = timestamp_ns;
+    record->request_id = request_id;
+    record->tag = tag;
+    record->event = event;
+    record->args[0] = arg0;
+    record->args[1] = arg1;
+    record->args[2] = arg2;
+    record->args[3] = arg3;
+    record_ring_commit(&ring, record);
+}
+
+void event_log_message(event_tag_t tag, event_id_t event, const struct __message_t* message, uint16_t peer_port) {
+    if (ring.header == NULL) {
+        return;
+    }
+    event_log_record(tag, event, protocol_get_request_id(message), protocol_get_request_type(message),
+        protocol_get_flags(message), message->data_len, peer_port);
+}
+
+static const char* EVENT_TAG_NAMES[EVENT_TAG_END] = {
+    [EVENT_TAG_SERVER_M] = "serverM",
+    [EVENT_TAG_SERVER_C] = "serverC",
+    [EVENT_TAG_DEPARTMENT_SERVER] = "department_server",
+};
+
+static const char* EVENT_NAMES[EVENT_END] = {
+    [EVENT_REQUEST_RECEIVED] = "request_received",
+    [EVENT_RESPONSE_SENT] = "response_sent",
+    [EVENT_BACKEND_REQUEST_SENT] = "backend_request_sent",
+    [EVENT_BACKEND_RESPONSE_RECEIVED] = "backend_response_received",
+    [EVENT_CACHE_HIT] = "cache_hit",
+    [EVENT_SINGLE_FLIGHT_JOINED] = "single_flight_joined",
+    [EVENT_MULTI_LOOKUP_DONE] = "multi_lookup_done",
+};
+
+static const char* MESSAGE_ARG_NAMES[EVENT_ARGS_COUNT] = { "type", "flags", "len", "port" };
+
+static const char* EVENT_ARG_NAMES[EVENT_END][EVENT_ARGS_COUNT] = {
+    [EVENT_CACHE_HIT] = { "category", "code_len" },
+    [EVENT_SINGLE_FLIGHT_JOINED] = { "leader" },
+    [EVENT_MULTI_LOOKUP_DONE] = { "courses", "found", "missing" },
+};
+
+const char* event_log_tag_name(event_tag_t tag) {
+    return tag < EVENT_TAG_END && EVENT_TAG_NAMES[tag] ? EVENT_TAG_NAMES[tag] : "unknown";
+}
+
+const char* event_log_event_name(event_id_t event) {
+    return event < EVENT_END && EVENT_NAMES[event] ? EVENT_NAMES[event] : "unknown";
+}
+
+const char* event_log_arg_name(event_id_t event, size_t arg) {
+    if (arg >= EVENT_ARGS_COUNT || event >= EVENT_END) {
+        return NULL;
+    }
+    if (event <= EVENT_BACKEND_RESPONSE_RECEIVED) {
+        return MESSAGE_ARG_NAMES[arg];
+    }
+    return EVENT_ARG_NAMES[event][arg];
+}
@@ -0,0 +1,82 @@
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "protocol.h"
+#include "record_ring.h"
+
+#define EVENT_LOG_MAGIC                 "EE450EVT"
+#define EVENT_LOG_VERSION               1
+
+// Module that recorded an event
+typedef uint8_t event_tag_t;
+#define EVENT_TAG_SERVER_M              0x01
+#define EVENT_TAG_SERVER_C              0x02
+#define EVENT_TAG_DEPARTMENT_SERVER     0x03
+#define EVENT_TAG_END                   0x04
+
+// What happened. Message events record the type, flags, length and peer port of the message in their args.
+typedef uint16_t event_id_t;
+#define EVENT_REQUEST_RECEIVED          0x01    // Message from a client (serverM) or from serverM (backends)
+#define EVENT_RESPONSE_SENT             0x02    // Message to the sender of a request
+#define EVENT_BACKEND_REQUEST_SENT      0x03    // Message from serverM to a backend server. args[3] is the backend port.
+#define EVENT_BACKEND_RESPONSE_RECEIVED 0x04    // Message from a backend server to serverM
+#define EVENT_CACHE_HIT                 0x05    // args: category, course code length
+#define EVENT_SINGLE_FLIGHT_JOINED      0x06    // args: request id of the lookup in flight
+#define EVENT_MULTI_LOOKUP_DONE         0x07    // args: courses asked for, courses found, responses missing
+#define EVENT_END                       0x08
+
+#define EVENT_ARGS_COUNT                4
+
+// One event. Fixed size, so that the file is an array of them.
+typedef struct __event_record_t {
+    uint64_t timestamp_ns;              // CLOCK_MONOTONIC
+    request_id_t request_id;
+    event_tag_t tag;
+    atomic_uchar committed;             // Set once the record is completely written
+    event_id_t event;
+    uint32_t args[EVENT_ARGS_COUNT];
+} event_record_t;
+
+// Event log files are record rings of event_record_t. Pass to record_ring_read() to read one.
+extern const record_ring_format_t EVENT_LOG_FORMAT;
+
+/**
+ * @brief Record events of this process to a memory-mapped record ring from now on
+ *
+ * @param path The file. Created or replaced.
+ * @param process Name of the process, stored in the header
+ * @param capacity Records the file holds. Rounded up to a power of 2.
+ *
+ * @return err_t ERR_OK, ERR_INVALID_PARAMETERS if the file cannot be created and mapped
+ */
+err_t event_log_open(const char* path, const char* process, size_t capacity);
+
+void event_log_close(void);
+
+/**
+ * @brief Record an event. Does nothing unless event_log_open() succeeded. Lock-free, safe from any thread.
+ */
+void event_log_record(event_tag_t tag, event_id_t event, request_id_t request_id, uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3);
+
+/**
+ * @brief Record an event about a message: its request id, type, flags, length and the port of the peer
+ */
+void event_log_message(event_tag_t tag, event_id_t event, const struct __message_t* message, uint16_t peer_port);
+
+const char* event_log_tag_name(event_tag_t tag);
+
+const char* event_log_event_name(event_id_t event);
+
+/**
+ * @brief Get the name of an argument of an event
+ *
+ * @return const char* The name, NULL if the event does not use the argument
+ */
+const char* event_log_arg_name(event_id_t event, size_t arg);
+
+#endif // EVENT_LOG_H
@@ -2,155 +2,242 @@
 #include "log.h"
 #include "utils.h"
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif // __SSE2__
 
 LOG_TAG(fileio.c);
 
+// Fields are split on runs of these characters, empty fields are skipped. Same as strtok(line, ",\r\n").
 #define CSV_SPLIT_TOKEN ",\r\n"
 
 #if defined(SERVER_C) || defined(SERVER_EE) || defined(SERVER_CS)
-static FILE* csv_open(const char* filename) {
-    FILE* fp = fopen(filename, "r");
-    if (fp == NULL) {
+/**
+ * @brief Map a file read-only
+ *
+ * @param filename The file to map
+ * @param mapping [out] The mapping, NULL if the file is empty
+ * @param len [out] The length of the file
+ * @return err_t ERR_OK on success, ERR_INVALID_PARAMETERS if the file could not be opened or mapped
+ */
+static err_t csv_map(const char* filename, char** mapping, size_t* len) {
+    *mapping = NULL;
+    *len = 0;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
         LOG_ERR("Failed to open file %s", filename);
-        return NULL;
+        return ERR_INVALID_PARAMETERS;
     }
-    return fp;
-}
 
-static void csv_close(FILE* fp) {
-    fclose(fp);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        LOG_ERR("Failed to stat file %s", filename);
+        close(fd);
+        return ERR_INVALID_PARAMETERS;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return ERR_OK;
+    }
+
+    void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping stays valid once the descriptor is closed
+    close(fd);
+    if (addr == MAP_FAILED) {
+        LOG_ERR("Failed to map file %s", filename);
+        return ERR_INVALID_PARAMETERS;
+    }
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+    *mapping = addr;
+    *len = st.st_size;
+    return ERR_OK;
 }
-#endif // SERVER_C || SERVER_EE || SERVER_CS
 
-#if defined(SERVER_C)
-credentials_t* fileio_credential_server_db_create(const char* filename) {
+static void csv_unmap(void* mapping, size_t len) {
+    if (mapping != NULL) {
+        munmap(mapping, len);
+    }
+}
 
-    if (filename == NULL) return NULL;
+// Find the first CSV_SPLIT_TOKEN character in [p, end). Returns end if there is none.
+static const char* csv_find_delimiter(const char* p, const char* end) {
+#if defined(__SSE2__)
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    // 16 bytes per compare. Never reads past the end of the mapping.
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*) p);
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, comma), _mm_cmpeq_epi8(chunk, cr)), _mm_cmpeq_epi8(chunk, lf));
+        int mask = _mm_movemask_epi8(hits);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif // __SSE2__
+    while (p < end && *p != ',' && *p != '\r' && *p != '\n') {
+        p++;
+    }
+    return p;
+}
 
-    FILE* fp = csv_open(filename);
-    char line[1024];
+/**
+ * @brief Split the line starting at p into its fields, in place
+ *
+ * @param p Start of the line
+ * @param end End of the mapping
+ * @param fields [out] Slices into the mapping. Fields past max_fields are dropped.
+ * @param max_fields Capacity of fields
+ * @param fields_count [out] Number of fields found
+ * @return const char* The start of the next line
+ */
+static const char* csv_next_line(const char* p, const char* end, string_slice_t* fields, size_t max_fields, size_t* fields_count) {
+    size_t count = 0;
+    while (p < end) {
+        const char* delimiter = csv_find_delimiter(p, end);
+        if (delimiter > p && count < max_fields) {
+            fields[count++] = (string_slice_t) { p, delimiter - p };
+        }
+        if (delimiter == end) {
+            p = end;
+            break;
+        }
+        p = delimiter + 1;
+        if (*delimiter == '\n') {
+            break;
+        }
+    }
+    *fields_count = count;
+    return p;
+}
+#endif // SERVER_C || SERVER_EE || SERVER_CS
 
-    if (fp == NULL) return NULL;
+#if defined(SERVER_C)
+#define CREDENTIAL_FIELDS_COUNT 2
 
-    credentials_t* credentials = NULL;
-    while (fgets(line, sizeof(line), fp)) {
-        char* token = strtok(line, CSV_SPLIT_TOKEN);
-        if (token == NULL) continue;
+credentials_db_t* fileio_credential_server_db_create(const char* filename) {
 
-        credentials_t* ptr = malloc(sizeof(credentials_t));
-        if (ptr == NULL) {
-            LOG_ERR("Failed to allocate memory for credentials");
-            return NULL;
-        }
+    if (filename == NULL) return NULL;
 
-        bzero(ptr, sizeof(credentials_t));
+    char* mapping = NULL;
+    size_t len = 0;
+    if (csv_map(filename, &mapping, &len) != ERR_OK) return NULL;
 
-        ptr->username_len = strlen(token);
-        if (ptr->username_len > CREDENTIALS_MAX_USERNAME_LEN) {
+    credentials_db_t* db = database_credentials_create();
+    if (db == NULL) {
+        LOG_ERR("Failed to allocate memory for credentials_db_t");
+        csv_unmap(mapping, len);
+        return NULL;
+    }
+    // The records point into the mapping, the db unmaps it when freed
+    db->mapping = mapping;
+    db->mapping_len = len;
+
+    const char* p = mapping;
+    const char* end = mapping + len;
+    while (p < end) {
+        // Username and password
+        string_slice_t fields[CREDENTIAL_FIELDS_COUNT];
+        size_t fields_count = 0;
+        p = csv_next_line(p, end, fields, CREDENTIAL_FIELDS_COUNT, &fields_count);
+        if (fields_count == 0) continue;
+
+        if (fields[0].len > CREDENTIALS_MAX_USERNAME_LEN) {
             LOG_ERR("Username is too long");
             continue;
         }
-        memcpy(ptr->username, token, min(ptr->username_len, CREDENTIALS_MAX_USERNAME_LEN));
-
-        token = strtok(NULL, CSV_SPLIT_TOKEN);
-        if (token == NULL) {
+        if (fields_count < CREDENTIAL_FIELDS_COUNT) {
             continue;
         }
-
-        ptr->password_len = strlen(token);
-        if (ptr->password_len > CREDENTIALS_MAX_PASSWORD_LEN) {
+        if (fields[1].len > CREDENTIALS_MAX_PASSWORD_LEN) {
             LOG_ERR("Password is too long");
             continue;
         }
-        memcpy(ptr->password, token, min(ptr->password_len, CREDENTIALS_MAX_PASSWORD_LEN));
 
-        if (credentials != NULL) {
-            ptr->next = credentials;
+        if (database_credentials_add(db, fields[0], fields[1]) != ERR_OK) {
+            LOG_ERR("Failed to allocate memory for credentials");
+            break;
         }
-
-        credentials = ptr;
     }
 
-    csv_close(fp);
-
-    return credentials;
+    if (database_credentials_index_build(db) != ERR_OK) {
+        // Validation falls back to scanning the records
+        LOG_WARN("Serving %s without a username index", filename);
+    }
+    return db;
 }
 
-void fileio_credential_server_db_free(credentials_t* db) {
-    while (db != NULL) {
-        credentials_t* ptr = db;
-        db = db->next;
-        free(ptr);
-    }
+void fileio_credential_server_db_free(credentials_db_t* db) {
+    database_credentials_free(db);
 }
 
 #endif // SERVER_C
 
 #if defined(SERVER_EE) || defined(SERVER_CS)
-course_t* fileio_department_server_db_create(const char* filename) {
-    course_t* head = NULL;
-    course_t* tail = NULL;
-    FILE* fp = csv_open(filename);
-    char line[1024];
+#define COURSE_FIELDS_COUNT 5
+
+// atoi() on a field that is not NUL terminated
+static int csv_field_to_int(string_slice_t field) {
+    char buffer[16];
+    size_t len = min(field.len, sizeof(buffer) - 1);
+    memcpy(buffer, field.data, len);
+    buffer[len] = '\0';
+    return atoi(buffer);
+}
+
+courses_db_t* fileio_department_server_db_create(const char* filename) {
+    char* mapping = NULL;
+    size_t len = 0;
 
-    if (fp == NULL) {
+    if (csv_map(filename, &mapping, &len) != ERR_OK) {
         return NULL;
     }
 
-    while (fgets(line, sizeof(line), fp)) {
-        char* token = strtok(line, CSV_SPLIT_TOKEN);
-        if (token == NULL) {
-            continue;
-        }
-        course_t* entry = (course_t*)malloc(sizeof(course_t));
-        if (entry == NULL) {
-            LOG_ERR("Failed to allocate memory for course_t");
-            continue;
-        }
-        memset(entry, 0, sizeof(course_t));
-        strncpy(entry->course_code, token, sizeof(entry->course_code));
-        token = strtok(NULL, CSV_SPLIT_TOKEN);
-        if (token == NULL) {
-            continue;
-        }
-        entry->credits = atoi(token);
-        token = strtok(NULL, CSV_SPLIT_TOKEN);
-        if (token == NULL) {
-            continue;
-        }
-        strncpy(entry->professor, token, sizeof(entry->professor));
-        token = strtok(NULL, CSV_SPLIT_TOKEN);
-        if (token == NULL) {
-            continue;
-        }
-        strncpy(entry->days, token, sizeof(entry->days));
-        token = strtok(NULL, CSV_SPLIT_TOKEN);
-        if (token == NULL) {
+    courses_db_t* db = database_courses_create();
+    if (db == NULL) {
+        LOG_ERR("Failed to allocate memory for courses_db_t");
+        csv_unmap(mapping, len);
+        return NULL;
+    }
+
+    const char* p = mapping;
+    const char* end = mapping + len;
+    while (p < end) {
+        // Course code, credits, professor, days and course name. Incomplete rows are skipped.
+        string_slice_t fields[COURSE_FIELDS_COUNT];
+        size_t fields_count = 0;
+        p = csv_next_line(p, end, fields, COURSE_FIELDS_COUNT, &fields_count);
+        if (fields_count < COURSE_FIELDS_COUNT) {
             continue;
         }
-        strncpy(entry->course_name, token, sizeof(entry->course_name));
-        if (head == NULL) {
-            head = entry;
-            tail = entry;
-        } else {
-            tail->next = entry;
-            tail = entry;
+        // The fields are interned straight from the mapping, only distinct strings are copied
+        if (database_courses_add(db, fields[0], csv_field_to_int(fields[1]), fields[2], fields[3], fields[4]) != ERR_OK) {
+            LOG_ERR("Failed to allocate memory for course %.*s", (int) fields[0].len, fields[0].data);
+            break;
         }
     }
 
-    csv_close(fp);
-    return head;
-}
+    csv_unmap(mapping, len);
 
-void fileio_department_server_db_free(course_t* head) {
-    course_t* entry = head;
-    while (entry != NULL) {
-        course_t* next = entry->next;
-        free(entry);
-        entry = next;
+    // The catalog is read-only from here on
+    database_courses_shrink(db);
+    if (database_courses_index_build(db) != ERR_OK) {
+        // Lookups fall back to scanning the records
+        LOG_WARN("Serving %s without a course index", filename);
     }
+    return db;
+}
+
+void fileio_department_server_db_free(courses_db_t* db) {
+    database_courses_free(db);
 }
 #endif // SERVER_EE || SERVER_CS
@@ -1,40 +1,41 @@
 #ifndef FILEIO_H
 #define FILEIO_H
 
+#include "database.h"
 #include "protocol.h"
 
 #if defined(SERVER_C)
 /**
- * @brief Create the credentials db from the given file
+ * @brief Create the credentials db from the given file and index it by username
  * 
  * @param filename The file to parse
- * @return credentials_t* The parsed credentials linked list
+ * @return credentials_db_t* The parsed credentials db, NULL if the file could not be read
  */
-credentials_t* fileio_credential_server_db_create(const char* filename);
+credentials_db_t* fileio_credential_server_db_create(const char* filename);
 
 /**
- * @brief Free the given credentials linked list
+ * @brief Free the given credentials db
  * 
- * @param credentials The credentials linked list to free
+ * @param db The credentials db to free
  */
-void fileio_credential_server_db_free(credentials_t* credentials);
+void fileio_credential_server_db_free(credentials_db_t* db);
 #endif // SERVER_C
 
 #if defined(SERVER_EE) || defined(SERVER_CS)
 /**
- * @brief Create the courses db from the given file
+ * @brief Create the courses db from the given file and index it by course code
  * 
  * @param filename The file to parse
- * @return course_t* The parsed credentials linked list
+ * @return courses_db_t* The parsed courses db, NULL if the file could not be read
  */
-course_t* fileio_department_server_db_create(const char* filename);
+courses_db_t* fileio_department_server_db_create(const char* filename);
 
 /**
- * @brief Free the given credentials linked list
+ * @brief Free the given courses db
  * 
- * @param courses The credentials linked list to free
+ * @param db The courses db to free
  */
-void fileio_department_server_db_free(course_t* courses);
+void fileio_department_server_db_free(courses_db_t* db);
 #endif // SERVER_EE || SERVER_CS
 
 #endif // FILEIO_H
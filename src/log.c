@@ -1,7 +1,17 @@
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "log.h"
 #include "protocol.h"
@@ -34,13 +44,406 @@ static const LogInfo_t LOG_INFO_TAGS[] = {
 	{"", "V", ""}
 };
 
+// Lines logged by one thread, waiting for the log thread. Only the owning thread moves head and only the
+// drain moves tail, so neither side locks. Positions only grow, the byte at pos is data[pos % LOG_RING_SIZE].
+typedef struct __log_ring_t {
+    atomic_uint_fast64_t head;          // Lines are written up to here
+    atomic_uint_fast64_t tail;          // Lines are drained up to here
+    atomic_uint_fast64_t dropped;       // Lines that did not fit, not yet reported
+    struct __log_ring_t* next;
+    char data[LOG_RING_SIZE];
+} log_ring_t;
+
+// Every ring ever created. Rings are only added, a thread that exits leaves its ring behind.
+static _Atomic(log_ring_t*) rings = NULL;
+static __thread log_ring_t* thread_ring = NULL;
+
+// Levels set through LOG_LEVEL or log_set_levels(), and the tags they apply to. Guarded by tags_lock.
+typedef struct __log_tag_level_t {
+    char name[LOG_TAG_NAME_MAX];
+    uint8_t level;
+} log_tag_level_t;
+
+static log_tag_level_t tag_levels[LOG_TAG_LEVELS_MAX];
+static size_t tag_levels_count = 0;
+static uint8_t default_level = ENABLE_DEBUG_LOGS ? LOG_LVL_VERBOSE : LOG_LVL_INFO;
+static bool levels_loaded = false;
+static log_tag_t* tags = NULL;
+static pthread_mutex_t tags_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_bool async = false;
+static atomic_uint_fast64_t dropped_total = 0;
+static int log_fd = STDOUT_FILENO;
+static pthread_t drain_thread;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Format a complete line, colors and newline included. Long lines are truncated. Returns its length.
+static size_t log_format(char* line, const LogLevel_t logLevel, const char* tag, const char* format, va_list args) {
+    const size_t ending_len = sizeof(LOG_ENDING_STR) - 1;
+    const size_t room = LOG_LINE_MAX - ending_len;
+    int n = snprintf(line, room, "%s%s %s : %s", LOG_INFO_TAGS[logLevel].highlightColorTag, LOG_INFO_TAGS[logLevel].tagString, tag, LOG_INFO_TAGS[logLevel].colorTag);
+    size_t len = n < 0 ? 0 : min((size_t) n, room - 1);
+    n = vsnprintf(line + len, room - len, format, args);
+    len = n < 0 ? len : min(len + n, room - 1);
+    memcpy(line + len, LOG_ENDING_STR, ending_len);
+    return len + ending_len;
+}
+
+static log_ring_t* log_ring_get(void) {
+    if (thread_ring == NULL) {
+        log_ring_t* ring = calloc(1, sizeof(log_ring_t));
+        if (ring == NULL) {
+            return NULL;
+        }
+        ring->next = atomic_load(&rings);
+        while (!atomic_compare_exchange_weak(&rings, &ring->next, ring));
+        thread_ring = ring;
+    }
+    return thread_ring;
+}
+
+// Queue a line for the log thread. Never blocks: a line that does not fit is dropped and counted.
+static void log_ring_push(const char* line, size_t len) {
+    log_ring_t* ring = log_ring_get();
+    if (ring == NULL) {
+        atomic_fetch_add(&dropped_total, 1);
+        return;
+    }
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (LOG_RING_SIZE - (head - tail) < len) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    size_t offset = head & (LOG_RING_SIZE - 1);
+    size_t first = min(len, LOG_RING_SIZE - offset);
+    memcpy(ring->data + offset, line, first);
+    memcpy(ring->data, line + first, len - first);
+    // Publish the line
+    atomic_store_explicit(&ring->head, head + len, memory_order_release);
+}
+
+// Write every buffer, resuming after partial writes. Output is given up on errors, the lines are lost.
+static void log_writev_all(struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(log_fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        while (count > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+// Append a string to a line. Async-signal-safe, unlike snprintf.
+static size_t line_append(char* line, size_t len, size_t room, const char* s) {
+    size_t n = min(strlen(s), room - 1 - len);
+    memcpy(line + len, s, n);
+    return len + n;
+}
+
+// Append a number in decimal to a line. Async-signal-safe, unlike snprintf.
+static size_t line_append_u64(char* line, size_t len, size_t room, uint64_t value) {
+    char digits[21];
+    size_t i = sizeof(digits) - 1;
+    digits[i] = '\0';
+    do {
+        digits[--i] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    return line_append(line, len, room, digits + i);
+}
+
+// Write out what every thread has logged so far, in batches of up to LOG_DRAIN_IOV_MAX buffers per writev.
+// Lines of a thread keep their order. Returns the bytes drained. The caller holds drain_lock.
+// Only async-signal-safe calls, as the signal handler drains too.
+static size_t log_drain_locked(void) {
+    struct iovec iov[LOG_DRAIN_IOV_MAX];
+    log_ring_t* batch_rings[LOG_DRAIN_IOV_MAX];
+    uint64_t batch_heads[LOG_DRAIN_IOV_MAX];
+    int iov_count = 0, rings_count = 0;
+    size_t drained = 0;
+    uint64_t dropped = 0;
+
+    for (log_ring_t* ring = atomic_load(&rings); ; ring = ring->next) {
+        // A ring may wrap around, so it takes up to two buffers. Flush before running out.
+        if (ring == NULL || iov_count + 2 > LOG_DRAIN_IOV_MAX) {
+            log_writev_all(iov, iov_count);
+            for (int i = 0; i < rings_count; i++) {
+                atomic_store_explicit(&batch_rings[i]->tail, batch_heads[i], memory_order_release);
+            }
+            iov_count = rings_count = 0;
+            if (ring == NULL) {
+                break;
+            }
+        }
+        dropped += atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (head == tail) {
+            continue;
+        }
+        size_t offset = tail & (LOG_RING_SIZE - 1);
+        size_t len = head - tail;
+        size_t first = min(len, LOG_RING_SIZE - offset);
+        iov[iov_count++] = (struct iovec) { ring->data + offset, first };
+        if (len > first) {
+            iov[iov_count++] = (struct iovec) { ring->data, len - first };
+        }
+        batch_rings[rings_count] = ring;
+        batch_heads[rings_count++] = head;
+        drained += len;
+    }
+    if (dropped > 0) {
+        // Report the loss in the log itself
+        atomic_fetch_add(&dropped_total, dropped);
+        char line[LOG_LINE_MAX];
+        size_t len = line_append(line, 0, sizeof(line), LOG_INFO_TAGS[LOG_LVL_WARNING].highlightColorTag);
+        len = line_append(line, len, sizeof(line), LOG_INFO_TAGS[LOG_LVL_WARNING].tagString);
+        len = line_append(line, len, sizeof(line), " log : ");
+        len = line_append(line, len, sizeof(line), LOG_INFO_TAGS[LOG_LVL_WARNING].colorTag);
+        len = line_append_u64(line, len, sizeof(line), dropped);
+        len = line_append(line, len, sizeof(line), " log lines dropped, the log buffer was full." LOG_ENDING_STR);
+        log_writev_all(&(struct iovec) { line, len }, 1);
+    }
+    return drained;
+}
+
+static size_t log_drain(void) {
+    pthread_mutex_lock(&drain_lock);
+    size_t drained = log_drain_locked();
+    pthread_mutex_unlock(&drain_lock);
+    return drained;
+}
+
+static void* log_drain_task(void* params) {
+    const struct timespec idle = { 0, LOG_DRAIN_IDLE_US * 1000L };
+    while (1) {
+        if (log_drain() == 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+// The servers only stop on SIGINT or SIGTERM, which skips atexit. Write out the lines still queued, often the ones
+// explaining the stop, then die of the signal as before: SA_RESETHAND has restored its default action.
+// The drain is skipped if drain_lock is taken, e.g. by log_flush() on the interrupted thread, which waiting would deadlock.
+static void log_on_signal(int signum) {
+    if (pthread_mutex_trylock(&drain_lock) == 0) {
+        log_drain_locked();
+        pthread_mutex_unlock(&drain_lock);
+    }
+    raise(signum);
+}
+
+// Only where the signal would otherwise kill the process, so that handlers the program installed are kept
+static void log_flush_on_signal(int signum) {
+    struct sigaction action;
+    if (sigaction(signum, NULL, &action) != 0 || action.sa_handler != SIG_DFL) {
+        return;
+    }
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = log_on_signal;
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    sigaction(signum, &action, NULL);
+}
+
+err_t log_start(const char* path) {
+    if (atomic_load(&async)) {
+        return ERR_OK;
+    }
+    if (path != NULL) {
+        int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            return ERR_INVALID_PARAMETERS;
+        }
+        log_fd = fd;
+    }
+    // Lines logged so far go out first
+    fflush(stdout);
+    // The log thread never takes the signals. Their handler drains too, and would find drain_lock taken by itself.
+    sigset_t signals, previous;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    int err = pthread_create(&drain_thread, NULL, log_drain_task, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (err != 0) {
+        if (log_fd != STDOUT_FILENO) {
+            close(log_fd);
+            log_fd = STDOUT_FILENO;
+        }
+        return ERR_OUT_OF_MEMORY;
+    }
+    pthread_detach(drain_thread);
+    atomic_store(&async, true);
+    // Lines still queued when the process exits, or is stopped
+    atexit(log_flush);
+    log_flush_on_signal(SIGINT);
+    log_flush_on_signal(SIGTERM);
+    return ERR_OK;
+}
+
+void log_flush(void) {
+    if (atomic_load(&async)) {
+        log_drain();
+    } else {
+        fflush(stdout);
+    }
+}
+
+uint64_t log_dropped(void) {
+    uint64_t dropped = atomic_load(&dropped_total);
+    for (log_ring_t* ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+        dropped += atomic_load(&ring->dropped);
+    }
+    return dropped;
+}
+
+static const char* LOG_LEVEL_NAMES[] = { "off", "error", "warn", "info", "debug", "verbose" };
+
+// Returns -1 if the name is not a level
+static int log_level_parse(string_slice_t name) {
+    for (int level = LOG_LVL_OFF; level <= LOG_LVL_VERBOSE; level++) {
+        if (strlen(LOG_LEVEL_NAMES[level]) == name.len && strncasecmp(LOG_LEVEL_NAMES[level], name.data, name.len) == 0) {
+            return level;
+        }
+    }
+    return -1;
+}
+
+static uint8_t log_level_of_locked(const char* name) {
+    for (size_t i = 0; i < tag_levels_count; i++) {
+        if (strcmp(tag_levels[i].name, name) == 0) {
+            return tag_levels[i].level;
+        }
+    }
+    return default_level;
+}
+
+// Apply a single `level` or `tag=level` item. Must be called with tags_lock held.
+static err_t log_set_level_locked(string_slice_t item) {
+    const char* equals = memchr(item.data, '=', item.len);
+    if (equals == NULL) {
+        int level = log_level_parse(item);
+        if (level < 0) {
+            return ERR_INVALID_PARAMETERS;
+        }
+        default_level = level;
+        return ERR_OK;
+    }
+    string_slice_t name = { item.data, equals - item.data };
+    int level = log_level_parse((string_slice_t) { equals + 1, item.len - name.len - 1 });
+    if (level < 0 || name.len == 0 || name.len >= LOG_TAG_NAME_MAX) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    size_t i = 0;
+    while (i < tag_levels_count && !(strlen(tag_levels[i].name) == name.len && memcmp(tag_levels[i].name, name.data, name.len) == 0)) {
+        i++;
+    }
+    if (i == tag_levels_count) {
+        if (tag_levels_count == LOG_TAG_LEVELS_MAX) {
+            return ERR_QUEUE_FULL;
+        }
+        memcpy(tag_levels[i].name, name.data, name.len);
+        tag_levels[i].name[name.len] = '\0';
+        tag_levels_count++;
+    }
+    tag_levels[i].level = level;
+    return ERR_OK;
+}
+
+static err_t log_set_levels_locked(const char* spec, size_t spec_len) {
+    err_t err = ERR_OK;
+    size_t start = 0;
+    while (err == ERR_OK && start < spec_len) {
+        size_t end = start;
+        while (end < spec_len && spec[end] != ',') {
+            end++;
+        }
+        string_slice_t item = { spec + start, end - start };
+        while (item.len > 0 && isspace((unsigned char) item.data[0])) {
+            item.data++;
+            item.len--;
+        }
+        while (item.len > 0 && isspace((unsigned char) item.data[item.len - 1])) {
+            item.len--;
+        }
+        if (item.len > 0) {
+            err = log_set_level_locked(item);
+        }
+        start = end + 1;
+    }
+    // Tags that already logged pick the new levels up on their next statement
+    for (log_tag_t* tag = tags; tag != NULL; tag = tag->next) {
+        atomic_store_explicit(&tag->level, log_level_of_locked(tag->name), memory_order_relaxed);
+    }
+    return err;
+}
+
+static void log_levels_load_locked(void) {
+    if (levels_loaded) {
+        return;
+    }
+    levels_loaded = true;
+    const char* spec = getenv(LOG_LEVEL_ENV);
+    if (spec != NULL && log_set_levels_locked(spec, strlen(spec)) != ERR_OK) {
+        // Not logged, the log is what is being configured
+        fprintf(stderr, "Ignoring the rest of " LOG_LEVEL_ENV "=%s\n", spec);
+    }
+}
+
+uint8_t log_tag_resolve(log_tag_t* tag) {
+    pthread_mutex_lock(&tags_lock);
+    log_levels_load_locked();
+    uint8_t level = atomic_load_explicit(&tag->level, memory_order_relaxed);
+    if (level == LOG_LVL_UNRESOLVED) {
+        level = log_level_of_locked(tag->name);
+        tag->next = tags;
+        tags = tag;
+        atomic_store_explicit(&tag->level, level, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&tags_lock);
+    return level;
+}
+
+err_t log_set_levels(const char* spec, size_t spec_len) {
+    if (spec == NULL && spec_len > 0) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    pthread_mutex_lock(&tags_lock);
+    // LOG_LEVEL is the starting point, this overrides it
+    log_levels_load_locked();
+    err_t err = log_set_levels_locked(spec, spec_len);
+    pthread_mutex_unlock(&tags_lock);
+    return err;
+}
+
 void log_text(const LogLevel_t logLevel, const char* tag, const char* format, ...) {
-    printf("%s%s %s : %s", LOG_INFO_TAGS[logLevel].highlightColorTag, LOG_INFO_TAGS[logLevel].tagString, tag, LOG_INFO_TAGS[logLevel].colorTag);
+    char line[LOG_LINE_MAX];
     va_list argptr;
     va_start(argptr, format);
-    vprintf(format, argptr);
+    size_t len = log_format(line, logLevel, tag, format, argptr);
     va_end(argptr);
-    printf(LOG_ENDING_STR);
+    if (atomic_load_explicit(&async, memory_order_relaxed)) {
+        log_ring_push(line, len);
+    } else {
+        // Until log_start() the line shares stdout's buffer with the rest of the program's output
+        fwrite(line, 1, len, stdout);
+    }
 }
 
 void log_dbg_buffer(const char* tag, const char* buffer_name, const uint8_t* buffer, size_t len) {
@@ -97,25 +500,16 @@ void log_dbg_buffer(const char* tag, const char* buffer_name, const uint8_t* buf
 
 void log_course(const void* course) {
 #if ENABLE_DEBUG_LOGS
-	static const char* TAG = "course";
-	const course_t* ptr = (const course_t*)course;
-    LOG_DBG("%s %s %s %s %d", ptr->course_code, ptr->course_name, ptr->professor, ptr->days, ptr->credits);
-#endif // ENABLE_DEBUG_LOGS
-}
-
-void log_courses(const void* head)  {
-#if ENABLE_DEBUG_LOGS
-	const course_t* ptr = (const course_t*)head;
-    while (ptr != NULL) {
-        log_course(ptr);
-        ptr = ptr->next;
-    }
+	LOG_TAG(course);
+	const course_details_view_t* ptr = (const course_details_view_t*)course;
+    LOG_DBG("%.*s %.*s %.*s %.*s %d", (int) ptr->course_code.len, ptr->course_code.data, (int) ptr->course_name.len, ptr->course_name.data,
+        (int) ptr->professor.len, ptr->professor.data, (int) ptr->days.len, ptr->days.data, ptr->credits);
 #endif // ENABLE_DEBUG_LOGS
 }
 
 void log_credential(const void* credentials) {
 #if ENABLE_DEBUG_LOGS
-	static const char* TAG = "credential";
+	LOG_TAG(credential);
 	const credentials_t* ptr = (const credentials_t*)credentials;
 	LOG_DBG("%s %s", ptr->username, ptr->password);
 #endif // ENABLE_DEBUG_LOGS
@@ -139,32 +533,32 @@ struct paddings_t {
     int course_name;
 };
 
-static void get_paddings(course_t* courses, struct paddings_t* paddings) {
+static void get_paddings(const course_details_view_t* courses, size_t count, struct paddings_t* paddings) {
     bzero(paddings, sizeof(struct paddings_t));
     paddings->course_code = strlen("Course Code");
     paddings->credits = strlen("Credits");
     paddings->professor = strlen("Professor");
     paddings->days = strlen("Days");
     paddings->course_name = strlen("Course Name");
-    while (courses) {
-        paddings->course_code = max(paddings->course_code, strlen(courses->course_code));
+    for (size_t i = 0; i < count; i++) {
+        paddings->course_code = max(paddings->course_code, (int) courses[i].course_code.len);
         paddings->credits = max(paddings->credits, 1);
-        paddings->professor = max(paddings->professor, strlen(courses->professor));
-        paddings->days = max(paddings->days, strlen(courses->days));
-        paddings->course_name = max(paddings->course_name, strlen(courses->course_name));
-        courses = courses->next;
+        paddings->professor = max(paddings->professor, (int) courses[i].professor.len);
+        paddings->days = max(paddings->days, (int) courses[i].days.len);
+        paddings->course_name = max(paddings->course_name, (int) courses[i].course_name.len);
     }
 }
 
-void log_course_multi_lookup_result(const void* courses) {
-	static const char* TAG = "client";
-	course_t* ptr = (course_t*)courses;
+void log_course_multi_lookup_result(const void* courses, size_t count) {
+	LOG_TAG(client);
+	const course_details_view_t* ptr = (const course_details_view_t*)courses;
     struct paddings_t pad = {0};
-    get_paddings(ptr, &pad);
+    get_paddings(ptr, count, &pad);
 
     LOG_WARN("%*s: %*s | %*s | %*s | %*s", -1 * pad.course_code, "Course Code", -1 * pad.credits, "Credits", -1 * pad.professor, "Professor", -1 * pad.days, "Days", -1 * pad.course_name, "Course Name");
-    while(ptr != NULL) {
-        LOG_INFO("%*s: %*d | %*s | %*s | %*s", -1 * pad.course_code, ptr->course_code, -1 * pad.credits, ptr->credits, -1 * pad.professor, ptr->professor, -1 * pad.days, ptr->days, -1 * pad.course_name, ptr->course_name);
-        ptr = ptr->next;
+    for (size_t i = 0; i < count; i++, ptr++) {
+        LOG_INFO("%*.*s: %*d | %*.*s | %*.*s | %*.*s", -1 * pad.course_code, (int) ptr->course_code.len, ptr->course_code.data, -1 * pad.credits, ptr->credits,
+            -1 * pad.professor, (int) ptr->professor.len, ptr->professor.data, -1 * pad.days, (int) ptr->days.len, ptr->days.data,
+            -1 * pad.course_name, (int) ptr->course_name.len, ptr->course_name.data);
     }
 }
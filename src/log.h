@@ -5,11 +5,12 @@
 #define ENABLE_DEBUG_LOGS 0
 #endif // ENABLE_DEBUG_LOGS
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-#define LOG_TAG(x) __attribute__((unused)) static const char* TAG = #x
+#include "error.h"
 
 typedef enum {
 	LOG_LVL_OFF,
@@ -20,38 +21,102 @@ typedef enum {
 	LOG_LVL_VERBOSE,
 } LogLevel_t;
 
-#define LOG_INFO(...)           log_text(LOG_LVL_INFO, TAG, __VA_ARGS__)
-#define LOG_WARN(...)           log_text(LOG_LVL_WARNING, TAG, __VA_ARGS__)
-#define LOG_ERR(...)            log_text(LOG_LVL_ERROR, TAG, __VA_ARGS__)
-
+// Most verbose level compiled in. Statements above it are removed by the compiler, e.g. -DLOG_LEVEL_COMPILED=LOG_LVL_WARNING.
+#ifndef LOG_LEVEL_COMPILED
 #if ENABLE_DEBUG_LOGS
-#define LOG_DBG(...)            log_text(LOG_LVL_DEBUG, TAG, __VA_ARGS__)
-#define LOG_VERBOSE(...)        log_text(LOG_LVL_VERBOSE, TAG, __VA_ARGS__)
-#define LOG_BUFFER(buffer, len) log_dbg_buffer(TAG, #buffer, buffer, len)
+#define LOG_LEVEL_COMPILED      LOG_LVL_VERBOSE
 #else
-#define LOG_DBG(...)
-#define LOG_VERBOSE(...)
-#define LOG_BUFFER(...)
-#endif
+#define LOG_LEVEL_COMPILED      LOG_LVL_INFO
+#endif // ENABLE_DEBUG_LOGS
+#endif // LOG_LEVEL_COMPILED
+
+// Level of a tag that has not logged yet. Lets its first statement through to look its level up.
+#define LOG_LVL_UNRESOLVED      0xFF
+
+// Runtime level of a tag. There is one per file using LOG_TAG(), files sharing a tag name share its level.
+typedef struct __log_tag_t {
+	const char* name;
+	atomic_uchar level;                 // Most verbose level logged
+	struct __log_tag_t* next;           // Tags that have resolved their level
+} log_tag_t;
+
+#define LOG_TAG(x) \
+	__attribute__((unused)) static log_tag_t LOG_TAG_STATE = { #x, LOG_LVL_UNRESOLVED, NULL }; \
+	__attribute__((unused)) static const char* TAG = #x
+
+// A disabled statement costs one compare and never evaluates its arguments
+#define LOG_ENABLED(lvl)        ((lvl) <= LOG_LEVEL_COMPILED && (lvl) <= atomic_load_explicit(&LOG_TAG_STATE.level, memory_order_relaxed) \
+                                    && log_tag_enabled(&LOG_TAG_STATE, lvl))
+#define LOG_AT(lvl, ...)        do { if (LOG_ENABLED(lvl)) log_text(lvl, TAG, __VA_ARGS__); } while (0)
+
+#define LOG_INFO(...)           LOG_AT(LOG_LVL_INFO, __VA_ARGS__)
+#define LOG_WARN(...)           LOG_AT(LOG_LVL_WARNING, __VA_ARGS__)
+#define LOG_ERR(...)            LOG_AT(LOG_LVL_ERROR, __VA_ARGS__)
+#define LOG_DBG(...)            LOG_AT(LOG_LVL_DEBUG, __VA_ARGS__)
+#define LOG_VERBOSE(...)        LOG_AT(LOG_LVL_VERBOSE, __VA_ARGS__)
+#define LOG_BUFFER(buffer, len) do { if (LOG_ENABLED(LOG_LVL_DEBUG)) log_dbg_buffer(TAG, #buffer, buffer, len); } while (0)
+
+/**
+ * @brief Look up the level of a tag the first time it logs
+ *
+ * @return uint8_t The level of the tag
+ */
+uint8_t log_tag_resolve(log_tag_t* tag);
+
+// Reached once the level compare of a statement passed, which it always does for an unresolved tag
+static inline bool log_tag_enabled(log_tag_t* tag, const LogLevel_t logLevel) {
+	return __builtin_expect(atomic_load_explicit(&tag->level, memory_order_relaxed) != LOG_LVL_UNRESOLVED, 1)
+		|| logLevel <= log_tag_resolve(tag);
+}
+
+/**
+ * @brief Change the runtime levels
+ *
+ * The spec is a comma separated list of `level` items, which set the level of every tag without
+ * one of its own, and `tag=level` items. Levels are off, error, warn, info, debug and verbose.
+ * The LOG_LEVEL environment variable is applied the same way when the first line is logged.
+ *
+ * @param spec The levels, e.g. "warn,serverM=info"
+ * @param spec_len The length of spec
+ *
+ * @return err_t ERR_OK, ERR_INVALID_PARAMETERS if an item cannot be parsed. Items before it are applied.
+ */
+err_t log_set_levels(const char* spec, size_t spec_len);
 
 void log_text(const LogLevel_t logLevel, const char* tag, const char* format, ...);
+
+/**
+ * @brief Write log lines from a background thread from now on
+ *
+ * Each thread formats its lines into a ring buffer of its own, which the log thread drains with writev.
+ * Logging never blocks: lines that do not fit are dropped, counted and reported in the log.
+ * Until this is called, lines are written to stdout by the calling thread.
+ * Queued lines are written out at exit, and on SIGINT or SIGTERM unless the program handles them itself.
+ *
+ * @param path File the lines are appended to, NULL for stdout
+ *
+ * @return err_t ERR_OK on success, ERR_INVALID_PARAMETERS if the file cannot be opened
+ */
+err_t log_start(const char* path);
+
+/**
+ * @brief Write out every line logged so far
+ */
+void log_flush(void);
+
+/**
+ * @brief Get the number of lines dropped because a log buffer was full
+ */
+uint64_t log_dropped(void);
 void log_dbg_buffer(const char* tag, const char* buffer_name, const uint8_t* buffer, size_t len);
 
 /**
  * @brief Log a course
  * 
- * @param course Pointer to the course to log
+ * @param course Pointer to the course_details_view_t to log
 */
 void log_course(const void* course);
 
-/**
- * @brief Print the given courses linked list
- * 
- * @param head Pointer to the head of the linked list
- * 
-*/
-void log_courses(const void* head);
-
 /**
  * @brief Print the given credentials
  * 
@@ -69,8 +134,9 @@ void log_credentials(const void* head);
 /**
  * @brief Print the output of the course multiple lookup
  *
- * @param courses The courses to print
+ * @param courses The course_details_view_t array to print
+ * @param count The number of courses
 */
-void log_course_multi_lookup_result(const void* courses);
+void log_course_multi_lookup_result(const void* courses, size_t count);
 
 #endif // _LOG_H_
@@ -0,0 +1,131 @@
+#include "message_buffer.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "constants.h"
+#include "log.h"
+#include "utils.h"
+
+LOG_TAG(message_buffer);
+
+// One free list per power of 2 between MESSAGE_BUFFER_POOL_MIN and MESSAGE_BUFFER_POOL_MAX
+#define POOL_CLASSES (__builtin_ctz(MESSAGE_BUFFER_POOL_MAX) - __builtin_ctz(MESSAGE_BUFFER_POOL_MIN) + 1)
+
+// A cached buffer. The link lives in the first bytes of the buffer itself.
+typedef struct __pool_entry_t {
+    struct __pool_entry_t* next;
+} pool_entry_t;
+
+typedef struct __pool_class_t {
+    pthread_mutex_t lock;
+    pool_entry_t* free_list;
+    size_t count;
+} pool_class_t;
+
+static pool_class_t pool[POOL_CLASSES] = {
+    [0 ... POOL_CLASSES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+// Round a request up to the size of the buffer that serves it
+static size_t pool_capacity(size_t capacity) {
+    if (capacity <= MESSAGE_BUFFER_POOL_MIN) {
+        return MESSAGE_BUFFER_POOL_MIN;
+    }
+    if (capacity > MESSAGE_BUFFER_POOL_MAX) {
+        return capacity;
+    }
+    return (size_t) 1 << (64 - __builtin_clzll(capacity - 1));
+}
+
+// Free list for a buffer size, NULL if buffers of this size are not cached
+static pool_class_t* pool_class(size_t capacity) {
+    if (capacity > MESSAGE_BUFFER_POOL_MAX) {
+        return NULL;
+    }
+    return &pool[__builtin_ctzll(capacity) - __builtin_ctz(MESSAGE_BUFFER_POOL_MIN)];
+}
+
+static uint8_t* pool_get(size_t capacity) {
+    pool_class_t* class = pool_class(capacity);
+    if (class != NULL) {
+        pthread_mutex_lock(&class->lock);
+        pool_entry_t* entry = class->free_list;
+        if (entry != NULL) {
+            class->free_list = entry->next;
+            class->count--;
+        }
+        pthread_mutex_unlock(&class->lock);
+        if (entry != NULL) {
+            return (uint8_t*) entry;
+        }
+    }
+    return malloc(capacity);
+}
+
+static void pool_put(uint8_t* data, size_t capacity) {
+    pool_class_t* class = pool_class(capacity);
+    if (class != NULL) {
+        pthread_mutex_lock(&class->lock);
+        if (class->count < MESSAGE_BUFFER_POOL_DEPTH) {
+            pool_entry_t* entry = (pool_entry_t*) data;
+            entry->next = class->free_list;
+            class->free_list = entry;
+            class->count++;
+            data = NULL;
+        }
+        pthread_mutex_unlock(&class->lock);
+    }
+    // The pool is full or the buffer is too large to cache
+    free(data);
+}
+
+err_t message_buffer_reserve(message_buffer_t* message, size_t capacity) {
+    if (message == NULL || (message->capacity == 0 && message->data != NULL)) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    if (capacity <= message->capacity) {
+        return ERR_OK;
+    }
+    capacity = pool_capacity(capacity);
+    uint8_t* data = pool_get(capacity);
+    if (data == NULL) {
+        LOG_ERR("Failed to allocate a %zu byte message buffer", capacity);
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (message->data != NULL) {
+        memcpy(data, message->data, message->data_len);
+        pool_put(message->data, message->capacity);
+    }
+    message->data = data;
+    message->capacity = capacity;
+    return ERR_OK;
+}
+
+err_t message_buffer_append(message_buffer_t* message, const void* data, size_t len) {
+    if (message == NULL || (data == NULL && len > 0)) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    if (message->data_len + len > message->capacity) {
+        // Grow geometrically so that appending field by field stays linear
+        err_t err = message_buffer_reserve(message, max(message->data_len + len, message->capacity * 2));
+        if (err != ERR_OK) {
+            return err;
+        }
+    }
+    memcpy(message->data + message->data_len, data, len);
+    message->data_len += len;
+    return ERR_OK;
+}
+
+void message_buffer_release(message_buffer_t* message) {
+    if (message != NULL) {
+        if (message->capacity > 0) {
+            pool_put(message->data, message->capacity);
+        }
+        message->data = NULL;
+        message->data_len = 0;
+        message->capacity = 0;
+    }
+}
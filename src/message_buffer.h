@@ -0,0 +1,41 @@
+#ifndef MESSAGE_BUFFER_H
+#define MESSAGE_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "error.h"
+
+/**
+ * @brief A message of any size: the header followed by the whole payload.
+ *
+ * The bytes come from a pool of power-of-two buffers shared by every thread, so building and dropping
+ * messages of similar sizes does not go through malloc. A zeroed message_buffer_t is empty and ready to use.
+ */
+typedef struct __message_buffer_t {
+    uint8_t* data;
+    size_t data_len;
+    size_t capacity;                // 0 if data is borrowed (see MESSAGE_BUFFER_VIEW)
+} message_buffer_t;
+
+// Read-only message over bytes owned by someone else, such as a single received segment
+#define MESSAGE_BUFFER_VIEW(d, len) ((message_buffer_t) { .data = (uint8_t*) (d), .data_len = (len), .capacity = 0 })
+
+/**
+ * @brief Make room for at least capacity bytes, keeping the bytes already in the message
+ *
+ * @return err_t ERR_OK on success, ERR_OUT_OF_MEMORY if no buffer could be allocated,
+ *               ERR_INVALID_PARAMETERS if the message is a view
+ */
+err_t message_buffer_reserve(message_buffer_t* message, size_t capacity);
+
+/**
+ * @brief Append bytes at the end of the message, growing it as needed
+ */
+err_t message_buffer_append(message_buffer_t* message, const void* data, size_t len);
+
+/**
+ * @brief Return the bytes of the message to the pool and leave it empty
+ */
+void message_buffer_release(message_buffer_t* message);
+
+#endif // MESSAGE_BUFFER_H
@@ -24,10 +24,10 @@
 
 #define SERVER_SUB_MESSAGE_ON_BOOTUP "The server%s is up and running using UDP on port %d."
 #define SERVER_SUB_MESSAGE_ON_BOOTUP_FAILED "The server%s failed to start with UDP. Reason: %s."
-#define SERVER_SUB_MESSAGE_ON_LOOKUP_REQUEST_RECEIVED "The server%s received a request from the Main Server about the %s of %s."
-#define SERVER_SUB_MESSAGE_ON_SUMMARY_REQUEST_RECEIVED "The server%s received a request from the Main Server for all the details of %s."
-#define SERVER_SUB_MESSAGE_ON_COURSE_FOUND "The course information has been found: The %s of the %s is %s."
-#define SERVER_SUB_MESSAGE_ON_COURSE_NOT_FOUND "Didn't find the course: %s."
+#define SERVER_SUB_MESSAGE_ON_LOOKUP_REQUEST_RECEIVED "The server%s received a request from the Main Server about the %s of %.*s."
+#define SERVER_SUB_MESSAGE_ON_SUMMARY_REQUEST_RECEIVED "The server%s received a request from the Main Server for all the details of %.*s."
+#define SERVER_SUB_MESSAGE_ON_COURSE_FOUND "The course information has been found: The %s of the %.*s is %.*s."
+#define SERVER_SUB_MESSAGE_ON_COURSE_NOT_FOUND "Didn't find the course: %.*s."
 #define SERVER_SUB_MESSAGE_ON_RESPONSE_SENT "The server%s finished sending the response to the Main Server."
 #define SERVER_SUB_MESSAGE_ON_REQUEST_INVALID "The server%s received an invalid request from the Main Server."
 
@@ -37,7 +37,7 @@
 #define SERVER_M_MESSAGE_ON_AUTH_REQUEST_FORWARDED "The main server sent an authentication request to serverC."
 #define SERVER_M_MESSAGE_ON_AUTH_RESULT_RECEIVED "The main server received the result of the authentication request from ServerC using UDP over port %d."
 #define SERVER_M_MESSAGE_ON_AUTH_RESULT_FORWARDED "The main server sent the authentication result to the client."
-#define SERVER_M_MESSAGE_ON_QUERY_RECEIVED "The main server received from %s to query course %s about %s using TCP over port %d."
+#define SERVER_M_MESSAGE_ON_QUERY_RECEIVED "The main server received from %s to query course %.*s about %s using TCP over port %d."
 #define SERVER_M_MESSAGE_ON_QUERY_FORWARDED "The main server sent a request to server%.*s."
 #define SERVER_M_MESSAGE_ON_RESULT_RECEIVED "The main server received the response from server%s using UDP over port %d."
 #define SERVER_M_MESSAGE_ON_RESULT_FORWARDED "The main server sent the query information to the client."
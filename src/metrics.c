@@ -0,0 +1,276 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "utils.h"
+
+LOG_TAG(metrics);
+
+typedef struct __metrics_shard_histogram_t {
+    atomic_uint_fast64_t counts[METRICS_HISTOGRAM_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum_ns;
+    atomic_uint_fast64_t max_ns;
+} metrics_shard_histogram_t;
+
+// The metrics of one thread. Only that thread writes them, any thread may read them.
+typedef struct __metrics_shard_t {
+    atomic_uint_fast64_t requests[METRICS_REQUEST_TYPES][METRICS_OUTCOMES];
+    metrics_shard_histogram_t latency[METRICS_REQUEST_TYPES][2];
+    metrics_shard_histogram_t backend_rtt[METRICS_BACKENDS];
+    struct __metrics_shard_t* next;
+} metrics_shard_t;
+
+// Every shard ever created. Shards are only added, a thread that exits leaves its shard behind.
+static _Atomic(metrics_shard_t*) shards = NULL;
+static __thread metrics_shard_t* thread_shard = NULL;
+static uint64_t started_ns = 0;
+
+static metrics_shard_t* metrics_shard_get(void) {
+    if (thread_shard == NULL) {
+        metrics_shard_t* shard = calloc(1, sizeof(metrics_shard_t));
+        if (shard == NULL) {
+            return NULL;
+        }
+        shard->next = atomic_load(&shards);
+        while (!atomic_compare_exchange_weak(&shards, &shard->next, shard));
+        thread_shard = shard;
+    }
+    return thread_shard;
+}
+
+// Only the owning thread writes a counter, so a load and a store do without a locked instruction
+static inline void counter_add(atomic_uint_fast64_t* counter, uint64_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static size_t bucket_of(uint64_t value) {
+    const uint64_t linear = 2 << METRICS_SUB_BUCKET_BITS;
+    if (value < linear) {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - METRICS_SUB_BUCKET_BITS;
+    size_t index = (size_t) (shift + 1) * (1 << METRICS_SUB_BUCKET_BITS) + ((value >> shift) - (1 << METRICS_SUB_BUCKET_BITS));
+    return min(index, METRICS_HISTOGRAM_BUCKETS - 1);
+}
+
+uint64_t metrics_histogram_bucket_upper_bound(size_t index) {
+    const size_t linear = 2 << METRICS_SUB_BUCKET_BITS;
+    if (index < linear) {
+        return index;
+    }
+    int shift = index / (1 << METRICS_SUB_BUCKET_BITS) - 1;
+    uint64_t mantissa = (1 << METRICS_SUB_BUCKET_BITS) + index % (1 << METRICS_SUB_BUCKET_BITS);
+    return ((mantissa + 1) << shift) - 1;
+}
+
+static void histogram_record(metrics_shard_histogram_t* histogram, uint64_t value) {
+    counter_add(&histogram->counts[bucket_of(value)], 1);
+    counter_add(&histogram->count, 1);
+    counter_add(&histogram->sum_ns, value);
+    if (value > atomic_load_explicit(&histogram->max_ns, memory_order_relaxed)) {
+        atomic_store_explicit(&histogram->max_ns, value, memory_order_relaxed);
+    }
+}
+
+static void histogram_sum(metrics_histogram_t* into, const metrics_shard_histogram_t* from) {
+    for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        into->counts[i] += atomic_load_explicit(&from->counts[i], memory_order_relaxed);
+    }
+    into->count += atomic_load_explicit(&from->count, memory_order_relaxed);
+    into->sum_ns += atomic_load_explicit(&from->sum_ns, memory_order_relaxed);
+    into->max_ns = max(into->max_ns, atomic_load_explicit(&from->max_ns, memory_order_relaxed));
+}
+
+void metrics_start(void) {
+    started_ns = metrics_now_ns();
+}
+
+void metrics_record_request(request_type_t type, uint8_t outcome, bool ok, uint64_t latency_ns) {
+    size_t type_idx = (size_t) type - REQUEST_TYPE_AUTH;
+    metrics_shard_t* shard = metrics_shard_get();
+    if (type_idx >= METRICS_REQUEST_TYPES || shard == NULL) {
+        return;
+    }
+    counter_add(&shard->requests[type_idx][outcome], 1);
+    histogram_record(&shard->latency[type_idx][ok ? 0 : 1], latency_ns);
+}
+
+void metrics_record_response(request_type_t type, const struct __message_t* response, uint64_t received_ns) {
+    // Lookup responses carry the category in their flags. Only these responses carry a result.
+    uint8_t outcome = ERR_OK;
+    bool ok = true;
+    switch (protocol_get_request_type(response)) {
+        case RESPONSE_TYPE_AUTH:
+            outcome = protocol_get_flags(response);
+            ok = AUTH_MASK_SUCCESS(outcome);
+            break;
+        case RESPONSE_TYPE_COURSES_ERROR:
+            outcome = protocol_get_flags(response);
+            ok = false;
+            break;
+        case RESPONSE_TYPE_LOG_LEVEL:
+        case RESPONSE_TYPE_STATS:
+            outcome = protocol_get_flags(response);
+            ok = outcome == ERR_OK;
+            break;
+    }
+    metrics_record_request(type, outcome, ok, metrics_now_ns() - received_ns);
+}
+
+void metrics_record_backend_rtt(metrics_backend_t backend, uint64_t rtt_ns) {
+    metrics_shard_t* shard = metrics_shard_get();
+    if (backend >= METRICS_BACKENDS || shard == NULL) {
+        return;
+    }
+    histogram_record(&shard->backend_rtt[backend], rtt_ns);
+}
+
+void metrics_snapshot(metrics_snapshot_t* snapshot) {
+    memset(snapshot, 0, sizeof(metrics_snapshot_t));
+    for (metrics_shard_t* shard = atomic_load(&shards); shard != NULL; shard = shard->next) {
+        for (size_t type = 0; type < METRICS_REQUEST_TYPES; type++) {
+            for (size_t outcome = 0; outcome < METRICS_OUTCOMES; outcome++) {
+                snapshot->requests[type][outcome] += atomic_load_explicit(&shard->requests[type][outcome], memory_order_relaxed);
+            }
+            histogram_sum(&snapshot->latency[type][0], &shard->latency[type][0]);
+            histogram_sum(&snapshot->latency[type][1], &shard->latency[type][1]);
+        }
+        for (size_t backend = 0; backend < METRICS_BACKENDS; backend++) {
+            histogram_sum(&snapshot->backend_rtt[backend], &shard->backend_rtt[backend]);
+        }
+    }
+}
+
+uint64_t metrics_histogram_percentile(const metrics_histogram_t* histogram, double percentile) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+    // Smallest value at or above the given share of the samples
+    uint64_t rank = (uint64_t) (percentile / 100.0 * histogram->count + 0.999999);
+    rank = max(rank, 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            return min(metrics_histogram_bucket_upper_bound(i), histogram->max_ns);
+        }
+    }
+    return histogram->max_ns;
+}
+
+void metrics_histogram_merge(metrics_histogram_t* into, const metrics_histogram_t* from) {
+    for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->count += from->count;
+    into->sum_ns += from->sum_ns;
+    into->max_ns = max(into->max_ns, from->max_ns);
+}
+
+static const char* BACKEND_NAMES[METRICS_BACKENDS] = { "serverC", "serverCS", "serverEE" };
+
+// Append an item if there is room
+static void stats_item_add(stats_item_t* items, size_t items_size, size_t* count, stats_id_t id, uint8_t index, uint64_t value) {
+    if (*count < items_size) {
+        items[(*count)++] = (stats_item_t) { .id = id, .index = index, .value = value };
+    }
+}
+
+size_t metrics_stats_items(stats_item_t* items, size_t items_size) {
+    size_t count = 0;
+    stats_item_add(items, items_size, &count, STATS_UPTIME_MS, 0, started_ns ? (metrics_now_ns() - started_ns) / 1000000 : 0);
+    stats_item_add(items, items_size, &count, STATS_LOG_DROPPED, 0, log_dropped());
+
+    metrics_snapshot_t* snapshot = malloc(sizeof(metrics_snapshot_t));
+    metrics_histogram_t* all = malloc(sizeof(metrics_histogram_t));
+    if (snapshot == NULL || all == NULL) {
+        free(snapshot);
+        free(all);
+        return count;
+    }
+    metrics_snapshot(snapshot);
+    for (size_t type = 0; type < METRICS_REQUEST_TYPES; type++) {
+        *all = snapshot->latency[type][0];
+        metrics_histogram_merge(all, &snapshot->latency[type][1]);
+        if (all->count == 0) {
+            continue;
+        }
+        uint8_t request_type = REQUEST_TYPE_AUTH + type;
+        stats_item_add(items, items_size, &count, STATS_REQUESTS, request_type, all->count);
+        stats_item_add(items, items_size, &count, STATS_REQUESTS_FAILED, request_type, snapshot->latency[type][1].count);
+        stats_item_add(items, items_size, &count, STATS_LATENCY_P50_NS, request_type, metrics_histogram_percentile(all, 50));
+        stats_item_add(items, items_size, &count, STATS_LATENCY_P99_NS, request_type, metrics_histogram_percentile(all, 99));
+        stats_item_add(items, items_size, &count, STATS_LATENCY_P999_NS, request_type, metrics_histogram_percentile(all, 99.9));
+        stats_item_add(items, items_size, &count, STATS_LATENCY_MAX_NS, request_type, all->max_ns);
+    }
+    for (size_t backend = 0; backend < METRICS_BACKENDS; backend++) {
+        const metrics_histogram_t* rtt = &snapshot->backend_rtt[backend];
+        if (rtt->count == 0) {
+            continue;
+        }
+        stats_item_add(items, items_size, &count, STATS_BACKEND_RESPONSES, backend, rtt->count);
+        stats_item_add(items, items_size, &count, STATS_BACKEND_RTT_P50_NS, backend, metrics_histogram_percentile(rtt, 50));
+        stats_item_add(items, items_size, &count, STATS_BACKEND_RTT_P99_NS, backend, metrics_histogram_percentile(rtt, 99));
+        stats_item_add(items, items_size, &count, STATS_BACKEND_RTT_P999_NS, backend, metrics_histogram_percentile(rtt, 99.9));
+    }
+    free(all);
+    free(snapshot);
+    return count;
+}
+
+static void log_histogram(const char* name, const char* counts, const metrics_histogram_t* histogram) {
+    LOG_INFO("%s: %s, p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms.", name, counts,
+        metrics_histogram_percentile(histogram, 50) / 1e6, metrics_histogram_percentile(histogram, 99) / 1e6,
+        metrics_histogram_percentile(histogram, 99.9) / 1e6, histogram->max_ns / 1e6);
+}
+
+void metrics_log_summary(void) {
+    metrics_snapshot_t* snapshot = malloc(sizeof(metrics_snapshot_t));
+    metrics_histogram_t* all = malloc(sizeof(metrics_histogram_t));
+    if (snapshot == NULL || all == NULL) {
+        free(snapshot);
+        free(all);
+        return;
+    }
+    static uint64_t last_recorded = 0;
+    metrics_snapshot(snapshot);
+    uint64_t recorded = 0;
+    for (size_t type = 0; type < METRICS_REQUEST_TYPES; type++) {
+        recorded += snapshot->latency[type][0].count + snapshot->latency[type][1].count;
+    }
+    for (size_t backend = 0; backend < METRICS_BACKENDS; backend++) {
+        recorded += snapshot->backend_rtt[backend].count;
+    }
+    if (recorded == last_recorded) {
+        free(all);
+        free(snapshot);
+        return;
+    }
+    last_recorded = recorded;
+
+    for (size_t type = 0; type < METRICS_REQUEST_TYPES; type++) {
+        uint64_t failed = snapshot->latency[type][1].count;
+        *all = snapshot->latency[type][0];
+        metrics_histogram_merge(all, &snapshot->latency[type][1]);
+        if (all->count > 0) {
+            char counts[64];
+            snprintf(counts, sizeof(counts), "%llu requests, %llu failed", (unsigned long long) all->count, (unsigned long long) failed);
+            const char* name = protocol_request_type_name(REQUEST_TYPE_AUTH + type);
+            log_histogram(name ? name : "other", counts, all);
+        }
+    }
+    for (size_t backend = 0; backend < METRICS_BACKENDS; backend++) {
+        if (snapshot->backend_rtt[backend].count > 0) {
+            char name[32], counts[64];
+            snprintf(name, sizeof(name), "%s round trip", BACKEND_NAMES[backend]);
+            snprintf(counts, sizeof(counts), "%llu responses", (unsigned long long) snapshot->backend_rtt[backend].count);
+            log_histogram(name, counts, &snapshot->backend_rtt[backend]);
+        }
+    }
+    free(all);
+    free(snapshot);
+}
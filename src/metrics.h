@@ -0,0 +1,122 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "constants.h"
+#include "protocol.h"
+
+// Request types REQUEST_TYPE_AUTH and up that are counted. Later types are ignored.
+#define METRICS_REQUEST_TYPES           8
+#define METRICS_OUTCOMES                256     // Every err_t or auth flags value
+
+// Latencies are bucketed like HDR histograms: 16 linear sub-buckets per power of 2, so a bucket is
+// within 6.25% of the values in it. Values are in ns, up to 2^36 ns (68 s). Longer ones land in the last bucket.
+#define METRICS_SUB_BUCKET_BITS         4
+#define METRICS_HISTOGRAM_BUCKETS       544
+
+// Backend servers serverM measures the round trip time to
+typedef uint8_t metrics_backend_t;
+#define METRICS_BACKEND_C               0
+#define METRICS_BACKEND_CS              1
+#define METRICS_BACKEND_EE              2
+#define METRICS_BACKENDS                3
+
+typedef struct __metrics_histogram_t {
+    uint64_t counts[METRICS_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+} metrics_histogram_t;
+
+// Sum of the metrics of every thread
+typedef struct __metrics_snapshot_t {
+    uint64_t requests[METRICS_REQUEST_TYPES][METRICS_OUTCOMES];     // By request type and outcome
+    metrics_histogram_t latency[METRICS_REQUEST_TYPES][2];          // By request type, [0] succeeded, [1] failed
+    metrics_histogram_t backend_rtt[METRICS_BACKENDS];
+} metrics_snapshot_t;
+
+/**
+ * @brief Monotonic clock in ns, for the latencies passed to the metrics
+ */
+static inline uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Mark the start of the server, for the uptime in its stats
+ */
+void metrics_start(void);
+
+/**
+ * @brief Count a handled request and record how long it took
+ *
+ * Every thread records into counters of its own, without locks or atomic read-modify-writes.
+ *
+ * @param type The type of the request
+ * @param outcome The err_t or auth flags of the response
+ * @param ok Whether the request succeeded
+ * @param latency_ns Time from receiving the request to sending the response
+ */
+void metrics_record_request(request_type_t type, uint8_t outcome, bool ok, uint64_t latency_ns);
+
+/**
+ * @brief Count a request from its response: the result of an auth, error or log level response, ERR_OK otherwise
+ *
+ * @param type The type of the request
+ * @param response The response sent for it
+ * @param received_ns metrics_now_ns() when the request was received
+ */
+void metrics_record_response(request_type_t type, const struct __message_t* response, uint64_t received_ns);
+
+/**
+ * @brief Record the time from sending a request to a backend server to receiving its response
+ */
+void metrics_record_backend_rtt(metrics_backend_t backend, uint64_t rtt_ns);
+
+/**
+ * @brief Sum the metrics of every thread. Recording goes on meanwhile, so the sums may be a little behind.
+ */
+void metrics_snapshot(metrics_snapshot_t* snapshot);
+
+/**
+ * @brief Get a percentile of a histogram
+ *
+ * @param percentile Percentile in [0, 100]
+ *
+ * @return uint64_t Upper bound of the bucket holding the percentile, in ns. 0 if the histogram is empty.
+ */
+uint64_t metrics_histogram_percentile(const metrics_histogram_t* histogram, double percentile);
+
+/**
+ * @brief Get the largest value, in ns, that lands in a bucket of a histogram
+ */
+uint64_t metrics_histogram_bucket_upper_bound(size_t index);
+
+/**
+ * @brief Add the counts of a histogram to another
+ */
+void metrics_histogram_merge(metrics_histogram_t* into, const metrics_histogram_t* from);
+
+/**
+ * @brief Fill the values of a stats response every server has: uptime, dropped log lines, and the request counts
+ * and latency percentiles of every request type and backend seen so far
+ *
+ * @return size_t Number of items written, at most items_size
+ */
+size_t metrics_stats_items(stats_item_t* items, size_t items_size);
+
+/**
+ * @brief Log the request counts, error counts and p50 / p99 / p99.9 latencies of every request type and backend
+ *
+ * Quiet when nothing was recorded since the last summary.
+ */
+void metrics_log_summary(void);
+
+#endif // METRICS_H
@@ -1,15 +1,61 @@
+#define _GNU_SOURCE // accept4, recvmmsg, sendmmsg
 #include "networking.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <unistd.h>
 #include "log.h"
+#include "protocol.h"
 #include "utils.h"
 
 LOG_TAG(networking);
 
+#if defined(CLIENT) || defined(SERVER_M)
+/**
+ * @brief Cut the next complete frame off a receive buffer
+ *
+ * @param rx [in] The receive buffer
+ * @param offset [in/out] Start of the unconsumed bytes. Advanced past the frame.
+ * @param frame [out] The frame
+ * @return err_t ERR_OK if a frame was cut, ERR_NETWORK_WOULD_BLOCK if more bytes are needed,
+ *               ERR_INVALID_PARAMETERS if the frame is larger than a segment
+ */
+static err_t tcp_rx_next_frame(const tcp_rx_buffer_t* rx, size_t* offset, tcp_sgmnt_t* frame) {
+    size_t available = rx->len - *offset;
+    size_t frame_len = protocol_get_frame_len(rx->data + *offset, available);
+    if (frame_len > sizeof(frame->data)) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    if (frame_len == 0 || frame_len > available) {
+        return ERR_NETWORK_WOULD_BLOCK;
+    }
+    memcpy(frame->data, rx->data + *offset, frame_len);
+    frame->data_len = frame_len;
+    *offset += frame_len;
+    return ERR_OK;
+}
+
+// Move the bytes of an incomplete frame to the front of the buffer.
+// What is left is always shorter than a segment, so the next read has room.
+static void tcp_rx_compact(tcp_rx_buffer_t* rx, size_t offset) {
+    if (offset > 0) {
+        memmove(rx->data, rx->data + offset, rx->len - offset);
+        rx->len -= offset;
+    }
+}
+#endif // CLIENT || SERVER_M
+
 #if defined(SERVER_M)
+// Put a socket into non-blocking mode
+static int set_non_blocking(int sd) {
+    int flags = fcntl(sd, F_GETFL, 0);
+    return flags < 0 ? flags : fcntl(sd, F_SETFL, flags | O_NONBLOCK);
+}
+
 // Create and Start a TCP Server
 tcp_server_t* tcp_server_start(uint16_t port) {
     tcp_server_t* server = (tcp_server_t*) calloc(1, sizeof(tcp_server_t));
@@ -17,11 +63,14 @@ tcp_server_t* tcp_server_start(uint16_t port) {
     if (server == NULL) {
         LOG_ERR("Failed to allocate memory for tcp_server_t");
     } else {
+        server->epfd = -1;
+        server->reserve_sd = open("/dev/null", O_RDONLY | O_CLOEXEC);
         // Create a socket
         server->sd = socket(AF_INET, SOCK_STREAM, 0);
         if (server->sd < 0) {
             LOG_ERR("Failed to create socket. Error: %s.", strerror(errno));
             free(server);
+            server = NULL;
         } else {
             struct sockaddr_in server_addr = {0};
             SERVER_ADDR_PORT(server_addr, port);
@@ -32,13 +81,16 @@ tcp_server_t* tcp_server_start(uint16_t port) {
             // Bind the socket to the port
             if (bind(server->sd, (struct sockaddr*) &server_addr, sizeof(server_addr)) < 0) {
                 LOG_ERR("Failed to bind socket. Error: %s.", strerror(errno));
+                close(server->sd);
                 free(server);
+                server = NULL;
             } else {
-                if (listen(server->sd, 5) < 0) {
+                if (listen(server->sd, SOMAXCONN) < 0) {
                     LOG_ERR("Failed to listen on socket. Error: %s.", strerror(errno));
                 } else {
-                    server->max_sd = server->sd;
-                    FD_SET(server->sd, &server->server_fd_set);
+                    // The reactor drains the listener until EAGAIN, so it must never block
+                    set_non_blocking(server->sd);
+                    server->port = port;
                     LOG_DBG("TCP Server started on port %d", port);
                 }
             }
@@ -47,35 +99,82 @@ tcp_server_t* tcp_server_start(uint16_t port) {
     return server;
 }
 
-// Close a TCP Child Socket
-static void close_child_socket(tcp_server_t* server, int child_sd) {
-    if (server != NULL) {
-        close(child_sd);
-        FD_CLR(child_sd, &server->server_fd_set);
-        if (child_sd == server->max_sd) {
-            server->max_sd--;
+// Watch a child socket for input, and for output while it has bytes queued
+static void watch_child_socket(tcp_server_t* server, tcp_endpoint_t* endpoint, int op, bool want_write) {
+    if (server->epfd >= 0) {
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLET | (want_write ? EPOLLOUT : 0), .data.ptr = endpoint };
+        if (epoll_ctl(server->epfd, op, endpoint->sd, &ev) < 0) {
+            LOG_ERR("Failed to watch socket %d. Error: %s.", endpoint->sd, strerror(errno));
         }
     }
 }
 
+// Close a TCP Child Socket and release its endpoint
+static void close_child_socket(tcp_server_t* server, tcp_endpoint_t* endpoint) {
+    if (server != NULL && endpoint != NULL) {
+        if (server->on_close) {
+            server->on_close(server, endpoint);
+        }
+        server->endpoints[endpoint->sd] = NULL;
+        server->endpoints_count--;
+        // Closing the descriptor also removes it from any epoll set
+        close(endpoint->sd);
+        pthread_mutex_destroy(&endpoint->tx_lock);
+        free(endpoint->tx_data);
+        message_buffer_release(&endpoint->rx_message);
+        free(endpoint);
+    }
+}
+
 // Close the TCP Server
 void tcp_server_stop(tcp_server_t* server) {
     if (server != NULL) {
-        while(server->max_sd > server->sd) {
-            close_child_socket(server, server->max_sd);
+        for (size_t sd = 0; sd < server->endpoints_capacity; sd++) {
+            close_child_socket(server, server->endpoints[sd]);
         }
+        free(server->endpoints);
         close(server->sd);
+        if (server->reserve_sd >= 0) {
+            close(server->reserve_sd);
+        }
         free(server);
     }
 }
 
+tcp_endpoint_t* tcp_server_get_endpoint(tcp_server_t* server, int sd) {
+    if (server == NULL || sd < 0 || sd >= server->endpoints_capacity) {
+        return NULL;
+    }
+    return server->endpoints[sd];
+}
+
 // Create a new TCP Child Socket
-static void create_child_socket(tcp_server_t* server, int child_sd) {
+static tcp_endpoint_t* create_child_socket(tcp_server_t* server, int child_sd) {
+    tcp_endpoint_t* endpoint = NULL;
     if (server != NULL) {
-        tcp_endpoint_t* endpoint = calloc(1, sizeof(tcp_endpoint_t));
+        if (child_sd >= server->endpoints_capacity) {
+            // Descriptors are allocated lowest-first, so the table stays about as large as the number of connections
+            size_t capacity = max(max(server->endpoints_capacity * 2, (size_t) child_sd + 1), 64);
+            tcp_endpoint_t** endpoints = realloc(server->endpoints, capacity * sizeof(tcp_endpoint_t*));
+            if (endpoints == NULL) {
+                LOG_ERR("Failed to grow the endpoint table");
+                close(child_sd);
+                return NULL;
+            }
+            memset(endpoints + server->endpoints_capacity, 0, (capacity - server->endpoints_capacity) * sizeof(tcp_endpoint_t*));
+            server->endpoints = endpoints;
+            server->endpoints_capacity = capacity;
+        }
+        endpoint = calloc(1, sizeof(tcp_endpoint_t));
+        if (endpoint == NULL) {
+            LOG_ERR("Failed to allocate memory for tcp_endpoint_t");
+            close(child_sd);
+            return NULL;
+        }
         endpoint->sd = child_sd;
-        endpoint->next = server->endpoints;
-        server->endpoints = endpoint;
+        pthread_mutex_init(&endpoint->tx_lock, NULL);
+        server->endpoints[child_sd] = endpoint;
+        server->endpoints_count++;
         endpoint->addr = (struct sockaddr_in) {0};
         socklen_t addr_len = sizeof(endpoint->addr);
         // Get the address of the client
@@ -84,107 +183,260 @@ static void create_child_socket(tcp_server_t* server, int child_sd) {
         } else {
             LOG_DBG("Peer name: " IP_ADDR_FORMAT, IP_ADDR(endpoint));
         }
-
-        FD_SET(child_sd, &server->server_fd_set);
-        if (child_sd > server->max_sd) {
-            server->max_sd = child_sd;
+        watch_child_socket(server, endpoint, EPOLL_CTL_ADD, false);
+        if (server->on_open) {
+            server->on_open(server, endpoint);
         }
     }
+    return endpoint;
+}
+
+// Out of descriptors. Free the reserve one to take the connection off the backlog, and close it.
+static err_t tcp_server_shed(tcp_server_t* server) {
+    if (server->reserve_sd < 0) {
+        server->reserve_sd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        return ERR_NETWORK_FAILURE;
+    }
+    close(server->reserve_sd);
+    int new_sd = accept4(server->sd, NULL, NULL, SOCK_CLOEXEC);
+    // accept reports EMFILE whether or not a connection is pending
+    bool empty = new_sd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    if (new_sd >= 0) {
+        close(new_sd);
+        LOG_WARN("Out of descriptors with %zu connections open. Closed a new connection.", server->endpoints_count);
+    }
+    server->reserve_sd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return empty ? ERR_NETWORK_WOULD_BLOCK : ERR_OK;
 }
 
 // Accept a new connection. Open a Child Socket
-void tcp_server_accept(tcp_server_t* server) {
-    if (server != NULL) {
-        int new_sd = -1;
-        if ((new_sd = accept(server->sd, NULL, NULL)) < 0) {
+err_t tcp_server_accept(tcp_server_t* server) {
+    if (server == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    int new_sd = accept4(server->sd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (new_sd >= 0) {
+        // Create a new child socket. It is closed again if it cannot be tracked.
+        LOG_DBG("Accepted connection on socket %d", new_sd);
+        create_child_socket(server, new_sd);
+        return ERR_OK;
+    }
+    switch (errno) {
+        case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif
+            return ERR_NETWORK_WOULD_BLOCK;
+        case EMFILE:
+        case ENFILE:
+            return tcp_server_shed(server);
+        case EINTR:
+        case ECONNABORTED:
+        case EPROTO:
+        case EPERM:
+        case ENETDOWN:
+        case ENETUNREACH:
+        case EHOSTDOWN:
+        case EHOSTUNREACH:
+        case ENONET:
+        case ENOPROTOOPT:
+        case EOPNOTSUPP:
+            // The connection went away before it was accepted, or a signal interrupted the call. The next may be fine.
+            LOG_DBG("Failed to accept connection. Error: %s.", strerror(errno));
+            return ERR_OK;
+        default:
             LOG_ERR("Failed to accept connection. Error: %s.", strerror(errno));
-        } else {
-            // Create a new child socket
-            LOG_DBG("Accepted connection on socket %d", new_sd);
-            create_child_socket(server, new_sd);
+            return ERR_NETWORK_FAILURE;
+    }
+}
+
+// Pass a frame on, or add it to the message being reassembled and pass that on once it is complete
+static err_t tcp_server_dispatch_frame(tcp_server_t* server, tcp_endpoint_t* endpoint, tcp_sgmnt_t* frame) {
+    if (endpoint->rx_message.data_len == 0 && !(frame->data[REQUEST_RESPONSE_TYPE_OFFSET] & REQUEST_RESPONSE_TYPE_MORE_FRAGMENTS)) {
+        // The whole message is in this frame
+        if (server->on_rx) {
+            server->on_rx(server, endpoint, frame);
+        }
+        return ERR_OK;
+    }
+    err_t err = protocol_fragment_decode(&endpoint->rx_message, frame);
+    if (err == ERR_OK) {
+        if (server->on_rx_message) {
+            server->on_rx_message(server, endpoint, &endpoint->rx_message);
         }
+        message_buffer_release(&endpoint->rx_message);
     }
+    return err == ERR_NETWORK_WOULD_BLOCK ? ERR_OK : err;
 }
 
-// Get TCP Endpoint from Socket Descriptor
-static tcp_endpoint_t* get_endpoint(tcp_server_t* server, int sd) {
-    tcp_endpoint_t* endpoint = NULL;
-    if (server != NULL) {
-        endpoint = server->endpoints;
-        while(endpoint != NULL) {
-            if (endpoint->sd == sd) {
-                break;
+// Receive data from a Child Socket until it would block
+err_t tcp_server_receive(tcp_server_t* server, tcp_endpoint_t* endpoint) {
+    if (server == NULL || endpoint == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    tcp_rx_buffer_t* rx = &endpoint->rx;
+    while (1) {
+        ssize_t bytes_read = read(endpoint->sd, rx->data + rx->len, sizeof(rx->data) - rx->len);
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return ERR_OK;
+            }
+            LOG_ERR("Failed to read from socket. Error: %s.", strerror(errno));
+            close_child_socket(server, endpoint);
+            return ERR_NETWORK_FAILURE;
+        } else if (bytes_read == 0) {
+            LOG_WARN("Client disconnected.");
+            close_child_socket(server, endpoint);
+            return ERR_NETWORK_DISCONNECTED;
+        } else {
+            LOG_DBG("Received %ld bytes from "IP_ADDR_FORMAT, bytes_read, IP_ADDR(endpoint));
+            rx->len += bytes_read;
+            // A read may end mid-frame or carry several pipelined frames
+            size_t offset = 0;
+            tcp_sgmnt_t sgmnt;
+            err_t err;
+            while ((err = tcp_rx_next_frame(rx, &offset, &sgmnt)) == ERR_OK) {
+                if ((err = tcp_server_dispatch_frame(server, endpoint, &sgmnt)) != ERR_OK) {
+                    break;
+                }
+            }
+            if (err != ERR_NETWORK_WOULD_BLOCK) {
+                // The stream cannot be resynchronised past a frame we cannot hold or place
+                LOG_ERR("Malformed stream from "IP_ADDR_FORMAT". Closing the connection.", IP_ADDR(endpoint));
+                close_child_socket(server, endpoint);
+                return ERR_REQ_INVALID;
             }
-            endpoint = endpoint->next;
+            tcp_rx_compact(rx, offset);
         }
     }
-    return endpoint;
 }
 
-// Receive data from a Child Socket
-void tcp_server_receive(tcp_server_t* server, int child_sd) {
-    uint8_t buffer[1024] = {0};
-    size_t bytes_read = read(child_sd, buffer, sizeof(buffer));
-    if (bytes_read < 0) {
-        LOG_ERR("Failed to read from socket. Error: %s.", strerror(errno));
-    } else if (bytes_read == 0) {
-        LOG_WARN("Client disconnected.");
-        close_child_socket(server, child_sd);
-    } else {
-        tcp_endpoint_t* endpoint = get_endpoint(server, child_sd);
-        LOG_DBG("Received %ld bytes from "IP_ADDR_FORMAT" : %s", bytes_read, IP_ADDR(endpoint), buffer);
-        // LOG_BUFFER(buffer, bytes_read);
-        tcp_sgmnt_t sgmnt = {0};
-        memcpy(sgmnt.data, buffer, bytes_read);
-        sgmnt.data_len = bytes_read;
-        server->on_rx(server, endpoint, &sgmnt);
+// Write as much as the socket takes. Returns the number of bytes written, -1 on a hard error.
+static ssize_t send_non_blocking(int sd, const uint8_t* data, size_t len) {
+    size_t offset = 0;
+    while (offset < len) {
+        ssize_t bytes_sent = send(sd, data + offset, len - offset, MSG_NOSIGNAL);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            LOG_ERR("Failed to send TCP Segment. Error: %s.", strerror(errno));
+            return -1;
+        }
+        offset += bytes_sent;
     }
+    return offset;
 }
 
-// Server Loop. Accept new connections and receive data
-void tcp_server_tick(tcp_server_t* server) {
-    if (server != NULL) {
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-        memcpy(&read_fds, &server->server_fd_set, sizeof(server->server_fd_set));
-
-        struct timeval timeout = { .tv_sec = 1, .tv_usec = 100*1000 };
-
-        int err = select(server->max_sd + 1, &read_fds, NULL, NULL, &timeout);
-        if (err > 0) {
-            for (int sd = server->sd; sd <= server->max_sd; sd++) {
-                if (FD_ISSET(sd, &read_fds)) {
-                    if (sd == server->sd) {
-                        // New connection
-                        tcp_server_accept(server);
-                    } else {
-                        // Receive data
-                        tcp_server_receive(server, sd);
-                    }
+// Send data to a Child Socket
+// Send what the socket takes and queue the rest behind the bytes already waiting. Must be called with tx_lock held.
+// Returns false if the socket failed.
+static bool tcp_server_write_locked(tcp_server_t* server, tcp_endpoint_t* dst, const uint8_t* data, size_t len) {
+    ssize_t sent = 0;
+    // Bytes already queued go first to keep the stream in order
+    if (dst->tx_len == 0) {
+        sent = send_non_blocking(dst->sd, data, len);
+    }
+    if (sent >= 0 && sent < len) {
+        size_t remaining = len - sent;
+        if (dst->tx_len + remaining > TCP_TX_BUFFER_MAX) {
+            LOG_ERR("Dropping %ld bytes for "IP_ADDR_FORMAT". The peer is not reading.", remaining, IP_ADDR(dst));
+        } else {
+            if (dst->tx_len + remaining > dst->tx_capacity) {
+                size_t capacity = max(dst->tx_capacity * 2, dst->tx_len + remaining);
+                uint8_t* tx_data = realloc(dst->tx_data, capacity);
+                if (tx_data == NULL) {
+                    LOG_ERR("Failed to grow the send queue");
+                    return true;
                 }
+                dst->tx_data = tx_data;
+                dst->tx_capacity = capacity;
             }
+            bool was_empty = dst->tx_len == 0;
+            memcpy(dst->tx_data + dst->tx_len, data + sent, remaining);
+            dst->tx_len += remaining;
+            if (was_empty) {
+                // Ask the reactor to tell us when the socket is writable again
+                watch_child_socket(server, dst, EPOLL_CTL_MOD, true);
+            }
+            LOG_DBG("Queued %ld bytes", remaining);
         }
     }
+    return sent >= 0;
 }
 
-// Send data to a Child Socket
 void tcp_server_send(tcp_server_t* server, tcp_endpoint_t* dst, tcp_sgmnt_t* segment) {
     if (server != NULL && dst != NULL && segment != NULL) {
         LOG_DBG("Sending TCP Segment to "IP_ADDR_FORMAT" %.*s", IP_ADDR(dst), (int) segment->data_len, segment->data);
-        // Send data to the client
-        size_t bytes_sent = sendto(dst->sd, segment->data, segment->data_len, 0, (struct sockaddr*) &dst->addr, sizeof(struct sockaddr));
-        if (bytes_sent < 0) {
-            LOG_ERR("Failed to send TCP Segment. Error: %s.", strerror(errno));
+        pthread_mutex_lock(&dst->tx_lock);
+        bool sent = tcp_server_write_locked(server, dst, segment->data, segment->data_len);
+        pthread_mutex_unlock(&dst->tx_lock);
+        if (sent && server->on_tx) {
+            server->on_tx(server, dst, segment);
+        }
+    }
+}
+
+void tcp_server_send_message(tcp_server_t* server, tcp_endpoint_t* dst, const message_buffer_t* message) {
+    if (server == NULL || dst == NULL || message == NULL || message->data_len < REQUEST_RESPONSE_HEADER_LEN) {
+        return;
+    }
+    size_t payload_len = message->data_len - REQUEST_RESPONSE_HEADER_LEN;
+    size_t frames = max((payload_len + REQUEST_RESPONSE_FRAME_PAYLOAD_MAX - 1) / REQUEST_RESPONSE_FRAME_PAYLOAD_MAX, 1);
+    LOG_DBG("Sending a %ld byte message in %ld frames to "IP_ADDR_FORMAT, message->data_len, frames, IP_ADDR(dst));
+
+    pthread_mutex_lock(&dst->tx_lock);
+    if (dst->tx_len + payload_len + frames * REQUEST_RESPONSE_HEADER_LEN > TCP_TX_BUFFER_MAX) {
+        // Part of a message would desynchronise the stream. Drop all of it.
+        LOG_ERR("Dropping a %ld byte message for "IP_ADDR_FORMAT". The peer is not reading.", message->data_len, IP_ADDR(dst));
+    } else {
+        // The fragments go out under one lock so that no other response lands between them
+        size_t offset = 0;
+        bool more = true;
+        while (more) {
+            tcp_sgmnt_t frame;
+            more = protocol_fragment_encode(message, &offset, &frame);
+            if (!tcp_server_write_locked(server, dst, frame.data, frame.data_len)) {
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&dst->tx_lock);
+}
+
+err_t tcp_server_flush(tcp_server_t* server, tcp_endpoint_t* endpoint) {
+    if (server == NULL || endpoint == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    err_t err = ERR_OK;
+    pthread_mutex_lock(&endpoint->tx_lock);
+    if (endpoint->tx_len > 0) {
+        ssize_t sent = send_non_blocking(endpoint->sd, endpoint->tx_data, endpoint->tx_len);
+        if (sent < 0) {
+            // The connection is broken. The read side will report the disconnect.
+            endpoint->tx_len = 0;
         } else {
-            LOG_DBG("Sent %ld bytes", bytes_sent);
+            memmove(endpoint->tx_data, endpoint->tx_data + sent, endpoint->tx_len - sent);
+            endpoint->tx_len -= sent;
+        }
+        if (endpoint->tx_len == 0) {
+            watch_child_socket(server, endpoint, EPOLL_CTL_MOD, false);
+        } else {
+            err = ERR_NETWORK_WOULD_BLOCK;
         }
     }
+    pthread_mutex_unlock(&endpoint->tx_lock);
+    return err;
 }
 #endif //SERVER_M
 
 #if defined(CLIENT)
 tcp_client_t* tcp_client_connect(tcp_endpoint_t* dest, tcp_receive_handler_t on_receive, tcp_disconnect_handler_t on_disconnect) {
-    tcp_client_t* client = malloc(sizeof(tcp_client_t));
+    tcp_client_t* client = calloc(1, sizeof(tcp_client_t));
     if (!client) {
         LOG_ERR("tcp_client_connect: Error allocating memory for client");
         return NULL;
@@ -229,6 +481,7 @@ void tcp_client_disconnect(tcp_client_t* client) {
     if (client) {
         // Close the socket
         close(client->sd);
+        message_buffer_release(&client->rx_message);
         // Free the client
         free(client);
     }
@@ -245,17 +498,65 @@ err_t tcp_client_send(tcp_client_t* client, tcp_sgmnt_t* sgmnt) {
     return ERR_INVALID_PARAMETERS;
 }
 
+err_t tcp_client_send_message(tcp_client_t* client, const message_buffer_t* message) {
+    if (client == NULL || message == NULL || message->data_len < REQUEST_RESPONSE_HEADER_LEN) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    size_t offset = 0;
+    bool more = true;
+    while (more) {
+        tcp_sgmnt_t frame;
+        more = protocol_fragment_encode(message, &offset, &frame);
+        if (tcp_client_send(client, &frame) != ERR_OK) {
+            return ERR_NETWORK_FAILURE;
+        }
+    }
+    return ERR_OK;
+}
+
+// Pass a frame on, or add it to the message being reassembled and pass that on once it is complete
+static err_t tcp_client_dispatch_frame(tcp_client_t* client, tcp_sgmnt_t* frame) {
+    if (client->rx_message.data_len == 0 && !(frame->data[REQUEST_RESPONSE_TYPE_OFFSET] & REQUEST_RESPONSE_TYPE_MORE_FRAGMENTS)) {
+        // The whole message is in this frame
+        if (client->on_receive) {
+            client->on_receive(client, frame);
+        }
+        return ERR_OK;
+    }
+    err_t err = protocol_fragment_decode(&client->rx_message, frame);
+    if (err == ERR_OK) {
+        if (client->on_receive_message) {
+            client->on_receive_message(client, &client->rx_message);
+        }
+        message_buffer_release(&client->rx_message);
+    }
+    return err == ERR_NETWORK_WOULD_BLOCK ? ERR_OK : err;
+}
+
 void tcp_client_receive(tcp_client_t* client) {
     if (client) {
-        tcp_sgmnt_t sgmnt = {0};
-        // Read data from socket into buffer
-        size_t bytes_read = recv(client->sd, sgmnt.data, sizeof(sgmnt.data), 0);
+        tcp_rx_buffer_t* rx = &client->rx;
+        // Read data from socket after whatever is left of the previous frame
+        ssize_t bytes_read = recv(client->sd, rx->data + rx->len, sizeof(rx->data) - rx->len, 0);
         if (bytes_read > 0) {
-            sgmnt.data_len = bytes_read;
+            rx->len += bytes_read;
             LOG_DBG("Received %ld bytes from server", bytes_read);
-            if (client->on_receive) {
-                client->on_receive(client, &sgmnt);
+            size_t offset = 0;
+            tcp_sgmnt_t sgmnt;
+            err_t err;
+            while ((err = tcp_rx_next_frame(rx, &offset, &sgmnt)) == ERR_OK) {
+                if ((err = tcp_client_dispatch_frame(client, &sgmnt)) != ERR_OK) {
+                    break;
+                }
+            }
+            if (err != ERR_NETWORK_WOULD_BLOCK) {
+                LOG_ERR("Malformed stream from server.");
+                if (client->on_disconnect) {
+                    client->on_disconnect(client);
+                }
+                return;
             }
+            tcp_rx_compact(rx, offset);
         } else {
             if (client->on_disconnect) {
                 client->on_disconnect(client);
@@ -266,25 +567,39 @@ void tcp_client_receive(tcp_client_t* client) {
 #endif // CLIENT
 
 #if defined(SERVER_M) || defined(SERVER_C) || defined(SERVER_CS) || defined(SERVER_EE)
+// Set while a thread dispatches a received batch. udp_send queues responses for that context instead of sending them.
+static __thread udp_ctx_t* batching_ctx = NULL;
+
 udp_ctx_t* udp_start(uint16_t port) {
     udp_ctx_t* udp = (udp_ctx_t*) calloc(1, sizeof(udp_ctx_t));
 
     if (udp == NULL) {
         LOG_ERR("Failed to allocate memory for udp_server_t");
+    } else if ((udp->batch = (udp_batch_t*) calloc(1, sizeof(udp_batch_t))) == NULL) {
+        LOG_ERR("Failed to allocate memory for udp_batch_t");
+        free(udp);
+        udp = NULL;
     } else {
         udp->port = port;
         // Create a socket
         udp->sd = socket(AF_INET, SOCK_DGRAM, 0);
         if (udp->sd < 0) {
             LOG_WARN("Failed to create socket on port %d. Error: %s.", port, strerror(errno));
+            free(udp->batch);
             free(udp);
             udp = NULL;
         } else {
             struct sockaddr_in server_addr;
             SERVER_ADDR_PORT(server_addr, port);
+            // Absorb request bursts (e.g. multi lookup fan-out from many clients) instead of dropping datagrams.
+            // The kernel caps this at net.core.rmem_max / wmem_max.
+            setsockopt(udp->sd, SOL_SOCKET, SO_RCVBUF, &(int){UDP_SOCKET_BUFFER_SIZE}, sizeof(int));
+            setsockopt(udp->sd, SOL_SOCKET, SO_SNDBUF, &(int){UDP_SOCKET_BUFFER_SIZE}, sizeof(int));
             // Bind the socket to a static port
             if (bind(udp->sd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
                 LOG_WARN("Failed to bind socket to port %d. Error: %s.", port, strerror(errno));
+                close(udp->sd);
+                free(udp->batch);
                 free(udp);
                 udp = NULL;
             } else {
@@ -301,32 +616,142 @@ void udp_stop(udp_ctx_t* udp) {
         // Close the socket
         close(udp->sd);
         // Free the server
+        free(udp->batch);
         free(udp);
     }
 }
 
-void udp_receive(udp_ctx_t* udp) {
-    if (udp != NULL) {
+err_t udp_receive(udp_ctx_t* udp) {
+    if (udp == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
 
-        udp_endpoint_t src = {0};
-        udp_dgram_t dgram = {0};
-        socklen_t addr_len = sizeof(struct sockaddr);
+    udp_endpoint_t src = {0};
+    udp_dgram_t dgram = {0};
+    socklen_t addr_len = sizeof(struct sockaddr);
 
-        LOG_DBG("Waiting for a UDP Datagram");
-        dgram.data_len = recvfrom(udp->sd, dgram.data, sizeof(dgram.data), 0, (struct sockaddr*) &src.addr, &addr_len);
-        if (dgram.data_len < 0) {
-            LOG_ERR("Failed to receive UDP Datagram. Error: %s.", strerror(errno));
-        } else {
-            LOG_DBG("Received UDP Datagram (%ld bytes) from " IP_ADDR_FORMAT, dgram.data_len, IP_ADDR((&src)));
-            if (udp->on_rx) {
-                udp->on_rx(udp, &src, &dgram);
+    LOG_DBG("Waiting for a UDP Datagram");
+    ssize_t bytes_read = recvfrom(udp->sd, dgram.data, sizeof(dgram.data), 0, (struct sockaddr*) &src.addr, &addr_len);
+    if (bytes_read < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return ERR_NETWORK_WOULD_BLOCK;
+        }
+        LOG_ERR("Failed to receive UDP Datagram. Error: %s.", strerror(errno));
+        return ERR_NETWORK_FAILURE;
+    }
+    dgram.data_len = bytes_read;
+    LOG_DBG("Received UDP Datagram (%ld bytes) from " IP_ADDR_FORMAT, dgram.data_len, IP_ADDR((&src)));
+    if (udp->on_rx) {
+        udp->on_rx(udp, &src, &dgram);
+    }
+    return ERR_OK;
+}
+
+// Send every queued response with a single sendmmsg
+static void udp_batch_flush(udp_ctx_t* udp) {
+    udp_batch_t* batch = udp->batch;
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+    struct iovec iovecs[UDP_BATCH_SIZE];
+    size_t sent = 0;
+
+    memset(msgs, 0, sizeof(struct mmsghdr) * batch->tx_count);
+    for (size_t i = 0; i < batch->tx_count; i++) {
+        iovecs[i].iov_base = batch->tx_dgrams[i].data;
+        iovecs[i].iov_len = batch->tx_dgrams[i].data_len;
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &batch->tx_dst[i].addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    while (sent < batch->tx_count) {
+        int count = sendmmsg(udp->sd, msgs + sent, batch->tx_count - sent, 0);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_ERR("Failed to send UDP Datagram batch. Error: %s.", strerror(errno));
+            // Skip the datagram that failed. The rest of the batch may still go through.
+            sent++;
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            if (udp->on_tx) {
+                udp->on_tx(udp, &batch->tx_dst[sent + i], &batch->tx_dgrams[sent + i]);
             }
         }
+        sent += count;
     }
+    LOG_DBG("Flushed %ld UDP Datagrams", batch->tx_count);
+    batch->tx_count = 0;
+}
+
+err_t udp_receive_batch(udp_ctx_t* udp) {
+    if (udp == NULL || udp->batch == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
+
+    udp_batch_t* batch = udp->batch;
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+    struct iovec iovecs[UDP_BATCH_SIZE];
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < UDP_BATCH_SIZE; i++) {
+        iovecs[i].iov_base = batch->rx_dgrams[i].data;
+        iovecs[i].iov_len = sizeof(batch->rx_dgrams[i].data);
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &batch->rx_src[i].addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(batch->rx_src[i].addr);
+    }
+
+    LOG_DBG("Waiting for a batch of UDP Datagrams");
+    // Block (on a blocking socket) for the first datagram only, then take whatever else is already queued
+    int count;
+    do {
+        count = recvmmsg(udp->sd, msgs, UDP_BATCH_SIZE, MSG_WAITFORONE, NULL);
+    } while (count < 0 && errno == EINTR);
+    if (count < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return ERR_NETWORK_WOULD_BLOCK;
+        }
+        if (errno == ECONNREFUSED || errno == EHOSTUNREACH || errno == ENETUNREACH) {
+            // An ICMP error for a datagram sent earlier, e.g. to a backend server that is down. It is reported once.
+            LOG_WARN("A UDP Datagram sent earlier was not delivered. Error: %s.", strerror(errno));
+        } else {
+            LOG_ERR("Failed to receive UDP Datagram batch. Error: %s.", strerror(errno));
+        }
+        return ERR_NETWORK_FAILURE;
+    }
+
+    LOG_DBG("Received a batch of %d UDP Datagrams", count);
+    batching_ctx = udp;
+    for (int i = 0; i < count; i++) {
+        batch->rx_dgrams[i].data_len = msgs[i].msg_len;
+        if (udp->on_rx) {
+            udp->on_rx(udp, &batch->rx_src[i], &batch->rx_dgrams[i]);
+        }
+    }
+    batching_ctx = NULL;
+
+    if (batch->tx_count > 0) {
+        udp_batch_flush(udp);
+    }
+    return ERR_OK;
 }
 
 void udp_send(udp_ctx_t* udp, udp_endpoint_t* dst, udp_dgram_t* dgram) {
-    if (udp != NULL && dst != NULL && dgram != NULL) {
+    if (udp != NULL && dst != NULL && dgram != NULL && batching_ctx == udp) {
+        // Called from within a batch. Queue the datagram, the batch is flushed once every datagram is handled.
+        udp_batch_t* batch = udp->batch;
+        if (batch->tx_count == UDP_BATCH_SIZE) {
+            udp_batch_flush(udp);
+        }
+        batch->tx_dst[batch->tx_count] = *dst;
+        memcpy(batch->tx_dgrams[batch->tx_count].data, dgram->data, dgram->data_len);
+        batch->tx_dgrams[batch->tx_count].data_len = dgram->data_len;
+        batch->tx_count++;
+    } else if (udp != NULL && dst != NULL && dgram != NULL) {
         LOG_DBG("Sending UDP Datagram (%ld bytes) to "IP_ADDR_FORMAT, dgram->data_len, IP_ADDR(dst));
         if (sendto(udp->sd, dgram->data, dgram->data_len, 0, (struct sockaddr*)&dst->addr, sizeof(struct sockaddr)) < 0) {
             LOG_ERR("Failed to send UDP Datagram. Error: %s.", strerror(errno));
@@ -338,3 +763,107 @@ void udp_send(udp_ctx_t* udp, udp_endpoint_t* dst, udp_dgram_t* dgram) {
     }
 }
 #endif // SERVER_M || SERVER_C || SERVER_CS || SERVER_EE
+
+#if defined(SERVER_M)
+reactor_t* reactor_create(void) {
+    reactor_t* reactor = (reactor_t*) calloc(1, sizeof(reactor_t));
+    if (reactor == NULL) {
+        LOG_ERR("Failed to allocate memory for reactor_t");
+    } else {
+        reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (reactor->epfd < 0) {
+            LOG_ERR("Failed to create epoll instance. Error: %s.", strerror(errno));
+            free(reactor);
+            reactor = NULL;
+        }
+    }
+    return reactor;
+}
+
+void reactor_destroy(reactor_t* reactor) {
+    if (reactor != NULL) {
+        close(reactor->epfd);
+        free(reactor);
+    }
+}
+
+// Add a descriptor to the epoll set in edge-triggered mode
+static err_t reactor_watch(reactor_t* reactor, int sd, void* source) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = source };
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, sd, &ev) < 0) {
+        LOG_ERR("Failed to add socket %d to epoll. Error: %s.", sd, strerror(errno));
+        return ERR_NETWORK_FAILURE;
+    }
+    return ERR_OK;
+}
+
+err_t reactor_attach_tcp_server(reactor_t* reactor, tcp_server_t* tcp) {
+    if (reactor == NULL || tcp == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    reactor->tcp = tcp;
+    // Child sockets are added to the epoll set as they are accepted
+    tcp->epfd = reactor->epfd;
+    return reactor_watch(reactor, tcp->sd, tcp);
+}
+
+err_t reactor_attach_udp(reactor_t* reactor, udp_ctx_t* udp) {
+    if (reactor == NULL || udp == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    set_non_blocking(udp->sd);
+    reactor->udp = udp;
+    return reactor_watch(reactor, udp->sd, udp);
+}
+
+// Edge-triggered: accept every pending connection. No new edge comes for the ones left behind by an error, so they are
+// picked up again on the next tick.
+static void reactor_accept(reactor_t* reactor) {
+    err_t err;
+    while ((err = tcp_server_accept(reactor->tcp)) == ERR_OK);
+    reactor->accept_backlog = err != ERR_NETWORK_WOULD_BLOCK;
+}
+
+// Edge-triggered: drain every queued datagram. A failed receive (e.g. ECONNREFUSED from an ICMP reply to an earlier
+// send) clears the socket error, so the drain goes on past it. It is picked up again on the next tick if it keeps failing.
+static void reactor_receive(reactor_t* reactor) {
+    err_t err;
+    int failures = 0;
+    while ((err = udp_receive_batch(reactor->udp)) != ERR_NETWORK_WOULD_BLOCK && (err == ERR_OK || ++failures < REACTOR_MAX_RECEIVE_FAILURES));
+    reactor->udp_backlog = err != ERR_NETWORK_WOULD_BLOCK;
+}
+
+void reactor_tick(reactor_t* reactor, int timeout_ms) {
+    if (reactor != NULL) {
+        if (reactor->accept_backlog) {
+            reactor_accept(reactor);
+        }
+        if (reactor->udp_backlog) {
+            reactor_receive(reactor);
+        }
+        struct epoll_event events[REACTOR_MAX_EVENTS];
+        int count = epoll_wait(reactor->epfd, events, REACTOR_MAX_EVENTS, timeout_ms);
+        if (count < 0 && errno != EINTR) {
+            LOG_ERR("epoll_wait failed. Error: %s.", strerror(errno));
+        }
+        for (int i = 0; i < count; i++) {
+            void* source = events[i].data.ptr;
+            if (source == reactor->tcp) {
+                reactor_accept(reactor);
+            } else if (source == reactor->udp) {
+                reactor_receive(reactor);
+            } else {
+                tcp_endpoint_t* endpoint = (tcp_endpoint_t*) source;
+                if (events[i].events & EPOLLOUT) {
+                    // Room in the socket buffer for queued responses
+                    tcp_server_flush(reactor->tcp, endpoint);
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    // Data on a TCP Child socket
+                    tcp_server_receive(reactor->tcp, endpoint);
+                }
+            }
+        }
+    }
+}
+#endif // SERVER_M
@@ -3,9 +3,12 @@
 
 #include "constants.h"
 #include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include "error.h"
+#include "message_buffer.h"
 
 struct ip_dest_t {
     struct sockaddr_in addr;
@@ -17,7 +20,7 @@ struct ip_dest_t {
 #define IP_ADDR(ip) inet_ntoa(ip->addr.sin_addr), ntohs(ip->addr.sin_port)
 
 struct __message_t {
-    uint8_t data[1024];
+    uint8_t data[MESSAGE_FRAME_SIZE];
     size_t data_len;
 };
 
@@ -25,14 +28,24 @@ struct __message_t {
 
 #if defined(CLIENT) || defined(SERVER_M)
 typedef struct __message_t tcp_sgmnt_t;
-typedef struct ip_dest_t tcp_endpoint_t;
+
+// Bytes read from a stream socket that do not form a complete frame yet
+typedef struct __tcp_rx_buffer_t {
+    uint8_t data[TCP_RX_BUFFER_SIZE];
+    size_t len;
+} tcp_rx_buffer_t;
 #endif // CLIENT || SERVER_M
 
+#if defined(CLIENT)
+typedef struct ip_dest_t tcp_endpoint_t;
+#endif // CLIENT
+
 #if defined(CLIENT)
 
 typedef struct __tcp_client_t tcp_client_t;
 
 typedef void (*tcp_receive_handler_t)(struct __tcp_client_t*, tcp_sgmnt_t*);
+typedef void (*tcp_message_receive_handler_t)(struct __tcp_client_t*, const message_buffer_t*);
 typedef void (*tcp_disconnect_handler_t)(struct __tcp_client_t*);
 
 struct __tcp_client_t {
@@ -42,38 +55,117 @@ struct __tcp_client_t {
     tcp_receive_handler_t on_receive;
     tcp_disconnect_handler_t on_disconnect;
     void* user_data;
+    tcp_message_receive_handler_t on_receive_message;   // Called for messages reassembled from several frames
+    tcp_rx_buffer_t rx;             // Partial frames carried over between reads
+    message_buffer_t rx_message;    // Fragments of the message being reassembled
 };
 
 tcp_client_t* tcp_client_connect(tcp_endpoint_t* dest, tcp_receive_handler_t on_receive, tcp_disconnect_handler_t on_disconnect);
 void tcp_client_disconnect(tcp_client_t* client);
 err_t tcp_client_send(tcp_client_t* client, tcp_sgmnt_t* sgmnt);
+
+/**
+ * @brief Send a message of any size, split into as many frames as it needs
+ */
+err_t tcp_client_send_message(tcp_client_t* client, const message_buffer_t* message);
+
+/**
+ * @brief Block for the next read from the server and call on_receive for every complete frame it finishes
+ *
+ * Messages sent as several frames are reassembled and passed to on_receive_message instead.
+ */
 void tcp_client_receive(tcp_client_t* client);
 #endif // CLIENT
 
 #if defined(SERVER_M)
 typedef struct __tcp_server_t tcp_server_t;
+typedef struct __tcp_endpoint_t tcp_endpoint_t;
 
 typedef void (*tcp_message_tx_cb_t) (tcp_server_t* tcp, tcp_endpoint_t* dest, tcp_sgmnt_t* res_sgmnt);
 typedef void (*tcp_message_rx_cb_t) (tcp_server_t* tcp, tcp_endpoint_t* dest, tcp_sgmnt_t* res_sgmnt);
+typedef void (*tcp_large_message_rx_cb_t) (tcp_server_t* tcp, tcp_endpoint_t* src, const message_buffer_t* message);
+typedef void (*tcp_endpoint_open_cb_t) (tcp_server_t* tcp, tcp_endpoint_t* endpoint);
+typedef void (*tcp_endpoint_close_cb_t) (tcp_server_t* tcp, tcp_endpoint_t* endpoint);
+
+// An accepted TCP child socket
+struct __tcp_endpoint_t {
+    struct sockaddr_in addr;
+    int sd;
+    void* session;                  // Per-connection application state. Managed through on_open / on_close.
+    pthread_mutex_t tx_lock;        // Responses may be sent from worker threads
+    uint8_t* tx_data;               // Bytes the socket could not take yet. Flushed by the reactor.
+    size_t tx_len;
+    size_t tx_capacity;
+    tcp_rx_buffer_t rx;             // Partial frames carried over between reads
+    message_buffer_t rx_message;    // Fragments of the message being reassembled
+};
 
 struct __tcp_server_t {
     int sd;
     uint16_t port;
-    int max_sd;
-    fd_set server_fd_set;
-    tcp_endpoint_t *endpoints;    
+    int reserve_sd;                     // Given up to accept (and close) a connection when out of descriptors
+    int epfd;                           // Reactor watching the child sockets, -1 if none
+    tcp_endpoint_t** endpoints;         // Child endpoints indexed by socket descriptor
+    size_t endpoints_capacity;
+    size_t endpoints_count;
     tcp_message_rx_cb_t on_rx;
-    tcp_message_tx_cb_t on_tx;
-    char username[CREDENTIALS_MAX_USERNAME_LEN + 1];
+    tcp_large_message_rx_cb_t on_rx_message;    // Called for messages reassembled from several frames
+    tcp_message_tx_cb_t on_tx;                  // Called for every segment sent with tcp_server_send
+    tcp_endpoint_open_cb_t on_open;     // Called once a child endpoint is accepted
+    tcp_endpoint_close_cb_t on_close;   // Called before a child endpoint is released
 };
 
 tcp_server_t* tcp_server_start(uint16_t port);
 void tcp_server_stop(tcp_server_t* server);
-void tcp_server_tick(tcp_server_t* server);
+
+/**
+ * @brief Send a segment to a child endpoint without blocking.
+ *
+ * Whatever the socket cannot take right away is queued on the endpoint and flushed by the reactor once it is writable.
+ */
 void tcp_server_send(tcp_server_t* server, tcp_endpoint_t* dest, tcp_sgmnt_t* datagram);
 
-void tcp_server_receive(tcp_server_t* server, int child_sd);
-void tcp_server_accept(tcp_server_t* server);
+/**
+ * @brief Send a message of any size to a child endpoint without blocking.
+ *
+ * The message is split into as many frames as it needs. They are queued back to back, or dropped together if the
+ * endpoint's send queue is full. Safe to call from any thread.
+ */
+void tcp_server_send_message(tcp_server_t* server, tcp_endpoint_t* dest, const message_buffer_t* message);
+
+/**
+ * @brief Flush the queued bytes of a child endpoint
+ *
+ * @return err_t ERR_OK if the queue is empty, ERR_NETWORK_WOULD_BLOCK if bytes remain
+ */
+err_t tcp_server_flush(tcp_server_t* server, tcp_endpoint_t* endpoint);
+
+/**
+ * @brief Get the child endpoint of a socket descriptor in O(1)
+ *
+ * @return tcp_endpoint_t* The endpoint, NULL if the descriptor is not an open child socket
+ */
+tcp_endpoint_t* tcp_server_get_endpoint(tcp_server_t* server, int sd);
+
+/**
+ * @brief Drain a child socket, calling on_rx for every complete frame.
+ *
+ * Frames may span reads and a read may carry several frames. Messages sent as several frames are reassembled and
+ * passed to on_rx_message instead. Closes the socket on disconnect or on a malformed stream.
+ *
+ * @return err_t ERR_OK if the endpoint is still open
+ */
+err_t tcp_server_receive(tcp_server_t* server, tcp_endpoint_t* endpoint);
+
+/**
+ * @brief Accept one pending connection on the (non-blocking) parent socket
+ *
+ * A connection that cannot be given an endpoint, for lack of descriptors or memory, is closed right away.
+ *
+ * @return err_t ERR_OK if a connection was taken off the backlog or may still be, ERR_NETWORK_WOULD_BLOCK if the
+ *               backlog is empty, ERR_NETWORK_FAILURE if accepting fails for as long as the process is out of resources
+ */
+err_t tcp_server_accept(tcp_server_t* server);
 #endif // SERVER_M
 
 /* ------------------------------------------ UDP --------------------------------------------- */
@@ -87,17 +179,80 @@ typedef struct __udp_ctx_t udp_ctx_t;
 typedef void (*udp_message_rx_cb_t)(udp_ctx_t* udp, udp_endpoint_t* src, udp_dgram_t* dgram);
 typedef void (*udp_message_tx_cb_t)(udp_ctx_t* udp, udp_endpoint_t* dst, udp_dgram_t* dgram);
 
+// Preallocated datagrams for recvmmsg / sendmmsg
+typedef struct __udp_batch_t {
+    udp_dgram_t rx_dgrams[UDP_BATCH_SIZE];
+    udp_endpoint_t rx_src[UDP_BATCH_SIZE];
+    udp_dgram_t tx_dgrams[UDP_BATCH_SIZE];
+    udp_endpoint_t tx_dst[UDP_BATCH_SIZE];
+    size_t tx_count;
+} udp_batch_t;
+
 struct __udp_ctx_t {
     int sd;
     uint16_t port;
     udp_message_rx_cb_t on_rx;
     udp_message_tx_cb_t on_tx;
+    udp_batch_t* batch;
 };
 
 udp_ctx_t* udp_start(uint16_t port);
 void udp_stop(udp_ctx_t* udp);
-void udp_receive(udp_ctx_t* udp);
+
+/**
+ * @brief Receive a single datagram and call on_rx for it
+ *
+ * @return err_t ERR_OK if a datagram was handled, ERR_NETWORK_WOULD_BLOCK if a non-blocking socket is empty
+ */
+err_t udp_receive(udp_ctx_t* udp);
+
+/**
+ * @brief Receive up to UDP_BATCH_SIZE datagrams in one syscall and call on_rx for each.
+ *
+ * Datagrams passed to udp_send from within on_rx are queued and flushed with a single sendmmsg once the batch is handled.
+ *
+ * @return err_t ERR_OK if at least one datagram was handled, ERR_NETWORK_WOULD_BLOCK if a non-blocking socket is empty,
+ *               ERR_NETWORK_FAILURE if the socket reported an error. Datagrams may still be queued behind it.
+ */
+err_t udp_receive_batch(udp_ctx_t* udp);
 void udp_send(udp_ctx_t* udp, udp_endpoint_t* dest, udp_dgram_t* datagram);
 #endif // SERVER_M || SERVER_C || SERVER_CS || SERVER_EE
 
+/* ----------------------------------------- Reactor ------------------------------------------ */
+
+#if defined(SERVER_M)
+#define REACTOR_MAX_EVENTS 64
+// Consecutive failed receives after which the reactor leaves the UDP socket for the next tick
+#define REACTOR_MAX_RECEIVE_FAILURES 8
+
+typedef struct __reactor_t reactor_t;
+
+// Edge-triggered epoll loop owning the TCP listener, its child sockets and a UDP socket
+struct __reactor_t {
+    int epfd;
+    tcp_server_t* tcp;
+    udp_ctx_t* udp;
+    bool accept_backlog;        // Accepting stopped on an error with connections left. Retried every tick.
+    bool udp_backlog;           // Receiving stopped on repeated errors with datagrams left. Retried every tick.
+};
+
+reactor_t* reactor_create(void);
+void reactor_destroy(reactor_t* reactor);
+
+/**
+ * @brief Register the TCP server with the reactor. Accepted children are registered automatically.
+ */
+err_t reactor_attach_tcp_server(reactor_t* reactor, tcp_server_t* tcp);
+
+/**
+ * @brief Register a UDP context with the reactor
+ */
+err_t reactor_attach_udp(reactor_t* reactor, udp_ctx_t* udp);
+
+/**
+ * @brief Wait up to timeout_ms for events and dispatch the on_rx callbacks of every ready descriptor
+ */
+void reactor_tick(reactor_t* reactor, int timeout_ms);
+#endif // SERVER_M
+
 #endif // NETWORKING_H
@@ -1,3 +1,4 @@
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -7,10 +8,14 @@
 #include "stdio.h"
 
 static uint16_t protocol_get_payload_len(const struct __message_t* message) {
-    return message->data_len < REQUEST_RESPONSE_HEADER_LEN ? REQUEST_RESPONSE_INVALID_TYPE : message->data[REQUEST_RESPONSE_PAYLOAD_LEN_OFFSET_1] | (message->data[REQUEST_RESPONSE_PAYLOAD_LEN_OFFSET_2] << 8);
+    return message->data_len < REQUEST_RESPONSE_HEADER_LEN ? REQUEST_RESPONSE_INVALID_TYPE : (message->data[REQUEST_RESPONSE_PAYLOAD_LEN_OFFSET_1] | (message->data[REQUEST_RESPONSE_PAYLOAD_LEN_OFFSET_2] << 8)) & ~REQUEST_RESPONSE_LEN_TRACE_CONTEXT;
 }
 
-static uint8_t protocol_get_flags(const struct __message_t* message) {
+static bool protocol_has_trace_context(const struct __message_t* message) {
+    return message->data_len >= REQUEST_RESPONSE_HEADER_LEN && (message->data[REQUEST_RESPONSE_PAYLOAD_LEN_OFFSET_2] << 8) & REQUEST_RESPONSE_LEN_TRACE_CONTEXT;
+}
+
+uint8_t protocol_get_flags(const struct __message_t* message) {
     return message->data_len < REQUEST_RESPONSE_HEADER_LEN ? 0 : message->data[REQUEST_RESPONSE_FLAGS_OFFSET];
 }
 
@@ -20,6 +25,7 @@ static void protocol_encode(struct __message_t* message, const uint8_t type, con
         message->data[REQUEST_RESPONSE_FLAGS_OFFSET] = flags;
         message->data[REQUEST_RESPONSE_PAYLOAD_LEN_OFFSET_1] = payload_len & 0xFF;
         message->data[REQUEST_RESPONSE_PAYLOAD_LEN_OFFSET_2] = payload_len >> 8;
+        memset(message->data + REQUEST_RESPONSE_REQUEST_ID_OFFSET, 0, sizeof(request_id_t));
         memcpy(message->data + REQUEST_RESPONSE_HEADER_LEN, payload, payload_len);
         message->data_len = REQUEST_RESPONSE_HEADER_LEN + payload_len;
     }
@@ -41,10 +47,204 @@ static void protocol_decode(const struct __message_t* message, request_type_t* r
     }
 }
 
+// Payload of a frame, bounded by the bytes actually received. Decoders below borrow from it instead of copying.
+static string_slice_t protocol_payload_view(const struct __message_t* message) {
+    if (message->data_len < REQUEST_RESPONSE_HEADER_LEN) {
+        return (string_slice_t) { NULL, 0 };
+    }
+    size_t len = min((size_t) protocol_get_payload_len(message), message->data_len - REQUEST_RESPONSE_HEADER_LEN);
+    return (string_slice_t) { (const char*) message->data + REQUEST_RESPONSE_HEADER_LEN, len };
+}
+
+// Point a slice at a length prefixed field
+static err_t course_field_view(const uint8_t* buffer, size_t buffer_len, size_t* offset, string_slice_t* field) {
+    if (*offset >= buffer_len || *offset + 1 + buffer[*offset] > buffer_len) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    field->len = buffer[(*offset)++];
+    field->data = (const char*) buffer + *offset;
+    *offset += field->len;
+    return ERR_OK;
+}
+
+size_t protocol_get_frame_len(const uint8_t* data, size_t len) {
+    if (len < REQUEST_RESPONSE_HEADER_LEN) {
+        return 0;
+    }
+    uint16_t payload_len = data[REQUEST_RESPONSE_PAYLOAD_LEN_OFFSET_1] | (data[REQUEST_RESPONSE_PAYLOAD_LEN_OFFSET_2] << 8);
+    if (payload_len & REQUEST_RESPONSE_LEN_TRACE_CONTEXT) {
+        return REQUEST_RESPONSE_HEADER_LEN + (payload_len & ~REQUEST_RESPONSE_LEN_TRACE_CONTEXT) + REQUEST_RESPONSE_TRACE_CONTEXT_LEN;
+    }
+    return REQUEST_RESPONSE_HEADER_LEN + payload_len;
+}
+
+bool protocol_get_trace_context(const struct __message_t* message, trace_context_t* context) {
+    if (!protocol_has_trace_context(message)) {
+        return false;
+    }
+    size_t offset = REQUEST_RESPONSE_HEADER_LEN + protocol_get_payload_len(message);
+    if (message->data_len < offset + REQUEST_RESPONSE_TRACE_CONTEXT_LEN) {
+        return false;
+    }
+    const uint8_t* ptr = message->data + offset;
+    context->trace_id = 0;
+    for (int byte = 7; byte >= 0; byte--) {
+        context->trace_id = (context->trace_id << 8) | ptr[byte];
+    }
+    context->span_id = ptr[8] | (ptr[9] << 8) | (ptr[10] << 16) | ((uint32_t) ptr[11] << 24);
+    context->flags = ptr[12];
+    return true;
+}
+
+err_t protocol_set_trace_context(struct __message_t* message, const trace_context_t* context) {
+    if (message == NULL || context == NULL || message->data_len < REQUEST_RESPONSE_HEADER_LEN) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    uint16_t payload_len = protocol_get_payload_len(message);
+    size_t offset = REQUEST_RESPONSE_HEADER_LEN + payload_len;
+    if (offset + REQUEST_RESPONSE_TRACE_CONTEXT_LEN > sizeof(message->data)) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    uint8_t* ptr = message->data + offset;
+    memset(ptr, 0, REQUEST_RESPONSE_TRACE_CONTEXT_LEN);
+    for (int byte = 0; byte < 8; byte++) {
+        ptr[byte] = (context->trace_id >> (8 * byte)) & 0xFF;
+    }
+    for (int byte = 0; byte < 4; byte++) {
+        ptr[8 + byte] = (context->span_id >> (8 * byte)) & 0xFF;
+    }
+    ptr[12] = context->flags;
+    message->data[REQUEST_RESPONSE_PAYLOAD_LEN_OFFSET_2] = (payload_len | REQUEST_RESPONSE_LEN_TRACE_CONTEXT) >> 8;
+    message->data_len = offset + REQUEST_RESPONSE_TRACE_CONTEXT_LEN;
+    return ERR_OK;
+}
+
 request_type_t protocol_get_request_type(const struct __message_t* message) {
     return message->data_len < REQUEST_RESPONSE_HEADER_LEN ? REQUEST_RESPONSE_INVALID_TYPE : message->data[REQUEST_RESPONSE_TYPE_OFFSET];
 }
 
+static const char* REQUEST_TYPE_NAMES[REQUEST_TYPE_END - REQUEST_TYPE_AUTH] = {
+    [REQUEST_TYPE_AUTH - REQUEST_TYPE_AUTH] = "auth",
+    [REQUEST_TYPE_COURSES_SINGLE_LOOKUP - REQUEST_TYPE_AUTH] = "single lookup",
+    [REQUEST_TYPE_COURSES_MULTI_LOOKUP - REQUEST_TYPE_AUTH] = "multi lookup",
+    [REQUEST_TYPE_COURSES_DETAIL_LOOKUP - REQUEST_TYPE_AUTH] = "detail lookup",
+    [REQUEST_TYPE_CACHE_INVALIDATE - REQUEST_TYPE_AUTH] = "cache invalidate",
+    [REQUEST_TYPE_LOG_LEVEL - REQUEST_TYPE_AUTH] = "log level",
+    [REQUEST_TYPE_STATS - REQUEST_TYPE_AUTH] = "stats",
+};
+
+const char* protocol_request_type_name(request_type_t type) {
+    return type >= REQUEST_TYPE_AUTH && type < REQUEST_TYPE_END ? REQUEST_TYPE_NAMES[type - REQUEST_TYPE_AUTH] : NULL;
+}
+
+static request_id_t header_get_request_id(const uint8_t* header) {
+    const uint8_t* ptr = header + REQUEST_RESPONSE_REQUEST_ID_OFFSET;
+    return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((request_id_t) ptr[3] << 24);
+}
+
+request_id_t protocol_get_request_id(const struct __message_t* message) {
+    return message->data_len < REQUEST_RESPONSE_HEADER_LEN ? 0 : header_get_request_id(message->data);
+}
+
+static void header_set_request_id(uint8_t* header, const request_id_t request_id) {
+    uint8_t* ptr = header + REQUEST_RESPONSE_REQUEST_ID_OFFSET;
+    ptr[0] = request_id & 0xFF;
+    ptr[1] = (request_id >> 8) & 0xFF;
+    ptr[2] = (request_id >> 16) & 0xFF;
+    ptr[3] = (request_id >> 24) & 0xFF;
+}
+
+void protocol_set_request_id(struct __message_t* message, const request_id_t request_id) {
+    if (message->data_len >= REQUEST_RESPONSE_HEADER_LEN) {
+        header_set_request_id(message->data, request_id);
+    }
+}
+
+#if defined(CLIENT) || defined(SERVER_M)
+request_type_t protocol_get_message_type(const message_buffer_t* message) {
+    return message->data_len < REQUEST_RESPONSE_HEADER_LEN ? REQUEST_RESPONSE_INVALID_TYPE : message->data[REQUEST_RESPONSE_TYPE_OFFSET];
+}
+
+request_id_t protocol_get_message_request_id(const message_buffer_t* message) {
+    return message->data_len < REQUEST_RESPONSE_HEADER_LEN ? 0 : header_get_request_id(message->data);
+}
+
+void protocol_set_message_request_id(message_buffer_t* message, const request_id_t request_id) {
+    if (message->data_len >= REQUEST_RESPONSE_HEADER_LEN) {
+        header_set_request_id(message->data, request_id);
+    }
+}
+
+static void header_set_payload_len(uint8_t* header, size_t payload_len) {
+    header[REQUEST_RESPONSE_PAYLOAD_LEN_OFFSET_1] = payload_len & 0xFF;
+    header[REQUEST_RESPONSE_PAYLOAD_LEN_OFFSET_2] = (payload_len >> 8) & 0xFF;
+}
+
+// Start a message with its header. message_end() fills in the payload length.
+static err_t message_begin(message_buffer_t* message, const uint8_t type, const uint8_t flags) {
+    uint8_t header[REQUEST_RESPONSE_HEADER_LEN] = {0};
+    header[REQUEST_RESPONSE_TYPE_OFFSET] = type;
+    header[REQUEST_RESPONSE_FLAGS_OFFSET] = flags;
+    message->data_len = 0;
+    return message_buffer_append(message, header, sizeof(header));
+}
+
+// The length field only has 16 bits. Readers of a whole message go by data_len, the field matters on single frames.
+static void message_end(message_buffer_t* message) {
+    header_set_payload_len(message->data, min(message->data_len - REQUEST_RESPONSE_HEADER_LEN, UINT16_MAX));
+}
+
+bool protocol_fragment_encode(const message_buffer_t* message, size_t* offset, struct __message_t* out_frame) {
+    size_t payload_len = message->data_len - REQUEST_RESPONSE_HEADER_LEN;
+    size_t chunk_len = min(payload_len - *offset, REQUEST_RESPONSE_FRAME_PAYLOAD_MAX);
+    bool more = *offset + chunk_len < payload_len;
+
+    memcpy(out_frame->data, message->data, REQUEST_RESPONSE_HEADER_LEN);
+    if (more) {
+        out_frame->data[REQUEST_RESPONSE_TYPE_OFFSET] |= REQUEST_RESPONSE_TYPE_MORE_FRAGMENTS;
+    }
+    header_set_payload_len(out_frame->data, chunk_len);
+    memcpy(out_frame->data + REQUEST_RESPONSE_HEADER_LEN, message->data + REQUEST_RESPONSE_HEADER_LEN + *offset, chunk_len);
+    out_frame->data_len = REQUEST_RESPONSE_HEADER_LEN + chunk_len;
+    *offset += chunk_len;
+    return more;
+}
+
+err_t protocol_fragment_decode(message_buffer_t* message, const struct __message_t* frame) {
+    if (frame->data_len < REQUEST_RESPONSE_HEADER_LEN) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    uint8_t type = frame->data[REQUEST_RESPONSE_TYPE_OFFSET];
+    if (message->data_len == 0) {
+        // The first fragment brings the header of the message
+        err_t err = message_buffer_append(message, frame->data, REQUEST_RESPONSE_HEADER_LEN);
+        if (err != ERR_OK) {
+            return err;
+        }
+        message->data[REQUEST_RESPONSE_TYPE_OFFSET] &= ~REQUEST_RESPONSE_TYPE_MORE_FRAGMENTS;
+    } else if ((type & ~REQUEST_RESPONSE_TYPE_MORE_FRAGMENTS) != message->data[REQUEST_RESPONSE_TYPE_OFFSET]
+            || memcmp(frame->data + REQUEST_RESPONSE_REQUEST_ID_OFFSET, message->data + REQUEST_RESPONSE_REQUEST_ID_OFFSET, sizeof(request_id_t)) != 0) {
+        // Fragments of a message are sent back to back
+        return ERR_INVALID_PARAMETERS;
+    }
+
+    // A trace context after the chunk is not part of the message
+    string_slice_t chunk = protocol_payload_view(frame);
+    if (message->data_len + chunk.len > TCP_MESSAGE_MAX) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    err_t err = message_buffer_append(message, chunk.data, chunk.len);
+    if (err != ERR_OK) {
+        return err;
+    }
+    if (type & REQUEST_RESPONSE_TYPE_MORE_FRAGMENTS) {
+        return ERR_NETWORK_WOULD_BLOCK;
+    }
+    message_end(message);
+    return ERR_OK;
+}
+#endif // CLIENT || SERVER_M
+
 err_t protocol_authentication_request_encode(const credentials_t* credentials, struct __message_t* out_dgrm) {
     if (credentials == NULL || out_dgrm == NULL) {
         return ERR_INVALID_PARAMETERS;
@@ -83,6 +283,9 @@ err_t protocol_authentication_request_decode(const struct __message_t* in_dgrm,
 
     credentials->username_len = CREDENTIALS_USERNAME_LEN(buffer);
     credentials->password_len = CREDENTIALS_PASSWORD_LEN(buffer);
+    if (credentials->username_len > CREDENTIALS_MAX_USERNAME_LEN || credentials->password_len > CREDENTIALS_MAX_PASSWORD_LEN) {
+        return ERR_INVALID_PARAMETERS;
+    }
     uint8_t offset = CREDENTIALS_HEADER_LEN;
     memcpy(credentials->username, buffer + offset, credentials->username_len);
     offset += credentials->username_len;
@@ -123,7 +326,7 @@ err_t protocol_courses_lookup_single_request_encode(const char* course_code, con
     return ERR_OK;
 }
 
-err_t protocol_courses_lookup_single_request_decode(const struct __message_t* in_dgrm, char* course_code, uint8_t* course_code_len, courses_lookup_category_t* category) {
+err_t protocol_courses_lookup_single_request_view(const struct __message_t* in_dgrm, string_slice_t* course_code, courses_lookup_category_t* category) {
     if (in_dgrm == NULL || course_code == NULL) {
         return ERR_INVALID_PARAMETERS;
     }
@@ -132,16 +335,9 @@ err_t protocol_courses_lookup_single_request_decode(const struct __message_t* in
         return ERR_INVALID_PARAMETERS;
     }
 
-    uint8_t flags = 0;
-    uint16_t olen = 0;
-    uint16_t size = course_code_len ? *course_code_len : 0;
-    protocol_decode(in_dgrm, NULL, &flags, &olen, size, (uint8_t*) course_code);
-
-    if (course_code_len) {
-        *course_code_len = olen;
-    }
+    *course_code = protocol_payload_view(in_dgrm);
     if (category) {
-        *category = flags;
+        *category = protocol_get_flags(in_dgrm);
     }
     return ERR_OK;
 }
@@ -153,7 +349,7 @@ err_t protocol_courses_lookup_single_response_encode(const char* course_code, co
 
     uint8_t* buffer = malloc(sizeof(course_code_len) + course_code_len + sizeof(information_len) + information_len);
     if (buffer) {
-        uint8_t offset = 0;
+        size_t offset = 0;
 
         buffer[offset++] = course_code_len;
         memcpy(buffer + offset, course_code, course_code_len);
@@ -169,6 +365,27 @@ err_t protocol_courses_lookup_single_response_encode(const char* course_code, co
     return ERR_OUT_OF_MEMORY;
 }
 
+err_t protocol_courses_lookup_single_response_view(const struct __message_t* in_dgrm, string_slice_t* course_code, courses_lookup_category_t* category, string_slice_t* information) {
+    if (in_dgrm == NULL || course_code == NULL || information == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
+
+    if (protocol_get_request_type(in_dgrm) != RESPONSE_TYPE_COURSES_SINGLE_LOOKUP) {
+        return ERR_INVALID_PARAMETERS;
+    }
+
+    string_slice_t payload = protocol_payload_view(in_dgrm);
+    size_t offset = 0;
+    if (course_field_view((const uint8_t*) payload.data, payload.len, &offset, course_code) != ERR_OK
+            || course_field_view((const uint8_t*) payload.data, payload.len, &offset, information) != ERR_OK) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    if (category) {
+        *category = protocol_get_flags(in_dgrm);
+    }
+    return ERR_OK;
+}
+
 err_t protocol_courses_lookup_single_response_decode(const struct __message_t* in_dgrm, char* course_code, uint8_t* course_code_len, courses_lookup_category_t* category, uint8_t* information, uint8_t* information_len) {
     if (in_dgrm == NULL || course_code == NULL || course_code_len == NULL || category == NULL || information == NULL || information_len == NULL) {
         return ERR_INVALID_PARAMETERS;
@@ -203,7 +420,7 @@ err_t protocol_courses_lookup_detail_request_encode(const uint8_t* course_code,
     return ERR_OK;
 }
 
-err_t protocol_courses_lookup_detail_request_decode(const struct __message_t* in_dgrm, uint8_t* course_code, uint8_t* course_code_len) {
+err_t protocol_courses_lookup_detail_request_view(const struct __message_t* in_dgrm, string_slice_t* course_code) {
     if (in_dgrm == NULL || course_code == NULL) {
         return ERR_INVALID_PARAMETERS;
     }
@@ -212,264 +429,331 @@ err_t protocol_courses_lookup_detail_request_decode(const struct __message_t* in
         return ERR_INVALID_PARAMETERS;
     }
 
-    uint16_t size = course_code_len ? *course_code_len : 0;
-    uint16_t olen = 0;
-    protocol_decode(in_dgrm, NULL, NULL, &olen, size, course_code);
-    course_code[olen] = '\0';
-
-    *course_code_len = olen;
-
+    *course_code = protocol_payload_view(in_dgrm);
     return ERR_OK;
 }
 
-err_t protocol_courses_lookup_detail_response_encode(const course_t* course, struct __message_t* out_dgrm) {
-    if (course == NULL || out_dgrm == NULL) {
-        return ERR_INVALID_PARAMETERS;
+// Append a length prefixed string field. Fields are clamped to UINT8_MAX bytes.
+static size_t course_field_encode(const char* field, uint8_t* buffer, size_t offset, size_t buffer_size) {
+    size_t len = min(strlen(field), UINT8_MAX);
+    if (offset + 1 + len > buffer_size) {
+        return 0;
     }
+    buffer[offset++] = len;
+    memcpy(buffer + offset, field, len);
+    return 1 + len;
+}
 
-    uint8_t buffer[256];
-    size_t offset = 0;
-    
-    buffer[offset++] = strlen(course->course_code);
-    memcpy(buffer + offset, course->course_code, strlen(course->course_code));
-    offset += strlen(course->course_code);
-
-    buffer[offset++] = strlen(course->course_name);
-    memcpy(buffer + offset, course->course_name, strlen(course->course_name));
-    offset += strlen(course->course_name);
-
-    buffer[offset++] = strlen(course->professor);
-    memcpy(buffer + offset, course->professor, strlen(course->professor));
-    offset += strlen(course->professor);
-
-    buffer[offset++] = strlen(course->days);
-    memcpy(buffer + offset, course->days, strlen(course->days));
-    offset += strlen(course->days);
+// Write the details of a course as a record: its length, then the course code, course name, professor, days and credits.
+// Detail lookup responses carry one record, multi lookup responses concatenate them. Returns 0 if the record does not fit.
+static size_t course_record_encode(const course_view_t* course, uint8_t* record, size_t record_size) {
+    size_t offset = 1;
+    const char* fields[] = { course->course_code, course->course_name, course->professor, course->days };
 
-    buffer[offset++] = 1;
-    buffer[offset++] = course->credits;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        size_t written = course_field_encode(fields[i], record, offset, record_size - 1);
+        if (written == 0) {
+            return 0;
+        }
+        offset += written;
+    }
+    record[offset++] = course->credits;
 
-    protocol_encode(out_dgrm, RESPONSE_TYPE_COURSES_DETAIL_LOOKUP, 0, offset, buffer);
+    // Informational only: a record with long fields does not fit the length byte, readers walk the fields instead
+    record[0] = min(offset, UINT8_MAX);
+    return offset;
+}
 
+// Check the record at offset and point the course at its fields. On success offset is past the record.
+static err_t course_record_parse(const uint8_t* buffer, size_t buffer_len, size_t* offset, course_details_view_t* course) {
+    // Skip the record length
+    (*offset)++;
+    if (course_field_view(buffer, buffer_len, offset, &course->course_code) != ERR_OK
+            || course_field_view(buffer, buffer_len, offset, &course->course_name) != ERR_OK
+            || course_field_view(buffer, buffer_len, offset, &course->professor) != ERR_OK
+            || course_field_view(buffer, buffer_len, offset, &course->days) != ERR_OK
+            || *offset >= buffer_len) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    course->credits = buffer[(*offset)++];
     return ERR_OK;
 }
 
-err_t protocol_courses_lookup_detail_response_decode(const struct __message_t* in_dgrm, course_t* course) {
-    if (in_dgrm == NULL || course == NULL) {
+err_t protocol_courses_lookup_detail_response_encode(const course_view_t* course, struct __message_t* out_dgrm) {
+    if (course == NULL || out_dgrm == NULL) {
         return ERR_INVALID_PARAMETERS;
     }
 
-    uint8_t buffer[128];
-    uint16_t buffer_len = 0;
-
-    protocol_decode(in_dgrm, NULL, NULL, &buffer_len, sizeof(buffer), buffer);
-
-    uint8_t len = 0;
-    uint8_t offset = 0;
-
-    len = buffer[offset++];
-    memcpy(course->course_code, buffer + offset, len);
-    course->course_code[len] = '\0';
-    offset += len;
+    uint8_t buffer[sizeof(out_dgrm->data) - REQUEST_RESPONSE_HEADER_LEN];
+    size_t len = course_record_encode(course, buffer, sizeof(buffer));
+    if (len == 0) {
+        return ERR_INVALID_PARAMETERS;
+    }
 
-    len = buffer[offset++];
-    memcpy(course->course_name, buffer + offset, len);
-    course->course_name[len] = '\0';
-    offset += len;
+    protocol_encode(out_dgrm, RESPONSE_TYPE_COURSES_DETAIL_LOOKUP, 0, len, buffer);
 
-    len = buffer[offset++];
-    memcpy(course->professor, buffer + offset, len);
-    course->professor[len] = '\0';
-    offset += len;
+    return ERR_OK;
+}
 
-    len = buffer[offset++];
-    memcpy(course->days, buffer + offset, len);
-    course->days[len] = '\0';
-    offset += len;
+err_t protocol_courses_lookup_detail_response_view(const struct __message_t* in_dgrm, string_slice_t* record, course_details_view_t* course) {
+    if (in_dgrm == NULL || record == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
 
-    course->credits = buffer[++offset];
+    if (protocol_get_request_type(in_dgrm) != RESPONSE_TYPE_COURSES_DETAIL_LOOKUP) {
+        return ERR_INVALID_PARAMETERS;
+    }
 
+    string_slice_t payload = protocol_payload_view(in_dgrm);
+    course_details_view_t details;
+    size_t offset = 0;
+    if (course_record_parse((const uint8_t*) payload.data, payload.len, &offset, course ? course : &details) != ERR_OK) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    *record = (string_slice_t) { payload.data, offset };
     return ERR_OK;
 }
 
-err_t protocol_courses_lookup_multiple_request_encode(const uint8_t course_count, const uint8_t* course_codes_buffer, const uint8_t course_codes_buffer_len, struct __message_t* out_sgmnt) {
-    if (course_codes_buffer == NULL || out_sgmnt == NULL) {
+#if defined(CLIENT) || defined(SERVER_M)
+err_t protocol_courses_lookup_multiple_request_encode(const uint8_t course_count, const uint8_t* course_codes_buffer, const size_t course_codes_buffer_len, message_buffer_t* out_message) {
+    if (course_codes_buffer == NULL || out_message == NULL || course_count > MULTI_LOOKUP_MAX_COURSES) {
         return ERR_INVALID_PARAMETERS;
     }
 
-    uint8_t buffer[128];
-    uint8_t buffer_len = 0;
+    err_t err = message_begin(out_message, REQUEST_TYPE_COURSES_MULTI_LOOKUP, 0);
+    if (err == ERR_OK) {
+        err = message_buffer_append(out_message, &course_count, 1);
+    }
 
     const uint8_t* ptr = course_codes_buffer;
-    buffer[0] = course_count;
-
-    buffer_len += 1;
-    for (uint8_t i = 0; i < course_count; i++) {
-        int length = utils_get_word_length((char*) ptr);
-        buffer[buffer_len] = length;
-        buffer_len += 1;
-        memcpy(buffer + buffer_len, ptr, length);
-        buffer_len += length;
-        ptr += length;
-        ptr += 1; // skip space
+    const uint8_t* end = course_codes_buffer + strnlen((const char*) course_codes_buffer, course_codes_buffer_len);
+    for (uint8_t i = 0; i < course_count && err == ERR_OK; i++) {
+        // Course codes are separated by whitespace. The input line may end with a newline.
+        while (ptr < end && isspace(*ptr)) {
+            ptr++;
+        }
+        const uint8_t* word = ptr;
+        while (ptr < end && !isspace(*ptr)) {
+            ptr++;
+        }
+        uint8_t length = min(ptr - word, UINT8_MAX);
+        err = message_buffer_append(out_message, &length, 1);
+        if (err == ERR_OK) {
+            err = message_buffer_append(out_message, word, length);
+        }
+    }
+    if (err != ERR_OK) {
+        return err;
     }
 
-    protocol_encode(out_sgmnt, REQUEST_TYPE_COURSES_MULTI_LOOKUP, 0, buffer_len, buffer);
+    message_end(out_message);
     return ERR_OK;
 }
 
-err_t protocol_courses_lookup_multiple_request_decode(const struct __message_t* in_dgrm, uint8_t* course_count, single_course_code_handler_t handler) {
-    if (in_dgrm == NULL || handler == NULL) {
+err_t protocol_courses_lookup_multiple_request_decode(const message_buffer_t* in_message, uint8_t* course_count, single_course_code_handler_t handler, void* user_data) {
+    if (in_message == NULL || course_count == NULL || handler == NULL) {
         return ERR_INVALID_PARAMETERS;
     }
 
-    if (protocol_get_request_type(in_dgrm) != REQUEST_TYPE_COURSES_MULTI_LOOKUP) {
+    if (protocol_get_message_type(in_message) != REQUEST_TYPE_COURSES_MULTI_LOOKUP) {
         return ERR_INVALID_PARAMETERS;
     }
 
-    uint8_t buffer[128];
-    uint16_t buffer_len = 0;
-
-    protocol_decode(in_dgrm, NULL, NULL, &buffer_len, sizeof(buffer), buffer);
+    const uint8_t* buffer = in_message->data + REQUEST_RESPONSE_HEADER_LEN;
+    size_t buffer_len = in_message->data_len - REQUEST_RESPONSE_HEADER_LEN;
+    size_t offset = 0;
 
-    uint8_t offset = 0;
-    *course_count = buffer[offset++];
-    for (uint8_t i = 0; i < *course_count; i++) {
+    *course_count = 0;
+    if (buffer_len == 0) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    uint8_t count = buffer[offset++];
+    for (uint8_t i = 0; i < count; i++) {
+        if (offset >= buffer_len || offset + 1 + buffer[offset] > buffer_len) {
+            // Truncated. The course codes before it were handled.
+            return ERR_INVALID_PARAMETERS;
+        }
         uint8_t len = buffer[offset++];
-        handler(i, (char*) buffer + offset, len);
+        handler(i, (const char*) buffer + offset, len, user_data);
         offset += len;
+        (*course_count)++;
     }
 
     return ERR_OK;
 }
 
-static uint8_t course_details_encode(course_t* course, uint8_t* buffer, uint8_t buffer_size) {
-    uint8_t buffer_offset = 1;
-    uint8_t course_code_len = strlen(course->course_code);
-    uint8_t course_name_len = strlen(course->course_name);
-    uint8_t professor_len = strlen(course->professor);
-    uint8_t days_len = strlen(course->days);
-
-    memcpy(buffer + buffer_offset, &course_code_len, 1);
-    buffer_offset += 1;
-    memcpy(buffer + buffer_offset, course->course_code, course_code_len);
-    buffer_offset += course_code_len;
-
-    memcpy(buffer + buffer_offset, &course_name_len, 1);
-    buffer_offset += 1;
-    memcpy(buffer + buffer_offset, course->course_name, course_name_len);
-    buffer_offset += course_name_len;
-
-    memcpy(buffer + buffer_offset, &professor_len, 1);
-    buffer_offset += 1;
-    memcpy(buffer + buffer_offset, course->professor, professor_len);
-    buffer_offset += professor_len;
-
-    memcpy(buffer + buffer_offset, &days_len, 1);
-    buffer_offset += 1;
-    memcpy(buffer + buffer_offset, course->days, days_len);
-    buffer_offset += days_len;
+err_t protocol_courses_lookup_multiple_response_encode(const string_slice_t* records, const uint8_t course_count, message_buffer_t* out_message) {
+    if ((records == NULL && course_count > 0) || out_message == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
 
-    memcpy(buffer + buffer_offset, &(course->credits), 1);
-    buffer_offset += 1;
+    err_t err = message_begin(out_message, RESPONSE_TYPE_COURSES_MULTI_LOOKUP, course_count);
+    for (uint8_t i = 0; i < course_count && err == ERR_OK; i++) {
+        err = message_buffer_append(out_message, records[i].data, records[i].len);
+    }
+    if (err != ERR_OK) {
+        return err;
+    }
 
-    buffer[0] = buffer_offset;
-    return buffer_offset;
+    // The course count travels in the flags
+    message_end(out_message);
+    return ERR_OK;
 }
 
-err_t protocol_courses_lookup_multiple_response_encode(const course_t* courses, struct __message_t* out_dgrm) {
-    if (out_dgrm == NULL || courses == NULL) {
+err_t protocol_courses_lookup_multiple_response_iterate(const message_buffer_t* in_message, courses_iterator_t* iterator) {
+    if (in_message == NULL || iterator == NULL) {
         return ERR_INVALID_PARAMETERS;
     }
-    
-    uint8_t buffer[1016];
-    uint16_t buffer_offset = 0;
 
-    course_t* course_ptr = (course_t*) courses;
-    uint8_t course_count = 0;
-    while(course_ptr) {
-        buffer_offset += course_details_encode(course_ptr, buffer + buffer_offset, sizeof(buffer) - buffer_offset);
-        course_count++;
-        course_ptr = course_ptr->next;
+    if (protocol_get_message_type(in_message) != RESPONSE_TYPE_COURSES_MULTI_LOOKUP) {
+        return ERR_INVALID_PARAMETERS;
     }
 
-    protocol_encode(out_dgrm, RESPONSE_TYPE_COURSES_MULTI_LOOKUP, course_count, buffer_offset, buffer);
-
+    iterator->data = in_message->data + REQUEST_RESPONSE_HEADER_LEN;
+    iterator->len = in_message->data_len - REQUEST_RESPONSE_HEADER_LEN;
+    iterator->offset = 0;
+    iterator->remaining = in_message->data[REQUEST_RESPONSE_FLAGS_OFFSET];
     return ERR_OK;
-
 }
 
-static course_t* course_details_decode(uint8_t* buffer, uint8_t buffer_size, uint16_t* bytes_read) {
-    course_t* course = malloc(sizeof(course_t));
-    bzero(course, sizeof(course_t));
+bool protocol_courses_iterator_next(courses_iterator_t* iterator, course_details_view_t* course) {
+    if (iterator == NULL || course == NULL || iterator->remaining == 0) {
+        return false;
+    }
+    size_t offset = iterator->offset;
+    if (course_record_parse(iterator->data, iterator->len, &offset, course) != ERR_OK) {
+        // Truncated. remaining stays above 0 so that the caller can tell.
+        iterator->offset = iterator->len;
+        return false;
+    }
+    iterator->offset = offset;
+    iterator->remaining--;
+    return true;
+}
+#endif // CLIENT || SERVER_M
 
-    uint8_t buffer_offset = 1;
-    uint8_t course_code_len = buffer[buffer_offset++];
-    memcpy(course->course_code, buffer + buffer_offset, course_code_len);
-    buffer_offset += course_code_len;
+err_t protocol_cache_invalidate_encode(const char* prefix, const uint8_t prefix_len, struct __message_t* out_dgrm) {
+    if ((prefix == NULL && prefix_len > 0) || out_dgrm == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    protocol_encode(out_dgrm, REQUEST_TYPE_CACHE_INVALIDATE, 0, prefix_len, (const uint8_t*) prefix);
+    return ERR_OK;
+}
 
-    uint8_t course_name_len = buffer[buffer_offset++];
-    memcpy(course->course_name, buffer + buffer_offset, course_name_len);
-    buffer_offset += course_name_len;
+err_t protocol_cache_invalidate_view(const struct __message_t* in_dgrm, string_slice_t* prefix) {
+    if (in_dgrm == NULL || prefix == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
 
-    uint8_t professor_len = buffer[buffer_offset++];
-    memcpy(course->professor, buffer + buffer_offset, professor_len);
-    buffer_offset += professor_len;
+    if (protocol_get_request_type(in_dgrm) != REQUEST_TYPE_CACHE_INVALIDATE) {
+        return ERR_INVALID_PARAMETERS;
+    }
 
-    uint8_t days_len = buffer[buffer_offset++];
-    memcpy(course->days, buffer + buffer_offset, days_len);
-    buffer_offset += days_len;
+    *prefix = protocol_payload_view(in_dgrm);
+    return ERR_OK;
+}
 
-    memcpy(&(course->credits), buffer + buffer_offset, 1);
-    buffer_offset += 1;
+err_t protocol_log_level_request_encode(const char* spec, const uint8_t spec_len, struct __message_t* out_sgmnt) {
+    if ((spec == NULL && spec_len > 0) || out_sgmnt == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    protocol_encode(out_sgmnt, REQUEST_TYPE_LOG_LEVEL, 0, spec_len, (const uint8_t*) spec);
+    return ERR_OK;
+}
 
-    *bytes_read += buffer[0];
+err_t protocol_log_level_request_view(const struct __message_t* in_sgmnt, string_slice_t* spec) {
+    if (in_sgmnt == NULL || spec == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
 
-    course->next = NULL;
+    if (protocol_get_request_type(in_sgmnt) != REQUEST_TYPE_LOG_LEVEL) {
+        return ERR_INVALID_PARAMETERS;
+    }
 
-    return course;
+    *spec = protocol_payload_view(in_sgmnt);
+    return ERR_OK;
 }
 
-err_t protocol_courses_lookup_multiple_response_decode(const struct __message_t* in_dgrm, course_t** courses_ret) {
-    if (in_dgrm == NULL || courses_ret == NULL) {
+err_t protocol_log_level_response_encode(const err_t result, struct __message_t* out_sgmnt) {
+    if (out_sgmnt == NULL) {
         return ERR_INVALID_PARAMETERS;
     }
+    protocol_encode(out_sgmnt, RESPONSE_TYPE_LOG_LEVEL, result, 0, NULL);
+    return ERR_OK;
+}
 
-    if (protocol_get_request_type(in_dgrm) != RESPONSE_TYPE_COURSES_MULTI_LOOKUP) {
+err_t protocol_log_level_response_decode(const struct __message_t* in_sgmnt, err_t* result) {
+    if (in_sgmnt == NULL || result == NULL) {
         return ERR_INVALID_PARAMETERS;
     }
 
-    uint8_t buffer[sizeof(in_dgrm->data) - REQUEST_RESPONSE_HEADER_LEN] = {0};
-    uint16_t buffer_len = sizeof(buffer);
+    if (protocol_get_request_type(in_sgmnt) != RESPONSE_TYPE_LOG_LEVEL) {
+        return ERR_INVALID_PARAMETERS;
+    }
 
-    protocol_decode(in_dgrm, NULL, NULL, &buffer_len, sizeof(buffer), buffer);
+    *result = protocol_get_flags(in_sgmnt);
+    return ERR_OK;
+}
 
-    uint8_t course_count = protocol_get_flags(in_dgrm);
-    uint16_t buffer_offset = 0;
+err_t protocol_stats_request_encode(struct __message_t* out_msg) {
+    if (out_msg == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    protocol_encode(out_msg, REQUEST_TYPE_STATS, 0, 0, NULL);
+    return ERR_OK;
+}
 
-    for (int i = 0; i < course_count; i++) {
-        course_t* course = course_details_decode(buffer + buffer_offset, buffer[buffer_offset], &buffer_offset);
-        if (*courses_ret == NULL) {
-            *courses_ret = course;
-        } else {
-            course_t* course_ptr = *courses_ret;
-            while(course_ptr->next) {
-                course_ptr = course_ptr->next;
-            }
-            course_ptr->next = course;
-            course->next = NULL;
+err_t protocol_stats_response_encode(const stats_item_t* items, const size_t items_count, struct __message_t* out_msg) {
+    if ((items == NULL && items_count > 0) || items_count > STATS_ITEMS_MAX || out_msg == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    uint8_t buffer[STATS_ITEMS_MAX * STATS_ITEM_LEN];
+    uint8_t* ptr = buffer;
+    for (size_t i = 0; i < items_count; i++) {
+        *ptr++ = items[i].id;
+        *ptr++ = items[i].index;
+        for (int byte = 0; byte < 8; byte++) {
+            *ptr++ = (items[i].value >> (8 * byte)) & 0xFF;
         }
     }
+    protocol_encode(out_msg, RESPONSE_TYPE_STATS, 0, ptr - buffer, buffer);
+    return ERR_OK;
+}
 
+err_t protocol_stats_error_encode(const err_t result, struct __message_t* out_msg) {
+    if (out_msg == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    protocol_encode(out_msg, RESPONSE_TYPE_STATS, result, 0, NULL);
     return ERR_OK;
 }
 
-void protocol_courses_lookup_multiple_response_decode_dealloc(course_t* course) {
-    while(course != NULL) {
-        course_t* next = course->next;
-        free(course);
-        course = next;
+err_t protocol_stats_response_decode(const struct __message_t* in_msg, stats_item_t* items, const size_t items_size, size_t* items_count) {
+    if (in_msg == NULL || items == NULL || items_count == NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
+
+    if (protocol_get_request_type(in_msg) != RESPONSE_TYPE_STATS) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    if (protocol_get_flags(in_msg) != ERR_OK) {
+        *items_count = 0;
+        return protocol_get_flags(in_msg);
+    }
+
+    string_slice_t payload = protocol_payload_view(in_msg);
+    const uint8_t* ptr = (const uint8_t*) payload.data;
+    size_t count = min(payload.len / STATS_ITEM_LEN, items_size);
+    for (size_t i = 0; i < count; i++, ptr += STATS_ITEM_LEN) {
+        items[i].id = ptr[0];
+        items[i].index = ptr[1];
+        items[i].value = 0;
+        for (int byte = 7; byte >= 0; byte--) {
+            items[i].value = (items[i].value << 8) | ptr[2 + byte];
+        }
     }
+    *items_count = count;
+    return ERR_OK;
 }
 
 err_t protocol_courses_error_encode(const err_t error_code, uint8_t* data, uint8_t data_len, struct __message_t* out_dgrm) {
@@ -1,23 +1,41 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include "networking.h"
 #include "constants.h"
+#include "message_buffer.h"
+#include "utils.h"
 
 
 #define REQUEST_RESPONSE_TYPE_OFFSET                0
 #define REQUEST_RESPONSE_FLAGS_OFFSET               1
 #define REQUEST_RESPONSE_PAYLOAD_LEN_OFFSET_1       2
 #define REQUEST_RESPONSE_PAYLOAD_LEN_OFFSET_2       3
-#define REQUEST_RESPONSE_HEADER_LEN                 4
+#define REQUEST_RESPONSE_REQUEST_ID_OFFSET          4
+#define REQUEST_RESPONSE_HEADER_LEN                 8
+#define REQUEST_RESPONSE_FRAME_PAYLOAD_MAX          (MESSAGE_FRAME_SIZE - REQUEST_RESPONSE_HEADER_LEN)
+
+// Set in the type of every fragment of a message but the last. Message types are all below 0x80.
+#define REQUEST_RESPONSE_TYPE_MORE_FRAGMENTS        0x80
+
+// Set in the payload length of a frame followed by a trace context. Frame payloads never come near 0x8000 bytes.
+#define REQUEST_RESPONSE_LEN_TRACE_CONTEXT          0x8000
+#define REQUEST_RESPONSE_TRACE_CONTEXT_LEN          16
+
+// Correlates a response with its request. Responders copy it from the request. 0 means uncorrelated.
+typedef uint32_t request_id_t;
 
 typedef uint8_t request_type_t;
 #define REQUEST_TYPE_AUTH                           0x61
 #define REQUEST_TYPE_COURSES_SINGLE_LOOKUP          0x62
 #define REQUEST_TYPE_COURSES_MULTI_LOOKUP           0x63
 #define REQUEST_TYPE_COURSES_DETAIL_LOOKUP          0x64
-#define REQUEST_TYPE_END                            0x65
+#define REQUEST_TYPE_CACHE_INVALIDATE               0x65
+#define REQUEST_TYPE_LOG_LEVEL                      0x66
+#define REQUEST_TYPE_STATS                          0x67
+#define REQUEST_TYPE_END                            0x68
 
 typedef uint8_t response_type_t;
 #define RESPONSE_TYPE_AUTH                          0x71
@@ -25,7 +43,9 @@ typedef uint8_t response_type_t;
 #define RESPONSE_TYPE_COURSES_MULTI_LOOKUP          0x73
 #define RESPONSE_TYPE_COURSES_DETAIL_LOOKUP         0x74
 #define RESPONSE_TYPE_COURSES_ERROR                 0x75
-#define RESPONSE_TYPE_END                           0x76
+#define RESPONSE_TYPE_LOG_LEVEL                     0x76
+#define RESPONSE_TYPE_STATS                         0x77
+#define RESPONSE_TYPE_END                           0x78
 
 #define REQUEST_RESPONSE_INVALID_TYPE               0x00
 
@@ -56,6 +76,49 @@ typedef uint8_t courses_lookup_category_t;
 #define COURSES_LOOKUP_CATEGORY_COURSE_NAME         0x54    
 #define COURSES_LOOKUP_CATEGORY_INVALID             0x55
 
+// Trace context carried after the payload of a traced request: the trace id (8 bytes), the span id of the
+// sender (4 bytes), flags and 3 reserved bytes, little endian. The span of the receiver is a child of the sender's.
+typedef struct __trace_context_t {
+    uint64_t trace_id;
+    uint32_t span_id;
+    uint8_t flags;
+} trace_context_t;
+#define TRACE_FLAGS_SAMPLED                         0x01
+
+// Values in a stats response. A server sends the ones it has.
+typedef uint8_t stats_id_t;
+#define STATS_UPTIME_MS                             0x01
+#define STATS_CONNECTIONS                           0x02    // Open client connections
+#define STATS_PENDING_REQUESTS                      0x03    // Requests waiting for a backend server
+#define STATS_QUEUE_DEPTH                           0x04    // Multi lookups waiting for a worker
+#define STATS_CACHE_HITS                            0x05
+#define STATS_CACHE_MISSES                          0x06
+#define STATS_CACHE_ENTRIES                         0x07
+#define STATS_COALESCED_LOOKUPS                     0x08
+#define STATS_LOG_DROPPED                           0x09    // Log lines dropped because a log ring was full
+#define STATS_RECORDS                               0x0A    // Courses or credentials loaded
+// Per request type. The index is the request type.
+#define STATS_REQUESTS                              0x10
+#define STATS_REQUESTS_FAILED                       0x11
+#define STATS_LATENCY_P50_NS                        0x12
+#define STATS_LATENCY_P99_NS                        0x13
+#define STATS_LATENCY_P999_NS                       0x14
+#define STATS_LATENCY_MAX_NS                        0x15
+// Per backend server of serverM. The index is a metrics_backend_t.
+#define STATS_BACKEND_RESPONSES                     0x20
+#define STATS_BACKEND_RTT_P50_NS                    0x21
+#define STATS_BACKEND_RTT_P99_NS                    0x22
+#define STATS_BACKEND_RTT_P999_NS                   0x23
+
+#define STATS_ITEM_LEN                              10      // Id, index and a 64 bit little endian value
+#define STATS_ITEMS_MAX                             (REQUEST_RESPONSE_FRAME_PAYLOAD_MAX / STATS_ITEM_LEN)
+
+typedef struct __stats_item_t {
+    stats_id_t id;
+    uint8_t index;                      // Request type or backend, 0 for values of the whole server
+    uint64_t value;
+} stats_item_t;
+
 typedef struct __credentials_t {
     uint8_t username[CREDENTIALS_MAX_USERNAME_LEN + 1];
     uint8_t password[CREDENTIALS_MAX_PASSWORD_LEN + 1];
@@ -64,17 +127,119 @@ typedef struct __credentials_t {
     struct __credentials_t* next;
 } credentials_t;
 
-typedef struct __course_t {
-    char course_code[32];
+// A course as carried on the wire, in a detail lookup response or a multi lookup response record.
+// The slices borrow the bytes of the message it was read from.
+typedef struct __course_details_view_t {
+    string_slice_t course_code;
+    string_slice_t course_name;
+    string_slice_t professor;
+    string_slice_t days;
+    uint8_t credits;
+} course_details_view_t;
+
+// Read-only view of a course. The strings are borrowed from whoever stores the course.
+typedef struct __course_view_t {
+    const char* course_code;
     int credits;
-    char professor[64];
-    char days[32];
-    char course_name[128];
-    struct __course_t* next;
-} course_t;
+    const char* professor;
+    const char* days;
+    const char* course_name;
+} course_view_t;
 
 request_type_t protocol_get_request_type(const struct __message_t* message);
 
+/**
+ * @brief Get the name of a request type for logs and tools, e.g. "single lookup"
+ *
+ * @return const char* The name, NULL if the type is not a known request type
+ */
+const char* protocol_request_type_name(request_type_t type);
+
+/**
+ * @brief Get the flags of a message. Their meaning depends on its type.
+ */
+uint8_t protocol_get_flags(const struct __message_t* message);
+
+/**
+ * @brief Get the length of the frame at the start of a byte stream from its header
+ *
+ * @param data [in] Bytes received on a stream
+ * @param len [in] Number of bytes available
+ * @return size_t Header and payload length, 0 if the header is not complete yet
+ */
+size_t protocol_get_frame_len(const uint8_t* data, size_t len);
+
+/**
+ * @brief Get the trace context carried by a frame
+ *
+ * @return bool false if the frame carries none
+ */
+bool protocol_get_trace_context(const struct __message_t* message, trace_context_t* context);
+
+/**
+ * @brief Carry a trace context after the payload of a frame, replacing the one it carries
+ *
+ * @return err_t ERR_INVALID_PARAMETERS if the frame has no room left for it
+ */
+err_t protocol_set_trace_context(struct __message_t* message, const trace_context_t* context);
+
+#if defined(CLIENT) || defined(SERVER_M)
+/**
+ * @brief Get the type of a message of any size
+ */
+request_type_t protocol_get_message_type(const message_buffer_t* message);
+
+/**
+ * @brief Get the request id from the header of a message of any size
+ */
+request_id_t protocol_get_message_request_id(const message_buffer_t* message);
+
+/**
+ * @brief Set the request id in the header of an encoded message of any size
+ */
+void protocol_set_message_request_id(message_buffer_t* message, const request_id_t request_id);
+
+/**
+ * @brief Cut the next frame of a message for a stream.
+ *
+ * A message whose payload does not fit one frame is sent as fragments of up to REQUEST_RESPONSE_FRAME_PAYLOAD_MAX
+ * bytes. Each fragment repeats the header with its own payload length, and all but the last carry
+ * REQUEST_RESPONSE_TYPE_MORE_FRAGMENTS in the type.
+ *
+ * @param message [in] The encoded message
+ * @param offset [in/out] Payload bytes framed so far. Start at 0.
+ * @param out_frame [out] The frame
+ * @return true if more frames follow
+ */
+bool protocol_fragment_encode(const message_buffer_t* message, size_t* offset, struct __message_t* out_frame);
+
+/**
+ * @brief Add a received frame to the message being reassembled
+ *
+ * @param message [in/out] The message so far. Empty before the first fragment.
+ * @param frame [in] The received frame
+ * @return err_t ERR_OK once the message is complete, ERR_NETWORK_WOULD_BLOCK while fragments are missing,
+ *               ERR_INVALID_PARAMETERS if the frame does not continue the message or the message grows past TCP_MESSAGE_MAX
+ */
+err_t protocol_fragment_decode(message_buffer_t* message, const struct __message_t* frame);
+#endif // CLIENT || SERVER_M
+
+/**
+ * @brief Get the request id from the message header
+ *
+ * @param message [in] The message
+ * @return request_id_t The request id, 0 if the message has no header
+ */
+request_id_t protocol_get_request_id(const struct __message_t* message);
+
+/**
+ * @brief Set the request id in the header of an encoded message
+ *
+ * @param message [in/out] The encoded message
+ * @param request_id [in] The request id
+ */
+void protocol_set_request_id(struct __message_t* message, const request_id_t request_id);
+
 /**
  * @brief Encode a authentication request.
  * 
@@ -130,16 +295,15 @@ err_t protocol_authentication_response_decode(const struct __message_t* in_dgrm,
 err_t protocol_courses_lookup_single_request_encode(const char* course_code, const uint8_t course_code_len, const courses_lookup_category_t category, struct __message_t* out_dgrm);
 
 /**
- * @brief Decode a course information lookup request
+ * @brief Decode a course information lookup request without copying it
  * 
  * @param in_dgrm [in] The datagram to decode
- * @param course_code [out] The course to lookup information for
- * @param course_code_len [out] The length of the course id
+ * @param course_code [out] The course to lookup information for. Points into in_dgrm.
  * @param category [out] The lookup category
  * 
  * @return err_t 
  */
-err_t protocol_courses_lookup_single_request_decode(const struct __message_t* in_dgrm, char* course_code, uint8_t* course_code_len, courses_lookup_category_t* category);
+err_t protocol_courses_lookup_single_request_view(const struct __message_t* in_dgrm, string_slice_t* course_code, courses_lookup_category_t* category);
 
 /**
  * @brief Encode a course information lookup response
@@ -155,6 +319,18 @@ err_t protocol_courses_lookup_single_request_decode(const struct __message_t* in
  */
 err_t protocol_courses_lookup_single_response_encode(const char* course_code, const uint8_t course_code_len, const courses_lookup_category_t category, const uint8_t* information, const uint8_t information_len, struct __message_t* out_dgrm);
 
+/**
+ * @brief Decode a course information lookup response without copying it
+ * 
+ * @param in_dgrm [in] The datagram to decode
+ * @param course_code [out] The course the information is for. Points into in_dgrm.
+ * @param category [out] Optional. The lookup category
+ * @param information [out] The information. Points into in_dgrm.
+ * 
+ * @return err_t ERR_INVALID_PARAMETERS if the response is malformed
+ */
+err_t protocol_courses_lookup_single_response_view(const struct __message_t* in_dgrm, string_slice_t* course_code, courses_lookup_category_t* category, string_slice_t* information);
+
 /**
  * @brief Decode a course information lookup response
  * 
@@ -181,84 +357,207 @@ err_t protocol_courses_lookup_single_response_decode(const struct __message_t* i
 err_t protocol_courses_lookup_detail_request_encode(const uint8_t* course_code, const uint8_t course_code_len, struct __message_t* out_dgrm);
 
 /**
- * @brief Decode a course detail lookup request
+ * @brief Decode a course detail lookup request without copying it
  * 
  * @param in_dgrm [in] The datagram to decode
- * @param course_code [out] The course to lookup information for
- * @param course_code_len [out] The length of the course id
+ * @param course_code [out] The course to lookup information for. Points into in_dgrm.
  * 
  * @return err_t 
  */
-err_t protocol_courses_lookup_detail_request_decode(const struct __message_t* in_dgrm, uint8_t* course_code, uint8_t* course_code_len);
+err_t protocol_courses_lookup_detail_request_view(const struct __message_t* in_dgrm, string_slice_t* course_code);
 
 /**
- * @brief Encode a course detail lookup response
+ * @brief Encode a course detail lookup response. The payload is a single multi lookup response record.
  * 
  * @param course [in] The course to encode
  * @param out_dgrm [out] The encoded datagram
  * 
  * @return err_t 
  */
-err_t protocol_courses_lookup_detail_response_encode(const course_t* course, struct __message_t* out_dgrm);
+err_t protocol_courses_lookup_detail_response_encode(const course_view_t* course, struct __message_t* out_dgrm);
 
 /**
- * @brief Decode a course detail lookup response
-*/
-err_t protocol_courses_lookup_detail_response_decode(const struct __message_t* in_dgrm, course_t* course);
+ * @brief Validate a course detail lookup response and get its record without copying it
+ *
+ * @param in_dgrm [in] The datagram to decode
+ * @param record [out] The course record, ready to be placed in a multi lookup response. Points into in_dgrm.
+ * @param course [out] Optional. The fields of the record.
+ *
+ * @return err_t ERR_INVALID_PARAMETERS if the record is malformed
+ */
+err_t protocol_courses_lookup_detail_response_view(const struct __message_t* in_dgrm, string_slice_t* record, course_details_view_t* course);
 
+#if defined(CLIENT) || defined(SERVER_M)
 /**
  * @brief Encode a course list lookup request
  * 
- * @param course_count [in] The number of courses to lookup
- * @param course_codes_buffer [in] The buffer with courses to lookup
+ * @param course_count [in] The number of courses to lookup. At most MULTI_LOOKUP_MAX_COURSES.
+ * @param course_codes_buffer [in] The whitespace separated courses to lookup
  * @param course_codes_buffer_len [in] The length of the course codes buffer
- * @param out_dgrm [out] The encoded datagram
+ * @param out_message [out] The encoded message. May span several frames.
  * 
  * @return err_t 
  */
-err_t protocol_courses_lookup_multiple_request_encode(const uint8_t course_count, const uint8_t* course_codes_buffer, const uint8_t course_codes_buffer_len, struct __message_t* out_sgmnt);
+err_t protocol_courses_lookup_multiple_request_encode(const uint8_t course_count, const uint8_t* course_codes_buffer, const size_t course_codes_buffer_len, message_buffer_t* out_message);
 
-typedef void (*single_course_code_handler_t)(const uint8_t idx, const char* course_code, const uint8_t course_code_len);
+typedef void (*single_course_code_handler_t)(const uint8_t idx, const char* course_code, const uint8_t course_code_len, void* user_data);
 
 /**
  * @brief Decode a course list lookup request
  * 
- * @param in_dgrm [in] The datagram to decode
+ * @param in_message [in] The message to decode
  * @param course_count [out] The number of courses to lookup
  * @param handler [callback] Callback function called for each course code
+ * @param user_data [in] Passed through to the handler
+ * 
+ * @return err_t 
+ */
+err_t protocol_courses_lookup_multiple_request_decode(const message_buffer_t* in_message, uint8_t* course_count, single_course_code_handler_t handler, void* user_data);
+
+/**
+ * @brief Encode a course list lookup response from course records
+ * 
+ * @param records [in] The records, as returned by protocol_courses_lookup_detail_response_view()
+ * @param course_count [in] The number of records
+ * @param out_message [out] The encoded message. May span several frames.
+ * 
+ * @return err_t 
+ */
+err_t protocol_courses_lookup_multiple_response_encode(const string_slice_t* records, const uint8_t course_count, message_buffer_t* out_message);
+
+// Walks the courses of a multi lookup response in place
+typedef struct __courses_iterator_t {
+    const uint8_t* data;
+    size_t len;
+    size_t offset;
+    uint8_t remaining;              // Courses left to read
+} courses_iterator_t;
+
+/**
+ * @brief Start iterating over the courses of a course list lookup response
+ * 
+ * @param in_message [in] The message to decode. Must outlive the iterator.
+ * @param iterator [out] The iterator
  * 
  * @return err_t 
  */
-err_t protocol_courses_lookup_multiple_request_decode(const struct __message_t* in_dgrm, uint8_t* course_count, single_course_code_handler_t handler);
+err_t protocol_courses_lookup_multiple_response_iterate(const message_buffer_t* in_message, courses_iterator_t* iterator);
 
 /**
- * @brief Encode a course list lookup response
+ * @brief Get the next course of a course list lookup response
  * 
- * @param courses [in] The courses to encode
+ * @param iterator [in/out] The iterator
+ * @param course [out] The course. Its slices point into the message.
+ * 
+ * @return true if a course was read, false at the end of the response or on a malformed record.
+ *         remaining is above 0 in the latter case.
+ */
+bool protocol_courses_iterator_next(courses_iterator_t* iterator, course_details_view_t* course);
+#endif // CLIENT || SERVER_M
+
+/**
+ * @brief Encode a cache invalidation, sent by a department server to serverM when its data (re)loads
+ * 
+ * @param prefix [in] Course code prefix of the cached replies to drop. Empty drops every reply.
+ * @param prefix_len [in] The length of the prefix
  * @param out_dgrm [out] The encoded datagram
  * 
  * @return err_t 
  */
-err_t protocol_courses_lookup_multiple_response_encode(const course_t* courses, struct __message_t* out_dgrm);
+err_t protocol_cache_invalidate_encode(const char* prefix, const uint8_t prefix_len, struct __message_t* out_dgrm);
 
 /**
- * @brief Decode a course list lookup response
+ * @brief Decode a cache invalidation without copying it
  * 
  * @param in_dgrm [in] The datagram to decode
- * @param courses [out] The courses linked list
+ * @param prefix [out] The course code prefix. Points into in_dgrm.
+ * 
+ * @return err_t 
+ */
+err_t protocol_cache_invalidate_view(const struct __message_t* in_dgrm, string_slice_t* prefix);
+
+/**
+ * @brief Encode a request to change the log levels of serverM
+ * 
+ * @param spec [in] The levels, in the format of log_set_levels()
+ * @param spec_len [in] The length of spec
+ * @param out_sgmnt [out] The encoded segment
+ * 
+ * @return err_t 
+ */
+err_t protocol_log_level_request_encode(const char* spec, const uint8_t spec_len, struct __message_t* out_sgmnt);
+
+/**
+ * @brief Decode a request to change the log levels without copying it
+ * 
+ * @param in_sgmnt [in] The segment to decode
+ * @param spec [out] The levels. Points into in_sgmnt.
+ * 
+ * @return err_t 
+ */
+err_t protocol_log_level_request_view(const struct __message_t* in_sgmnt, string_slice_t* spec);
+
+/**
+ * @brief Encode the result of a log level change
+ * 
+ * @param result [in] ERR_OK if every level was applied
+ * @param out_sgmnt [out] The encoded segment
  * 
- * @note The caller needs to call protocol_courses_lookup_multiple_response_decode_dealloc() to avoid memory leaks
+ * @return err_t 
+ */
+err_t protocol_log_level_response_encode(const err_t result, struct __message_t* out_sgmnt);
+
+/**
+ * @brief Decode the result of a log level change
+ * 
+ * @param in_sgmnt [in] The segment to decode
+ * @param result [out] ERR_OK if every level was applied, ERR_CREDENTIALS_NOT_AUTHENTICATED if the connection has not logged in
  * 
  * @return err_t 
  */
-err_t protocol_courses_lookup_multiple_response_decode(const struct __message_t* in_dgrm, course_t** courses);
+err_t protocol_log_level_response_decode(const struct __message_t* in_sgmnt, err_t* result);
 
 /**
- * @brief Deallocate the memory used by a course list lookup response
+ * @brief Encode a request for the stats of a server
+ * 
+ * @param out_msg [out] The encoded message
+ * 
+ * @return err_t 
+ */
+err_t protocol_stats_request_encode(struct __message_t* out_msg);
+
+/**
+ * @brief Encode the stats of a server
+ * 
+ * @param items [in] The values
+ * @param items_count [in] Number of values, at most STATS_ITEMS_MAX
+ * @param out_msg [out] The encoded message
+ * 
+ * @return err_t ERR_INVALID_PARAMETERS if there are too many values for a frame
+ */
+err_t protocol_stats_response_encode(const stats_item_t* items, const size_t items_count, struct __message_t* out_msg);
+
+/**
+ * @brief Encode a refused stats request. The response carries the error and no values.
+ * 
+ * @param result [in] Why the stats were not sent
+ * @param out_msg [out] The encoded message
+ * 
+ * @return err_t 
+ */
+err_t protocol_stats_error_encode(const err_t result, struct __message_t* out_msg);
+
+/**
+ * @brief Decode the stats of a server
+ * 
+ * @param in_msg [in] The message to decode
+ * @param items [out] The values
+ * @param items_size [in] Room in items. Further values are skipped.
+ * @param items_count [out] Number of values decoded
  * 
- * @param course [in] The courses linked list
+ * @return err_t The error the server refused the request with, ERR_INVALID_PARAMETERS if it is not a stats response
  */
-void protocol_courses_lookup_multiple_response_decode_dealloc(course_t* course);
+err_t protocol_stats_response_decode(const struct __message_t* in_msg, stats_item_t* items, const size_t items_size, size_t* items_count);
 
 /**
  * @brief Encode a course lookup error
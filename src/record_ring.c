@@ -0,0 +1,133 @@
+#include "record_ring.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+LOG_TAG(record_ring);
+
+_Static_assert(sizeof(record_ring_header_t) == 64, "the record ring header is written to disk");
+
+static uint64_t timespec_ns(const struct timespec* ts) {
+    return (uint64_t) ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+uint64_t record_ring_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return timespec_ns(&ts);
+}
+
+static atomic_uchar* committed_flag(const record_ring_format_t* format, const void* record) {
+    return (atomic_uchar*) ((const uint8_t*) record + format->committed_offset);
+}
+
+err_t record_ring_open(record_ring_t* ring, const record_ring_format_t* format, const char* path, const char* process, size_t capacity) {
+    if (ring == NULL || format == NULL || path == NULL || capacity == 0 || ring->header != NULL) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    size_t records_count = 1;
+    while (records_count < capacity) {
+        records_count <<= 1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOG_ERR("Failed to create the %s %s", format->name, path);
+        return ERR_INVALID_PARAMETERS;
+    }
+    size_t len = sizeof(record_ring_header_t) + records_count * format->record_size;
+    // The file starts out sparse and zeroed: a record that was never written is not committed
+    void* mapping = MAP_FAILED;
+    if (ftruncate(fd, len) == 0) {
+        mapping = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        LOG_ERR("Failed to map the %s %s", format->name, path);
+        return ERR_INVALID_PARAMETERS;
+    }
+
+    struct timespec monotonic, realtime;
+    clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    clock_gettime(CLOCK_REALTIME, &realtime);
+
+    record_ring_header_t* header = (record_ring_header_t*) mapping;
+    memcpy(header->magic, format->magic, sizeof(header->magic));
+    header->version = format->version;
+    header->record_size = format->record_size;
+    header->capacity = records_count;
+    atomic_init(&header->next, 0);
+    header->realtime_offset_ns = (int64_t) (timespec_ns(&realtime) - timespec_ns(&monotonic));
+    header->pid = getpid();
+    strncpy(header->process, process ? process : "", sizeof(header->process) - 1);
+
+    ring->format = format;
+    ring->records = (uint8_t*) (header + 1);
+    ring->mapped_len = len;
+    ring->header = header;
+    return ERR_OK;
+}
+
+void record_ring_close(record_ring_t* ring) {
+    if (ring == NULL || ring->header == NULL) {
+        return;
+    }
+    record_ring_header_t* header = ring->header;
+    ring->header = NULL;
+    ring->records = NULL;
+    munmap(header, ring->mapped_len);
+}
+
+void* record_ring_claim(record_ring_t* ring) {
+    record_ring_header_t* header = ring->header;
+    if (header == NULL) {
+        return NULL;
+    }
+    uint64_t n = atomic_fetch_add_explicit(&header->next, 1, memory_order_relaxed);
+    void* record = ring->records + (n & (header->capacity - 1)) * ring->format->record_size;
+    atomic_store_explicit(committed_flag(ring->format, record), 0, memory_order_relaxed);
+    return record;
+}
+
+void record_ring_commit(const record_ring_t* ring, void* record) {
+    atomic_store_explicit(committed_flag(ring->format, record), 1, memory_order_release);
+}
+
+err_t record_ring_read(const char* path, const record_ring_format_t* format, record_ring_visit_cb_t visit, void* user_data, uint64_t* overwritten) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    bool readable = fd >= 0 && fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(record_ring_header_t);
+    void* mapping = readable ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (mapping == MAP_FAILED) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    record_ring_header_t* header = mapping;
+    if (memcmp(header->magic, format->magic, sizeof(header->magic)) != 0 || header->version != format->version
+            || header->record_size != format->record_size
+            || (size_t) st.st_size < sizeof(record_ring_header_t) + header->capacity * format->record_size) {
+        munmap(mapping, st.st_size);
+        return ERR_INVALID_PARAMETERS;
+    }
+
+    const uint8_t* records = (const uint8_t*) (header + 1);
+    uint64_t written = atomic_load(&header->next);
+    uint64_t count = written < header->capacity ? written : header->capacity;
+    for (uint64_t i = 0; i < count; i++) {
+        const void* record = records + i * format->record_size;
+        if (atomic_load(committed_flag(format, record))) {
+            visit(header, record, user_data);
+        }
+    }
+    *overwritten = written > header->capacity ? written - header->capacity : 0;
+    return ERR_OK;
+}
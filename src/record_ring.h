@@ -0,0 +1,88 @@
+#ifndef RECORD_RING_H
+#define RECORD_RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "error.h"
+
+// Start of a record ring file. The records follow it.
+typedef struct __record_ring_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;                  // Records in the file. A power of 2.
+    atomic_uint_fast64_t next;          // Records written so far. Record n is at n % capacity.
+    int64_t realtime_offset_ns;         // Add to a timestamp to get CLOCK_REALTIME
+    uint32_t pid;
+    char process[20];
+} record_ring_header_t;
+
+// What a ring holds. Every record has an atomic_uchar that is set once it is completely written.
+typedef struct __record_ring_format_t {
+    const char* name;                   // For messages, e.g. "event log"
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    size_t committed_offset;            // Of the atomic_uchar in a record
+} record_ring_format_t;
+
+// A ring file mapped for writing
+typedef struct __record_ring_t {
+    const record_ring_format_t* format;
+    record_ring_header_t* header;       // NULL until record_ring_open() succeeds
+    uint8_t* records;
+    size_t mapped_len;
+} record_ring_t;
+
+// Called for every committed record of a file
+typedef void (*record_ring_visit_cb_t) (const record_ring_header_t* header, const void* record, void* user_data);
+
+/**
+ * @brief Map a file holding a ring of fixed-size records
+ *
+ * Once the ring is full the oldest records are overwritten. Records are written to the mapping, so records
+ * written right before a crash are not lost.
+ *
+ * @param ring [out] The ring
+ * @param format What the records are
+ * @param path The file. Created or replaced.
+ * @param process Name of the process, stored in the header
+ * @param capacity Records the file holds. Rounded up to a power of 2.
+ *
+ * @return err_t ERR_OK, ERR_INVALID_PARAMETERS if the file cannot be created and mapped
+ */
+err_t record_ring_open(record_ring_t* ring, const record_ring_format_t* format, const char* path, const char* process, size_t capacity);
+
+void record_ring_close(record_ring_t* ring);
+
+/**
+ * @brief Claim the next record. Lock-free: writers never wait for each other, the oldest record is overwritten.
+ *
+ * @return void* The record, to be filled in and passed to record_ring_commit(). NULL if the ring is not open.
+ */
+void* record_ring_claim(record_ring_t* ring);
+
+/**
+ * @brief Mark a claimed record as completely written
+ */
+void record_ring_commit(const record_ring_t* ring, void* record);
+
+/**
+ * @brief Map a ring file read-only and call visit for each of its committed records
+ *
+ * The mapping is kept, so the header and records passed to visit stay valid.
+ *
+ * @param overwritten [out] Oldest records that were overwritten
+ *
+ * @return err_t ERR_OK, ERR_INVALID_PARAMETERS if the file cannot be mapped or does not hold records of format
+ */
+err_t record_ring_read(const char* path, const record_ring_format_t* format, record_ring_visit_cb_t visit, void* user_data, uint64_t* overwritten);
+
+/**
+ * @brief CLOCK_MONOTONIC in ns, the clock of the timestamps in records
+ */
+uint64_t record_ring_now_ns(void);
+
+#endif // RECORD_RING_H
@@ -0,0 +1,306 @@
+#include "response_cache.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "constants.h"
+#include "log.h"
+
+LOG_TAG(response_cache);
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a over the lower cased course code and the category
+static uint64_t key_hash(string_slice_t course_code, uint8_t category) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < course_code.len; i++) {
+        hash ^= (uint64_t) tolower((unsigned char) course_code.data[i]);
+        hash *= 0x100000001b3ULL;
+    }
+    hash ^= category;
+    hash *= 0x100000001b3ULL;
+    return hash;
+}
+
+static bool key_equals(const response_cache_entry_t* entry, uint64_t hash, string_slice_t course_code, uint8_t category) {
+    return entry->hash == hash && entry->category == category && entry->key_len == course_code.len
+        && strncasecmp(entry->key, course_code.data, course_code.len) == 0;
+}
+
+static response_cache_shard_t* shard_of(response_cache_t* cache, uint64_t hash) {
+    // The low bits pick the bucket, the high bits pick the shard
+    return &cache->shards[(hash >> 32) % cache->shards_count];
+}
+
+static void lru_unlink(response_cache_shard_t* shard, uint32_t idx) {
+    response_cache_entry_t* entry = &shard->entries[idx];
+    if (entry->lru_prev != RESPONSE_CACHE_NIL) {
+        shard->entries[entry->lru_prev].lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != RESPONSE_CACHE_NIL) {
+        shard->entries[entry->lru_next].lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+}
+
+static void lru_push_front(response_cache_shard_t* shard, uint32_t idx) {
+    response_cache_entry_t* entry = &shard->entries[idx];
+    entry->lru_prev = RESPONSE_CACHE_NIL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head != RESPONSE_CACHE_NIL) {
+        shard->entries[shard->lru_head].lru_prev = idx;
+    } else {
+        shard->lru_tail = idx;
+    }
+    shard->lru_head = idx;
+}
+
+static void bucket_unlink(response_cache_shard_t* shard, uint32_t idx) {
+    uint32_t* link = &shard->buckets[shard->entries[idx].hash & shard->buckets_mask];
+    while (*link != idx) {
+        link = &shard->entries[*link].bucket_next;
+    }
+    *link = shard->entries[idx].bucket_next;
+}
+
+// Take an entry out of its bucket and the LRU. Its value buffer is kept for the next use.
+static void entry_remove(response_cache_shard_t* shard, uint32_t idx) {
+    bucket_unlink(shard, idx);
+    lru_unlink(shard, idx);
+    shard->entries[idx].bucket_next = shard->free_head;
+    shard->free_head = idx;
+    shard->entries_count--;
+}
+
+static uint32_t entry_find(response_cache_shard_t* shard, uint64_t hash, string_slice_t course_code, uint8_t category) {
+    uint32_t idx = shard->buckets[hash & shard->buckets_mask];
+    while (idx != RESPONSE_CACHE_NIL && !key_equals(&shard->entries[idx], hash, course_code, category)) {
+        idx = shard->entries[idx].bucket_next;
+    }
+    return idx;
+}
+
+response_cache_t* response_cache_create(size_t capacity, uint64_t ttl_ms) {
+    response_cache_t* cache = calloc(1, sizeof(response_cache_t));
+    if (cache == NULL) {
+        LOG_ERR("Failed to allocate memory for response_cache_t");
+        return NULL;
+    }
+    cache->ttl_ms = ttl_ms;
+    atomic_init(&cache->generation, 0);
+    if (capacity == 0 || ttl_ms == 0) {
+        // Disabled. Every lookup misses and nothing is stored.
+        return cache;
+    }
+
+    cache->shards_count = min(capacity, RESPONSE_CACHE_SHARDS);
+    cache->shards = calloc(cache->shards_count, sizeof(response_cache_shard_t));
+    if (cache->shards == NULL) {
+        LOG_ERR("Failed to allocate memory for the response cache shards");
+        free(cache);
+        return NULL;
+    }
+    for (size_t s = 0; s < cache->shards_count; s++) {
+        response_cache_shard_t* shard = &cache->shards[s];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->capacity = (capacity + cache->shards_count - 1) / cache->shards_count;
+        // Twice as many buckets as entries keeps the chains short
+        size_t buckets = 1;
+        while (buckets < shard->capacity * 2) {
+            buckets <<= 1;
+        }
+        shard->buckets_mask = buckets - 1;
+        shard->entries = calloc(shard->capacity, sizeof(response_cache_entry_t));
+        shard->buckets = malloc(buckets * sizeof(uint32_t));
+        if (shard->entries == NULL || shard->buckets == NULL) {
+            LOG_ERR("Failed to allocate memory for a response cache shard of %zu entries", shard->capacity);
+            cache->shards_count = s + 1;
+            response_cache_destroy(cache);
+            return NULL;
+        }
+        memset(shard->buckets, 0xFF, buckets * sizeof(uint32_t));
+        shard->lru_head = shard->lru_tail = shard->free_head = RESPONSE_CACHE_NIL;
+    }
+    return cache;
+}
+
+void response_cache_destroy(response_cache_t* cache) {
+    if (cache == NULL) {
+        return;
+    }
+    for (size_t s = 0; s < cache->shards_count; s++) {
+        response_cache_shard_t* shard = &cache->shards[s];
+        if (shard->entries != NULL) {
+            for (size_t i = 0; i < shard->capacity; i++) {
+                free(shard->entries[i].value);
+            }
+        }
+        free(shard->entries);
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache->shards);
+    free(cache);
+}
+
+bool response_cache_get(response_cache_t* cache, string_slice_t course_code, uint8_t category, uint8_t* out, size_t out_size, size_t* out_len) {
+    if (cache == NULL || cache->shards_count == 0 || out == NULL || out_len == NULL) {
+        return false;
+    }
+    uint64_t hash = key_hash(course_code, category);
+    response_cache_shard_t* shard = shard_of(cache, hash);
+    bool hit = false;
+
+    pthread_mutex_lock(&shard->lock);
+    uint32_t idx = entry_find(shard, hash, course_code, category);
+    if (idx != RESPONSE_CACHE_NIL) {
+        response_cache_entry_t* entry = &shard->entries[idx];
+        if (entry->expires_ms <= now_ms()) {
+            entry_remove(shard, idx);
+            shard->stats.expirations++;
+        } else if (entry->value_len <= out_size) {
+            memcpy(out, entry->value, entry->value_len);
+            *out_len = entry->value_len;
+            // Most recently used
+            lru_unlink(shard, idx);
+            lru_push_front(shard, idx);
+            hit = true;
+        }
+    }
+    if (hit) {
+        shard->stats.hits++;
+    } else {
+        shard->stats.misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return hit;
+}
+
+uint32_t response_cache_generation(response_cache_t* cache) {
+    return cache == NULL ? 0 : atomic_load(&cache->generation);
+}
+
+err_t response_cache_put(response_cache_t* cache, string_slice_t course_code, uint8_t category, const uint8_t* value, size_t value_len, uint32_t generation) {
+    if (cache == NULL || value == NULL || value_len == 0) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    if (cache->shards_count == 0 || course_code.len == 0 || course_code.len > RESPONSE_CACHE_KEY_MAX) {
+        // Disabled, or a key that cannot be stored. Not an error for the caller.
+        return ERR_OK;
+    }
+    uint64_t hash = key_hash(course_code, category);
+    response_cache_shard_t* shard = shard_of(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    // The data may have changed since the request went out. Checked under the lock, so a concurrent
+    // invalidation either sees this entry or makes us skip it.
+    if (generation != atomic_load(&cache->generation)) {
+        pthread_mutex_unlock(&shard->lock);
+        return ERR_OK;
+    }
+    uint32_t idx = entry_find(shard, hash, course_code, category);
+    if (idx != RESPONSE_CACHE_NIL) {
+        // Refresh the entry in place
+        lru_unlink(shard, idx);
+    } else {
+        if (shard->free_head != RESPONSE_CACHE_NIL) {
+            idx = shard->free_head;
+            shard->free_head = shard->entries[idx].bucket_next;
+        } else if (shard->entries_count < shard->capacity) {
+            // Never used yet: entries are handed out in order until the shard is full
+            idx = shard->entries_count;
+        } else {
+            // Evict the least recently used entry
+            idx = shard->lru_tail;
+            entry_remove(shard, idx);
+            shard->free_head = shard->entries[idx].bucket_next;
+            shard->stats.evictions++;
+        }
+        response_cache_entry_t* entry = &shard->entries[idx];
+        entry->hash = hash;
+        entry->category = category;
+        entry->key_len = course_code.len;
+        memcpy(entry->key, course_code.data, course_code.len);
+        entry->bucket_next = shard->buckets[hash & shard->buckets_mask];
+        shard->buckets[hash & shard->buckets_mask] = idx;
+        shard->entries_count++;
+    }
+
+    response_cache_entry_t* entry = &shard->entries[idx];
+    if (value_len > entry->value_capacity) {
+        uint8_t* buffer = realloc(entry->value, value_len);
+        if (buffer == NULL) {
+            // Drop the entry rather than keep a stale value
+            lru_push_front(shard, idx);
+            entry_remove(shard, idx);
+            pthread_mutex_unlock(&shard->lock);
+            return ERR_OUT_OF_MEMORY;
+        }
+        entry->value = buffer;
+        entry->value_capacity = value_len;
+    }
+    memcpy(entry->value, value, value_len);
+    entry->value_len = value_len;
+    entry->expires_ms = now_ms() + cache->ttl_ms;
+    lru_push_front(shard, idx);
+    shard->stats.insertions++;
+    pthread_mutex_unlock(&shard->lock);
+    return ERR_OK;
+}
+
+size_t response_cache_invalidate(response_cache_t* cache, string_slice_t prefix) {
+    if (cache == NULL) {
+        return 0;
+    }
+    // Replies already in flight must not repopulate the cache with the old data
+    atomic_fetch_add(&cache->generation, 1);
+
+    size_t dropped = 0;
+    for (size_t s = 0; s < cache->shards_count; s++) {
+        response_cache_shard_t* shard = &cache->shards[s];
+        pthread_mutex_lock(&shard->lock);
+        uint32_t idx = shard->lru_head;
+        while (idx != RESPONSE_CACHE_NIL) {
+            uint32_t next = shard->entries[idx].lru_next;
+            const response_cache_entry_t* entry = &shard->entries[idx];
+            if (entry->key_len >= prefix.len && strncasecmp(entry->key, prefix.data, prefix.len) == 0) {
+                entry_remove(shard, idx);
+                shard->stats.invalidations++;
+                dropped++;
+            }
+            idx = next;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return dropped;
+}
+
+void response_cache_get_stats(response_cache_t* cache, response_cache_stats_t* stats) {
+    memset(stats, 0, sizeof(response_cache_stats_t));
+    if (cache == NULL) {
+        return;
+    }
+    for (size_t s = 0; s < cache->shards_count; s++) {
+        response_cache_shard_t* shard = &cache->shards[s];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->stats.hits;
+        stats->misses += shard->stats.misses;
+        stats->insertions += shard->stats.insertions;
+        stats->evictions += shard->stats.evictions;
+        stats->expirations += shard->stats.expirations;
+        stats->invalidations += shard->stats.invalidations;
+        stats->entries += shard->entries_count;
+        stats->capacity += shard->capacity;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
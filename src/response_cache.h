@@ -0,0 +1,116 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "utils.h"
+
+// Key category of detail lookups. Single lookups use their COURSES_LOOKUP_CATEGORY_*.
+#define RESPONSE_CACHE_DETAILS          0x00
+
+// Marks the end of a list of entries
+#define RESPONSE_CACHE_NIL              UINT32_MAX
+
+// A cached backend reply. Entries are linked into their bucket and into the LRU list of their shard by index.
+typedef struct __response_cache_entry_t {
+    uint64_t hash;
+    uint64_t expires_ms;
+    uint32_t bucket_next;
+    uint32_t lru_prev;                  // Towards the most recently used entry
+    uint32_t lru_next;                  // Towards the least recently used entry
+    uint8_t category;
+    uint8_t key_len;
+    char key[RESPONSE_CACHE_KEY_MAX];   // Course code as first stored. Compared case-insensitively.
+    uint8_t* value;
+    size_t value_len;
+    size_t value_capacity;
+} response_cache_entry_t;
+
+// Counters of a cache, summed over its shards
+typedef struct __response_cache_stats_t {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t insertions;
+    uint64_t evictions;                 // Entries dropped to make room
+    uint64_t expirations;               // Entries found past their TTL
+    uint64_t invalidations;             // Entries dropped by response_cache_invalidate()
+    size_t entries;
+    size_t capacity;
+} response_cache_stats_t;
+
+// A part of the cache with its own lock, so that lookups of different courses rarely contend
+typedef struct __response_cache_shard_t {
+    pthread_mutex_t lock;
+    response_cache_entry_t* entries;
+    size_t entries_count;               // Entries in use. Entries are handed out in order and recycled through the LRU.
+    size_t capacity;
+    uint32_t* buckets;                  // Head of each hash chain
+    size_t buckets_mask;
+    uint32_t lru_head;                  // Most recently used
+    uint32_t lru_tail;                  // Least recently used
+    uint32_t free_head;                 // Invalidated entries, chained through bucket_next
+    response_cache_stats_t stats;
+} response_cache_shard_t;
+
+/**
+ * @brief A bounded, sharded LRU cache of encoded course lookup replies keyed on (course code, category).
+ *
+ * Course codes are compared case-insensitively. Entries expire ttl_ms after they were stored.
+ */
+typedef struct __response_cache_t {
+    response_cache_shard_t* shards;
+    size_t shards_count;
+    uint64_t ttl_ms;
+    atomic_uint_fast32_t generation;    // Bumped by every invalidation
+} response_cache_t;
+
+/**
+ * @brief Create a cache
+ *
+ * @param capacity Entries the cache holds, split evenly over its shards. 0 disables the cache.
+ * @param ttl_ms Time an entry stays valid. 0 disables the cache.
+ *
+ * @return response_cache_t* The cache, NULL if it could not be allocated
+ */
+response_cache_t* response_cache_create(size_t capacity, uint64_t ttl_ms);
+
+void response_cache_destroy(response_cache_t* cache);
+
+/**
+ * @brief Copy the reply cached for a course
+ *
+ * @param out [out] Receives the reply
+ * @param out_size [in] Size of out. Replies that do not fit are reported as misses.
+ * @param out_len [out] Length of the reply
+ *
+ * @return true on a hit
+ */
+bool response_cache_get(response_cache_t* cache, string_slice_t course_code, uint8_t category, uint8_t* out, size_t out_size, size_t* out_len);
+
+/**
+ * @brief Get the generation to pass to response_cache_put() for a reply requested now
+ */
+uint32_t response_cache_generation(response_cache_t* cache);
+
+/**
+ * @brief Store the reply for a course, evicting the least recently used entry of its shard if needed
+ *
+ * @param generation The generation when the request was sent. Replies requested before an invalidation are not stored.
+ */
+err_t response_cache_put(response_cache_t* cache, string_slice_t course_code, uint8_t category, const uint8_t* value, size_t value_len, uint32_t generation);
+
+/**
+ * @brief Drop every entry whose course code starts with the prefix. An empty prefix drops everything.
+ *
+ * @return size_t Entries dropped
+ */
+size_t response_cache_invalidate(response_cache_t* cache, string_slice_t prefix);
+
+void response_cache_get_stats(response_cache_t* cache, response_cache_stats_t* stats);
+
+#endif // RESPONSE_CACHE_H
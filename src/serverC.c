@@ -9,15 +9,19 @@ authentication status.
 
 #include "database.h"
 #include "constants.h"
+#include "event_log.h"
+#include "metrics.h"
 #include "fileio.h"
 #include "log.h"
 #include "messages.h"
 #include "networking.h"
 #include "protocol.h"
+#include "server_observability.h"
+#include "trace.h"
 
 LOG_TAG(serverC);
 
-static credentials_t* credentials_db = NULL;
+static credentials_db_t* credentials_db = NULL;
 
 static void handle_auth_request_validate(const udp_dgram_t* req_dgram, udp_dgram_t* res_dgram) {
 
@@ -48,16 +52,29 @@ static void handle_auth_request_validate(const udp_dgram_t* req_dgram, udp_dgram
     protocol_authentication_response_encode(flags, res_dgram);
 }
 
+static void handle_stats_request(udp_dgram_t* res_dgram) {
+    stats_item_t items[STATS_ITEMS_MAX];
+    size_t count = metrics_stats_items(items, STATS_ITEMS_MAX - 1);
+    items[count++] = (stats_item_t) { STATS_RECORDS, 0, credentials_db->count };
+    protocol_stats_response_encode(items, count, res_dgram);
+}
+
 static void udp_message_rx_handler(udp_ctx_t* ctx, udp_endpoint_t* source, udp_dgram_t* req_dgram) {
 
     // Received a message over UDP
 
     udp_dgram_t resp_dgram = {0};
-    
+    trace_span_t span;
+    trace_span_start_from_message(&span, req_dgram);
+    event_log_message(EVENT_TAG_SERVER_C, EVENT_REQUEST_RECEIVED, req_dgram, ntohs(source->addr.sin_port));
+
     request_type_t req_type = protocol_get_request_type(req_dgram);
     if (req_type == REQUEST_TYPE_AUTH) {
         // Handle authentication request
         handle_auth_request_validate(req_dgram, &resp_dgram);
+    } else if (req_type == REQUEST_TYPE_STATS) {
+        // Handle a stats query
+        handle_stats_request(&resp_dgram);
     } else {
         // Invalid request
         LOG_WARN(SERVER_C_MESSAGE_ON_INVALID_REQUEST_RECEIVED);
@@ -65,10 +82,18 @@ static void udp_message_rx_handler(udp_ctx_t* ctx, udp_endpoint_t* source, udp_d
         protocol_authentication_response_encode(AUTH_FLAGS_FAILURE, &resp_dgram);
     }
 
+    // Echo the request id so that serverM can match the response to its request
+    protocol_set_request_id(&resp_dgram, protocol_get_request_id(req_dgram));
+
     // Send the response to the received message
+    event_log_message(EVENT_TAG_SERVER_C, EVENT_RESPONSE_SENT, &resp_dgram, ntohs(source->addr.sin_port));
     udp_send(ctx, source, &resp_dgram);
+    metrics_record_response(req_type, &resp_dgram, span.start_ns);
+    trace_span_end(&span, TRACE_KIND_SERVER, protocol_get_request_id(req_dgram), req_type, ntohs(source->addr.sin_port));
 
-    LOG_INFO(SERVER_C_MESSAGE_ON_AUTH_RESPONSE_SENT);
+    if (req_type != REQUEST_TYPE_STATS) {
+        LOG_INFO(SERVER_C_MESSAGE_ON_AUTH_RESPONSE_SENT);
+    }
 }
 
 // Print CLI Usage
@@ -103,6 +128,8 @@ int main(int argc, char** argv) {
 
     credentials_file = capture_data_file_from_args(argc, argv);
 
+    server_observability_start("serverC");
+
     // Read and store the credentials database from `CREDENTIALS_FILE`
     credentials_db = fileio_credential_server_db_create(credentials_file);
     if (!credentials_db) {
@@ -112,7 +139,12 @@ int main(int argc, char** argv) {
     }
 
     // [Debug only] Log the credentials
-    log_credentials(credentials_db);
+#if ENABLE_DEBUG_LOGS
+    for (size_t i = 0; i < credentials_db->count; i++) {
+        const credential_record_t* record = &credentials_db->credentials[i];
+        LOG_DBG("%.*s %.*s", record->username_len, record->username, record->password_len, record->password);
+    }
+#endif // ENABLE_DEBUG_LOGS
 
     // Create a UDP context. Bind it to SERVER_C_UDP_PORT_NUMBER.
     udp_ctx_t* udp = udp_start(SERVER_C_UDP_PORT_NUMBER);
@@ -128,9 +160,10 @@ int main(int argc, char** argv) {
     // Attach the UDP message handler
     udp->on_rx = udp_message_rx_handler;
 
-    // Listen to UDP messages
+    // Listen to UDP messages. Latencies are summarized now and then, between batches.
     while(1) {
-        udp_receive(udp);
+        udp_receive_batch(udp);
+        server_observability_report();
     }
 
     // Stop the UDP context. Free the memory and exit.
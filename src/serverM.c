@@ -11,42 +11,365 @@
 #include <sys/wait.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <stdbool.h>
+#include <time.h>
 
 #include "constants.h"
 #include "database.h"
+#include "event_log.h"
 #include "log.h"
+#include "metrics.h"
 #include "protocol.h"
 #include "messages.h"
 #include "networking.h"
+#include "response_cache.h"
+#include "server_observability.h"
+#include "threadpool.h"
+#include "trace.h"
 #include "utils.h"
 
 LOG_TAG(serverM);
 
 static udp_ctx_t* udp = NULL;
 static tcp_server_t* tcp = NULL;
+static reactor_t* reactor = NULL;
+static threadpool_t* workers = NULL;
+static response_cache_t* cache = NULL;
 
 static udp_endpoint_t serverC; 
 static udp_endpoint_t serverCS; 
 static udp_endpoint_t serverEE;
 
-course_t* multi_course_response = NULL;
+typedef struct __multi_lookup_t multi_lookup_t;
 
-static pthread_t thread;
-static sem_t semaphore;
+// A request forwarded to a backend server, waiting for its response
+typedef struct __pending_request_t {
+    request_id_t id;                    // 0 if the entry is free
+    request_type_t type;
+    tcp_endpoint_t* endpoint;           // Originating client. NULL once it has disconnected, and for the courses of a multi lookup.
+    request_id_t client_request_id;     // Echoed back to the client
+    multi_lookup_t* lookup;             // Multi lookup this request belongs to, if any
+    uint8_t slot;
+    uint32_t cache_generation;          // Cache generation when the request was sent
+    uint64_t deadline_ms;               // When it is answered with an error if the backend server has not replied
+    bool waiter;                        // Coalesced on a single flight. Answered, and expired, with it.
+    request_id_t next_waiter;           // Next single lookup coalesced on the same flight
+    trace_span_t span;                  // Span of the client request. Starts when it was received.
+    trace_span_t backend_span;          // Span of the request to the backend server. Starts when it was sent.
+} pending_request_t;
 
-static void on_course_lookup_error_received(udp_dgram_t *req_dgram);
+// A single lookup sent to a department server. Identical lookups received meanwhile wait for its reply
+// instead of being sent again. Stored at the index of its pending request.
+typedef struct __single_flight_t {
+    request_id_t id;                    // Request sent to the department server. 0 if the entry is free.
+    request_id_t bucket_next;           // Next flight in the same bucket
+    request_id_t waiters;               // First coalesced request, chained through next_waiter
+    bool indexed;                       // Later lookups can still find the flight
+    uint64_t hash;
+    uint64_t sent_ms;
+    courses_lookup_category_t category;
+    uint8_t course_code_len;
+    char course_code[RESPONSE_CACHE_KEY_MAX];
+} single_flight_t;
+
+// Scatter-gather state of a multi course lookup
+typedef struct __multi_lookup_slot_t {
+    request_id_t request_id;
+    bool done;
+    size_t record_offset;               // Record of the course in the lookup's records
+    size_t record_len;                  // 0 if the course was not found
+} multi_lookup_slot_t;
+
+struct __multi_lookup_t {
+    message_buffer_t request;
+    message_buffer_t records;           // Course records in arrival order. Guarded by pending_lock.
+    tcp_endpoint_t* endpoint;           // Guarded by pending_lock. NULL once the client has disconnected.
+    request_id_t client_request_id;
+    request_id_t anchor_id;             // Pending entry tying the lookup to its endpoint while it runs
+    trace_span_t span;
+    sem_t done;
+    uint16_t count;
+    uint16_t pending;                   // Up to one per course, plus the sending reference
+    multi_lookup_slot_t slots[MULTI_LOOKUP_MAX_COURSES];
+};
+
+// Per-connection state, attached to its tcp_endpoint_t
+typedef struct __session_t {
+    bool authenticated;
+    char username[CREDENTIALS_MAX_USERNAME_LEN + 1];
+    uint32_t in_flight;                 // Pending requests for this connection. Guarded by pending_lock.
+} session_t;
+
+#define SESSION(endpoint) ((session_t*) (endpoint)->session)
+
+// Requests in flight, indexed by request id. Shared between the event loop and the multi lookup workers.
+static pending_request_t pending_requests[PENDING_REQUESTS_MAX];
+static request_id_t next_request_id = 1;
+static size_t pending_count = 0;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Single lookups in flight, hashed on (course code, category). Guarded by pending_lock.
+static single_flight_t flights[PENDING_REQUESTS_MAX];
+static request_id_t flight_buckets[PENDING_REQUESTS_MAX];
+static uint64_t coalesced_lookups = 0;
+
+#define FLIGHT(id) (&flights[(id) & (PENDING_REQUESTS_MAX - 1)])
+
+// Span of the client request being dispatched, started when it was received. Only used on the event loop.
+static trace_span_t request_span;
+
+/* ======================================== Pending Requests ============================================= */
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Register a request. Must be called with pending_lock held. Returns the assigned id, 0 if the table is full.
+static request_id_t pending_request_add_locked(const pending_request_t* request) {
+    for (size_t attempt = 0; attempt < PENDING_REQUESTS_MAX; attempt++) {
+        request_id_t id = next_request_id++;
+        if (id == 0) {
+            // 0 is reserved for uncorrelated messages
+            id = next_request_id++;
+        }
+        pending_request_t* entry = &pending_requests[id & (PENDING_REQUESTS_MAX - 1)];
+        if (entry->id == 0) {
+            *entry = *request;
+            entry->id = id;
+            entry->deadline_ms = now_ms() + PENDING_REQUEST_TIMEOUT_MS;
+            pending_count++;
+            if (entry->endpoint) {
+                SESSION(entry->endpoint)->in_flight++;
+            }
+            return id;
+        }
+    }
+    LOG_ERR("Pending request table is full");
+    return 0;
+}
+
+static request_id_t pending_request_add(const pending_request_t* request) {
+    pthread_mutex_lock(&pending_lock);
+    request_id_t id = pending_request_add_locked(request);
+    pthread_mutex_unlock(&pending_lock);
+    return id;
+}
+
+// Remove a request from the table. Must be called with pending_lock held.
+static bool pending_request_take_locked(request_id_t id, pending_request_t* request) {
+    pending_request_t* entry = &pending_requests[id & (PENDING_REQUESTS_MAX - 1)];
+    if (id == 0 || entry->id != id) {
+        return false;
+    }
+    if (request) {
+        *request = *entry;
+    }
+    if (entry->endpoint) {
+        SESSION(entry->endpoint)->in_flight--;
+    }
+    entry->id = 0;
+    pending_count--;
+    return true;
+}
+
+// Send a response to a client, recording it in the event log, the metrics and the span of the request
+static void send_to_client(tcp_endpoint_t* dst, tcp_sgmnt_t* sgmnt, const trace_span_t* span) {
+    event_log_message(EVENT_TAG_SERVER_M, EVENT_RESPONSE_SENT, sgmnt, ntohs(dst->addr.sin_port));
+    tcp_server_send(tcp, dst, sgmnt);
+    // Errors only answer single lookups. Every other response type mirrors its request type.
+    uint8_t response_type = protocol_get_request_type(sgmnt);
+    request_type_t request_type = response_type == RESPONSE_TYPE_COURSES_ERROR
+        ? REQUEST_TYPE_COURSES_SINGLE_LOOKUP : response_type - RESPONSE_TYPE_AUTH + REQUEST_TYPE_AUTH;
+    metrics_record_response(request_type, sgmnt, span->start_ns);
+    trace_span_end(span, TRACE_KIND_SERVER, protocol_get_request_id(sgmnt), request_type, ntohs(dst->addr.sin_port));
+}
+
+// Which backend server a datagram came from, for its round trip time
+static metrics_backend_t get_backend(const udp_endpoint_t* source) {
+    if (source->addr.sin_port == serverC.addr.sin_port) {
+        return METRICS_BACKEND_C;
+    } else if (source->addr.sin_port == serverCS.addr.sin_port) {
+        return METRICS_BACKEND_CS;
+    } else if (source->addr.sin_port == serverEE.addr.sin_port) {
+        return METRICS_BACKEND_EE;
+    }
+    return METRICS_BACKENDS;
+}
+
+// Send a request to a backend server, recording it in the event log
+static void send_to_backend(udp_endpoint_t* dst, udp_dgram_t* dgram) {
+    event_log_message(EVENT_TAG_SERVER_M, EVENT_BACKEND_REQUEST_SENT, dgram, ntohs(dst->addr.sin_port));
+    udp_send(udp, dst, dgram);
+}
+
+/* ======================================== Single Flights ============================================= */
+
+// FNV-1a over the course code as typed and the category. Only byte-identical lookups are coalesced,
+// so the reply echoes the course code of every waiter as is.
+static uint64_t single_flight_hash(string_slice_t course_code, courses_lookup_category_t category) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < course_code.len; i++) {
+        hash ^= (uint8_t) course_code.data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    hash ^= category;
+    hash *= 0x100000001b3ULL;
+    return hash;
+}
+
+// Stop later lookups from joining the flight. Must be called with pending_lock held.
+static void single_flight_unindex_locked(single_flight_t* flight) {
+    if (!flight->indexed) {
+        return;
+    }
+    request_id_t* link = &flight_buckets[flight->hash & (PENDING_REQUESTS_MAX - 1)];
+    while (*link != flight->id) {
+        link = &FLIGHT(*link)->bucket_next;
+    }
+    *link = flight->bucket_next;
+    flight->indexed = false;
+}
+
+// Find the flight of an identical lookup. Must be called with pending_lock held. Returns NULL if there is none.
+static single_flight_t* single_flight_find_locked(uint64_t hash, string_slice_t course_code, courses_lookup_category_t category) {
+    request_id_t id = flight_buckets[hash & (PENDING_REQUESTS_MAX - 1)];
+    while (id != 0) {
+        single_flight_t* flight = FLIGHT(id);
+        if (flight->hash == hash && flight->category == category && flight->course_code_len == course_code.len
+                && memcmp(flight->course_code, course_code.data, course_code.len) == 0) {
+            if (now_ms() - flight->sent_ms > SINGLE_FLIGHT_MAX_AGE_MS) {
+                // The reply may have been lost. The next lookup goes to the department server again.
+                single_flight_unindex_locked(flight);
+                return NULL;
+            }
+            return flight;
+        }
+        id = flight->bucket_next;
+    }
+    return NULL;
+}
+
+// Let identical lookups wait on a request that was just sent
+static void single_flight_start(request_id_t id, string_slice_t course_code, courses_lookup_category_t category) {
+    if (course_code.len > RESPONSE_CACHE_KEY_MAX) {
+        return;
+    }
+    uint64_t hash = single_flight_hash(course_code, category);
+    pthread_mutex_lock(&pending_lock);
+    // The reply may already have been handled
+    if (pending_requests[id & (PENDING_REQUESTS_MAX - 1)].id == id) {
+        single_flight_t* flight = FLIGHT(id);
+        flight->id = id;
+        flight->waiters = 0;
+        flight->hash = hash;
+        flight->sent_ms = now_ms();
+        flight->category = category;
+        flight->course_code_len = course_code.len;
+        memcpy(flight->course_code, course_code.data, course_code.len);
+        flight->bucket_next = flight_buckets[hash & (PENDING_REQUESTS_MAX - 1)];
+        flight_buckets[hash & (PENDING_REQUESTS_MAX - 1)] = id;
+        flight->indexed = true;
+    }
+    pthread_mutex_unlock(&pending_lock);
+}
+
+// Attach a lookup to an identical one in flight. Returns false if there is none, the lookup must then be sent.
+static bool single_flight_join(tcp_endpoint_t* src, request_id_t client_request_id, string_slice_t course_code, courses_lookup_category_t category) {
+    if (course_code.len > RESPONSE_CACHE_KEY_MAX) {
+        return false;
+    }
+    uint64_t hash = single_flight_hash(course_code, category);
+    request_id_t leader_id = 0;
+    pthread_mutex_lock(&pending_lock);
+    single_flight_t* flight = single_flight_find_locked(hash, course_code, category);
+    if (flight != NULL) {
+        // The waiter is a pending request of its own, so a disconnect forgets its endpoint like any other
+        pending_request_t waiter = { .type = REQUEST_TYPE_COURSES_SINGLE_LOOKUP, .endpoint = src, .client_request_id = client_request_id, .waiter = true, .next_waiter = flight->waiters, .span = request_span };
+        request_id_t id = pending_request_add_locked(&waiter);
+        if (id != 0) {
+            flight->waiters = id;
+            leader_id = flight->id;
+            coalesced_lookups++;
+        }
+    }
+    pthread_mutex_unlock(&pending_lock);
+    if (leader_id != 0) {
+        event_log_record(EVENT_TAG_SERVER_M, EVENT_SINGLE_FLIGHT_JOINED, client_request_id, leader_id, 0, 0, 0);
+        LOG_DBG("Coalesced the lookup of %.*s with request %u", (int) course_code.len, course_code.data, leader_id);
+    }
+    return leader_id != 0;
+}
+
+// Send the reply of a single lookup to every lookup that waited on it. Must be called with pending_lock held,
+// which keeps the endpoints valid. The request id of the reply is restored before returning.
+static void single_flight_complete_locked(request_id_t id, udp_dgram_t* reply) {
+    single_flight_t* flight = FLIGHT(id);
+    if (flight->id != id) {
+        return;
+    }
+    single_flight_unindex_locked(flight);
+    flight->id = 0;
+
+    pending_request_t waiter;
+    request_id_t waiter_id = flight->waiters;
+    while (waiter_id != 0 && pending_request_take_locked(waiter_id, &waiter)) {
+        waiter_id = waiter.next_waiter;
+        if (waiter.endpoint) {
+            protocol_set_request_id(reply, waiter.client_request_id);
+            send_to_client(waiter.endpoint, reply, &waiter.span);
+            LOG_INFO(SERVER_M_MESSAGE_ON_RESULT_FORWARDED);
+        }
+    }
+    protocol_set_request_id(reply, id);
+}
+
+/* ======================================== Sessions ============================================= */
+
+static void on_tcp_endpoint_open(tcp_server_t* tcp, tcp_endpoint_t* endpoint) {
+    endpoint->session = calloc(1, sizeof(session_t));
+    if (endpoint->session == NULL) {
+        // Without a session the connection cannot be served
+        LOG_ERR("Failed to allocate memory for session_t");
+        shutdown(endpoint->sd, SHUT_RDWR);
+    }
+}
+
+// Forget the endpoint of a disconnected client. Responses for its requests are dropped.
+static void on_tcp_endpoint_close(tcp_server_t* tcp, tcp_endpoint_t* endpoint) {
+    session_t* session = SESSION(endpoint);
+    if (session == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pending_lock);
+    for (size_t i = 0; i < PENDING_REQUESTS_MAX && session->in_flight > 0; i++) {
+        pending_request_t* entry = &pending_requests[i];
+        if (entry->id != 0 && entry->endpoint == endpoint) {
+            entry->endpoint = NULL;
+            session->in_flight--;
+            if (entry->lookup) {
+                entry->lookup->endpoint = NULL;
+            }
+        }
+    }
+    endpoint->session = NULL;
+    pthread_mutex_unlock(&pending_lock);
+    free(session);
+}
 
 /* ======================================== Authentication ============================================= */
 
-static void set_username(char* username, uint8_t username_len) {
-    strncpy(tcp->username, username, min(username_len, CREDENTIALS_MAX_USERNAME_LEN));
+static void set_username(session_t* session, char* username, uint8_t username_len) {
+    memset(session->username, 0, sizeof(session->username));
+    strncpy(session->username, username, min(username_len, CREDENTIALS_MAX_USERNAME_LEN));
 }
 
-static void clear_username() {
-    memset(tcp->username, 0, CREDENTIALS_MAX_USERNAME_LEN);
+static void clear_username(session_t* session) {
+    memset(session->username, 0, sizeof(session->username));
 }
 
-static void authenticate_user(credentials_t* user) {
+static void authenticate_user(credentials_t* user, tcp_endpoint_t* src, request_id_t client_request_id) {
     if (udp) {
         udp_dgram_t dgram = {0};
         credentials_t enc_user = {0};
@@ -55,9 +378,16 @@ static void authenticate_user(credentials_t* user) {
         if (database_credentials_encrypt(user, &enc_user) == ERR_OK) {
             // Encode the authentication request
             if (protocol_authentication_request_encode(&enc_user, &dgram) == ERR_OK) {
-                // Send the request to the authentication server
-                udp_send(udp, &serverC, &dgram);
-                LOG_INFO(SERVER_M_MESSAGE_ON_AUTH_REQUEST_FORWARDED);
+                pending_request_t request = { .type = REQUEST_TYPE_AUTH, .endpoint = src, .client_request_id = client_request_id, .span = request_span };
+                trace_span_start_child(&request.backend_span, &request.span);
+                request_id_t id = pending_request_add(&request);
+                if (id != 0) {
+                    protocol_set_request_id(&dgram, id);
+                    trace_span_inject(&request.backend_span, &dgram);
+                    // Send the request to the authentication server
+                    send_to_backend(&serverC, &dgram);
+                    LOG_INFO(SERVER_M_MESSAGE_ON_AUTH_REQUEST_FORWARDED);
+                }
             }
         }
     }
@@ -68,204 +398,516 @@ static void on_auth_request_received(tcp_server_t* tcp, tcp_endpoint_t* src, tcp
     // Decode the authentication request
     if (protocol_authentication_request_decode(sgmnt, &credentials) == ERR_OK) {
         LOG_INFO(SERVER_M_MESSAGE_ON_AUTH_REQUEST_RECEIVED, credentials.username, ntohs(src->addr.sin_port));
-        // Store the username of the authenticating user.
-        set_username((char*) credentials.username, credentials.username_len);
+        // Store the username of the authenticating user. A new attempt drops the previous login.
+        SESSION(src)->authenticated = false;
+        set_username(SESSION(src), (char*) credentials.username, credentials.username_len);
         // Authenticate the user
-        authenticate_user(&credentials);
+        authenticate_user(&credentials, src, protocol_get_request_id(sgmnt));
     }
 }
 
-static void on_auth_response_received(udp_dgram_t* req_dgram) {
+static void on_auth_response_received(udp_dgram_t* req_dgram, tcp_endpoint_t* dst, const trace_span_t* span) {
     // Response received for authentication result. Forward to client.
     uint8_t auth_result = AUTH_SUCCESS;
     protocol_authentication_response_decode(req_dgram, &auth_result);
     if (AUTH_MASK_FAILURE(auth_result)) {
         // Clear the username if the user failed to authenticate
-        clear_username();
+        clear_username(SESSION(dst));
+    } else if (AUTH_MASK_SUCCESS(auth_result)) {
+        SESSION(dst)->authenticated = true;
     }
-    tcp_server_send(tcp, tcp->endpoints, req_dgram);
+    send_to_client(dst, req_dgram, span);
     LOG_INFO(SERVER_M_MESSAGE_ON_AUTH_RESULT_FORWARDED);
 }
 
 /* ============================================================================================================ */
 
-static udp_endpoint_t* get_department_server_endpoint(const char* course_code) {
-    if (strncasecmp((char*) course_code, DEPARTMENT_PREFIX_EE, DEPARTMENT_PREFIX_LEN) == 0) {
+static udp_endpoint_t* get_department_server_endpoint(string_slice_t course_code) {
+    if (course_code.len < DEPARTMENT_PREFIX_LEN) {
+        return NULL;
+    } else if (strncasecmp(course_code.data, DEPARTMENT_PREFIX_EE, DEPARTMENT_PREFIX_LEN) == 0) {
         return &serverEE;
-    } else if (strncasecmp((char*) course_code, DEPARTMENT_PREFIX_CS, DEPARTMENT_PREFIX_LEN) == 0) {
+    } else if (strncasecmp(course_code.data, DEPARTMENT_PREFIX_CS, DEPARTMENT_PREFIX_LEN) == 0) {
         return &serverCS;
     } else {
         return NULL;
     }
 }
 
-static void send_request_to_department_server(udp_dgram_t* dgram, const char* course_code, uint8_t course_code_len) {
+// Register the request as pending and send it to the department server. Returns the request id, 0 on failure.
+static request_id_t send_request_to_department_server(udp_dgram_t* dgram, string_slice_t course_code, const pending_request_t* request) {
     // Figure out which department server to send the request to based on the course code
-    udp_endpoint_t* endpoint = get_department_server_endpoint((char*) course_code);
-        if (endpoint) {
-            // Send the request to the department server
-            udp_send(udp, endpoint, dgram);
-            LOG_INFO(SERVER_M_MESSAGE_ON_QUERY_FORWARDED, 2, course_code);
-        } else {
-            // Send an error response to the client
-            LOG_WARN("Invalid course code: %.*s", course_code_len, course_code);
-            protocol_courses_error_encode(ERR_COURSES_NOT_FOUND, (uint8_t*) course_code, course_code_len, dgram);
-            on_course_lookup_error_received(dgram);
-            // sem_post(&semaphore);
-        }
+    udp_endpoint_t* endpoint = get_department_server_endpoint(course_code);
+    if (!endpoint) {
+        LOG_WARN("Invalid course code: %.*s", (int) course_code.len, course_code.data);
+        return 0;
+    }
+    pending_request_t cached_request = *request;
+    cached_request.cache_generation = response_cache_generation(cache);
+    trace_span_start_child(&cached_request.backend_span, &request->span);
+    request_id_t id = pending_request_add(&cached_request);
+    if (id != 0) {
+        protocol_set_request_id(dgram, id);
+        // Replaces the context of the client in a forwarded request
+        trace_span_inject(&cached_request.backend_span, dgram);
+        // Send the request to the department server
+        send_to_backend(endpoint, dgram);
+        LOG_INFO(SERVER_M_MESSAGE_ON_QUERY_FORWARDED, 2, course_code.data);
+    }
+    return id;
 }
 
-static void request_course_category_information(char* course_code, uint8_t course_code_len, courses_lookup_category_t category) {
-    if (udp) {
-        udp_dgram_t dgram = {0};
-        // Encode the course category lookup request
-        protocol_courses_lookup_single_request_encode(course_code, course_code_len, category, &dgram);
-        // send request to department server
-        send_request_to_department_server(&dgram, course_code, course_code_len);
+// Answer a single course lookup from the cache. Returns false on a miss.
+static bool answer_course_category_from_cache(tcp_endpoint_t* src, request_id_t client_request_id, string_slice_t course_code, courses_lookup_category_t category) {
+    udp_dgram_t dgram;
+    string_slice_t echoed_code, information;
+    if (!response_cache_get(cache, course_code, category, dgram.data, sizeof(dgram.data), &dgram.data_len)
+            || protocol_courses_lookup_single_response_view(&dgram, &echoed_code, NULL, &information) != ERR_OK
+            || echoed_code.len != course_code.len) {
+        return false;
     }
+    // The reply may have been cached for a request typed in another case. Echo this one.
+    memcpy((char*) echoed_code.data, course_code.data, course_code.len);
+    protocol_set_request_id(&dgram, client_request_id);
+    event_log_record(EVENT_TAG_SERVER_M, EVENT_CACHE_HIT, client_request_id, category, course_code.len, 0, 0);
+    send_to_client(src, &dgram, &request_span);
+    LOG_DBG("Answered %.*s from the cache", (int) course_code.len, course_code.data);
+    LOG_INFO(SERVER_M_MESSAGE_ON_RESULT_FORWARDED);
+    return true;
 }
 
-static void request_course_details(const uint8_t* course_code, const uint8_t course_code_len) {
+static void request_course_category_information(tcp_endpoint_t* src, tcp_sgmnt_t* req_sgmnt, string_slice_t course_code, courses_lookup_category_t category) {
     if (udp) {
-        udp_dgram_t dgram = {0};
-        // Encode the course detail lookup request
-        protocol_courses_lookup_detail_request_encode(course_code, course_code_len, &dgram);
-        // Send the request to the department server
-        send_request_to_department_server(&dgram, (const char*) course_code, course_code_len);
+        request_id_t client_request_id = protocol_get_request_id(req_sgmnt);
+        if (answer_course_category_from_cache(src, client_request_id, course_code, category)
+                || single_flight_join(src, client_request_id, course_code, category)) {
+            return;
+        }
+        pending_request_t request = { .type = REQUEST_TYPE_COURSES_SINGLE_LOOKUP, .endpoint = src, .client_request_id = client_request_id, .span = request_span };
+        // The department server takes the same request. Forward the segment as is, under our own request id.
+        request_id_t id = send_request_to_department_server(req_sgmnt, course_code, &request);
+        if (id != 0) {
+            // Identical lookups received before the reply wait for it
+            single_flight_start(id, course_code, category);
+        } else {
+            // Send an error response to the client
+            udp_dgram_t dgram = {0};
+            protocol_courses_error_encode(ERR_COURSES_NOT_FOUND, (uint8_t*) course_code.data, min(course_code.len, UINT8_MAX), &dgram);
+            protocol_set_request_id(&dgram, client_request_id);
+            send_to_client(src, &dgram, &request_span);
+        }
     }
 }
 
 static void on_course_lookup_info_request_received(tcp_server_t* tcp, tcp_endpoint_t* src, tcp_sgmnt_t* req_sgmnt) {
     LOG_INFO("Received course lookup info request from " IP_ADDR_FORMAT, IP_ADDR(src));
 
-    char course_code[10] = {0};
-    uint8_t size = sizeof(course_code);
+    string_slice_t course_code = {0};
     courses_lookup_category_t category = COURSES_LOOKUP_CATEGORY_INVALID;
 
-    // Decode Single Course Lookup Request
-    if (protocol_courses_lookup_single_request_decode(req_sgmnt, course_code, &size, &category) == ERR_OK) {
-        LOG_INFO(SERVER_M_MESSAGE_ON_QUERY_RECEIVED, tcp->username, course_code, database_courses_category_string_from_enum(category), ntohs(src->addr.sin_port));
+    // Decode Single Course Lookup Request. The course code points into the segment.
+    if (protocol_courses_lookup_single_request_view(req_sgmnt, &course_code, &category) == ERR_OK) {
+        LOG_INFO(SERVER_M_MESSAGE_ON_QUERY_RECEIVED, SESSION(src)->username, (int) course_code.len, course_code.data, database_courses_category_string_from_enum(category), ntohs(src->addr.sin_port));
         // Send Single Course Lookup Request to Department Server
-        request_course_category_information(course_code, size, category);
+        request_course_category_information(src, req_sgmnt, course_code, category);
     } else {
         LOG_ERR("Failed to decode course lookup info request");
     }
 }
 
-static course_t* insert_to_end_of_linked_list(course_t* list, course_t* item) {
-    item->next = NULL;
-    if (list == NULL) {
-        list = item;
-    } else {
-        course_t* ptr = list;
-        while (ptr->next) {
-            ptr = ptr->next;
+// Record the response for a slot. Must be called with pending_lock held. Wakes the worker when the last one arrives.
+// The record is copied, the datagram it points into is reused once this returns.
+static void multi_lookup_complete_locked(multi_lookup_t* lookup, uint8_t slot, const string_slice_t* record) {
+    if (slot < lookup->count && !lookup->slots[slot].done) {
+        lookup->slots[slot].done = true;
+        if (record != NULL) {
+            size_t offset = lookup->records.data_len;
+            if (message_buffer_append(&lookup->records, record->data, record->len) == ERR_OK) {
+                lookup->slots[slot].record_offset = offset;
+                lookup->slots[slot].record_len = record->len;
+            }
+        }
+        if (--lookup->pending == 0) {
+            sem_post(&lookup->done);
         }
-        ptr->next = item;
     }
-    return list;
 }
 
-static void drop_linked_list(course_t* ptr) {
-    while (ptr) {
-        course_t* next = ptr->next;
-        free(ptr);
-        ptr = next;
+static void single_course_code_handler(const uint8_t idx, const char* course_code, const uint8_t course_code_len, void* user_data) {
+    multi_lookup_t* lookup = (multi_lookup_t*) user_data;
+    LOG_DBG("%d) Requesting course details for %.*s", idx, course_code_len, course_code);
+
+    // Register the slot before sending so that a fast response always finds it
+    pthread_mutex_lock(&pending_lock);
+    uint8_t slot = lookup->count++;
+    lookup->pending++;
+    pthread_mutex_unlock(&pending_lock);
+
+    udp_dgram_t dgram;
+    string_slice_t record;
+    if (response_cache_get(cache, (string_slice_t) { course_code, course_code_len }, RESPONSE_CACHE_DETAILS, dgram.data, sizeof(dgram.data), &dgram.data_len)
+            && protocol_courses_lookup_detail_response_view(&dgram, &record, NULL) == ERR_OK) {
+        // Cached. The department server is not asked.
+        event_log_record(EVENT_TAG_SERVER_M, EVENT_CACHE_HIT, lookup->client_request_id, RESPONSE_CACHE_DETAILS, course_code_len, 0, 0);
+        pthread_mutex_lock(&pending_lock);
+        multi_lookup_complete_locked(lookup, slot, &record);
+        pthread_mutex_unlock(&pending_lock);
+        return;
     }
-}
 
-static void single_course_code_handler(const uint8_t idx, const char* course_code, const uint8_t course_code_len) {
-    LOG_DBG("%d) Requesting course details for %.*s", idx, course_code_len, course_code);
-    // Request course details for individual course code
-    request_course_details((const uint8_t*) course_code, course_code_len);
-    // Wait for response
-    sem_wait(&semaphore);
+    // No endpoint on the slot's entry: the client may disconnect meanwhile, and the lookup's anchor already tracks it
+    pending_request_t request = { .type = REQUEST_TYPE_COURSES_DETAIL_LOOKUP, .client_request_id = lookup->client_request_id, .lookup = lookup, .slot = slot, .span = lookup->span };
+    // Request course details for individual course code. Responses are gathered once every request is out.
+    protocol_courses_lookup_detail_request_encode((const uint8_t*) course_code, course_code_len, &dgram);
+    request_id_t id = send_request_to_department_server(&dgram, (string_slice_t) { course_code, course_code_len }, &request);
+
+    pthread_mutex_lock(&pending_lock);
+    if (id == 0) {
+        // Not sent. The course is skipped in the response.
+        multi_lookup_complete_locked(lookup, slot, NULL);
+    } else {
+        lookup->slots[slot].request_id = id;
+    }
+    pthread_mutex_unlock(&pending_lock);
 }
 
-static void* multi_request_thread(void* params) {
-    LOG_DBG("Starting multi request thread");
-    tcp_sgmnt_t* req_sgmnt = (tcp_sgmnt_t*) params;
+// Runs on a worker. The task owns the lookup and the copy of the request in it.
+static void multi_request_task(void* params) {
+    LOG_DBG("Starting multi request task");
+    multi_lookup_t* lookup = (multi_lookup_t*) params;
 
     uint8_t courses_length = 0;
-    multi_course_response = NULL;
-    // Decode the multiple course lookup request. single_course_code_handler is called for each course code
-    protocol_courses_lookup_multiple_request_decode(req_sgmnt, &courses_length, single_course_code_handler);
-    LOG_DBG("Received multi request for %d courses", courses_length);
-    log_courses(multi_course_response);
-
-    tcp_sgmnt_t sgmnt = {0};
-    // Encode the multiple course lookup response.
-    protocol_courses_lookup_multiple_response_encode(multi_course_response, &sgmnt);
-    // Send the multiple course lookup response.
-    tcp_server_send(tcp, tcp->endpoints, &sgmnt);
-
-    // Free the linked list containing the course information.
-    course_t* ptr = multi_course_response;
-    drop_linked_list(ptr);
-    multi_course_response = NULL;
-    thread = (pthread_t) NULL;
+    struct timespec deadline = {0};
 
-    return NULL;
+    // Decode the multiple course lookup request. single_course_code_handler sends the request for each course code
+    protocol_courses_lookup_multiple_request_decode(&lookup->request, &courses_length, single_course_code_handler, lookup);
+    LOG_DBG("Sent multi request for %d courses", courses_length);
+
+    // Release the sending reference and wait for every response or the deadline
+    pthread_mutex_lock(&pending_lock);
+    bool complete = --lookup->pending == 0;
+    pthread_mutex_unlock(&pending_lock);
+    if (!complete) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += MULTI_LOOKUP_TIMEOUT_MS / 1000;
+        deadline.tv_nsec += (MULTI_LOOKUP_TIMEOUT_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (sem_timedwait(&lookup->done, &deadline) < 0 && errno == EINTR);
+    }
+
+    // Assemble the found courses in request order. Late responses are dropped from here on.
+    string_slice_t records[MULTI_LOOKUP_MAX_COURSES];
+    uint16_t records_count = 0;
+    pthread_mutex_lock(&pending_lock);
+    if (lookup->pending > 0) {
+        LOG_WARN("Multi lookup timed out with %d responses outstanding", lookup->pending);
+    }
+    uint16_t missing = lookup->pending;
+    for (uint16_t i = 0; i < lookup->count; i++) {
+        multi_lookup_slot_t* slot = &lookup->slots[i];
+        if (!slot->done) {
+            pending_request_take_locked(slot->request_id, NULL);
+        }
+    }
+    pthread_mutex_unlock(&pending_lock);
+
+    // No response can reach the lookup any more, its records stay put. The anchor keeps it tied to the client until
+    // the response is sent, so that a disconnect still clears the endpoint.
+    for (uint16_t i = 0; i < lookup->count; i++) {
+        if (lookup->slots[i].record_len > 0) {
+            records[records_count++] = (string_slice_t) { (const char*) lookup->records.data + lookup->slots[i].record_offset, lookup->slots[i].record_len };
+        }
+    }
+
+    event_log_record(EVENT_TAG_SERVER_M, EVENT_MULTI_LOOKUP_DONE, lookup->client_request_id, lookup->count, records_count, missing, 0);
+
+    // Encode the multiple course lookup response. It grows past a single frame as needed.
+    message_buffer_t response = {0};
+    err_t err = protocol_courses_lookup_multiple_response_encode(records, records_count, &response);
+    protocol_set_message_request_id(&response, lookup->client_request_id);
+
+    // The endpoint stays valid while pending_lock is held
+    pthread_mutex_lock(&pending_lock);
+    pending_request_take_locked(lookup->anchor_id, NULL);
+    if (err != ERR_OK) {
+        LOG_ERR("Failed to encode the multi lookup response");
+    } else if (lookup->endpoint) {
+        // Send the multiple course lookup response.
+        event_log_record(EVENT_TAG_SERVER_M, EVENT_RESPONSE_SENT, lookup->client_request_id, RESPONSE_TYPE_COURSES_MULTI_LOOKUP,
+            response.data[REQUEST_RESPONSE_FLAGS_OFFSET], response.data_len, ntohs(lookup->endpoint->addr.sin_port));
+        tcp_server_send_message(tcp, lookup->endpoint, &response);
+        // Courses whose response never came make the lookup count as failed
+        metrics_record_request(REQUEST_TYPE_COURSES_MULTI_LOOKUP, missing == 0 ? ERR_OK : ERR_NETWORK_FAILURE, missing == 0,
+            metrics_now_ns() - lookup->span.start_ns);
+        trace_span_end(&lookup->span, TRACE_KIND_SERVER, lookup->client_request_id, REQUEST_TYPE_COURSES_MULTI_LOOKUP, ntohs(lookup->endpoint->addr.sin_port));
+    }
+    pthread_mutex_unlock(&pending_lock);
+
+    message_buffer_release(&response);
+    message_buffer_release(&lookup->records);
+    message_buffer_release(&lookup->request);
+    sem_destroy(&lookup->done);
+    free(lookup);
 }
 
-static void on_course_lookup_multi_request_received(tcp_server_t* tcp, tcp_endpoint_t* src, tcp_sgmnt_t* req_sgmnt) {
+static void on_course_lookup_multi_request_received(tcp_server_t* tcp, tcp_endpoint_t* src, const message_buffer_t* request) {
     LOG_DBG("Received course lookup multiple request from " IP_ADDR_FORMAT, IP_ADDR(src));
-    // Start a new thread to handle the request
-    pthread_create(&thread, NULL, multi_request_thread, (void*) req_sgmnt);
+    // The request belongs to the receive loop. The lookup keeps its own copy.
+    multi_lookup_t* lookup = calloc(1, sizeof(multi_lookup_t));
+    if (lookup == NULL) {
+        LOG_ERR("Failed to allocate memory for multi request");
+        return;
+    }
+    if (message_buffer_append(&lookup->request, request->data, request->data_len) != ERR_OK) {
+        free(lookup);
+        return;
+    }
+    lookup->endpoint = src;
+    lookup->client_request_id = protocol_get_message_request_id(request);
+    lookup->span = request_span;
+    // Hold one pending reference while requests are being sent, so the worker is woken only after the last one.
+    lookup->pending = 1;
+    sem_init(&lookup->done, 0, 0);
+
+    pending_request_t anchor = { .type = REQUEST_TYPE_COURSES_MULTI_LOOKUP, .endpoint = src, .lookup = lookup };
+    lookup->anchor_id = pending_request_add(&anchor);
+
+    // Hand the lookup to a worker
+    if (lookup->anchor_id == 0 || threadpool_submit(workers, multi_request_task, lookup) != ERR_OK) {
+        LOG_ERR("Failed to queue multi request");
+        pthread_mutex_lock(&pending_lock);
+        pending_request_take_locked(lookup->anchor_id, NULL);
+        pthread_mutex_unlock(&pending_lock);
+        message_buffer_release(&lookup->request);
+        sem_destroy(&lookup->done);
+        free(lookup);
+    }
 }
 
-static void on_single_course_lookup_info_response_received(udp_dgram_t* req_dgram) {
+static void on_single_course_lookup_info_response_received(udp_dgram_t* req_dgram, tcp_endpoint_t* dst, const trace_span_t* span) {
     // Forward the single course lookup response to the client
-    tcp_server_send(tcp, tcp->endpoints, req_dgram);
+    send_to_client(dst, req_dgram, span);
     LOG_INFO(SERVER_M_MESSAGE_ON_RESULT_FORWARDED);
 }
 
-static void on_course_lookup_error_received(udp_dgram_t* req_dgram) {
+static void on_course_lookup_error_received(udp_dgram_t* req_dgram, tcp_endpoint_t* dst, const trace_span_t* span) {
     // On course lookup error response from department server
     err_t error_code = ERR_OK;
     protocol_courses_error_decode(req_dgram, &error_code, NULL, NULL);
     LOG_WARN("Received course lookup error (%d).", error_code);
-    if (!thread) {
-        // This is a single course query. Send the response.
-        tcp_server_send(tcp, tcp->endpoints, req_dgram);
-    } else {
-        // This is a multi course query. Signal the thread to continue.
-        sem_post(&semaphore);
+    // This is a single course query. Send the response.
+    send_to_client(dst, req_dgram, span);
+}
+
+static void on_cache_invalidate_received(udp_dgram_t* req_dgram) {
+    string_slice_t prefix;
+    if (protocol_cache_invalidate_view(req_dgram, &prefix) == ERR_OK) {
+        size_t dropped = response_cache_invalidate(cache, prefix);
+        LOG_INFO("Dropped %zu cached replies for courses starting with \"%.*s\".", dropped, (int) prefix.len, prefix.data);
     }
 }
 
 static void on_udp_server_rx(udp_ctx_t* udp, udp_endpoint_t* source, udp_dgram_t* req_dgram) {
     // Received a response from a backend server
     uint8_t response_type = protocol_get_request_type(req_dgram);
+    string_slice_t record = {0};
+    course_details_view_t course;
+    bool has_record = false;
+    pending_request_t request = {0};
+    event_log_message(EVENT_TAG_SERVER_M, EVENT_BACKEND_RESPONSE_RECEIVED, req_dgram, ntohs(source->addr.sin_port));
+
+    if (response_type == REQUEST_TYPE_CACHE_INVALIDATE) {
+        // A department server (re)loaded its data
+        on_cache_invalidate_received(req_dgram);
+        return;
+    }
+
+    if (response_type == RESPONSE_TYPE_COURSES_DETAIL_LOOKUP) {
+        LOG_INFO("Received course detail response.");
+        // On course detail response from department server. Validate it before taking the lock.
+        has_record = protocol_courses_lookup_detail_response_view(req_dgram, &record, &course) == ERR_OK;
+        if (has_record) {
+            log_course(&course);
+        }
+    }
+
+    // Find the request this is a response to
+    pthread_mutex_lock(&pending_lock);
+    if (!pending_request_take_locked(protocol_get_request_id(req_dgram), &request)) {
+        pthread_mutex_unlock(&pending_lock);
+        LOG_WARN("Dropping response %d for unknown request %u.", response_type, protocol_get_request_id(req_dgram));
+        return;
+    }
+    metrics_record_backend_rtt(get_backend(source), metrics_now_ns() - request.backend_span.start_ns);
+    trace_span_end(&request.backend_span, TRACE_KIND_CLIENT, request.id, request.type, ntohs(source->addr.sin_port));
+    if (request.lookup) {
+        // Part of a multi course query. Hand the course to its slot. Errors leave the slot empty.
+        multi_lookup_complete_locked(request.lookup, request.slot, has_record ? &record : NULL);
+        pthread_mutex_unlock(&pending_lock);
+        if (has_record) {
+            response_cache_put(cache, course.course_code, RESPONSE_CACHE_DETAILS, req_dgram->data, req_dgram->data_len, request.cache_generation);
+        }
+        return;
+    }
+    if (request.type == REQUEST_TYPE_COURSES_SINGLE_LOOKUP) {
+        // Answers, errors included, go to every lookup coalesced on this one
+        single_flight_complete_locked(request.id, req_dgram);
+    }
+    pthread_mutex_unlock(&pending_lock);
+
+    if (response_type == RESPONSE_TYPE_COURSES_SINGLE_LOOKUP) {
+        // Cache the reply before its request id is rewritten. Hits overwrite the id anyway.
+        string_slice_t course_code, information;
+        courses_lookup_category_t category;
+        if (protocol_courses_lookup_single_response_view(req_dgram, &course_code, &category, &information) == ERR_OK) {
+            response_cache_put(cache, course_code, category, req_dgram->data, req_dgram->data_len, request.cache_generation);
+        }
+    }
+
+    if (request.endpoint == NULL) {
+        LOG_WARN("Client disconnected before the response to request %u arrived.", request.id);
+        return;
+    }
+    // Answer the client with the id of its own request
+    protocol_set_request_id(req_dgram, request.client_request_id);
+
     if (response_type == RESPONSE_TYPE_AUTH) {
         LOG_INFO(SERVER_M_MESSAGE_ON_AUTH_RESULT_RECEIVED, ntohs(source->addr.sin_port));
         // On auth response from auth server
-        on_auth_response_received(req_dgram);
+        on_auth_response_received(req_dgram, request.endpoint, &request.span);
     } else if (response_type == RESPONSE_TYPE_COURSES_SINGLE_LOOKUP) {
         LOG_INFO("Received course lookup info response for a single course.");
         // On single course lookup response from department server
-        on_single_course_lookup_info_response_received(req_dgram);
-    } else if (response_type == RESPONSE_TYPE_COURSES_DETAIL_LOOKUP) {
-        LOG_INFO("Received course detail response.");
-        course_t* course = calloc(1, sizeof(course_t));
-        // On course detail response from department server
-        if (protocol_courses_lookup_detail_response_decode(req_dgram, course) == ERR_OK) {
-            // Insert into linked list
-            multi_course_response = insert_to_end_of_linked_list(multi_course_response, course);
-        }
-        // Signal semaphore to place next request
-        sem_post(&semaphore);
+        on_single_course_lookup_info_response_received(req_dgram, request.endpoint, &request.span);
     } else if (response_type == RESPONSE_TYPE_COURSES_ERROR) {
-        on_course_lookup_error_received(req_dgram);
+        on_course_lookup_error_received(req_dgram, request.endpoint, &request.span);
     } else {
         LOG_ERR("SERVER_M_MESSAGE_ON_UNKNOWN_REQUEST_TYPE: %d", response_type);
-        // On unknown response type
-        sem_post(&semaphore);
     }
 }
 
+// Answer a request its backend server did not reply to. Must be called with pending_lock held, which keeps the
+// endpoints valid.
+static void pending_request_expire_locked(const pending_request_t* request) {
+    trace_span_end(&request->backend_span, TRACE_KIND_CLIENT, request->id, request->type, 0);
+    if (request->lookup) {
+        // A course of a multi lookup. It is left out of the response.
+        multi_lookup_complete_locked(request->lookup, request->slot, NULL);
+        return;
+    }
+
+    udp_dgram_t reply = {0};
+    if (request->type == REQUEST_TYPE_AUTH) {
+        // Neither user not found nor password mismatch, the login just failed
+        protocol_authentication_response_encode(AUTH_FLAGS_FAILURE, &reply);
+    } else {
+        // The course code is only known to the flight. Lookups coalesced on this one get the same error.
+        single_flight_t* flight = FLIGHT(request->id);
+        uint8_t course_code_len = flight->id == request->id ? flight->course_code_len : 0;
+        protocol_courses_error_encode(ERR_NETWORK_FAILURE, (uint8_t*) flight->course_code, course_code_len, &reply);
+        protocol_set_request_id(&reply, request->id);
+        single_flight_complete_locked(request->id, &reply);
+    }
+    if (request->endpoint == NULL) {
+        return;
+    }
+    protocol_set_request_id(&reply, request->client_request_id);
+    if (request->type == REQUEST_TYPE_AUTH) {
+        on_auth_response_received(&reply, request->endpoint, &request->span);
+    } else {
+        send_to_client(request->endpoint, &reply, &request->span);
+    }
+}
+
+// Fail the requests whose reply was lost or whose backend server is down, so that their clients get an answer
+// and their entries are not held forever. Runs on the event loop.
+static void pending_requests_expire(void) {
+    static uint64_t last_sweep_ms = 0;
+    uint64_t now = now_ms();
+    if (now - last_sweep_ms < PENDING_REQUEST_SWEEP_INTERVAL_MS) {
+        return;
+    }
+    last_sweep_ms = now;
+
+    size_t expired = 0;
+    pthread_mutex_lock(&pending_lock);
+    for (size_t i = 0; i < PENDING_REQUESTS_MAX && pending_count > 0; i++) {
+        pending_request_t* entry = &pending_requests[i];
+        // Multi lookups are timed out by their worker, coalesced lookups together with the one they wait on
+        if (entry->id == 0 || entry->waiter || entry->type == REQUEST_TYPE_COURSES_MULTI_LOOKUP || now < entry->deadline_ms) {
+            continue;
+        }
+        pending_request_t request;
+        pending_request_take_locked(entry->id, &request);
+        pending_request_expire_locked(&request);
+        expired++;
+    }
+    pthread_mutex_unlock(&pending_lock);
+    if (expired > 0) {
+        LOG_WARN("%zu requests got no reply from the backend servers within %d ms.", expired, PENDING_REQUEST_TIMEOUT_MS);
+    }
+}
+
+// Change the log levels without a restart. Only a logged in user may. The result is sent back.
+static void on_log_level_request_received(tcp_server_t* tcp, tcp_endpoint_t* src, tcp_sgmnt_t* req_sgmnt) {
+    string_slice_t spec;
+    err_t result = protocol_log_level_request_view(req_sgmnt, &spec);
+    if (result == ERR_OK && !SESSION(src)->authenticated) {
+        LOG_WARN("Refused a log level change from " IP_ADDR_FORMAT ", which has not logged in.", IP_ADDR(src));
+        result = ERR_CREDENTIALS_NOT_AUTHENTICATED;
+    } else if (result == ERR_OK) {
+        result = log_set_levels(spec.data, spec.len);
+        // Logged as a warning, so that it shows at any level but off
+        LOG_WARN("Log levels set to \"%.*s\" by " IP_ADDR_FORMAT " (%d).", (int) spec.len, spec.data, IP_ADDR(src), result);
+    }
+    tcp_sgmnt_t sgmnt;
+    protocol_log_level_response_encode(result, &sgmnt);
+    protocol_set_request_id(&sgmnt, protocol_get_request_id(req_sgmnt));
+    send_to_client(src, &sgmnt, &request_span);
+}
+
+// Answer with a snapshot of the counters, so that a loaded server can be watched live. Only a logged in user gets
+// them, they are not for every client of the public port.
+static void on_stats_request_received(tcp_server_t* tcp, tcp_endpoint_t* src, tcp_sgmnt_t* req_sgmnt) {
+    tcp_sgmnt_t sgmnt;
+    if (!SESSION(src)->authenticated) {
+        LOG_WARN("Refused the stats to " IP_ADDR_FORMAT ", which has not logged in.", IP_ADDR(src));
+        protocol_stats_error_encode(ERR_CREDENTIALS_NOT_AUTHENTICATED, &sgmnt);
+        protocol_set_request_id(&sgmnt, protocol_get_request_id(req_sgmnt));
+        send_to_client(src, &sgmnt, &request_span);
+        return;
+    }
+
+    stats_item_t items[STATS_ITEMS_MAX];
+    size_t count = metrics_stats_items(items, STATS_ITEMS_MAX - 8);
+
+    response_cache_stats_t cache_stats;
+    response_cache_get_stats(cache, &cache_stats);
+    pthread_mutex_lock(&pending_lock);
+    items[count++] = (stats_item_t) { STATS_PENDING_REQUESTS, 0, pending_count };
+    items[count++] = (stats_item_t) { STATS_COALESCED_LOOKUPS, 0, coalesced_lookups };
+    pthread_mutex_unlock(&pending_lock);
+    items[count++] = (stats_item_t) { STATS_CONNECTIONS, 0, tcp->endpoints_count };
+    items[count++] = (stats_item_t) { STATS_QUEUE_DEPTH, 0, threadpool_queue_depth(workers) };
+    items[count++] = (stats_item_t) { STATS_CACHE_HITS, 0, cache_stats.hits };
+    items[count++] = (stats_item_t) { STATS_CACHE_MISSES, 0, cache_stats.misses };
+    items[count++] = (stats_item_t) { STATS_CACHE_ENTRIES, 0, cache_stats.entries };
+
+    protocol_stats_response_encode(items, count, &sgmnt);
+    protocol_set_request_id(&sgmnt, protocol_get_request_id(req_sgmnt));
+    send_to_client(src, &sgmnt, &request_span);
+}
+
 static void on_tcp_server_rx(tcp_server_t* tcp, tcp_endpoint_t* src, tcp_sgmnt_t* req_sgmnt) {
+    if (SESSION(src) == NULL) {
+        return;
+    }
+    trace_span_start_from_message(&request_span, req_sgmnt);
     uint8_t request_type = protocol_get_request_type(req_sgmnt);
+    event_log_message(EVENT_TAG_SERVER_M, EVENT_REQUEST_RECEIVED, req_sgmnt, ntohs(src->addr.sin_port));
     switch (request_type) {
         case REQUEST_TYPE_AUTH:
             // Received auth request
@@ -276,8 +918,16 @@ static void on_tcp_server_rx(tcp_server_t* tcp, tcp_endpoint_t* src, tcp_sgmnt_t
             on_course_lookup_info_request_received(tcp, src, req_sgmnt);
             break;
         case REQUEST_TYPE_COURSES_MULTI_LOOKUP:
-            // Received a request for multiple courses
-            on_course_lookup_multi_request_received(tcp, src, req_sgmnt);
+            // Received a request for multiple courses that fits a single segment
+            on_course_lookup_multi_request_received(tcp, src, &MESSAGE_BUFFER_VIEW(req_sgmnt->data, req_sgmnt->data_len));
+            break;
+        case REQUEST_TYPE_LOG_LEVEL:
+            // Received a log level change
+            on_log_level_request_received(tcp, src, req_sgmnt);
+            break;
+        case REQUEST_TYPE_STATS:
+            // Received a stats query
+            on_stats_request_received(tcp, src, req_sgmnt);
             break;
         default:
             LOG_ERR("Unknown type: %d", request_type);
@@ -285,38 +935,75 @@ static void on_tcp_server_rx(tcp_server_t* tcp, tcp_endpoint_t* src, tcp_sgmnt_t
     }
 }
 
-static void tick(tcp_server_t* tcp, udp_ctx_t* udp) {
-    if (tcp != NULL) {
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-        memcpy(&read_fds, &tcp->server_fd_set, sizeof(tcp->server_fd_set));
-        FD_SET(udp->sd, &read_fds);
-
-        struct timeval timeout = { .tv_sec = 1, .tv_usec = 100*1000 };
-        int err = select(max(udp->sd, tcp->max_sd) + 1, &read_fds, NULL, NULL, &timeout);
-        if (err > 0) {            
-            for (int sd = min(tcp->sd, udp->sd); sd <= tcp->max_sd; sd++) {
-                if (FD_ISSET(sd, &read_fds)) {
-                    if (sd == udp->sd) {
-                        // Data on UDP socket
-                        udp_receive(udp);
-                    } else if (sd == tcp->sd) {
-                        // Data on TCP Parent socket
-                        tcp_server_accept(tcp);
-                    } else {
-                        // Data on TCP Child socket
-                        tcp_server_receive(tcp, sd);
-                    }
-                }
-            }
+// A request that was sent as several frames
+static void on_tcp_server_rx_message(tcp_server_t* tcp, tcp_endpoint_t* src, const message_buffer_t* request) {
+    if (SESSION(src) == NULL) {
+        return;
+    }
+    // Messages sent as several frames carry no trace context
+    trace_span_start_root(&request_span, 0);
+    uint8_t request_type = protocol_get_message_type(request);
+    event_log_record(EVENT_TAG_SERVER_M, EVENT_REQUEST_RECEIVED, protocol_get_message_request_id(request), request_type,
+        request->data[REQUEST_RESPONSE_FLAGS_OFFSET], request->data_len, ntohs(src->addr.sin_port));
+    if (request_type == REQUEST_TYPE_COURSES_MULTI_LOOKUP) {
+        // Received a request for many courses
+        on_course_lookup_multi_request_received(tcp, src, request);
+    } else {
+        LOG_ERR("Unexpected %ld byte message of type: %d", request->data_len, request_type);
+    }
+}
+
+// Print CLI Usage
+static void print_usage(void) {
+    LOG_ERR("Usage: ./serverM [--cache-ttl <ms>] [--cache-entries <count>]");
+    exit(1);
+}
+
+// Read the optional cache settings. A TTL or a size of 0 disables the cache.
+static void capture_cache_settings_from_args(int argc, char** argv, uint64_t* ttl_ms, size_t* entries) {
+    for (int i = 1; i < argc; i += 2) {
+        char* end = NULL;
+        if (i + 1 >= argc) {
+            print_usage();
+        }
+        unsigned long long value = strtoull(argv[i + 1], &end, 10);
+        if (end == argv[i + 1] || *end != '\0') {
+            print_usage();
+        }
+        if (strcmp(argv[i], "--cache-ttl") == 0) {
+            *ttl_ms = value;
+        } else if (strcmp(argv[i], "--cache-entries") == 0) {
+            *entries = value;
+        } else {
+            print_usage();
         }
     }
 }
 
-int main() {
+// Report the cache and coalescing counters so that the cache size and TTL can be tuned. Quiet while there is no traffic.
+static void log_lookup_stats(void) {
+    static uint64_t last_lookups = 0;
+    response_cache_stats_t stats;
+    response_cache_get_stats(cache, &stats);
+    pthread_mutex_lock(&pending_lock);
+    uint64_t coalesced = coalesced_lookups;
+    pthread_mutex_unlock(&pending_lock);
+    if (stats.hits + stats.misses != last_lookups) {
+        last_lookups = stats.hits + stats.misses;
+        LOG_INFO("%llu single lookups coalesced with one in flight.", (unsigned long long) coalesced);
+        LOG_INFO("Response cache: %llu hits, %llu misses, %zu / %zu entries, %llu evicted, %llu expired, %llu invalidated.",
+            (unsigned long long) stats.hits, (unsigned long long) stats.misses, stats.entries, stats.capacity,
+            (unsigned long long) stats.evictions, (unsigned long long) stats.expirations, (unsigned long long) stats.invalidations);
+    }
+}
+
+int main(int argc, char** argv) {
+
+    uint64_t cache_ttl_ms = RESPONSE_CACHE_TTL_MS;
+    size_t cache_entries = RESPONSE_CACHE_ENTRIES;
+    capture_cache_settings_from_args(argc, argv, &cache_ttl_ms, &cache_entries);
 
-    // Initialize semaphores
-    sem_init(&semaphore, 0, 0);
+    server_observability_start("serverM");
 
     // Initialize server addresses
     SERVER_ADDR_PORT(serverC.addr, SERVER_C_UDP_PORT_NUMBER);
@@ -339,15 +1026,43 @@ int main() {
         return 1;
     }
 
+    // Start the workers for multi course lookups
+    workers = threadpool_create(SERVER_M_WORKER_THREADS, SERVER_M_TASK_QUEUE_SIZE);
+    if (!workers) {
+        LOG_ERR(SERVER_M_MESSAGE_ON_BOOTUP_FAILURE, "Error starting worker threads");
+        return 1;
+    }
+
+    // Cache of department server replies
+    cache = response_cache_create(cache_entries, cache_ttl_ms);
+    if (!cache) {
+        LOG_ERR(SERVER_M_MESSAGE_ON_BOOTUP_FAILURE, "Error allocating the response cache");
+        return 1;
+    }
+
     // Register callbacks
     udp->on_rx = on_udp_server_rx;
     tcp->on_rx = on_tcp_server_rx;
+    tcp->on_rx_message = on_tcp_server_rx_message;
+    tcp->on_open = on_tcp_endpoint_open;
+    tcp->on_close = on_tcp_endpoint_close;
+
+    // Create the event loop. It owns the TCP listener, the TCP children and the UDP socket.
+    reactor = reactor_create();
+    if (!reactor || reactor_attach_tcp_server(reactor, tcp) != ERR_OK || reactor_attach_udp(reactor, udp) != ERR_OK) {
+        LOG_ERR(SERVER_M_MESSAGE_ON_BOOTUP_FAILURE, "Error starting event loop");
+        return 1;
+    }
 
     LOG_INFO(SERVER_M_MESSAGE_ON_BOOTUP);
 
     // Start listening for requests
     while(1) {
-        tick(tcp, udp);
+        reactor_tick(reactor, SERVER_M_REACTOR_TICK_TIMEOUT_MS);
+        pending_requests_expire();
+        if (server_observability_report()) {
+            log_lookup_stats();
+        }
     }
 
     return 0;
@@ -0,0 +1,44 @@
+#include "server_observability.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "constants.h"
+#include "event_log.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+
+LOG_TAG(server_observability);
+
+// Only read and written by the server's loop
+static uint64_t last_report_ns = 0;
+
+void server_observability_start(const char* process) {
+    // Log from a background thread, so that the request path does not wait on stdout
+    if (log_start(getenv(LOG_FILE_ENV)) != ERR_OK) {
+        LOG_WARN("Failed to start the log thread. Logging synchronously.");
+    }
+    metrics_start();
+    last_report_ns = metrics_now_ns();
+    // Trace requests to a binary event log when asked to. `make eventlog` builds its decoder.
+    const char* event_log_path = getenv(EVENT_LOG_ENV);
+    if (event_log_path != NULL && event_log_open(event_log_path, process, EVENT_LOG_RECORDS) != ERR_OK) {
+        LOG_WARN("Failed to open the event log %s", event_log_path);
+    }
+    // Record the spans of traced requests when asked to. `make tracemerge` builds the tool that joins them up.
+    const char* trace_path = getenv(TRACE_FILE_ENV);
+    if (trace_path != NULL && trace_open(trace_path, process, TRACE_RECORDS) != ERR_OK) {
+        LOG_WARN("Failed to open the trace file %s", trace_path);
+    }
+}
+
+bool server_observability_report(void) {
+    uint64_t now_ns = metrics_now_ns();
+    if (now_ns - last_report_ns < METRICS_REPORT_INTERVAL_S * 1000000000ULL) {
+        return false;
+    }
+    metrics_log_summary();
+    last_report_ns = now_ns;
+    return true;
+}
@@ -0,0 +1,23 @@
+#ifndef SERVER_OBSERVABILITY_H
+#define SERVER_OBSERVABILITY_H
+
+#include <stdbool.h>
+
+/**
+ * @brief Set up what every server records: the log thread, the metrics, and the event log and trace file named by
+ * the EVENT_LOG and TRACE_FILE environment variables
+ *
+ * A part that fails to start is logged and left out. The server runs without it.
+ *
+ * @param process Name of the server, stored in the event log and trace file
+ */
+void server_observability_start(const char* process);
+
+/**
+ * @brief Log the metrics summary once every METRICS_REPORT_INTERVAL_S. Call it from the server's loop.
+ *
+ * @return bool true if the summary was due, so that the server can report its own counters with it
+ */
+bool server_observability_report(void);
+
+#endif // SERVER_OBSERVABILITY_H
@@ -0,0 +1,155 @@
+#include "threadpool.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include "log.h"
+
+LOG_TAG(threadpool);
+
+// Bounded MPMC queue after Dmitry Vyukov's design. A slot is free for the producer at position pos when its
+// sequence equals pos, and holds a task for the consumer at position pos when its sequence equals pos + 1.
+static bool threadpool_enqueue(threadpool_t* pool, const threadpool_task_t* task) {
+    size_t pos = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+    while (true) {
+        threadpool_slot_t* slot = &pool->slots[pos & pool->mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&pool->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                slot->task = *task;
+                atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            // The consumers have not freed this slot yet: the queue is full
+            return false;
+        } else {
+            pos = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+static bool threadpool_dequeue(threadpool_t* pool, threadpool_task_t* task) {
+    size_t pos = atomic_load_explicit(&pool->dequeue_pos, memory_order_relaxed);
+    while (true) {
+        threadpool_slot_t* slot = &pool->slots[pos & pool->mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t) sequence - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&pool->dequeue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                *task = slot->task;
+                // Hand the slot back to the producers one lap later
+                atomic_store_explicit(&slot->sequence, pos + pool->mask + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            // The producer of this slot has not finished writing it
+            return false;
+        } else {
+            pos = atomic_load_explicit(&pool->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+static void* threadpool_worker(void* params) {
+    threadpool_t* pool = (threadpool_t*) params;
+    while (true) {
+        while (sem_wait(&pool->available) < 0 && errno == EINTR);
+
+        threadpool_task_t task;
+        // A posted task may sit behind a slot another producer is still writing. Wait for it.
+        while (!threadpool_dequeue(pool, &task)) {
+            if (atomic_load(&pool->stopping)) {
+                return NULL;
+            }
+            sched_yield();
+        }
+        task.fn(task.arg);
+    }
+    return NULL;
+}
+
+threadpool_t* threadpool_create(size_t workers_count, size_t queue_capacity) {
+    if (workers_count == 0 || queue_capacity == 0) {
+        return NULL;
+    }
+
+    threadpool_t* pool = calloc(1, sizeof(threadpool_t));
+    if (pool == NULL) {
+        LOG_ERR("Failed to allocate memory for threadpool_t");
+        return NULL;
+    }
+
+    size_t capacity = 2;
+    while (capacity < queue_capacity) {
+        capacity <<= 1;
+    }
+    pool->slots = calloc(capacity, sizeof(threadpool_slot_t));
+    pool->workers = calloc(workers_count, sizeof(pthread_t));
+    if (pool->slots == NULL || pool->workers == NULL) {
+        LOG_ERR("Failed to allocate memory for %zu workers and %zu tasks", workers_count, capacity);
+        free(pool->slots);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    pool->mask = capacity - 1;
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&pool->slots[i].sequence, i);
+    }
+    atomic_init(&pool->enqueue_pos, 0);
+    atomic_init(&pool->dequeue_pos, 0);
+    atomic_init(&pool->stopping, false);
+    sem_init(&pool->available, 0, 0);
+
+    for (size_t i = 0; i < workers_count; i++) {
+        if (pthread_create(&pool->workers[i], NULL, threadpool_worker, pool) != 0) {
+            LOG_ERR("Failed to start worker %zu", i);
+            break;
+        }
+        pool->workers_count++;
+    }
+    if (pool->workers_count == 0) {
+        threadpool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void threadpool_destroy(threadpool_t* pool) {
+    if (pool == NULL) {
+        return;
+    }
+    atomic_store(&pool->stopping, true);
+    // One extra wake-up per worker. Each exits once it finds the queue drained.
+    for (size_t i = 0; i < pool->workers_count; i++) {
+        sem_post(&pool->available);
+    }
+    for (size_t i = 0; i < pool->workers_count; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+    sem_destroy(&pool->available);
+    free(pool->workers);
+    free(pool->slots);
+    free(pool);
+}
+
+err_t threadpool_submit(threadpool_t* pool, threadpool_task_fn_t fn, void* arg) {
+    if (pool == NULL || fn == NULL || atomic_load(&pool->stopping)) {
+        return ERR_INVALID_PARAMETERS;
+    }
+    threadpool_task_t task = { .fn = fn, .arg = arg };
+    if (!threadpool_enqueue(pool, &task)) {
+        return ERR_QUEUE_FULL;
+    }
+    sem_post(&pool->available);
+    return ERR_OK;
+}
+
+size_t threadpool_queue_depth(threadpool_t* pool) {
+    size_t dequeued = atomic_load_explicit(&pool->dequeue_pos, memory_order_relaxed);
+    size_t enqueued = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+}
@@ -0,0 +1,69 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "error.h"
+
+typedef void (*threadpool_task_fn_t)(void* arg);
+
+// A unit of work. The task owns arg, typically a heap copy of the request it serves.
+typedef struct __threadpool_task_t {
+    threadpool_task_fn_t fn;
+    void* arg;
+} threadpool_task_t;
+
+// Slot of the work queue. The sequence number tells producers and consumers whose turn the slot is.
+typedef struct __threadpool_slot_t {
+    atomic_size_t sequence;
+    threadpool_task_t task;
+} threadpool_slot_t;
+
+typedef struct __threadpool_t threadpool_t;
+
+// Fixed set of worker threads fed by a bounded lock-free multi-producer multi-consumer queue
+struct __threadpool_t {
+    threadpool_slot_t* slots;
+    size_t mask;                        // Queue capacity - 1. The capacity is a power of 2.
+    _Alignas(64) atomic_size_t enqueue_pos;
+    _Alignas(64) atomic_size_t dequeue_pos;
+    _Alignas(64) sem_t available;       // Counts queued tasks. Idle workers sleep on it.
+    atomic_bool stopping;
+    pthread_t* workers;
+    size_t workers_count;
+};
+
+/**
+ * @brief Start a pool of worker threads
+ *
+ * @param workers_count Number of worker threads
+ * @param queue_capacity Maximum number of queued tasks. Rounded up to a power of 2.
+ * @return threadpool_t* The pool, NULL if it could not be started
+ */
+threadpool_t* threadpool_create(size_t workers_count, size_t queue_capacity);
+
+/**
+ * @brief Run the queued tasks, then stop and join the workers and free the pool
+ */
+void threadpool_destroy(threadpool_t* pool);
+
+/**
+ * @brief Queue a task. Never blocks.
+ *
+ * @param pool The pool
+ * @param fn The function to run on a worker
+ * @param arg Argument passed to fn. Owned by the task.
+ * @return err_t ERR_OK if queued, ERR_QUEUE_FULL if the queue is at capacity, ERR_INVALID_PARAMETERS if the pool is stopping
+ */
+err_t threadpool_submit(threadpool_t* pool, threadpool_task_fn_t fn, void* arg);
+
+/**
+ * @brief Number of tasks queued and not yet picked up by a worker. Approximate while tasks are being queued.
+ */
+size_t threadpool_queue_depth(threadpool_t* pool);
+
+#endif // THREADPOOL_H
@@ -0,0 +1,112 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+
+LOG_TAG(trace);
+
+_Static_assert(sizeof(trace_record_t) == 48, "trace records are written to disk");
+
+const record_ring_format_t TRACE_FILE_FORMAT = {
+    .name = "trace file",
+    .magic = TRACE_FILE_MAGIC,
+    .version = TRACE_FILE_VERSION,
+    .record_size = sizeof(trace_record_t),
+    .committed_offset = offsetof(trace_record_t, committed),
+};
+
+// The mapped file. Set up by trace_open() before the threads that record spans start.
+static record_ring_t ring = {0};
+
+// Per-thread generator of trace and span ids
+static __thread uint64_t random_state = 0;
+
+// xorshift64*, seeded from the clock, the process and the thread
+static uint64_t random_next(void) {
+    if (random_state == 0) {
+        random_state = record_ring_now_ns() ^ ((uint64_t) getpid() << 32) ^ (uint64_t) pthread_self();
+        random_state |= 1;
+    }
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1DULL;
+}
+
+// Never 0, which means no span
+static uint32_t random_span_id(void) {
+    uint32_t id;
+    while ((id = (uint32_t) (random_next() >> 32)) == 0);
+    return id;
+}
+
+err_t trace_open(const char* path, const char* process, size_t capacity) {
+    return record_ring_open(&ring, &TRACE_FILE_FORMAT, path, process, capacity);
+}
+
+void trace_close(void) {
+    record_ring_close(&ring);
+}
+
+void trace_span_start_root(trace_span_t* span, double sample_rate) {
+    memset(span, 0, sizeof(trace_span_t));
+    span->start_ns = record_ring_now_ns();
+    // Top 53 bits as a uniform double in [0, 1)
+    if (sample_rate > 0 && (random_next() >> 11) * (1.0 / (1ULL << 53)) < sample_rate) {
+        while ((span->trace_id = random_next()) == 0);
+        span->span_id = random_span_id();
+    }
+}
+
+void trace_span_start_from_message(trace_span_t* span, const struct __message_t* message) {
+    trace_context_t context;
+    memset(span, 0, sizeof(trace_span_t));
+    span->start_ns = record_ring_now_ns();
+    if (protocol_get_trace_context(message, &context) && (context.flags & TRACE_FLAGS_SAMPLED) && context.trace_id != 0) {
+        span->trace_id = context.trace_id;
+        span->parent_id = context.span_id;
+        span->span_id = random_span_id();
+    }
+}
+
+void trace_span_start_child(trace_span_t* span, const trace_span_t* parent) {
+    memset(span, 0, sizeof(trace_span_t));
+    span->start_ns = record_ring_now_ns();
+    if (parent->trace_id != 0) {
+        span->trace_id = parent->trace_id;
+        span->parent_id = parent->span_id;
+        span->span_id = random_span_id();
+    }
+}
+
+void trace_span_inject(const trace_span_t* span, struct __message_t* message) {
+    if (span->trace_id == 0) {
+        return;
+    }
+    trace_context_t context = { .trace_id = span->trace_id, .span_id = span->span_id, .flags = TRACE_FLAGS_SAMPLED };
+    if (protocol_set_trace_context(message, &context) != ERR_OK) {
+        LOG_DBG("No room for the trace context of a %zu byte message", message->data_len);
+    }
+}
+
+void trace_span_end(const trace_span_t* span, trace_kind_t kind, request_id_t request_id, uint8_t request_type, uint16_t peer_port) {
+    if (ring.header == NULL || span->trace_id == 0) {
+        return;
+    }
+    uint64_t end_ns = record_ring_now_ns();
+    trace_record_t* record = record_ring_claim(&ring);
+    record->trace_id = span->trace_id;
+    record->start_ns = span->start_ns;
+    record->end_ns = end_ns;
+    record->span_id = span->span_id;
+    record->parent_id = span->parent_id;
+    record->request_id = request_id;
+    record->kind = kind;
+    record->request_type = request_type;
+    record->peer_port = peer_port;
+    record_ring_commit(&ring, record);
+}
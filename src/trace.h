@@ -0,0 +1,89 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "protocol.h"
+#include "record_ring.h"
+
+#define TRACE_FILE_MAGIC                "EE450TRC"
+#define TRACE_FILE_VERSION              1
+
+// Side of a hop a span times
+typedef uint8_t trace_kind_t;
+#define TRACE_KIND_CLIENT               0x01    // From sending a request to receiving its response
+#define TRACE_KIND_SERVER               0x02    // From receiving a request to sending its response
+
+// A finished span. Fixed size, so that the file is an array of them.
+typedef struct __trace_record_t {
+    uint64_t trace_id;
+    uint64_t start_ns;                  // CLOCK_MONOTONIC
+    uint64_t end_ns;
+    uint32_t span_id;
+    uint32_t parent_id;                 // 0 for the span that started the trace
+    request_id_t request_id;            // As seen by this process
+    trace_kind_t kind;
+    uint8_t request_type;
+    uint16_t peer_port;
+    atomic_uchar committed;             // Set once the record is completely written
+    uint8_t reserved[7];
+} trace_record_t;
+
+// Trace files are record rings of trace_record_t. Pass to record_ring_read() to read one.
+extern const record_ring_format_t TRACE_FILE_FORMAT;
+
+// A span being timed. Its start is set even when the request is not traced, so it doubles as the receive time.
+typedef struct __trace_span_t {
+    uint64_t trace_id;                  // 0 if the request is not traced
+    uint32_t span_id;
+    uint32_t parent_id;
+    uint64_t start_ns;
+} trace_span_t;
+
+/**
+ * @brief Record the spans of this process to a memory-mapped record ring from now on
+ *
+ * @param path The file. Created or replaced.
+ * @param process Name of the process, stored in the header
+ * @param capacity Records the file holds. Rounded up to a power of 2.
+ *
+ * @return err_t ERR_OK, ERR_INVALID_PARAMETERS if the file cannot be created and mapped
+ */
+err_t trace_open(const char* path, const char* process, size_t capacity);
+
+void trace_close(void);
+
+/**
+ * @brief Start the span of a request that may start a trace. Only the client starts traces.
+ *
+ * @param sample_rate Share of the requests that are traced, in [0, 1]
+ */
+void trace_span_start_root(trace_span_t* span, double sample_rate);
+
+/**
+ * @brief Start the span of a received request, as a child of the span of its sender.
+ * The span is not traced unless the request carries a sampled trace context.
+ */
+void trace_span_start_from_message(trace_span_t* span, const struct __message_t* message);
+
+/**
+ * @brief Start a span of this process under another one, traced if the parent is
+ */
+void trace_span_start_child(trace_span_t* span, const trace_span_t* parent);
+
+/**
+ * @brief Carry the context of a traced span in the request it sends, so that the receiver's span becomes its child.
+ * Does nothing if the span is not traced.
+ */
+void trace_span_inject(const trace_span_t* span, struct __message_t* message);
+
+/**
+ * @brief Record a finished span. Does nothing if the span is not traced or trace_open() did not succeed. Lock-free.
+ */
+void trace_span_end(const trace_span_t* span, trace_kind_t kind, request_id_t request_id, uint8_t request_type, uint16_t peer_port);
+
+#endif // TRACE_H
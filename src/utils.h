@@ -1,11 +1,22 @@
 #ifndef __UTILS_H__
 #define __UTILS_H__
 
+#include <stddef.h>
+#include <string.h>
+
 #include "constants.h"
 
 #define max(a,b) ((a) > (b) ? (a) : (b))
 #define min(a,b) ((a) < (b) ? (a) : (b))
 
+// Length delimited string, not necessarily NUL terminated
+typedef struct __string_slice_t {
+    const char* data;
+    size_t len;
+} string_slice_t;
+
+#define STRING_SLICE(s) ((string_slice_t) { (s), strlen(s) })
+
 #define SERVER_ADDR_PORT(addr, port) do { \
     addr.sin_family = AF_INET; \
     addr.sin_addr.s_addr = htonl(LOCALHOST); \
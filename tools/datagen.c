@@ -0,0 +1,442 @@
+/**
+ * Generates a synthetic dataset at any scale for the loader, index and cache
+ * benchmarks: department course files, the credentials file and a trace of
+ * requests against them.
+ *
+ * Into the output directory go
+ * - `<prefix>.txt` for every department, in the format of data/cs.txt. The
+ *   first two departments are CS and EE, the ones the servers load.
+ * - `popularity.csv`, the rank and request probability of every course. The
+ *   probabilities follow a Zipf distribution over a random order of courses.
+ * - `cred.txt`, encrypted with database_credentials_encrypt like data/cred.txt,
+ *   and `cred_unencrypted.txt` with the same users in plain text.
+ * - `requests.txt`, one request per line: `auth <username> <password>`,
+ *   `single <course code> <category>` or `multi <course code>...`. Courses are
+ *   drawn by popularity. `./out/loadgen --replay` sends them in order.
+ *
+ * The same options and seed always give the same files.
+ * Build with `make datagen`, then
+ * `./out/datagen [--out <dir>] [--courses <n>] [--departments <m>] [--users <n>] [--requests <n>]
+ *   [--zipf <s>] [--mix auth=1,single=8,multi=1] [--multi-size <n>] [--miss <fraction>] [--seed <n>]`.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "../src/constants.h"
+#include "../src/database.h"
+
+#define DATAGEN_OUT_DIR             "out/data"
+#define DATAGEN_COURSES             10000
+#define DATAGEN_DEPARTMENTS         2
+#define DATAGEN_USERS               10000
+#define DATAGEN_REQUESTS            100000
+#define DATAGEN_ZIPF                1.0
+#define DATAGEN_MULTI_SIZE          4
+#define DATAGEN_MISS                0.02
+#define DATAGEN_SECTIONS_PER_PROFESSOR  3   // Courses per professor, on average
+#define DATAGEN_PATH_MAX            4096
+
+#define COUNT_OF(array)             (sizeof(array) / sizeof((array)[0]))
+
+// Two letters each, like DEPARTMENT_PREFIX_LEN
+static const char* PREFIXES[] = {
+    "CS", "EE", "MA", "PH", "CH", "BI", "EC", "ME", "CE", "AE", "BM", "IS", "PS",
+    "LI", "HI", "AR", "MU", "EN", "GE", "AS", "PY", "SO", "LW", "BU", "AC", "FI",
+};
+
+static const char* FIRST_NAMES[] = {
+    "Ali", "Wade", "Eun", "Todd", "Chao", "Wei-Min", "Sanjay", "Marco", "Moe", "Priya", "James", "Maria", "Hiroshi", "Fatima",
+    "Olga", "David", "Mei", "Carlos", "Aisha", "John", "Sofia", "Arjun", "Elena", "Kwame", "Lucas", "Yuki", "Omar", "Grace",
+    "Ivan", "Nadia", "Peter", "Lin", "Rosa", "Samuel", "Anika", "Tariq", "Julia", "Kenji", "Leila", "Michael", "Zhen", "Ana",
+};
+
+static const char* LAST_NAMES[] = {
+    "Zahid", "Hsu", "Kim", "Brun", "Wang", "Shen", "Madhav", "Paolieri", "Tabar", "Raghavachary", "Smith", "Garcia", "Nguyen",
+    "Patel", "Chen", "Johnson", "Rodriguez", "Tanaka", "Ivanova", "Okafor", "Muller", "Rossi", "Kowalski", "Haddad", "Silva",
+    "Sato", "Khan", "Nakamura", "Lee", "Martin", "Andersson", "Park", "Gupta", "Cohen", "Dubois", "Yilmaz", "Mensah", "Lopez",
+};
+
+static const char* TITLES[] = {
+    "Introduction to", "Foundations of", "Advanced", "Topics in", "Principles of", "Applied", "Computational Methods in",
+    "Seminar in", "Analysis of", "Theory of", "Special Topics in",
+};
+
+static const char* SUBJECTS[] = {
+    "Computer Networks", "Digital Systems", "Artificial Intelligence", "Machine Learning", "Operating Systems", "Databases",
+    "Signal Processing", "Quantum Information Processing", "Wearable Technology", "Control Systems", "Software Engineering",
+    "Computer Architecture", "Wireless Communication", "Compilers", "Computer Graphics", "Distributed Systems", "Robotics",
+    "Embedded Systems", "Probability", "Linear Algebra", "Optimization", "Information Theory", "Power Systems", "Cryptography",
+    "Human Computer Interaction", "Computer Vision", "Natural Language Processing", "VLSI Design", "Electromagnetics",
+};
+
+// A value with how often it is picked, in percent
+typedef struct __datagen_weighted_t {
+    const char* value;
+    unsigned weight;
+} datagen_weighted_t;
+
+// Formatted like data/cs.txt
+static const datagen_weighted_t DAYS[] = {
+    { "Tue;Thu", 36 }, { "Mon;Wed", 34 }, { "Mon;Wed;Fri", 8 }, { "Monday", 4 }, { "Tuesday", 4 }, { "Wednesday", 4 },
+    { "Thursday", 4 }, { "Friday", 4 }, { "Saturday", 2 },
+};
+
+static const datagen_weighted_t CREDITS[] = { { "4", 68 }, { "3", 22 }, { "2", 7 }, { "1", 3 } };
+
+// The categories requests ask for, spelled like the client reads them
+static const char* CATEGORIES[] = { "Credits", "Professor", "Days", "CourseName" };
+
+// Characters of generated passwords. No separators: `,` splits the credentials file and spaces split the requests.
+static const char PASSWORD_CHARS[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789!@#$%^&*()";
+
+static const char* MIX_NAMES[] = { "auth", "single", "multi" };
+#define DATAGEN_MIX_TYPES           COUNT_OF(MIX_NAMES)
+
+typedef struct __datagen_config_t {
+    const char* out_dir;
+    size_t courses;
+    size_t departments;
+    size_t users;
+    size_t requests;
+    double zipf;
+    unsigned mix[DATAGEN_MIX_TYPES];
+    long multi_size;
+    double miss;
+    uint64_t seed;
+} datagen_config_t;
+
+// A course code, in the order the courses were generated
+typedef struct __datagen_course_t {
+    char code[16];
+} datagen_course_t;
+
+static datagen_config_t config;
+static uint64_t random_state = 0;
+static datagen_course_t* courses = NULL;
+static double* popularity_cdf = NULL;   // Running sum of the course probabilities, in course order
+static credentials_t* users = NULL;     // In plain text
+
+// xorshift64*
+static uint64_t random_next(void) {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1DULL;
+}
+
+// Uniform in [0, 1)
+static double random_unit(void) {
+    return (random_next() >> 11) * (1.0 / (1ULL << 53));
+}
+
+static size_t random_below(size_t bound) {
+    return random_next() % bound;
+}
+
+static const char* random_weighted(const datagen_weighted_t* values, size_t count) {
+    unsigned total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += values[i].weight;
+    }
+    unsigned pick = random_below(total);
+    for (size_t i = 0; i < count; i++) {
+        if (pick < values[i].weight) {
+            return values[i].value;
+        }
+        pick -= values[i].weight;
+    }
+    return values[0].value;
+}
+
+// Fisher-Yates
+static void shuffle(size_t* values, size_t count) {
+    for (size_t i = count; i > 1; i--) {
+        size_t j = random_below(i);
+        size_t value = values[i - 1];
+        values[i - 1] = values[j];
+        values[j] = value;
+    }
+}
+
+static size_t* permutation(size_t count, size_t first) {
+    size_t* values = malloc((count ? count : 1) * sizeof(size_t));
+    if (values == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < count; i++) {
+        values[i] = first + i;
+    }
+    shuffle(values, count);
+    return values;
+}
+
+static FILE* open_output(const char* name) {
+    char path[DATAGEN_PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", config.out_dir, name);
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    return fp;
+}
+
+static void close_output(FILE* fp, const char* name) {
+    if (ferror(fp) || fclose(fp) != 0) {
+        fprintf(stderr, "Failed to write %s/%s\n", config.out_dir, name);
+        exit(1);
+    }
+}
+
+// Every department gets an equal share of the courses. Each has a pool of professors that teach several of them,
+// so that professors and days repeat across sections like they do in the real catalog.
+static void generate_courses(void) {
+    courses = calloc(config.courses ? config.courses : 1, sizeof(datagen_course_t));
+    if (courses == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    size_t course = 0;
+    for (size_t department = 0; department < config.departments; department++) {
+        size_t count = config.courses / config.departments + (department < config.courses % config.departments);
+        char name[16];
+        snprintf(name, sizeof(name), "%c%c.txt", PREFIXES[department][0] + 'a' - 'A', PREFIXES[department][1] + 'a' - 'A');
+        FILE* fp = open_output(name);
+
+        // Distinct course numbers from 100 up, three digits while they last, in no particular order
+        size_t* numbers = permutation(count > 900 ? count : 900, 100);
+        size_t professors = count / DATAGEN_SECTIONS_PER_PROFESSOR + 1;
+        for (size_t i = 0; i < count; i++, course++) {
+            snprintf(courses[course].code, sizeof(courses[course].code), "%s%zu", PREFIXES[department], numbers[i]);
+            // A professor's name follows from their place in the pool, scattered over the first and last names
+            size_t professor = (department * professors + random_below(professors)) * 2654435761u;
+            fprintf(fp, "%s,%s,%s %s,%s,%s %s\r\n", courses[course].code, random_weighted(CREDITS, COUNT_OF(CREDITS)),
+                FIRST_NAMES[professor % COUNT_OF(FIRST_NAMES)], LAST_NAMES[professor / COUNT_OF(FIRST_NAMES) % COUNT_OF(LAST_NAMES)],
+                random_weighted(DAYS, COUNT_OF(DAYS)), TITLES[random_below(COUNT_OF(TITLES))], SUBJECTS[random_below(COUNT_OF(SUBJECTS))]);
+        }
+        free(numbers);
+        close_output(fp, name);
+    }
+}
+
+// The course of rank r is asked for with probability proportional to 1 / r^s
+static void generate_popularity(void) {
+    popularity_cdf = malloc((config.courses ? config.courses : 1) * sizeof(double));
+    double* weights = malloc((config.courses ? config.courses : 1) * sizeof(double));
+    if (popularity_cdf == NULL || weights == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    size_t* ranks = permutation(config.courses, 1);
+    double total = 0;
+    for (size_t i = 0; i < config.courses; i++) {
+        weights[i] = 1.0 / pow((double) ranks[i], config.zipf);
+        total += weights[i];
+    }
+
+    FILE* fp = open_output("popularity.csv");
+    fprintf(fp, "course_code,rank,probability\n");
+    double sum = 0;
+    for (size_t i = 0; i < config.courses; i++) {
+        fprintf(fp, "%s,%zu,%.9g\n", courses[i].code, ranks[i], weights[i] / total);
+        sum += weights[i] / total;
+        popularity_cdf[i] = sum;
+    }
+    close_output(fp, "popularity.csv");
+    free(ranks);
+    free(weights);
+}
+
+static const char* pick_course(void) {
+    double pick = random_unit() * popularity_cdf[config.courses - 1];
+    size_t low = 0, high = config.courses - 1;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (popularity_cdf[middle] <= pick) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return courses[low].code;
+}
+
+static void generate_credentials(void) {
+    users = calloc(config.users ? config.users : 1, sizeof(credentials_t));
+    if (users == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    FILE* encrypted_fp = open_output(CREDENTIALS_FILE);
+    FILE* plain_fp = open_output("cred_unencrypted.txt");
+    for (size_t i = 0; i < config.users; i++) {
+        credentials_t* user = &users[i];
+        // A first name and a few letters of a last name, made unique by the user's number
+        char last[4] = {0};
+        strncpy(last, LAST_NAMES[random_below(COUNT_OF(LAST_NAMES))], sizeof(last) - 1);
+        user->username_len = snprintf((char*) user->username, sizeof(user->username), "%s%s%zu",
+            FIRST_NAMES[random_below(COUNT_OF(FIRST_NAMES))], last, i);
+        for (size_t j = 0; j < user->username_len; j++) {
+            user->username[j] = user->username[j] >= 'A' && user->username[j] <= 'Z' ? user->username[j] + 'a' - 'A' : user->username[j];
+        }
+        user->password_len = CREDENTIALS_MIN_PASSWORD_LEN + 3 + random_below(9);
+        for (size_t j = 0; j < user->password_len; j++) {
+            user->password[j] = PASSWORD_CHARS[random_below(sizeof(PASSWORD_CHARS) - 1)];
+        }
+
+        credentials_t encrypted = {0};
+        if (database_credentials_encrypt(user, &encrypted) != ERR_OK) {
+            fprintf(stderr, "Failed to encrypt the credentials of user %zu\n", i);
+            exit(1);
+        }
+        fprintf(encrypted_fp, "%.*s,%.*s\n", (int) encrypted.username_len, encrypted.username, (int) encrypted.password_len, encrypted.password);
+        fprintf(plain_fp, "%.*s,%.*s\n", (int) user->username_len, user->username, (int) user->password_len, user->password);
+    }
+    close_output(encrypted_fp, CREDENTIALS_FILE);
+    close_output(plain_fp, "cred_unencrypted.txt");
+}
+
+// A course that is not in the catalog: a known prefix with a number below the first course
+static void print_missing_course(FILE* fp) {
+    fprintf(fp, "%s0%02zu", PREFIXES[random_below(config.departments)], random_below(100));
+}
+
+static void print_course(FILE* fp) {
+    if (random_unit() < config.miss) {
+        print_missing_course(fp);
+    } else {
+        fprintf(fp, "%s", pick_course());
+    }
+}
+
+static void generate_requests(void) {
+    unsigned total = 0;
+    for (size_t i = 0; i < DATAGEN_MIX_TYPES; i++) {
+        total += config.mix[i];
+    }
+    FILE* fp = open_output("requests.txt");
+    for (size_t i = 0; i < config.requests; i++) {
+        unsigned pick = random_below(total);
+        size_t type = 0;
+        while (pick >= config.mix[type]) {
+            pick -= config.mix[type++];
+        }
+        if (type == 0) {
+            const credentials_t* user = &users[random_below(config.users)];
+            if (random_unit() >= config.miss) {
+                fprintf(fp, "auth %.*s %.*s\n", (int) user->username_len, user->username, (int) user->password_len, user->password);
+            } else if (random_below(2)) {
+                fprintf(fp, "auth %.*s %.*sx\n", (int) user->username_len, user->username, (int) user->password_len, user->password);
+            } else {
+                fprintf(fp, "auth nobody%zu %.*s\n", i, (int) user->password_len, user->password);
+            }
+        } else if (type == 1) {
+            fprintf(fp, "single ");
+            print_course(fp);
+            fprintf(fp, " %s\n", CATEGORIES[random_below(COUNT_OF(CATEGORIES))]);
+        } else {
+            fprintf(fp, "multi");
+            for (long j = 0; j < config.multi_size; j++) {
+                fprintf(fp, " ");
+                print_course(fp);
+            }
+            fprintf(fp, "\n");
+        }
+    }
+    close_output(fp, "requests.txt");
+}
+
+// Parse "auth=1,single=8,multi=1". Types left out get no requests.
+static bool parse_mix(char* mix) {
+    memset(config.mix, 0, sizeof(config.mix));
+    unsigned total = 0;
+    for (char* item = strtok(mix, ","); item != NULL; item = strtok(NULL, ",")) {
+        char* weight = strchr(item, '=');
+        if (weight == NULL) {
+            return false;
+        }
+        *weight++ = '\0';
+        size_t i = 0;
+        while (i < DATAGEN_MIX_TYPES && strcmp(item, MIX_NAMES[i]) != 0) {
+            i++;
+        }
+        if (i == DATAGEN_MIX_TYPES) {
+            return false;
+        }
+        config.mix[i] = strtoul(weight, NULL, 10);
+        total += config.mix[i];
+    }
+    return total > 0;
+}
+
+static void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--out <dir>] [--courses <n>] [--departments <m>] [--users <n>] [--requests <n>]\n"
+        "    [--zipf <s>] [--mix auth=1,single=8,multi=1] [--multi-size <n>] [--miss <fraction>] [--seed <n>]\n", program);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    static char default_mix[] = "auth=1,single=8,multi=1";
+    config = (datagen_config_t) { .out_dir = DATAGEN_OUT_DIR, .courses = DATAGEN_COURSES, .departments = DATAGEN_DEPARTMENTS,
+        .users = DATAGEN_USERS, .requests = DATAGEN_REQUESTS, .zipf = DATAGEN_ZIPF, .multi_size = DATAGEN_MULTI_SIZE,
+        .miss = DATAGEN_MISS, .seed = 1 };
+    parse_mix(default_mix);
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+        } else if (strcmp(argv[i], "--out") == 0) {
+            config.out_dir = argv[++i];
+        } else if (strcmp(argv[i], "--courses") == 0) {
+            config.courses = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--departments") == 0) {
+            config.departments = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--users") == 0) {
+            config.users = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--requests") == 0) {
+            config.requests = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--zipf") == 0) {
+            config.zipf = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--multi-size") == 0) {
+            config.multi_size = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--miss") == 0) {
+            config.miss = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            config.seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--mix") == 0) {
+            if (!parse_mix(argv[++i])) {
+                print_usage(argv[0]);
+            }
+        } else {
+            print_usage(argv[0]);
+        }
+    }
+    if (config.courses == 0 || config.departments == 0 || config.departments > COUNT_OF(PREFIXES) || config.users == 0
+            || config.zipf < 0 || config.miss < 0 || config.miss > 1 || config.multi_size < 2 || config.multi_size > MULTI_LOOKUP_MAX_COURSES) {
+        print_usage(argv[0]);
+    }
+    // xorshift must not start from 0
+    random_state = config.seed * 0x9E3779B97F4A7C15ULL + 1;
+    if (mkdir(config.out_dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create %s: %s\n", config.out_dir, strerror(errno));
+        return 1;
+    }
+
+    generate_courses();
+    generate_popularity();
+    generate_credentials();
+    generate_requests();
+    printf("%zu courses in %zu departments, %zu users and %zu requests written to %s\n", config.courses, config.departments,
+        config.users, config.requests, config.out_dir);
+
+    free(users);
+    free(popularity_cdf);
+    free(courses);
+    return 0;
+}
@@ -0,0 +1,119 @@
+/**
+ * Renders the binary event logs the servers write when EVENT_LOG is set.
+ * Records of several files are merged in time order, so the logs of
+ * serverM and the backend servers read as one trace.
+ * Build with `make eventlog`, then `./out/eventlog [--csv] <file>...`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/event_log.h"
+
+// A record with the file it came from
+typedef struct __event_entry_t {
+    uint64_t time_ns;                   // CLOCK_REALTIME
+    const record_ring_header_t* header;
+    event_record_t record;
+} event_entry_t;
+
+static event_entry_t* entries = NULL;
+static size_t entries_count = 0;
+static size_t entries_capacity = 0;
+
+static int compare_entries(const void* a, const void* b) {
+    uint64_t x = ((const event_entry_t*) a)->time_ns;
+    uint64_t y = ((const event_entry_t*) b)->time_ns;
+    return (x > y) - (x < y);
+}
+
+static void collect(const record_ring_header_t* header, const void* record, void* user_data) {
+    if (entries_count == entries_capacity) {
+        entries_capacity = entries_capacity ? entries_capacity * 2 : 4096;
+        entries = realloc(entries, entries_capacity * sizeof(event_entry_t));
+        if (entries == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    event_entry_t* entry = &entries[entries_count++];
+    entry->header = header;
+    entry->record = *(const event_record_t*) record;
+    entry->time_ns = entry->record.timestamp_ns + header->realtime_offset_ns;
+}
+
+// Map a file and collect its committed records. The mapping is kept for the headers.
+static int load(const char* path) {
+    uint64_t overwritten = 0;
+    if (record_ring_read(path, &EVENT_LOG_FORMAT, collect, NULL, &overwritten) != ERR_OK) {
+        fprintf(stderr, "%s: not an event log of version %d\n", path, EVENT_LOG_VERSION);
+        return -1;
+    }
+    if (overwritten > 0) {
+        fprintf(stderr, "%s: %llu oldest records were overwritten\n", path, (unsigned long long) overwritten);
+    }
+    return 0;
+}
+
+static void print_text(const event_entry_t* entry) {
+    const event_record_t* record = &entry->record;
+    time_t seconds = entry->time_ns / 1000000000ULL;
+    struct tm tm;
+    char date[32];
+    localtime_r(&seconds, &tm);
+    strftime(date, sizeof(date), "%H:%M:%S", &tm);
+    printf("%s.%09llu %s[%u] %-18s %-26s req=%-8u", date, (unsigned long long) (entry->time_ns % 1000000000ULL),
+        entry->header->process, entry->header->pid, event_log_tag_name(record->tag), event_log_event_name(record->event), record->request_id);
+    for (size_t i = 0; i < EVENT_ARGS_COUNT; i++) {
+        const char* name = event_log_arg_name(record->event, i);
+        if (name == NULL) {
+            continue;
+        }
+        // Message types and flags read best in hex, like the protocol tables
+        if (i < 2 && record->event <= EVENT_BACKEND_RESPONSE_RECEIVED) {
+            printf(" %s=0x%02x", name, record->args[i]);
+        } else {
+            printf(" %s=%u", name, record->args[i]);
+        }
+    }
+    printf("\n");
+}
+
+static void print_csv(const event_entry_t* entry) {
+    const event_record_t* record = &entry->record;
+    printf("%llu,%s,%u,%s,%s,%u,%u,%u,%u,%u\n", (unsigned long long) entry->time_ns, entry->header->process, entry->header->pid,
+        event_log_tag_name(record->tag), event_log_event_name(record->event), record->request_id,
+        record->args[0], record->args[1], record->args[2], record->args[3]);
+}
+
+int main(int argc, char** argv) {
+    int first = 1;
+    int csv = argc > 1 && strcmp(argv[1], "--csv") == 0;
+    if (csv) {
+        first++;
+    }
+    if (first >= argc) {
+        fprintf(stderr, "Usage: %s [--csv] <file>...\n", argv[0]);
+        return 1;
+    }
+    for (int i = first; i < argc; i++) {
+        if (load(argv[i]) != 0) {
+            return 1;
+        }
+    }
+    qsort(entries, entries_count, sizeof(event_entry_t), compare_entries);
+
+    if (csv) {
+        printf("time_ns,process,pid,tag,event,request_id,arg0,arg1,arg2,arg3\n");
+    }
+    for (size_t i = 0; i < entries_count; i++) {
+        if (csv) {
+            print_csv(&entries[i]);
+        } else {
+            print_text(&entries[i]);
+        }
+    }
+    free(entries);
+    return 0;
+}
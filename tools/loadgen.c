@@ -0,0 +1,700 @@
+/**
+ * Drives serverM end to end from many concurrent client sessions at an
+ * open-loop target rate, and reports the throughput and latency as JSON.
+ *
+ * Requests are sent on a fixed schedule whether or not earlier ones were
+ * answered, and every latency is measured from the time the schedule meant
+ * the request to go out. A stall in the servers (or in loadgen) therefore
+ * shows up in the latencies of every request it delayed, instead of
+ * silently lowering the request rate (coordinated omission).
+ *
+ * Build with `make loadgen`, then
+ * `./out/loadgen [--rate <req/s>] [--duration <s>] [--warmup <s>] [--connections <n>]
+ *   [--mix auth=1,single=8,multi=1] [--multi-size <n>] [--arrival constant|poisson]
+ *   [--timeout <ms>] [--user <name>:<password>] [--courses <code>,<code>,...] [--replay <requests file>]`.
+ *
+ * With --replay, the requests are read from a file `make datagen` generates
+ * and sent in its order, from the start again when it runs out, instead of
+ * being drawn from the mix, the user and the courses.
+ */
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "../src/constants.h"
+#include "../src/database.h"
+#include "../src/metrics.h"
+#include "../src/networking.h"
+#include "../src/protocol.h"
+#include "../src/trace.h"
+#include "../src/utils.h"
+
+#define LOADGEN_RATE                1000
+#define LOADGEN_DURATION_S          10
+#define LOADGEN_CONNECTIONS         64
+#define LOADGEN_MULTI_SIZE          4
+#define LOADGEN_TIMEOUT_MS          5000
+#define LOADGEN_MAX_EVENTS          256
+#define LOADGEN_PENDING_MAX         (1 << 20)   // Requests in flight. A power of 2.
+#define LOADGEN_COURSES_MAX         1024
+
+static const char* DEFAULT_USER = "james:2kAnsa7s)";
+static const char DEFAULT_COURSES[] = "EE450,EE658,EE604,EE608,EE520,CS100,CS310,CS561,CS435,CS356";
+
+static const courses_lookup_category_t CATEGORIES[] = {
+    COURSES_LOOKUP_CATEGORY_CREDITS, COURSES_LOOKUP_CATEGORY_PROFESSOR, COURSES_LOOKUP_CATEGORY_DAYS, COURSES_LOOKUP_CATEGORY_COURSE_NAME,
+};
+
+// Request types loadgen sends, in the order of the mix
+static const request_type_t MIX_TYPES[] = { REQUEST_TYPE_AUTH, REQUEST_TYPE_COURSES_SINGLE_LOOKUP, REQUEST_TYPE_COURSES_MULTI_LOOKUP };
+static const char* MIX_NAMES[] = { "auth", "single", "multi" };
+#define LOADGEN_MIX_TYPES           (sizeof(MIX_TYPES) / sizeof(MIX_TYPES[0]))
+
+// A line of a replayed requests file: `auth <username> <password>`, `single <course code> <category>` or
+// `multi <course code>...`
+typedef struct __loadgen_replay_t {
+    request_type_t type;
+    uint8_t courses_count;              // Of a multi lookup
+    const char* args;                   // The rest of the line, after the type
+    size_t args_len;
+} loadgen_replay_t;
+
+typedef struct __loadgen_session_t {
+    tcp_client_t* client;
+    bool open;
+} loadgen_session_t;
+
+// A request waiting for its response, at its request id modulo LOADGEN_PENDING_MAX
+typedef struct __loadgen_pending_t {
+    request_id_t id;                    // 0 if the slot is free
+    request_type_t type;
+    bool measured;                      // Scheduled after the warmup
+    uint64_t intended_ns;               // When the schedule meant the request to be sent
+    const loadgen_replay_t* replay;     // The line it was read from, if the requests are replayed
+    trace_span_t span;
+} loadgen_pending_t;
+
+typedef struct __loadgen_config_t {
+    double rate;
+    double duration_s;
+    double warmup_s;
+    long connections;
+    unsigned mix[LOADGEN_MIX_TYPES];
+    long multi_size;
+    bool poisson;
+    long timeout_ms;
+    credentials_t credentials;
+    string_slice_t courses[LOADGEN_COURSES_MAX];
+    size_t courses_count;
+    double trace_sample_rate;
+    const char* replay_path;
+    char* replay_text;                  // The requests file, which the lines point into
+    loadgen_replay_t* replay;
+    size_t replay_count;
+} loadgen_config_t;
+
+typedef struct __loadgen_counts_t {
+    uint64_t sent;                      // Measured requests sent
+    uint64_t timeouts;                  // Measured requests not answered within the timeout
+    uint64_t send_failures;
+    uint64_t late;                      // Responses that came after their request timed out
+    uint64_t disconnects;
+    uint64_t lag_max_ns;                // Longest a request went out after its scheduled time
+    uint64_t last_response_ns;          // When the last measured response came
+} loadgen_counts_t;
+
+static loadgen_config_t config;
+static loadgen_counts_t counts;
+static loadgen_session_t* sessions = NULL;
+static loadgen_pending_t* pending = NULL;
+static request_id_t next_id = 1;
+static request_id_t oldest_id = 1;     // Requests below it were answered or timed out
+static uint64_t outstanding = 0;
+static uint64_t random_state = 0x9E3779B97F4A7C15ULL;
+static int epfd = -1;
+static uint64_t measure_ns = 0;         // End of the warmup
+
+// xorshift64*
+static uint64_t random_next(void) {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1DULL;
+}
+
+// Uniform in [0, 1)
+static double random_unit(void) {
+    return (random_next() >> 11) * (1.0 / (1ULL << 53));
+}
+
+static loadgen_pending_t* pending_slot(request_id_t id) {
+    return &pending[id & (LOADGEN_PENDING_MAX - 1)];
+}
+
+// Take the pending request a response answers. NULL if it timed out or is unknown.
+static loadgen_pending_t* pending_take(request_id_t id) {
+    loadgen_pending_t* slot = pending_slot(id);
+    if (id == 0 || slot->id != id) {
+        counts.late++;
+        return NULL;
+    }
+    slot->id = 0;
+    outstanding--;
+    return slot;
+}
+
+// Count the requests that were not answered in time and free their slots
+static void pending_expire(uint64_t now) {
+    uint64_t timeout_ns = config.timeout_ms * 1000000ULL;
+    while (oldest_id != next_id) {
+        loadgen_pending_t* slot = pending_slot(oldest_id);
+        if (slot->id == oldest_id) {
+            if (slot->intended_ns + timeout_ns > now) {
+                break;
+            }
+            counts.timeouts += slot->measured;
+            slot->id = 0;
+            outstanding--;
+        }
+        oldest_id = oldest_id + 1 ? oldest_id + 1 : 1;
+    }
+}
+
+static void on_receive(tcp_client_t* client, tcp_sgmnt_t* sgmnt) {
+    loadgen_pending_t* request = pending_take(protocol_get_request_id(sgmnt));
+    if (request == NULL) {
+        return;
+    }
+    if (request->measured) {
+        metrics_record_response(request->type, sgmnt, request->intended_ns);
+        counts.last_response_ns = metrics_now_ns();
+    }
+    trace_span_end(&request->span, TRACE_KIND_CLIENT, request->id, request->type, SERVER_M_TCP_PORT_NUMBER);
+}
+
+// A multi lookup response that was sent as several frames
+static void on_receive_message(tcp_client_t* client, const message_buffer_t* message) {
+    loadgen_pending_t* request = pending_take(protocol_get_message_request_id(message));
+    if (request == NULL) {
+        return;
+    }
+    if (request->measured) {
+        counts.last_response_ns = metrics_now_ns();
+        metrics_record_request(request->type, ERR_OK, true, counts.last_response_ns - request->intended_ns);
+    }
+    trace_span_end(&request->span, TRACE_KIND_CLIENT, request->id, request->type, SERVER_M_TCP_PORT_NUMBER);
+}
+
+static void on_disconnect(tcp_client_t* client) {
+    loadgen_session_t* session = client->user_data;
+    if (session->open) {
+        session->open = false;
+        counts.disconnects++;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, client->sd, NULL);
+    }
+}
+
+static request_type_t pick_type(void) {
+    unsigned total = 0;
+    for (size_t i = 0; i < LOADGEN_MIX_TYPES; i++) {
+        total += config.mix[i];
+    }
+    unsigned pick = random_next() % total;
+    for (size_t i = 0; i < LOADGEN_MIX_TYPES; i++) {
+        if (pick < config.mix[i]) {
+            return MIX_TYPES[i];
+        }
+        pick -= config.mix[i];
+    }
+    return MIX_TYPES[0];
+}
+
+static const string_slice_t* pick_course(void) {
+    return &config.courses[random_next() % config.courses_count];
+}
+
+static const loadgen_replay_t* next_replay(void) {
+    static size_t next = 0;
+    const loadgen_replay_t* replay = &config.replay[next];
+    next = (next + 1) % config.replay_count;
+    return replay;
+}
+
+// Encode a replayed request. Multi lookups are left in message, everything else in sgmnt.
+static err_t encode_replay(const loadgen_replay_t* replay, tcp_sgmnt_t* sgmnt, message_buffer_t* message) {
+    const char* args = replay->args;
+    const char* space = memchr(args, ' ', replay->args_len);
+    if (replay->type == REQUEST_TYPE_AUTH) {
+        credentials_t credentials = {0};
+        credentials.username_len = space - args;
+        credentials.password_len = replay->args_len - credentials.username_len - 1;
+        memcpy(credentials.username, args, credentials.username_len);
+        memcpy(credentials.password, space + 1, credentials.password_len);
+        return protocol_authentication_request_encode(&credentials, sgmnt);
+    } else if (replay->type == REQUEST_TYPE_COURSES_SINGLE_LOOKUP) {
+        char category[COURSE_CATEGORY_BUFFER_SIZE];
+        snprintf(category, sizeof(category), "%.*s", (int) (args + replay->args_len - space - 1), space + 1);
+        return protocol_courses_lookup_single_request_encode(args, space - args, database_courses_lookup_category_from_string(category), sgmnt);
+    }
+    return protocol_courses_lookup_multiple_request_encode(replay->courses_count, (const uint8_t*) args, replay->args_len, message);
+}
+
+// Encode and send a request on a session. The frame or message is tagged with the request id of its slot.
+static err_t send_request(loadgen_session_t* session, loadgen_pending_t* request) {
+    tcp_sgmnt_t sgmnt = {0};
+    if (request->replay != NULL && request->type != REQUEST_TYPE_COURSES_MULTI_LOOKUP) {
+        encode_replay(request->replay, &sgmnt, NULL);
+    } else if (request->type == REQUEST_TYPE_AUTH) {
+        protocol_authentication_request_encode(&config.credentials, &sgmnt);
+    } else if (request->type == REQUEST_TYPE_COURSES_SINGLE_LOOKUP) {
+        const string_slice_t* course = pick_course();
+        courses_lookup_category_t category = CATEGORIES[random_next() % (sizeof(CATEGORIES) / sizeof(CATEGORIES[0]))];
+        protocol_courses_lookup_single_request_encode(course->data, course->len, category, &sgmnt);
+    } else {
+        // Whitespace separated course codes, like the client reads them
+        char codes[COURSE_CODES_INPUT_BUFFER_SIZE];
+        size_t codes_len = 0;
+        for (long i = 0; request->replay == NULL && i < config.multi_size; i++) {
+            const string_slice_t* course = pick_course();
+            codes_len += snprintf(codes + codes_len, sizeof(codes) - codes_len, "%.*s ", (int) course->len, course->data);
+        }
+        message_buffer_t message = {0};
+        err_t err = request->replay != NULL ? encode_replay(request->replay, NULL, &message)
+            : protocol_courses_lookup_multiple_request_encode(config.multi_size, (const uint8_t*) codes, codes_len, &message);
+        if (err == ERR_OK) {
+            protocol_set_message_request_id(&message, request->id);
+            size_t offset = 0;
+            if (!protocol_fragment_encode(&message, &offset, &sgmnt)) {
+                // The whole message fits a single frame, which has room for the trace context
+                trace_span_inject(&request->span, &sgmnt);
+                err = tcp_client_send(session->client, &sgmnt);
+            } else {
+                err = tcp_client_send_message(session->client, &message);
+            }
+        }
+        message_buffer_release(&message);
+        return err;
+    }
+    protocol_set_request_id(&sgmnt, request->id);
+    trace_span_inject(&request->span, &sgmnt);
+    return tcp_client_send(session->client, &sgmnt);
+}
+
+// Send the request the schedule meant to go out at intended_ns, on the next open session
+static void send_scheduled(uint64_t intended_ns, bool measured) {
+    static size_t next_session = 0;
+    loadgen_session_t* session = NULL;
+    for (long i = 0; i < config.connections && session == NULL; i++) {
+        loadgen_session_t* candidate = &sessions[next_session];
+        next_session = (next_session + 1) % config.connections;
+        if (candidate->open) {
+            session = candidate;
+        }
+    }
+    loadgen_pending_t* request = pending_slot(next_id);
+    if (session == NULL || request->id != 0) {
+        // Every session is gone, or LOADGEN_PENDING_MAX requests are in flight
+        counts.send_failures += measured;
+        counts.sent += measured;
+        return;
+    }
+    *request = (loadgen_pending_t) { .id = next_id, .measured = measured, .intended_ns = intended_ns };
+    if (config.replay_count > 0) {
+        request->replay = next_replay();
+        request->type = request->replay->type;
+    } else {
+        request->type = pick_type();
+    }
+    trace_span_start_root(&request->span, config.trace_sample_rate);
+    uint64_t lag_ns = request->span.start_ns - intended_ns;
+    counts.lag_max_ns = max(counts.lag_max_ns, lag_ns);
+    next_id = next_id + 1 ? next_id + 1 : 1;
+    outstanding++;
+    counts.sent += measured;
+    if (send_request(session, request) != ERR_OK) {
+        // Left pending, so that it counts as timed out
+        counts.send_failures += measured;
+    }
+}
+
+// Time between two scheduled requests
+static uint64_t next_interval_ns(void) {
+    double mean_ns = 1e9 / config.rate;
+    return (uint64_t) (config.poisson ? -log(1.0 - random_unit()) * mean_ns : mean_ns);
+}
+
+static void arm_timer(int timer_fd, uint64_t at_ns) {
+    struct itimerspec spec = {0};
+    spec.it_value.tv_sec = at_ns / 1000000000ULL;
+    spec.it_value.tv_nsec = at_ns % 1000000000ULL;
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+static void run(void) {
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    struct epoll_event timer_event = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fd, &timer_event);
+
+    uint64_t start_ns = metrics_now_ns();
+    measure_ns = start_ns + (uint64_t) (config.warmup_s * 1e9);
+    uint64_t end_ns = measure_ns + (uint64_t) (config.duration_s * 1e9);
+    uint64_t drain_ns = end_ns + config.timeout_ms * 1000000ULL;
+    uint64_t next_ns = start_ns;
+    struct epoll_event events[LOADGEN_MAX_EVENTS];
+    while (true) {
+        uint64_t now = metrics_now_ns();
+        // Catch up with the schedule. Requests that go out late still count from their scheduled time.
+        while (next_ns <= now && next_ns < end_ns) {
+            send_scheduled(next_ns, next_ns >= measure_ns);
+            next_ns += next_interval_ns();
+        }
+        pending_expire(now);
+        if ((next_ns >= end_ns && outstanding == 0) || now >= drain_ns) {
+            break;
+        }
+        // Wake for the next scheduled request, or to expire the oldest pending one once the schedule is done
+        arm_timer(timer_fd, next_ns < end_ns ? next_ns : min(pending_slot(oldest_id)->intended_ns + config.timeout_ms * 1000000ULL, drain_ns));
+
+        int n = epoll_wait(epfd, events, LOADGEN_MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            loadgen_session_t* session = events[i].data.ptr;
+            if (session == NULL) {
+                uint64_t expirations;
+                while (read(timer_fd, &expirations, sizeof(expirations)) > 0);
+            } else if (session->open) {
+                tcp_client_receive(session->client);
+            }
+        }
+    }
+    close(timer_fd);
+}
+
+static void print_histogram_json(const metrics_histogram_t* histogram, bool buckets) {
+    printf("{\"count\": %llu, \"mean_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu",
+        (unsigned long long) histogram->count, (unsigned long long) (histogram->count ? histogram->sum_ns / histogram->count : 0),
+        (unsigned long long) metrics_histogram_percentile(histogram, 50), (unsigned long long) metrics_histogram_percentile(histogram, 90),
+        (unsigned long long) metrics_histogram_percentile(histogram, 99), (unsigned long long) metrics_histogram_percentile(histogram, 99.9),
+        (unsigned long long) histogram->max_ns);
+    if (buckets) {
+        // Non-empty buckets as [largest value in the bucket, count]
+        printf(", \"buckets\": [");
+        bool first = true;
+        for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+            if (histogram->counts[i] > 0) {
+                printf("%s[%llu, %llu]", first ? "" : ", ", (unsigned long long) metrics_histogram_bucket_upper_bound(i),
+                    (unsigned long long) histogram->counts[i]);
+                first = false;
+            }
+        }
+        printf("]");
+    }
+    printf("}");
+}
+
+static void report(void) {
+    metrics_snapshot_t* snapshot = calloc(1, sizeof(metrics_snapshot_t));
+    metrics_histogram_t* all = calloc(1, sizeof(metrics_histogram_t));
+    metrics_histogram_t* type_all = calloc(1, sizeof(metrics_histogram_t));
+    if (snapshot == NULL || all == NULL || type_all == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    metrics_snapshot(snapshot);
+    uint64_t failed = 0;
+    for (size_t i = 0; i < LOADGEN_MIX_TYPES; i++) {
+        size_t type = MIX_TYPES[i] - REQUEST_TYPE_AUTH;
+        metrics_histogram_merge(all, &snapshot->latency[type][0]);
+        metrics_histogram_merge(all, &snapshot->latency[type][1]);
+        failed += snapshot->latency[type][1].count;
+    }
+
+    printf("{\n");
+    printf("  \"config\": {\"rate\": %.1f, \"duration_s\": %.1f, \"warmup_s\": %.1f, \"connections\": %ld, \"arrival\": \"%s\", "
+        "\"multi_size\": %ld, \"timeout_ms\": %ld, \"mix\": {", config.rate, config.duration_s, config.warmup_s, config.connections,
+        config.poisson ? "poisson" : "constant", config.multi_size, config.timeout_ms);
+    for (size_t i = 0; i < LOADGEN_MIX_TYPES; i++) {
+        printf("%s\"%s\": %u", i ? ", " : "", MIX_NAMES[i], config.mix[i]);
+    }
+    printf("}");
+    if (config.replay_path != NULL) {
+        printf(", \"replay\": \"%s\", \"replay_requests\": %zu", config.replay_path, config.replay_count);
+    }
+    printf("},\n");
+    printf("  \"sent\": %llu,\n  \"completed\": %llu,\n  \"failed\": %llu,\n  \"timeouts\": %llu,\n  \"send_failures\": %llu,\n"
+        "  \"late_responses\": %llu,\n  \"disconnects\": %llu,\n",
+        (unsigned long long) counts.sent, (unsigned long long) all->count, (unsigned long long) failed, (unsigned long long) counts.timeouts,
+        (unsigned long long) counts.send_failures, (unsigned long long) counts.late, (unsigned long long) counts.disconnects);
+    // Responses over the time it took to get them. Longer than the duration once the servers fall behind.
+    double elapsed_s = max(config.duration_s, counts.last_response_ns > measure_ns ? (counts.last_response_ns - measure_ns) / 1e9 : 0);
+    printf("  \"elapsed_s\": %.3f,\n  \"throughput_rps\": %.1f,\n  \"schedule_lag_max_ns\": %llu,\n", elapsed_s, all->count / elapsed_s,
+        (unsigned long long) counts.lag_max_ns);
+    printf("  \"latency\": ");
+    print_histogram_json(all, true);
+    printf(",\n  \"by_type\": {");
+    for (size_t i = 0; i < LOADGEN_MIX_TYPES; i++) {
+        size_t type = MIX_TYPES[i] - REQUEST_TYPE_AUTH;
+        *type_all = snapshot->latency[type][0];
+        metrics_histogram_merge(type_all, &snapshot->latency[type][1]);
+        printf("%s\n    \"%s\": {\"failed\": %llu, \"latency\": ", i ? "," : "", MIX_NAMES[i],
+            (unsigned long long) snapshot->latency[type][1].count);
+        print_histogram_json(type_all, false);
+        printf("}");
+    }
+    printf("\n  }\n}\n");
+    free(type_all);
+    free(all);
+    free(snapshot);
+}
+
+// Parse "auth=1,single=8,multi=1". Types left out get no requests.
+static bool parse_mix(char* mix) {
+    memset(config.mix, 0, sizeof(config.mix));
+    unsigned total = 0;
+    for (char* item = strtok(mix, ","); item != NULL; item = strtok(NULL, ",")) {
+        char* weight = strchr(item, '=');
+        size_t i = 0;
+        if (weight == NULL) {
+            return false;
+        }
+        *weight++ = '\0';
+        while (i < LOADGEN_MIX_TYPES && strcmp(item, MIX_NAMES[i]) != 0) {
+            i++;
+        }
+        if (i == LOADGEN_MIX_TYPES) {
+            return false;
+        }
+        config.mix[i] = strtoul(weight, NULL, 10);
+        total += config.mix[i];
+    }
+    return total > 0;
+}
+
+// Split a comma separated list of course codes. The slices point into the list.
+static bool parse_courses(char* courses) {
+    config.courses_count = 0;
+    for (char* code = strtok(courses, ","); code != NULL && config.courses_count < LOADGEN_COURSES_MAX; code = strtok(NULL, ",")) {
+        config.courses[config.courses_count++] = (string_slice_t) { code, strlen(code) };
+    }
+    return config.courses_count > 0;
+}
+
+static bool parse_user(const char* user) {
+    const char* colon = strchr(user, ':');
+    if (colon == NULL) {
+        return false;
+    }
+    size_t username_len = colon - user, password_len = strlen(colon + 1);
+    if (username_len < CREDENTIALS_MIN_USERNAME_LEN || username_len > CREDENTIALS_MAX_USERNAME_LEN
+            || password_len < CREDENTIALS_MIN_PASSWORD_LEN || password_len > CREDENTIALS_MAX_PASSWORD_LEN) {
+        return false;
+    }
+    memset(&config.credentials, 0, sizeof(config.credentials));
+    memcpy(config.credentials.username, user, username_len);
+    memcpy(config.credentials.password, colon + 1, password_len);
+    config.credentials.username_len = username_len;
+    config.credentials.password_len = password_len;
+    return true;
+}
+
+// Read a requests file into config.replay
+static bool load_replay(const char* path) {
+    FILE* fp = fopen(path, "r");
+    struct stat st;
+    if (fp == NULL || fstat(fileno(fp), &st) != 0) {
+        fprintf(stderr, "Failed to open the requests file %s\n", path);
+        return false;
+    }
+    char* text = malloc(st.st_size + 1);
+    size_t lines = 0;
+    if (text == NULL || fread(text, 1, st.st_size, fp) != (size_t) st.st_size) {
+        fprintf(stderr, "Failed to read the requests file %s\n", path);
+        fclose(fp);
+        return false;
+    }
+    fclose(fp);
+    text[st.st_size] = '\n';
+    for (off_t i = 0; i <= st.st_size; i++) {
+        lines += text[i] == '\n';
+    }
+    config.replay = calloc(lines, sizeof(loadgen_replay_t));
+    if (config.replay == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    size_t line_number = 0;
+    for (char* line = text; line < text + st.st_size; ) {
+        char* end = memchr(line, '\n', text + st.st_size + 1 - line);
+        line_number++;
+        *end = '\0';
+        if (end > line && end[-1] == '\r') {
+            end[-1] = '\0';
+        }
+        char* args = strchr(line, ' ');
+        loadgen_replay_t* replay = &config.replay[config.replay_count];
+        *replay = (loadgen_replay_t) { .args = args != NULL ? args + 1 : NULL, .args_len = args != NULL ? strlen(args + 1) : 0 };
+        size_t words = 0;
+        for (size_t i = 0; i < replay->args_len; i++) {
+            words += replay->args[i] != ' ' && (i == 0 || replay->args[i - 1] == ' ');
+        }
+        const char* space = replay->args_len ? memchr(replay->args, ' ', replay->args_len) : NULL;
+        bool valid = false;
+        if (line == end) {
+            // Blank lines are skipped
+        } else if (strncmp(line, "auth ", 5) == 0 && words == 2) {
+            size_t username_len = space - replay->args, password_len = replay->args_len - username_len - 1;
+            replay->type = REQUEST_TYPE_AUTH;
+            valid = username_len >= CREDENTIALS_MIN_USERNAME_LEN && username_len <= CREDENTIALS_MAX_USERNAME_LEN
+                && password_len >= CREDENTIALS_MIN_PASSWORD_LEN && password_len <= CREDENTIALS_MAX_PASSWORD_LEN;
+        } else if (strncmp(line, "single ", 7) == 0 && words == 2) {
+            replay->type = REQUEST_TYPE_COURSES_SINGLE_LOOKUP;
+            valid = space - replay->args <= UINT8_MAX
+                && database_courses_lookup_category_from_string(space + 1) != COURSES_LOOKUP_CATEGORY_INVALID;
+        } else if (strncmp(line, "multi ", 6) == 0 && words >= 2 && words <= MULTI_LOOKUP_MAX_COURSES) {
+            replay->type = REQUEST_TYPE_COURSES_MULTI_LOOKUP;
+            replay->courses_count = words;
+            valid = true;
+        }
+        if (valid) {
+            config.replay_count++;
+        } else if (line != end) {
+            fprintf(stderr, "%s:%zu: not a request, skipped\n", path, line_number);
+        }
+        line = end + 1;
+    }
+    if (config.replay_count == 0) {
+        fprintf(stderr, "No requests in %s\n", path);
+        return false;
+    }
+    config.replay_path = path;
+    config.replay_text = text;
+    return true;
+}
+
+static void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--rate <req/s>] [--duration <s>] [--warmup <s>] [--connections <n>]\n"
+        "    [--mix auth=1,single=8,multi=1] [--multi-size <n>] [--arrival constant|poisson]\n"
+        "    [--timeout <ms>] [--user <name>:<password>] [--courses <code>,<code>,...] [--replay <requests file>]\n", program);
+    exit(1);
+}
+
+// Each session holds a socket. Allow as many as the hard limit does.
+static void raise_open_files_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+int main(int argc, char** argv) {
+    static char default_mix[] = "auth=1,single=8,multi=1";
+    static char default_courses[sizeof(DEFAULT_COURSES)];
+    strcpy(default_courses, DEFAULT_COURSES);
+    config = (loadgen_config_t) { .rate = LOADGEN_RATE, .duration_s = LOADGEN_DURATION_S, .connections = LOADGEN_CONNECTIONS,
+        .multi_size = LOADGEN_MULTI_SIZE, .timeout_ms = LOADGEN_TIMEOUT_MS };
+    parse_mix(default_mix);
+    parse_courses(default_courses);
+    parse_user(DEFAULT_USER);
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+        } else if (strcmp(argv[i], "--rate") == 0) {
+            config.rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--duration") == 0) {
+            config.duration_s = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--warmup") == 0) {
+            config.warmup_s = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--connections") == 0) {
+            config.connections = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--multi-size") == 0) {
+            config.multi_size = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--timeout") == 0) {
+            config.timeout_ms = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--arrival") == 0) {
+            i++;
+            if (strcmp(argv[i], "poisson") != 0 && strcmp(argv[i], "constant") != 0) {
+                print_usage(argv[0]);
+            }
+            config.poisson = strcmp(argv[i], "poisson") == 0;
+        } else if (strcmp(argv[i], "--mix") == 0) {
+            if (!parse_mix(argv[++i])) {
+                print_usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--courses") == 0) {
+            if (!parse_courses(argv[++i])) {
+                print_usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--user") == 0) {
+            if (!parse_user(argv[++i])) {
+                print_usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--replay") == 0) {
+            if (!load_replay(argv[++i])) {
+                return 1;
+            }
+        } else {
+            print_usage(argv[0]);
+        }
+    }
+    if (config.rate <= 0 || config.duration_s <= 0 || config.warmup_s < 0 || config.connections <= 0 || config.timeout_ms <= 0
+            || config.multi_size < 2 || config.multi_size > MULTI_LOOKUP_MAX_COURSES) {
+        print_usage(argv[0]);
+    }
+
+    // Requests can be traced like the client's, see tracemerge
+    const char* trace_path = getenv(TRACE_FILE_ENV);
+    const char* trace_sample = getenv(TRACE_SAMPLE_ENV);
+    if (trace_path != NULL && trace_open(trace_path, "loadgen", TRACE_RECORDS) != ERR_OK) {
+        fprintf(stderr, "Failed to open the trace file %s\n", trace_path);
+    }
+    config.trace_sample_rate = trace_sample != NULL ? atof(trace_sample) : 0;
+
+    raise_open_files_limit();
+    sessions = calloc(config.connections, sizeof(loadgen_session_t));
+    pending = calloc(LOADGEN_PENDING_MAX, sizeof(loadgen_pending_t));
+    epfd = epoll_create1(0);
+    if (sessions == NULL || pending == NULL || epfd < 0) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    metrics_start();
+
+    tcp_endpoint_t server = {0};
+    SERVER_ADDR_PORT(server.addr, SERVER_M_TCP_PORT_NUMBER);
+    for (long i = 0; i < config.connections; i++) {
+        loadgen_session_t* session = &sessions[i];
+        session->client = tcp_client_connect(&server, on_receive, on_disconnect);
+        if (session->client == NULL) {
+            fprintf(stderr, "Connection %ld of %ld to serverM on port %d failed\n", i + 1, config.connections, SERVER_M_TCP_PORT_NUMBER);
+            return 1;
+        }
+        session->client->on_receive_message = on_receive_message;
+        session->client->user_data = session;
+        session->open = true;
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = session };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, session->client->sd, &event);
+    }
+
+    run();
+    report();
+
+    for (long i = 0; i < config.connections; i++) {
+        tcp_client_disconnect(sessions[i].client);
+    }
+    close(epfd);
+    free(pending);
+    free(config.replay);
+    free(config.replay_text);
+    free(sessions);
+    trace_close();
+    return counts.sent > 0 ? 0 : 1;
+}
@@ -0,0 +1,343 @@
+/**
+ * Polls a running server for its stats and shows them like top: request
+ * rates, error counts and latency percentiles per request type, and for
+ * serverM its connections, queues, cache and backend round trip times.
+ * serverM is asked over TCP, the backend servers over UDP.
+ * serverM only answers a user that logged in with --user.
+ * With --log-level it instead changes the log levels of serverM.
+ * Build with `make statsctl`, then
+ * `./out/statsctl [--interval <ms>] [--count <n>] [--user <name>:<password>] [--log-level <levels>]
+ *   <serverM|serverC|serverCS|serverEE>`.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/protocol.h"
+
+#define STATSCTL_INTERVAL_MS    1000
+#define STATSCTL_TIMEOUT_MS     1000
+// Out of the way of the poll ids, which count up from 1
+#define STATSCTL_LOGIN_REQUEST_ID       (UINT32_MAX - 1)
+#define STATSCTL_LOG_LEVEL_REQUEST_ID   UINT32_MAX
+
+typedef struct __statsctl_server_t {
+    const char* name;
+    uint16_t port;
+    int type;                           // SOCK_STREAM or SOCK_DGRAM
+} statsctl_server_t;
+
+static const statsctl_server_t SERVERS[] = {
+    { "serverM", SERVER_M_TCP_PORT_NUMBER, SOCK_STREAM },
+    { "serverC", SERVER_C_UDP_PORT_NUMBER, SOCK_DGRAM },
+    { "serverCS", SERVER_CS_UDP_PORT_NUMBER, SOCK_DGRAM },
+    { "serverEE", SERVER_EE_UDP_PORT_NUMBER, SOCK_DGRAM },
+};
+
+static const char* BACKEND_NAMES[] = { "serverC", "serverCS", "serverEE" };
+
+typedef struct __statsctl_snapshot_t {
+    stats_item_t items[STATS_ITEMS_MAX];
+    size_t count;
+    uint64_t time_ns;
+} statsctl_snapshot_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool stats_get(const statsctl_snapshot_t* snapshot, stats_id_t id, uint8_t index, uint64_t* value) {
+    for (size_t i = 0; i < snapshot->count; i++) {
+        if (snapshot->items[i].id == id && snapshot->items[i].index == index) {
+            *value = snapshot->items[i].value;
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint64_t stats_value(const statsctl_snapshot_t* snapshot, stats_id_t id, uint8_t index) {
+    uint64_t value = 0;
+    stats_get(snapshot, id, index, &value);
+    return value;
+}
+
+static int connect_to(const statsctl_server_t* server) {
+    struct sockaddr_in addr = {0};
+    SERVER_ADDR_PORT(addr, server->port);
+    int sd = socket(AF_INET, server->type, 0);
+    struct timeval timeout = { STATSCTL_TIMEOUT_MS / 1000, (STATSCTL_TIMEOUT_MS % 1000) * 1000 };
+    if (sd < 0 || setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0
+            || connect(sd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        if (sd >= 0) {
+            close(sd);
+        }
+        return -1;
+    }
+    return sd;
+}
+
+// Read exactly len bytes from a stream
+static bool read_full(int sd, uint8_t* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = recv(sd, data, len, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Send a request and wait for its response, which replaces it in message. The request id tells late replies to
+// earlier requests apart.
+static bool exchange(const statsctl_server_t* server, int sd, request_id_t request_id, struct __message_t* message) {
+    protocol_set_request_id(message, request_id);
+    if (send(sd, message->data, message->data_len, 0) != (ssize_t) message->data_len) {
+        return false;
+    }
+    do {
+        if (server->type == SOCK_STREAM) {
+            if (!read_full(sd, message->data, REQUEST_RESPONSE_HEADER_LEN)) {
+                return false;
+            }
+            message->data_len = protocol_get_frame_len(message->data, REQUEST_RESPONSE_HEADER_LEN);
+            if (message->data_len > sizeof(message->data)
+                    || !read_full(sd, message->data + REQUEST_RESPONSE_HEADER_LEN, message->data_len - REQUEST_RESPONSE_HEADER_LEN)) {
+                return false;
+            }
+        } else {
+            ssize_t n = recv(sd, message->data, sizeof(message->data), 0);
+            if (n < 0) {
+                return false;
+            }
+            message->data_len = n;
+        }
+    } while (protocol_get_request_id(message) != request_id);
+    return true;
+}
+
+// Ask for the stats once
+static bool stats_poll(const statsctl_server_t* server, int sd, request_id_t request_id, statsctl_snapshot_t* snapshot) {
+    struct __message_t message;
+    protocol_stats_request_encode(&message);
+    if (!exchange(server, sd, request_id, &message)) {
+        fprintf(stderr, "%s did not answer\n", server->name);
+        return false;
+    }
+    snapshot->time_ns = now_ns();
+    err_t err = protocol_stats_response_decode(&message, snapshot->items, STATS_ITEMS_MAX, &snapshot->count);
+    if (err == ERR_CREDENTIALS_NOT_AUTHENTICATED) {
+        fprintf(stderr, "%s only sends its stats to a user that logged in, see --user\n", server->name);
+    } else if (err != ERR_OK) {
+        fprintf(stderr, "%s sent malformed stats\n", server->name);
+    }
+    return err == ERR_OK;
+}
+
+// Log in to serverM over the connection, like the client does. "<name>:<password>".
+static bool login(const statsctl_server_t* server, int sd, const char* user) {
+    const char* colon = strchr(user, ':');
+    credentials_t credentials = {0};
+    if (colon == NULL || colon - user > CREDENTIALS_MAX_USERNAME_LEN || strlen(colon + 1) > CREDENTIALS_MAX_PASSWORD_LEN) {
+        fprintf(stderr, "Expected --user <name>:<password>\n");
+        return false;
+    }
+    credentials.username_len = colon - user;
+    credentials.password_len = strlen(colon + 1);
+    memcpy(credentials.username, user, credentials.username_len);
+    memcpy(credentials.password, colon + 1, credentials.password_len);
+
+    struct __message_t message;
+    uint8_t result = 0;
+    protocol_authentication_request_encode(&credentials, &message);
+    if (!exchange(server, sd, STATSCTL_LOGIN_REQUEST_ID, &message) || protocol_authentication_response_decode(&message, &result) != ERR_OK) {
+        fprintf(stderr, "%s did not answer the login\n", server->name);
+        return false;
+    }
+    if (!AUTH_MASK_SUCCESS(result)) {
+        fprintf(stderr, "%s refused the login of %.*s\n", server->name, (int) credentials.username_len, credentials.username);
+        return false;
+    }
+    return true;
+}
+
+static int set_log_levels(const statsctl_server_t* server, int sd, const char* levels) {
+    struct __message_t message;
+    err_t result = ERR_OK;
+    if (strlen(levels) > UINT8_MAX || protocol_log_level_request_encode(levels, strlen(levels), &message) != ERR_OK) {
+        fprintf(stderr, "The levels are too long\n");
+        return 1;
+    }
+    if (!exchange(server, sd, STATSCTL_LOG_LEVEL_REQUEST_ID, &message) || protocol_log_level_response_decode(&message, &result) != ERR_OK) {
+        fprintf(stderr, "%s did not answer\n", server->name);
+        return 1;
+    }
+    if (result == ERR_CREDENTIALS_NOT_AUTHENTICATED) {
+        fprintf(stderr, "%s only takes log levels from a user that logged in, see --user\n", server->name);
+    } else if (result != ERR_OK) {
+        fprintf(stderr, "%s did not apply every level (%d), the ones before the first invalid one were\n", server->name, result);
+    } else {
+        printf("Log levels of %s set to \"%s\"\n", server->name, levels);
+    }
+    return result == ERR_OK ? 0 : 1;
+}
+
+static double ms(uint64_t ns) {
+    return ns / 1e6;
+}
+
+// Per second rate of a counter since the previous snapshot
+static double rate(const statsctl_snapshot_t* now, const statsctl_snapshot_t* before, stats_id_t id, uint8_t index) {
+    if (before == NULL || now->time_ns <= before->time_ns) {
+        return 0;
+    }
+    uint64_t current = stats_value(now, id, index), previous = stats_value(before, id, index);
+    return current > previous ? (current - previous) * 1e9 / (now->time_ns - before->time_ns) : 0;
+}
+
+static void render(const statsctl_server_t* server, const statsctl_snapshot_t* now, const statsctl_snapshot_t* before, bool tty) {
+    uint64_t value;
+    if (tty) {
+        // Home and clear, like top
+        printf("\033[H\033[2J");
+    }
+
+    uint64_t uptime_s = stats_value(now, STATS_UPTIME_MS, 0) / 1000;
+    printf("%s  up %llu:%02llu:%02llu", server->name, (unsigned long long) (uptime_s / 3600),
+        (unsigned long long) (uptime_s / 60 % 60), (unsigned long long) (uptime_s % 60));
+    if (stats_get(now, STATS_CONNECTIONS, 0, &value)) {
+        printf("   connections %llu", (unsigned long long) value);
+    }
+    if (stats_get(now, STATS_PENDING_REQUESTS, 0, &value)) {
+        printf("   pending %llu", (unsigned long long) value);
+    }
+    if (stats_get(now, STATS_QUEUE_DEPTH, 0, &value)) {
+        printf("   queued %llu", (unsigned long long) value);
+    }
+    if (stats_get(now, STATS_RECORDS, 0, &value)) {
+        printf("   records %llu", (unsigned long long) value);
+    }
+    printf("   log dropped %llu\n", (unsigned long long) stats_value(now, STATS_LOG_DROPPED, 0));
+
+    uint64_t hits, misses;
+    if (stats_get(now, STATS_CACHE_HITS, 0, &hits) && stats_get(now, STATS_CACHE_MISSES, 0, &misses)) {
+        printf("cache  hits %llu   misses %llu   hit rate %.1f%%   entries %llu   coalesced %llu\n",
+            (unsigned long long) hits, (unsigned long long) misses, hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+            (unsigned long long) stats_value(now, STATS_CACHE_ENTRIES, 0), (unsigned long long) stats_value(now, STATS_COALESCED_LOOKUPS, 0));
+    }
+
+    printf("\n%-18s %9s %10s %9s %10s %10s %10s %10s\n", "REQUEST", "REQ/S", "TOTAL", "FAILED", "P50 MS", "P99 MS", "P99.9 MS", "MAX MS");
+    for (request_type_t type = REQUEST_TYPE_AUTH; type < REQUEST_TYPE_END; type++) {
+        if (!stats_get(now, STATS_REQUESTS, type, &value)) {
+            continue;
+        }
+        printf("%-18s %9.1f %10llu %9llu %10.3f %10.3f %10.3f %10.3f\n", protocol_request_type_name(type), rate(now, before, STATS_REQUESTS, type),
+            (unsigned long long) value, (unsigned long long) stats_value(now, STATS_REQUESTS_FAILED, type),
+            ms(stats_value(now, STATS_LATENCY_P50_NS, type)), ms(stats_value(now, STATS_LATENCY_P99_NS, type)),
+            ms(stats_value(now, STATS_LATENCY_P999_NS, type)), ms(stats_value(now, STATS_LATENCY_MAX_NS, type)));
+    }
+
+    bool header = false;
+    for (size_t backend = 0; backend < sizeof(BACKEND_NAMES) / sizeof(BACKEND_NAMES[0]); backend++) {
+        if (!stats_get(now, STATS_BACKEND_RESPONSES, backend, &value)) {
+            continue;
+        }
+        if (!header) {
+            printf("\n%-18s %9s %10s %9s %10s %10s %10s\n", "BACKEND", "RESP/S", "TOTAL", "", "P50 MS", "P99 MS", "P99.9 MS");
+            header = true;
+        }
+        printf("%-18s %9.1f %10llu %9s %10.3f %10.3f %10.3f\n", BACKEND_NAMES[backend], rate(now, before, STATS_BACKEND_RESPONSES, backend),
+            (unsigned long long) value, "", ms(stats_value(now, STATS_BACKEND_RTT_P50_NS, backend)),
+            ms(stats_value(now, STATS_BACKEND_RTT_P99_NS, backend)), ms(stats_value(now, STATS_BACKEND_RTT_P999_NS, backend)));
+    }
+    if (!tty) {
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+static void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--interval <ms>] [--count <n>] [--user <name>:<password>] [--log-level <levels>]\n"
+        "    <serverM|serverC|serverCS|serverEE>\n", program);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    long interval_ms = STATSCTL_INTERVAL_MS;
+    long count = 0;                     // 0 polls until interrupted
+    const char* user = NULL;
+    const char* levels = NULL;
+    const statsctl_server_t* server = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            interval_ms = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) {
+            count = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--user") == 0 && i + 1 < argc) {
+            user = argv[++i];
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            levels = argv[++i];
+        } else {
+            for (size_t s = 0; s < sizeof(SERVERS) / sizeof(SERVERS[0]); s++) {
+                if (strcmp(argv[i], SERVERS[s].name) == 0) {
+                    server = &SERVERS[s];
+                }
+            }
+            if (server == NULL) {
+                print_usage(argv[0]);
+            }
+        }
+    }
+    if (server == NULL || interval_ms <= 0 || count < 0) {
+        print_usage(argv[0]);
+    }
+    // Only serverM has logins and takes log levels
+    if ((user != NULL || levels != NULL) && server->type != SOCK_STREAM) {
+        fprintf(stderr, "--user and --log-level only apply to serverM\n");
+        return 1;
+    }
+
+    int sd = connect_to(server);
+    if (sd < 0) {
+        fprintf(stderr, "Cannot reach %s on port %d\n", server->name, server->port);
+        return 1;
+    }
+    if (user != NULL && !login(server, sd, user)) {
+        close(sd);
+        return 1;
+    }
+    if (levels != NULL) {
+        int status = set_log_levels(server, sd, levels);
+        close(sd);
+        return status;
+    }
+    bool tty = isatty(STDOUT_FILENO);
+    statsctl_snapshot_t snapshots[2];
+    statsctl_snapshot_t* before = NULL;
+    for (long poll = 0; count == 0 || poll < count; poll++) {
+        statsctl_snapshot_t* now = &snapshots[poll % 2];
+        if (!stats_poll(server, sd, poll + 1, now)) {
+            close(sd);
+            return 1;
+        }
+        render(server, now, before, tty);
+        before = now;
+        if (count == 0 || poll + 1 < count) {
+            usleep(interval_ms * 1000);
+        }
+    }
+    close(sd);
+    return 0;
+}
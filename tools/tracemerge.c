@@ -0,0 +1,202 @@
+/**
+ * Joins up the spans the client and the servers write when TRACE_FILE is
+ * set, and prints every trace as a waterfall: which process handled which
+ * hop of a request, when, and for how long.
+ * Build with `make tracemerge`, then
+ * `./out/tracemerge [--slowest <n>] [--trace <id>] <file>...`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/trace.h"
+
+#define TRACEMERGE_BAR_WIDTH    40
+
+// A span with the file it came from
+typedef struct __trace_entry_t {
+    uint64_t start_ns;                  // CLOCK_REALTIME
+    uint64_t end_ns;
+    const record_ring_header_t* header;
+    trace_record_t record;
+} trace_entry_t;
+
+// The spans of one trace, a range of the sorted entries
+typedef struct __trace_group_t {
+    size_t first;
+    size_t count;
+    uint64_t start_ns;
+    uint64_t end_ns;
+} trace_group_t;
+
+static trace_entry_t* entries = NULL;
+static size_t entries_count = 0;
+static size_t entries_capacity = 0;
+
+// By trace, then by start time, so that the spans of a trace are next to each other
+static int compare_entries(const void* a, const void* b) {
+    const trace_entry_t* x = a;
+    const trace_entry_t* y = b;
+    if (x->record.trace_id != y->record.trace_id) {
+        return x->record.trace_id < y->record.trace_id ? -1 : 1;
+    }
+    return (x->start_ns > y->start_ns) - (x->start_ns < y->start_ns);
+}
+
+static int compare_groups_by_start(const void* a, const void* b) {
+    uint64_t x = ((const trace_group_t*) a)->start_ns;
+    uint64_t y = ((const trace_group_t*) b)->start_ns;
+    return (x > y) - (x < y);
+}
+
+// Slowest first
+static int compare_groups(const void* a, const void* b) {
+    uint64_t x = ((const trace_group_t*) a)->end_ns - ((const trace_group_t*) a)->start_ns;
+    uint64_t y = ((const trace_group_t*) b)->end_ns - ((const trace_group_t*) b)->start_ns;
+    return (x < y) - (x > y);
+}
+
+static void collect(const record_ring_header_t* header, const void* record, void* user_data) {
+    if (entries_count == entries_capacity) {
+        entries_capacity = entries_capacity ? entries_capacity * 2 : 4096;
+        entries = realloc(entries, entries_capacity * sizeof(trace_entry_t));
+        if (entries == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    trace_entry_t* entry = &entries[entries_count++];
+    entry->header = header;
+    entry->record = *(const trace_record_t*) record;
+    entry->start_ns = entry->record.start_ns + header->realtime_offset_ns;
+    entry->end_ns = entry->record.end_ns + header->realtime_offset_ns;
+}
+
+// Map a file and collect its committed spans. The mapping is kept for the headers.
+static int load(const char* path) {
+    uint64_t overwritten = 0;
+    if (record_ring_read(path, &TRACE_FILE_FORMAT, collect, NULL, &overwritten) != ERR_OK) {
+        fprintf(stderr, "%s: not a trace file of version %d\n", path, TRACE_FILE_VERSION);
+        return -1;
+    }
+    if (overwritten > 0) {
+        fprintf(stderr, "%s: %llu oldest spans were overwritten\n", path, (unsigned long long) overwritten);
+    }
+    return 0;
+}
+
+static const char* request_type_name(uint8_t type) {
+    const char* name = protocol_request_type_name(type);
+    return name ? name : "?";
+}
+
+static bool has_span(const trace_group_t* group, uint32_t span_id) {
+    for (size_t i = group->first; i < group->first + group->count; i++) {
+        if (entries[i].record.span_id == span_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void print_span(const trace_group_t* group, const trace_entry_t* entry, int depth) {
+    const trace_record_t* record = &entry->record;
+    uint64_t duration = group->end_ns - group->start_ns;
+    char name[48];
+    snprintf(name, sizeof(name), "%*s%s %s", depth * 2, "", entry->header->process, record->kind == TRACE_KIND_CLIENT ? "client" : "server");
+
+    // The bar spans the part of the trace the span covers
+    char bar[TRACEMERGE_BAR_WIDTH + 1];
+    size_t from = duration ? (entry->start_ns - group->start_ns) * TRACEMERGE_BAR_WIDTH / duration : 0;
+    size_t to = duration ? (entry->end_ns - group->start_ns) * TRACEMERGE_BAR_WIDTH / duration : TRACEMERGE_BAR_WIDTH;
+    for (size_t i = 0; i < TRACEMERGE_BAR_WIDTH; i++) {
+        bar[i] = i >= from && (i < to || i == from) ? '#' : '.';
+    }
+    bar[TRACEMERGE_BAR_WIDTH] = '\0';
+
+    printf("  %-26s %-14s req=%-8u %10.3f %10.3f  %s\n", name, request_type_name(record->request_type), record->request_id,
+        (entry->start_ns - group->start_ns) / 1e6, (entry->end_ns - entry->start_ns) / 1e6, bar);
+}
+
+// Print the spans under a parent in start order, each followed by its own children
+static void print_children(const trace_group_t* group, uint32_t parent_id, int depth) {
+    for (size_t i = group->first; i < group->first + group->count; i++) {
+        const trace_entry_t* entry = &entries[i];
+        if (entry->record.parent_id == parent_id && entry->record.span_id != parent_id) {
+            print_span(group, entry, depth);
+            print_children(group, entry->record.span_id, depth + 1);
+        }
+    }
+}
+
+static void print_trace(const trace_group_t* group) {
+    printf("trace %016llx  %zu spans  %.3f ms\n", (unsigned long long) entries[group->first].record.trace_id, group->count,
+        (group->end_ns - group->start_ns) / 1e6);
+    printf("  %-26s %-14s %-12s %10s %10s\n", "SPAN", "REQUEST", "", "START MS", "TOOK MS");
+    // Spans whose parent is missing, because it was overwritten or its process was not traced, are shown as roots
+    for (size_t i = group->first; i < group->first + group->count; i++) {
+        const trace_entry_t* entry = &entries[i];
+        if (entry->record.parent_id == 0 || !has_span(group, entry->record.parent_id)) {
+            print_span(group, entry, 0);
+            print_children(group, entry->record.span_id, 1);
+        }
+    }
+    printf("\n");
+}
+
+static void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--slowest <n>] [--trace <id>] <file>...\n", program);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    long slowest = 0;                   // 0 prints every trace in time order
+    uint64_t trace_id = 0;              // 0 prints every trace
+    int files = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--slowest") == 0 && i + 1 < argc) {
+            slowest = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_id = strtoull(argv[++i], NULL, 16);
+        } else if (load(argv[i]) == 0) {
+            files++;
+        } else {
+            return 1;
+        }
+    }
+    if (files == 0 || slowest < 0) {
+        print_usage(argv[0]);
+    }
+    qsort(entries, entries_count, sizeof(trace_entry_t), compare_entries);
+
+    // Group the spans by trace
+    trace_group_t* groups = malloc((entries_count ? entries_count : 1) * sizeof(trace_group_t));
+    size_t groups_count = 0;
+    if (groups == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < entries_count; i++) {
+        if (i == 0 || entries[i].record.trace_id != entries[i - 1].record.trace_id) {
+            groups[groups_count++] = (trace_group_t) { i, 0, entries[i].start_ns, entries[i].end_ns };
+        }
+        trace_group_t* group = &groups[groups_count - 1];
+        group->count++;
+        group->end_ns = entries[i].end_ns > group->end_ns ? entries[i].end_ns : group->end_ns;
+    }
+
+    if (slowest > 0) {
+        qsort(groups, groups_count, sizeof(trace_group_t), compare_groups);
+        groups_count = (size_t) slowest < groups_count ? (size_t) slowest : groups_count;
+    } else {
+        qsort(groups, groups_count, sizeof(trace_group_t), compare_groups_by_start);
+    }
+    for (size_t i = 0; i < groups_count; i++) {
+        if (trace_id == 0 || entries[groups[i].first].record.trace_id == trace_id) {
+            print_trace(&groups[i]);
+        }
+    }
+    free(groups);
+    free(entries);
+    return 0;
+}